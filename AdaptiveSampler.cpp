@@ -0,0 +1,138 @@
+#include <algorithm>
+
+#include "AdaptiveSampler.hpp"
+#include "Scene.hpp"
+#include "Stats.hpp"
+
+AdaptiveSampler::AdaptiveSampler(Scene &scene, const Viewport &viewport, const size_t &width, const size_t &height)
+        : scene_(scene), viewport_(viewport), width_(width), height_(height),
+          tile_(), out_(nullptr), stride_(0), samples_(), traced_(0) {}
+
+/*
+ * Return the sample at pixel (i, j), tracing it on first use.
+ * Pixels inside the tile are written out as they are traced.
+ */
+AdaptiveSampler::Sample &AdaptiveSampler::sample(const size_t &i, const size_t &j) {
+    Sample &s = samples_[(i - tile_.x) + (j - tile_.y) * (tile_.width + 1)];
+    if (!s.traced) {
+        Stats::begin_pixel();
+        s.colour = scene_.trace(viewport_.ray(i, j), s.surface);
+        if (i < tile_.x + tile_.width && j < tile_.y + tile_.height) {
+            Stats::end_pixel(i, j);
+        }
+        s.traced = true;
+        traced_++;
+        if (i < tile_.x + tile_.width && j < tile_.y + tile_.height) {
+            out_[(i - tile_.x) + (j - tile_.y) * stride_] = s.colour;
+        }
+    }
+    return s;
+}
+
+/*
+ * Return true iff the corners of the cell with inclusive corners (x0, y0) and (x1, y1)
+ * hit the same object and are close enough in colour to interpolate between.
+ */
+bool AdaptiveSampler::uniform(const size_t &x0, const size_t &y0, const size_t &x1, const size_t &y1) {
+    const Sample &a = sample(x0, y0);
+    const Sample &b = sample(x1, y0);
+    const Sample &c = sample(x0, y1);
+    const Sample &d = sample(x1, y1);
+    if (!a.surface.same_object(b.surface) || !a.surface.same_object(c.surface) ||
+        !a.surface.same_object(d.surface)) {
+        return false;
+    }
+
+    float low[3] = {a.colour.x, a.colour.y, a.colour.z};
+    float high[3] = {a.colour.x, a.colour.y, a.colour.z};
+    for (const Sample *s : {&b, &c, &d}) {
+        for (size_t k = 0; k < 3; k++) {
+            low[k] = std::min(low[k], s->colour[k]);
+            high[k] = std::max(high[k], s->colour[k]);
+        }
+    }
+    const float threshold = scene_.settings.adaptive_threshold;
+    return high[0] - low[0] <= threshold && high[1] - low[1] <= threshold && high[2] - low[2] <= threshold;
+}
+
+/*
+ * Fill the untraced pixels of a cell by bilinear interpolation between its corners.
+ */
+void AdaptiveSampler::interpolate(const size_t &x0, const size_t &y0, const size_t &x1, const size_t &y1) {
+    const Vec3f &a = sample(x0, y0).colour;
+    const Vec3f &b = sample(x1, y0).colour;
+    const Vec3f &c = sample(x0, y1).colour;
+    const Vec3f &d = sample(x1, y1).colour;
+    const size_t j_end = std::min(y1, tile_.y + tile_.height - 1);
+    const size_t i_end = std::min(x1, tile_.x + tile_.width - 1);
+
+    for (size_t j = y0; j <= j_end; j++) {
+        const float v = y1 > y0 ? (float) (j - y0) / (float) (y1 - y0) : 0.0f;
+        for (size_t i = x0; i <= i_end; i++) {
+            Sample &s = samples_[(i - tile_.x) + (j - tile_.y) * (tile_.width + 1)];
+            if (s.traced) {
+                continue;
+            }
+            const float u = x1 > x0 ? (float) (i - x0) / (float) (x1 - x0) : 0.0f;
+            out_[(i - tile_.x) + (j - tile_.y) * stride_] = (a * (1 - u) + b * u) * (1 - v) + (c * (1 - u) + d * u) * v;
+        }
+    }
+}
+
+/*
+ * Render the cell with inclusive corners (x0, y0) and (x1, y1),
+ * interpolating it if it looks uniform and subdividing it otherwise.
+ */
+void AdaptiveSampler::refine(const size_t &x0, const size_t &y0, const size_t &x1, const size_t &y1) {
+    // Every pixel of a cell this small is a corner.
+    if (x1 - x0 <= 1 && y1 - y0 <= 1) {
+        sample(x0, y0);
+        sample(x1, y0);
+        sample(x0, y1);
+        sample(x1, y1);
+        return;
+    }
+
+    if (uniform(x0, y0, x1, y1)) {
+        interpolate(x0, y0, x1, y1);
+        return;
+    }
+
+    // Only split along axes that are still more than a pixel apart.
+    const size_t xm = x1 - x0 > 1 ? (x0 + x1) / 2 : x1;
+    const size_t ym = y1 - y0 > 1 ? (y0 + y1) / 2 : y1;
+    refine(x0, y0, xm, ym);
+    if (xm < x1) {
+        refine(xm, y0, x1, ym);
+    }
+    if (ym < y1) {
+        refine(x0, ym, xm, y1);
+    }
+    if (xm < x1 && ym < y1) {
+        refine(xm, ym, x1, y1);
+    }
+}
+
+/*
+ * Render one tile into out, which holds the tile's top-left pixel and has rows stride pixels apart.
+ * Returns the number of rays traced for it.
+ */
+size_t AdaptiveSampler::render_tile(const Tile &tile, Vec3f *out, const size_t &stride) {
+    tile_ = tile;
+    out_ = out;
+    stride_ = stride;
+    traced_ = 0;
+    samples_.assign((tile.width + 1) * (tile.height + 1), Sample());
+
+    // Cells reach one pixel past the tile, to the next tile's first row and column,
+    // so that neighbouring tiles interpolate towards the same edge samples.
+    const size_t step = std::max((size_t) 1, scene_.settings.adaptive_step);
+    const size_t x_end = std::min(tile.x + tile.width, width_ - 1);
+    const size_t y_end = std::min(tile.y + tile.height, height_ - 1);
+    for (size_t y0 = tile.y; y0 < y_end || y0 == tile.y; y0 += step) {
+        for (size_t x0 = tile.x; x0 < x_end || x0 == tile.x; x0 += step) {
+            refine(x0, y0, std::min(x0 + step, x_end), std::min(y0 + step, y_end));
+        }
+    }
+    return traced_;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+
+#include "Camera.hpp"
+#include "Geometry.hpp"
+#include "Scene.hpp"
+#include "Scheduler.hpp"
+
+/*
+ * Renders a tile by tracing a coarse grid of samples and refining only where they disagree.
+ *
+ * Each cell of the grid is traced at its corners. If all four corners hit the same object
+ * (sphere or mesh, or all miss) and their colours are within the scene's adaptive threshold,
+ * the interior is filled by bilinear interpolation. Otherwise the cell is split in four and each
+ * quarter is treated the same way, which homes in on object and shading edges by bisection.
+ */
+struct AdaptiveSampler {
+    AdaptiveSampler(Scene &scene, const Viewport &viewport, const size_t &width, const size_t &height);
+
+    size_t render_tile(const Tile &tile, Vec3f *out, const size_t &stride);
+
+private:
+
+    struct Sample {
+        Vec3f colour;
+        Surface surface;
+        bool traced;
+
+        Sample()
+                : colour(), surface(), traced(false) {}
+    };
+
+    Sample &sample(const size_t &i, const size_t &j);
+
+    bool uniform(const size_t &x0, const size_t &y0, const size_t &x1, const size_t &y1);
+
+    void refine(const size_t &x0, const size_t &y0, const size_t &x1, const size_t &y1);
+
+    void interpolate(const size_t &x0, const size_t &y0, const size_t &x1, const size_t &y1);
+
+    Scene &scene_;
+    const Viewport &viewport_;
+    size_t width_;
+    size_t height_;
+
+    // The tile being rendered, where its pixels go, and its samples
+    // (including the row and column just past it).
+    Tile tile_;
+    Vec3f *out_;
+    size_t stride_;
+    std::vector<Sample> samples_;
+    size_t traced_;
+};
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cmath>
+
+#include "AmbientOcclusion.hpp"
+#include "constants.hpp"
+#include "Random.hpp"
+#include "Scene.hpp"
+#include "Stats.hpp"
+
+namespace {
+
+// Successive points of the lattice step around the normal by this fraction of a turn (the golden ratio's),
+// so that any number of them is spread evenly.
+const float LATTICE_STEP = 0.618034f;
+
+}
+
+AmbientOcclusion::AmbientOcclusion(const Scene &scene)
+        : scene_(scene), points_(), open_(), rays_(), openness_() {}
+
+/*
+ * Replace the unoccluded ambient light in the tile's pixels, which out holds with rows stride pixels apart,
+ * with occluded ambient light. samples holds where each pixel of the tile hit, row by row.
+ */
+void AmbientOcclusion::apply(const Tile &tile, const SurfaceSample *samples, Vec3f *out, const size_t &stride) {
+    const size_t pixels = tile.width * tile.height;
+    openness_.assign(pixels, 1.0f);
+    points_.clear();
+    if (!scene_.settings.ao_half_resolution) {
+        for (uint32_t p = 0; p < pixels; p++) {
+            if (samples[p].depth > 0) {
+                points_.push_back(p);
+            }
+        }
+        trace(tile, samples);
+    } else {
+        // Each block's first pixel with a hit is traced.
+        const size_t blocks_across = (tile.width + 1) / 2;
+        const size_t blocks_down = (tile.height + 1) / 2;
+        std::vector<int32_t> blocks(blocks_across * blocks_down, -1);
+        for (size_t b = 0; b < blocks.size(); b++) {
+            const size_t x0 = 2 * (b % blocks_across);
+            const size_t y0 = 2 * (b / blocks_across);
+            for (size_t y = y0; y < std::min(y0 + 2, tile.height) && blocks[b] < 0; y++) {
+                for (size_t x = x0; x < std::min(x0 + 2, tile.width) && blocks[b] < 0; x++) {
+                    if (samples[x + y * tile.width].depth > 0) {
+                        blocks[b] = (int32_t) points_.size();
+                        points_.push_back((uint32_t) (x + y * tile.width));
+                    }
+                }
+            }
+        }
+        trace(tile, samples);
+        share(tile, samples, blocks);
+        if (!points_.empty()) {
+            trace(tile, samples);
+        }
+    }
+    for (size_t k = 0; k < points_.size(); k++) {
+        openness_[points_[k]] = open_[k];
+    }
+
+    for (size_t y = 0; y < tile.height; y++) {
+        for (size_t x = 0; x < tile.width; x++) {
+            const size_t p = x + y * tile.width;
+            if (samples[p].depth > 0) {
+                out[x + y * stride] += samples[p].ambient * (openness_[p] - 1);
+            }
+        }
+    }
+}
+
+/*
+ * Find the fraction of rays which escape from each pixel in points_, into open_.
+ */
+void AmbientOcclusion::trace(const Tile &tile, const SurfaceSample *samples) {
+    const size_t count = std::max((size_t) 1, scene_.settings.ao_samples);
+    const float offset = std::max((float) INCIDENT_NORMAL_DISPLACEMENT, scene_.settings.ao_distance * AO_RAY_OFFSET);
+    rays_.clear();
+    rays_.reserve(points_.size() * count);
+    for (const uint32_t p : points_) {
+        const SurfaceSample &sample = samples[p];
+        const Vec3f &normal = sample.normal;
+        // Any vector not parallel to the normal gives a basis perpendicular to it.
+        const Vec3f helper = std::abs(normal.x) > 0.5f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0);
+        const Vec3f tangent = cross(helper, normal).unit();
+        const Vec3f bitangent = cross(normal, tangent);
+        const Pos3f origin = sample.position + normal * offset;
+
+        // The lattice's shift comes from the pixel's place in the image, so that renders are repeatable.
+        uint32_t random = hash_bits((uint32_t) (tile.x + p % tile.width) * 0x9e3779b9u ^
+                                    hash_bits((uint32_t) (tile.y + p / tile.width)));
+        const float shift_u = next_uniform(random);
+        const float shift_v = next_uniform(random);
+        for (size_t s = 0; s < count; s++) {
+            float u = ((float) s + 0.5f) / (float) count + shift_u;
+            float v = (float) s * LATTICE_STEP + shift_v;
+            u -= std::floor(u);
+            v -= std::floor(v);
+            // u is the square of the sine of the angle from the normal, which makes the density go as its cosine.
+            const float sin_theta = std::sqrt(u);
+            const float cos_theta = std::sqrt(1 - u);
+            const float phi = 2 * PI * v;
+            rays_.emplace_back(origin, tangent * (sin_theta * std::cos(phi)) + bitangent * (sin_theta * std::sin(phi)) +
+                                       normal * cos_theta);
+        }
+    }
+    STATS_ADD(occlusion_rays, rays_.size());
+
+    open_.assign(points_.size(), 0.0f);
+    const float distance = scene_.settings.ao_distance;
+    const float weight = 1.0f / (float) count;
+    for (size_t r = 0; r < rays_.size(); r++) {
+        if (!scene_.occluded(rays_[r], distance)) {
+            open_[r / count] += weight;
+        }
+    }
+}
+
+/*
+ * Give every pixel with a hit the weighted mean openness of the traced blocks around its own which lie on
+ * the same surface, and leave in points_ the pixels with none, to be traced themselves.
+ */
+void AmbientOcclusion::share(const Tile &tile, const SurfaceSample *samples, const std::vector<int32_t> &blocks) {
+    std::vector<uint32_t> traced;
+    std::vector<float> open;
+    traced.swap(points_);
+    open.swap(open_);
+    const int32_t blocks_across = (int32_t) (tile.width + 1) / 2;
+    const int32_t blocks_down = (int32_t) (tile.height + 1) / 2;
+    for (size_t y = 0; y < tile.height; y++) {
+        for (size_t x = 0; x < tile.width; x++) {
+            const size_t p = x + y * tile.width;
+            const SurfaceSample &sample = samples[p];
+            if (sample.depth <= 0) {
+                continue;
+            }
+            float total = 0;
+            float weight = 0;
+            const int32_t bx = (int32_t) x / 2;
+            const int32_t by = (int32_t) y / 2;
+            for (int32_t ny = std::max(by - 1, 0); ny <= std::min(by + 1, blocks_down - 1); ny++) {
+                for (int32_t nx = std::max(bx - 1, 0); nx <= std::min(bx + 1, blocks_across - 1); nx++) {
+                    const int32_t k = blocks[nx + ny * blocks_across];
+                    if (k < 0) {
+                        continue;
+                    }
+                    const SurfaceSample &other = samples[traced[k]];
+                    if (other.normal * sample.normal < AO_NORMAL_TOLERANCE ||
+                        std::abs((other.position - sample.position) * sample.normal) >
+                        AO_PLANE_TOLERANCE * sample.depth) {
+                        continue;
+                    }
+                    const float dx = (float) (traced[k] % tile.width) - (float) x;
+                    const float dy = (float) (traced[k] / tile.width) - (float) y;
+                    const float w = 1 / (1 + dx * dx + dy * dy);
+                    total += w * open[k];
+                    weight += w;
+                }
+            }
+            if (weight > 0) {
+                openness_[p] = total / weight;
+            } else {
+                points_.push_back((uint32_t) p);
+            }
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Geometry.hpp"
+#include "Scheduler.hpp"
+
+struct Scene;
+
+/*
+ * Where a pixel's primary ray hit, as ambient occlusion needs it.
+ */
+struct SurfaceSample {
+    Pos3f position;
+    Vec3f normal;  // Unit length, on the side the ray came from.
+    Vec3f ambient; // The ambient light the surface reflects while nothing occludes it.
+    float depth;   // The distance to the hit; zero for a pixel that hit nothing.
+
+    SurfaceSample()
+            : position(), normal(), ambient(), depth(0) {}
+};
+
+/*
+ * Scales the ambient light of a rendered tile by how open each point's surroundings are: the fraction of
+ * settings.ao_samples rays leaving it that travel settings.ao_distance without hitting anything.
+ *
+ * The rays are spread over the hemisphere about the normal in proportion to their cosine with it, so the
+ * fraction needs no weighting, and stratified by a small Fibonacci lattice that each pixel shifts at random.
+ * Every ray of the tile is made first and then traced as one batch, each stopping at the first thing it hits.
+ *
+ * At half resolution, occlusion is found only at one pixel of each 2x2 block. Every pixel then averages
+ * the blocks around its own, weighted by distance, but only those whose depth and normal are close to its own,
+ * so occlusion doesn't bleed across the edges of objects. The few pixels with no such block nearby
+ * are traced themselves, in a second batch.
+ */
+struct AmbientOcclusion {
+    explicit AmbientOcclusion(const Scene &scene);
+
+    void apply(const Tile &tile, const SurfaceSample *samples, Vec3f *out, const size_t &stride);
+
+private:
+
+    void trace(const Tile &tile, const SurfaceSample *samples);
+
+    void share(const Tile &tile, const SurfaceSample *samples, const std::vector<int32_t> &blocks);
+
+    const Scene &scene_;
+    std::vector<uint32_t> points_; // The pixels of the tile to trace, row by row from its top-left.
+    std::vector<float> open_;      // The fraction of each point's rays which escaped.
+    std::vector<Ray3f> rays_;
+    std::vector<float> openness_;  // Each pixel's.
+};
@@ -0,0 +1,271 @@
+#include <chrono>
+
+#include "BVH.hpp"
+#include "Sphere.hpp"
+
+/*
+ * Discard the hierarchy.
+ */
+void BVH::clear() {
+    nodes.clear();
+    indices.clear();
+    build_stats = BuildStats();
+}
+
+/*
+ * Build the hierarchy over the given spheres using a binned surface area heuristic.
+ *
+ * At each node the primitive centroids are sorted into BVH_BIN_COUNT bins along each axis,
+ * and the split plane between bins minimising
+ *     C_trav + (A_left * N_left + A_right * N_right) / A_node * C_isect
+ * is chosen. A node becomes a leaf if no split is cheaper than intersecting all of its primitives.
+ */
+void BVH::build(const FlatArray<Sphere> &spheres) {
+    Build state;
+    state.primitives.resize(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        const Vec3f r(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+        state.primitives[i].bounds = AABB(spheres[i].centre - r, spheres[i].centre + r);
+        state.primitives[i].centroid = spheres[i].centre;
+    }
+    build(state);
+}
+
+/*
+ * Build the hierarchy over primitives with the given bounding boxes, as for spheres.
+ * The boxes' centres are used as the primitives' centroids.
+ */
+void BVH::build(const std::vector<AABB> &bounds) {
+    Build state;
+    state.primitives.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        state.primitives[i].bounds = bounds[i];
+        state.primitives[i].centroid = bounds[i].centroid();
+    }
+    build(state);
+}
+
+void BVH::build(Build &state) {
+    const auto start = std::chrono::steady_clock::now();
+    clear();
+
+    const size_t count = state.primitives.size();
+    if (count == 0) {
+        return;
+    }
+
+    state.indices.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        state.indices[i] = (uint32_t) i;
+    }
+
+    // A binary tree over n primitives has at most 2n - 1 nodes.
+    state.nodes.reserve(2 * count - 1);
+    state.nodes.emplace_back();
+    build_node(0, 0, (uint32_t) count, 1, state);
+    state.nodes.shrink_to_fit();
+    nodes.assign(std::move(state.nodes));
+    indices.assign(std::move(state.indices));
+
+    for (const auto &node : nodes) {
+        if (node.is_leaf()) {
+            build_stats.leaf_count++;
+            build_stats.max_leaf_size = std::max(build_stats.max_leaf_size, (size_t) node.count);
+        }
+    }
+
+    build_stats.primitive_count = count;
+    build_stats.node_count = nodes.size();
+    build_stats.sah_cost = sah_cost();
+    build_stats.refit_sah_cost = build_stats.sah_cost;
+    build_stats.build_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Recompute every node's bounds for the spheres' current positions and radii, keeping the tree's structure.
+ * The spheres must be the ones the hierarchy was built over.
+ *
+ * This is much cheaper than a rebuild, but the tree gets worse as spheres move away from where
+ * it was built. Returns false if its expected cost has grown past BVH_REFIT_LIMIT times what it was
+ * when built, in which case it should be rebuilt.
+ */
+bool BVH::refit(const FlatArray<Sphere> &spheres) {
+    if (nodes.empty()) {
+        return true;
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    // Children are always stored after their parents, so a reverse sweep visits them first.
+    BVHNode *node = &nodes.at(0);
+    for (size_t n = nodes.size(); n-- > 0;) {
+        AABB bounds;
+        if (node[n].is_leaf()) {
+            for (uint32_t i = node[n].first; i < node[n].first + node[n].count; i++) {
+                const Sphere &sphere = spheres[indices[i]];
+                const Vec3f r(sphere.radius, sphere.radius, sphere.radius);
+                bounds.extend(AABB(sphere.centre - r, sphere.centre + r));
+            }
+        } else {
+            bounds.extend(node[node[n].first].bounds);
+            bounds.extend(node[node[n].first + 1].bounds);
+        }
+        node[n].bounds = bounds;
+    }
+
+    // A loaded hierarchy's cost when built isn't known, so it is measured against its first refit.
+    build_stats.refit_sah_cost = sah_cost();
+    if (build_stats.sah_cost == 0) {
+        build_stats.sah_cost = build_stats.refit_sah_cost;
+    }
+    build_stats.refit_count++;
+    build_stats.refit_ms += std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    return build_stats.refit_sah_cost <= BVH_REFIT_LIMIT * build_stats.sah_cost;
+}
+
+/*
+ * Total expected cost of a ray through the tree, relative to the root.
+ */
+float BVH::sah_cost() const {
+    const float root_area = nodes[0].bounds.surface_area();
+    float cost = 0;
+    for (const auto &node : nodes) {
+        const float relative_area = root_area > 0 ? node.bounds.surface_area() / root_area : 1.0f;
+        cost += relative_area * (node.is_leaf() ? node.count * BVH_INTERSECTION_COST : BVH_TRAVERSAL_COST);
+    }
+    return cost;
+}
+
+/*
+ * Recursively construct the subtree rooted at node_index over indices [begin, end).
+ */
+void BVH::build_node(uint32_t node_index, uint32_t begin, uint32_t end, size_t depth,
+                     Build &state) {
+    build_stats.max_depth = std::max(build_stats.max_depth, depth);
+
+    AABB bounds;
+    AABB centroid_bounds;
+    for (uint32_t i = begin; i < end; i++) {
+        bounds.extend(state.primitives[state.indices[i]].bounds);
+        centroid_bounds.extend(state.primitives[state.indices[i]].centroid);
+    }
+    state.nodes[node_index].bounds = bounds;
+
+    const uint32_t count = end - begin;
+    const float leaf_cost = count * BVH_INTERSECTION_COST;
+
+    // Traversal never needs more stack than the tree is deep.
+    if (count == 1 || depth + 2 >= BVH_STACK_SIZE) {
+        state.nodes[node_index].first = begin;
+        state.nodes[node_index].count = count;
+        return;
+    }
+
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    int best_split = 0;
+    const Vec3f extent = centroid_bounds.max - centroid_bounds.min;
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0) {
+            continue;
+        }
+
+        AABB bin_bounds[BVH_BIN_COUNT];
+        uint32_t bin_counts[BVH_BIN_COUNT] = {};
+        const float scale = BVH_BIN_COUNT / extent[axis];
+        for (uint32_t i = begin; i < end; i++) {
+            const BuildPrimitive &p = state.primitives[state.indices[i]];
+            const int bin = std::min(BVH_BIN_COUNT - 1, (int) ((p.centroid[axis] - centroid_bounds.min[axis]) * scale));
+            bin_bounds[bin].extend(p.bounds);
+            bin_counts[bin]++;
+        }
+
+        // Sweep from the right to accumulate the areas and counts right of each split,
+        // then from the left to evaluate each split.
+        float right_areas[BVH_BIN_COUNT];
+        uint32_t right_counts[BVH_BIN_COUNT];
+        AABB right_bounds;
+        uint32_t right_count = 0;
+        for (int b = BVH_BIN_COUNT - 1; b > 0; b--) {
+            right_bounds.extend(bin_bounds[b]);
+            right_count += bin_counts[b];
+            right_areas[b] = right_bounds.surface_area();
+            right_counts[b] = right_count;
+        }
+
+        AABB left_bounds;
+        uint32_t left_count = 0;
+        for (int b = 1; b < BVH_BIN_COUNT; b++) {
+            left_bounds.extend(bin_bounds[b - 1]);
+            left_count += bin_counts[b - 1];
+            if (left_count == 0 || right_counts[b] == 0) {
+                continue;
+            }
+            const float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST *
+                    (left_bounds.surface_area() * left_count + right_areas[b] * right_counts[b]) / bounds.surface_area();
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    // Keep the primitives together if splitting doesn't pay for itself,
+    // or if they cannot be separated at all.
+    if (best_axis == -1 || (best_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE)) {
+        if (best_axis == -1 && count > BVH_MAX_LEAF_SIZE) {
+            // Coincident centroids: split down the middle regardless.
+            best_axis = 0;
+            best_split = -1;
+        } else {
+            state.nodes[node_index].first = begin;
+            state.nodes[node_index].count = count;
+            return;
+        }
+    }
+
+    uint32_t mid;
+    if (best_split < 0) {
+        mid = begin + count / 2;
+    } else {
+        const float scale = BVH_BIN_COUNT / extent[best_axis];
+        const float axis_min = centroid_bounds.min[best_axis];
+        auto *split_point = std::partition(&state.indices[begin], &state.indices[begin] + count, [&](uint32_t index) {
+            const int bin = std::min(BVH_BIN_COUNT - 1,
+                                     (int) ((state.primitives[index].centroid[best_axis] - axis_min) * scale));
+            return bin < best_split;
+        });
+        mid = (uint32_t) (split_point - &state.indices[0]);
+    }
+
+    const auto left = (uint32_t) state.nodes.size();
+    state.nodes[node_index].first = left;
+    state.nodes[node_index].count = 0;
+    state.nodes.emplace_back();
+    state.nodes.emplace_back();
+    build_node(left, begin, mid, depth + 1, state);
+    build_node(left + 1, mid, end, depth + 1, state);
+}
+
+/*
+ * Print construction statistics.
+ */
+void BVH::report(std::ostream &out) const {
+    if (build_stats.prebuilt) {
+        out << "BVH: " << build_stats.primitive_count << " spheres, " << build_stats.node_count << " nodes, prebuilt\n";
+    } else {
+        out << "BVH: " << build_stats.primitive_count << " spheres, "
+            << build_stats.node_count << " nodes (" << build_stats.leaf_count << " leaves), "
+            << "depth " << build_stats.max_depth << ", "
+            << "max leaf " << build_stats.max_leaf_size << ", "
+            << "SAH cost " << build_stats.sah_cost << ", "
+            << "built in " << build_stats.build_ms << " ms\n";
+    }
+    if (build_stats.refit_count > 0) {
+        out << "BVH: refitted " << build_stats.refit_count << " times in " << build_stats.refit_ms << " ms, "
+            << "SAH cost now " << build_stats.refit_sah_cost << "\n";
+    }
+}
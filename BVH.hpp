@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "constants.hpp"
+#include "FlatArray.hpp"
+#include "Geometry.hpp"
+#include "Stats.hpp"
+
+struct Sphere;
+
+struct AABB {
+    Pos3f min;
+    Pos3f max;
+
+    // An empty box, which any point will extend.
+    AABB()
+            : min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                  std::numeric_limits<float>::max()),
+              max(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(),
+                  -std::numeric_limits<float>::max()) {}
+
+    AABB(const Pos3f &mn, const Pos3f &mx)
+            : min(mn), max(mx) {}
+
+    void extend(const Pos3f &p) {
+        min = Pos3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Pos3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    void extend(const AABB &box) {
+        if (box.empty()) {
+            return;
+        }
+        extend(box.min);
+        extend(box.max);
+    }
+
+    bool empty() const {
+        return min.x > max.x;
+    }
+
+    Pos3f centroid() const {
+        return Pos3f((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f);
+    }
+
+    float surface_area() const {
+        if (empty()) {
+            return 0;
+        }
+        const Vec3f e = max - min;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    /*
+     * Slab test: return true iff the ray enters this box somewhere in [0, t_max],
+     * writing the entry parameter to t_entry.
+     * The ray is given by its origin and the reciprocal of its direction.
+     */
+    bool intersect(const Pos3f &origin, const Vec3f &inv_dir, const float t_max, float &t_entry) const {
+        const float tx1 = (min.x - origin.x) * inv_dir.x;
+        const float tx2 = (max.x - origin.x) * inv_dir.x;
+        float t_near = std::min(tx1, tx2);
+        float t_far = std::max(tx1, tx2);
+
+        const float ty1 = (min.y - origin.y) * inv_dir.y;
+        const float ty2 = (max.y - origin.y) * inv_dir.y;
+        t_near = std::max(t_near, std::min(ty1, ty2));
+        t_far = std::min(t_far, std::max(ty1, ty2));
+
+        const float tz1 = (min.z - origin.z) * inv_dir.z;
+        const float tz2 = (max.z - origin.z) * inv_dir.z;
+        t_near = std::max(t_near, std::min(tz1, tz2));
+        t_far = std::min(t_far, std::max(tz1, tz2));
+
+        t_entry = t_near;
+        return t_far >= std::max(t_near, 0.0f) && t_near <= t_max;
+    }
+};
+
+/*
+ * A node is either interior, with its two children stored adjacently from index `first`,
+ * or a leaf (count > 0), referencing primitives [first, first + count) of BVH::indices.
+ */
+struct BVHNode {
+    AABB bounds;
+    uint32_t first;
+    uint32_t count;
+
+    bool is_leaf() const {
+        return count > 0;
+    }
+};
+
+struct BVH {
+    struct BuildStats {
+        double build_ms;
+        size_t primitive_count;
+        size_t node_count;
+        size_t leaf_count;
+        size_t max_depth;
+        size_t max_leaf_size;
+        float sah_cost;
+        bool prebuilt; // Loaded rather than built; only the counts are known.
+
+        // Refits since the hierarchy was built, and its cost after the latest one.
+        size_t refit_count;
+        double refit_ms;
+        float refit_sah_cost;
+
+        BuildStats()
+                : build_ms(0), primitive_count(0), node_count(0), leaf_count(0),
+                  max_depth(0), max_leaf_size(0), sah_cost(0), prebuilt(false),
+                  refit_count(0), refit_ms(0), refit_sah_cost(0) {}
+    };
+
+    // Either built here or referring to a prebuilt hierarchy, e.g. in a scene file.
+    FlatArray<BVHNode> nodes;
+    FlatArray<uint32_t> indices; // Primitive indices in leaf order.
+    BuildStats build_stats;
+
+    BVH()
+            : nodes(), indices(), build_stats() {}
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    void clear();
+
+    void build(const FlatArray<Sphere> &spheres);
+
+    void build(const std::vector<AABB> &bounds);
+
+    bool refit(const FlatArray<Sphere> &spheres);
+
+    void report(std::ostream &out) const;
+
+    /*
+     * Visit, nearest first, every leaf below root whose bounds the ray enters before t_max.
+     * The visitor is called as leaf(first, count, t_max) and may shrink t_max as it finds hits;
+     * if it returns true, traversal stops immediately (used for any-hit queries).
+     */
+    template<typename LeafVisitor>
+    void traverse(const Ray3f &ray, float &t_max, LeafVisitor leaf, const uint32_t &root = 0) const {
+        if (nodes.empty()) {
+            return;
+        }
+
+        const Vec3f inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+        uint32_t stack[BVH_STACK_SIZE];
+        float stack_entry[BVH_STACK_SIZE];
+        size_t stack_size = 0;
+        uint64_t visited = 0;
+
+        float t_entry;
+        if (nodes[root].bounds.intersect(ray.position, inv_dir, t_max, t_entry)) {
+            push(stack, stack_entry, stack_size, root, t_entry);
+        }
+
+        while (stack_size > 0) {
+            --stack_size;
+            // A closer hit may have been found since this node was pushed.
+            if (stack_entry[stack_size] > t_max) {
+                continue;
+            }
+            const BVHNode &node = nodes[stack[stack_size]];
+            visited++;
+
+            if (node.is_leaf()) {
+                if (leaf(node.first, node.count, t_max)) {
+                    break;
+                }
+                continue;
+            }
+
+            // Push the farther child first so that the nearer one is popped next.
+            float t_left, t_right;
+            const bool hit_left = nodes[node.first].bounds.intersect(ray.position, inv_dir, t_max, t_left);
+            const bool hit_right = nodes[node.first + 1].bounds.intersect(ray.position, inv_dir, t_max, t_right);
+            if (hit_left && hit_right) {
+                if (t_left <= t_right) {
+                    push(stack, stack_entry, stack_size, node.first + 1, t_right);
+                    push(stack, stack_entry, stack_size, node.first, t_left);
+                } else {
+                    push(stack, stack_entry, stack_size, node.first, t_left);
+                    push(stack, stack_entry, stack_size, node.first + 1, t_right);
+                }
+            } else if (hit_left) {
+                push(stack, stack_entry, stack_size, node.first, t_left);
+            } else if (hit_right) {
+                push(stack, stack_entry, stack_size, node.first + 1, t_right);
+            }
+        }
+
+        STATS_WORK(bvh_nodes, visited);
+    }
+
+private:
+
+    static void push(uint32_t *stack, float *stack_entry, size_t &stack_size, uint32_t node, float t_entry) {
+        stack_entry[stack_size] = t_entry;
+        stack[stack_size++] = node;
+    }
+
+    float sah_cost() const;
+
+    struct BuildPrimitive {
+        AABB bounds;
+        Pos3f centroid;
+    };
+
+    // Working state for build(); the finished nodes and indices are moved into the hierarchy.
+    struct Build {
+        std::vector<BuildPrimitive> primitives;
+        std::vector<BVHNode> nodes;
+        std::vector<uint32_t> indices;
+    };
+
+    void build(Build &state);
+
+    void build_node(uint32_t node_index, uint32_t begin, uint32_t end, size_t depth, Build &state);
+};
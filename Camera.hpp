@@ -26,4 +26,32 @@ struct Camera {
               fov(f), plane_distance(d) {}
 };
 
+/*
+ * Maps pixel coordinates in a width x height image of a camera's view to the rays through them.
+ * Coordinates may be fractional, for sampling between pixel centres.
+ */
+struct Viewport {
+    Pos3f origin;
+    float x_comp;
+    float y_comp;
+    float half_width;
+    float half_height;
+    float plane_distance;
 
+    Viewport(const Camera &camera, const size_t &width, const size_t &height)
+            : origin(camera.position), half_width(width / 2.0f), half_height(height / 2.0f),
+              plane_distance(camera.plane_distance) {
+        const float x_fov_tan = std::tan(camera.fov / 2.0f);
+        const float y_fov_tan = x_fov_tan * (float) height / (float) width;
+        x_comp = 2.0f * camera.plane_distance * x_fov_tan / ((float) width - 1);
+        y_comp = -2.0f * camera.plane_distance * y_fov_tan / ((float) height - 1);
+    }
+
+    Vec3f direction(const float &i, const float &j) const {
+        return Vec3f((i - half_width) * x_comp, (j - half_height) * y_comp, plane_distance).unit();
+    }
+
+    Ray3f ray(const float &i, const float &j) const {
+        return Ray3f(origin, direction(i, j));
+    }
+};
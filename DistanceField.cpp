@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FIELD_X86
+#endif
+
+#include "DistanceField.hpp"
+#include "Stats.hpp"
+
+namespace {
+
+// Lanes of a distance estimate, and so rays marched together.
+const uint32_t FIELD_LANES = 4;
+
+// Leaves room for the Mandelbulb's bulbs, which reach about 1.14 from its centre.
+const float MANDELBULB_RADIUS = 1.2f;
+
+/*
+ * Both estimators iterate the fractal's formula on the point until its orbit escapes, carrying the derivative dz
+ * of the orbit along, and estimate the distance as |z| log |z| / 2 |dz|: with squared magnitude m and squared
+ * derivative dz2, log(m) sqrt(m / dz2) / 4.
+ */
+float julia_distance(const Quatf &c, const uint32_t &iterations, const float &x, const float &y, const float &z) {
+    Quatf q(x, y, z, 0);
+    float m = inner_product(q, q);
+    float dz2 = 1;
+    for (uint32_t i = 0; i < iterations && m < FIELD_ESCAPE; i++) {
+        dz2 *= 4 * m;
+        q = q * q + c;
+        m = inner_product(q, q);
+    }
+    return 0.25f * std::log(m) * std::sqrt(m / dz2);
+}
+
+/*
+ * The power 8 Mandelbulb in closed form, without trigonometry: each step raises the point to the 8th power
+ * in spherical coordinates (with y as the pole) through polynomials in its coordinates.
+ * Here dz is the derivative's magnitude rather than its square, growing by 8 r^7 per step.
+ */
+float mandelbulb_distance(const uint32_t &iterations, const float &px, const float &py, const float &pz) {
+    float x = px, y = py, z = pz;
+    float m = x * x + y * y + z * z;
+    float dz = 1;
+    for (uint32_t i = 0; i < iterations && m < FIELD_ESCAPE; i++) {
+        dz = 8 * m * m * m * std::sqrt(m) * dz + 1;
+        const float x2 = x * x, y2 = y * y, z2 = z * z;
+        const float x4 = x2 * x2, y4 = y2 * y2, z4 = z2 * z2;
+        const float k3 = x2 + z2;
+        const float k2 = 1 / std::sqrt(std::max(k3 * k3 * k3 * k3 * k3 * k3 * k3, 1e-30f));
+        const float k1 = x4 + y4 + z4 - 6 * y2 * z2 - 6 * x2 * y2 + 2 * z2 * x2;
+        const float k4 = x2 - y2 + z2;
+        const float nx = px + 64 * x * y * z * (x2 - z2) * k4 * (x4 - 6 * x2 * z2 + z4) * k1 * k2;
+        const float ny = py - 16 * y2 * k3 * k4 * k4 + k1 * k1;
+        const float nz = pz - 8 * y * k4 * (x4 * x4 - 28 * x4 * x2 * z2 + 70 * x4 * z4 - 28 * x2 * z2 * z4 + z4 * z4) *
+                              k1 * k2;
+        x = nx;
+        y = ny;
+        z = nz;
+        m = x * x + y * y + z * z;
+    }
+    return 0.25f * std::log(m) * std::sqrt(m) / dz;
+}
+
+#ifdef FIELD_X86
+
+/*
+ * The same estimators on four points at once. Lanes whose orbits have escaped keep their last values,
+ * and the loop ends once every lane has escaped; the logarithms are then taken lane by lane.
+ */
+void julia_distance4(const Quatf &c, const uint32_t &iterations, const __m128 &x, const __m128 &y, const __m128 &z,
+                     float *distance) {
+    const __m128 escape = _mm_set1_ps(FIELD_ESCAPE);
+    const __m128 ct = _mm_set1_ps(c.t), cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+    __m128 qt = x, qx = y, qy = z, qz = _mm_setzero_ps();
+    __m128 m = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qt, qt), _mm_mul_ps(qx, qx)), _mm_mul_ps(qy, qy));
+    __m128 dz2 = _mm_set1_ps(1);
+    for (uint32_t i = 0; i < iterations; i++) {
+        const __m128 active = _mm_cmplt_ps(m, escape);
+        if (_mm_movemask_ps(active) == 0) {
+            break;
+        }
+        const __m128 new_dz2 = _mm_mul_ps(dz2, _mm_mul_ps(_mm_set1_ps(4), m));
+        const __m128 two_t = _mm_add_ps(qt, qt);
+        const __m128 nt = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(qt, qt), _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, qx),
+                                                                                          _mm_mul_ps(qy, qy)),
+                                                                               _mm_mul_ps(qz, qz))), ct);
+        const __m128 nx = _mm_add_ps(_mm_mul_ps(two_t, qx), cx);
+        const __m128 ny = _mm_add_ps(_mm_mul_ps(two_t, qy), cy);
+        const __m128 nz = _mm_add_ps(_mm_mul_ps(two_t, qz), cz);
+        const __m128 new_m = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nt, nt), _mm_mul_ps(nx, nx)),
+                                        _mm_add_ps(_mm_mul_ps(ny, ny), _mm_mul_ps(nz, nz)));
+        dz2 = _mm_or_ps(_mm_and_ps(active, new_dz2), _mm_andnot_ps(active, dz2));
+        qt = _mm_or_ps(_mm_and_ps(active, nt), _mm_andnot_ps(active, qt));
+        qx = _mm_or_ps(_mm_and_ps(active, nx), _mm_andnot_ps(active, qx));
+        qy = _mm_or_ps(_mm_and_ps(active, ny), _mm_andnot_ps(active, qy));
+        qz = _mm_or_ps(_mm_and_ps(active, nz), _mm_andnot_ps(active, qz));
+        m = _mm_or_ps(_mm_and_ps(active, new_m), _mm_andnot_ps(active, m));
+    }
+
+    float ms[FIELD_LANES], roots[FIELD_LANES];
+    _mm_storeu_ps(ms, m);
+    _mm_storeu_ps(roots, _mm_sqrt_ps(_mm_div_ps(m, dz2)));
+    for (uint32_t lane = 0; lane < FIELD_LANES; lane++) {
+        distance[lane] = 0.25f * std::log(ms[lane]) * roots[lane];
+    }
+}
+
+void mandelbulb_distance4(const uint32_t &iterations, const __m128 &px, const __m128 &py, const __m128 &pz,
+                          float *distance) {
+    const __m128 escape = _mm_set1_ps(FIELD_ESCAPE);
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 two = _mm_set1_ps(2), six = _mm_set1_ps(6), eight = _mm_set1_ps(8), sixteen = _mm_set1_ps(16);
+    const __m128 twenty_eight = _mm_set1_ps(28), sixty_four = _mm_set1_ps(64), seventy = _mm_set1_ps(70);
+    __m128 x = px, y = py, z = pz;
+    __m128 m = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+    __m128 dz = one;
+    for (uint32_t i = 0; i < iterations; i++) {
+        const __m128 active = _mm_cmplt_ps(m, escape);
+        if (_mm_movemask_ps(active) == 0) {
+            break;
+        }
+        const __m128 m3 = _mm_mul_ps(_mm_mul_ps(m, m), m);
+        const __m128 new_dz = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(eight, _mm_mul_ps(m3, _mm_sqrt_ps(m))), dz), one);
+        const __m128 x2 = _mm_mul_ps(x, x), y2 = _mm_mul_ps(y, y), z2 = _mm_mul_ps(z, z);
+        const __m128 x4 = _mm_mul_ps(x2, x2), y4 = _mm_mul_ps(y2, y2), z4 = _mm_mul_ps(z2, z2);
+        const __m128 k3 = _mm_add_ps(x2, z2);
+        const __m128 k3_2 = _mm_mul_ps(k3, k3);
+        const __m128 k3_7 = _mm_mul_ps(_mm_mul_ps(k3_2, k3_2), _mm_mul_ps(k3_2, k3));
+        const __m128 k2 = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(k3_7, _mm_set1_ps(1e-30f))));
+        const __m128 k1 = _mm_add_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(x4, y4), z4),
+                                                _mm_mul_ps(six, _mm_add_ps(_mm_mul_ps(y2, z2), _mm_mul_ps(x2, y2)))),
+                                     _mm_mul_ps(two, _mm_mul_ps(z2, x2)));
+        const __m128 k4 = _mm_add_ps(_mm_sub_ps(x2, y2), z2);
+        const __m128 k12 = _mm_mul_ps(k1, k2);
+        const __m128 x2z2 = _mm_mul_ps(x2, z2);
+
+        const __m128 fx = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(sixty_four, _mm_mul_ps(x, _mm_mul_ps(y, z))),
+                                                _mm_mul_ps(_mm_sub_ps(x2, z2), k4)),
+                                     _mm_mul_ps(_mm_add_ps(_mm_sub_ps(x4, _mm_mul_ps(six, x2z2)), z4), k12));
+        const __m128 fy = _mm_sub_ps(_mm_mul_ps(k1, k1),
+                                     _mm_mul_ps(_mm_mul_ps(sixteen, y2), _mm_mul_ps(k3, _mm_mul_ps(k4, k4))));
+        const __m128 poly = _mm_add_ps(_mm_sub_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(x4, x4),
+                                                                         _mm_mul_ps(twenty_eight,
+                                                                                    _mm_mul_ps(x4, x2z2))),
+                                                              _mm_mul_ps(seventy, _mm_mul_ps(x4, z4))),
+                                                   _mm_mul_ps(twenty_eight, _mm_mul_ps(x2z2, z4))),
+                                       _mm_mul_ps(z4, z4));
+        const __m128 fz = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(eight, y), k4), _mm_mul_ps(poly, k12));
+        const __m128 nx = _mm_add_ps(px, fx);
+        const __m128 ny = _mm_add_ps(py, fy);
+        const __m128 nz = _mm_sub_ps(pz, fz);
+        const __m128 new_m = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+
+        dz = _mm_or_ps(_mm_and_ps(active, new_dz), _mm_andnot_ps(active, dz));
+        x = _mm_or_ps(_mm_and_ps(active, nx), _mm_andnot_ps(active, x));
+        y = _mm_or_ps(_mm_and_ps(active, ny), _mm_andnot_ps(active, y));
+        z = _mm_or_ps(_mm_and_ps(active, nz), _mm_andnot_ps(active, z));
+        m = _mm_or_ps(_mm_and_ps(active, new_m), _mm_andnot_ps(active, m));
+    }
+
+    float ms[FIELD_LANES], roots[FIELD_LANES];
+    _mm_storeu_ps(ms, m);
+    _mm_storeu_ps(roots, _mm_div_ps(_mm_sqrt_ps(m), dz));
+    for (uint32_t lane = 0; lane < FIELD_LANES; lane++) {
+        distance[lane] = 0.25f * std::log(ms[lane]) * roots[lane];
+    }
+}
+
+#endif
+
+}
+
+DistanceField DistanceField::julia(const Pos3f &centre, const float &scale, const Quatf &c,
+                                   const uint32_t &iterations) {
+    return {FractalKind::julia, centre, scale, c, iterations};
+}
+
+DistanceField DistanceField::mandelbulb(const Pos3f &centre, const float &scale, const uint32_t &iterations) {
+    return {FractalKind::mandelbulb, centre, scale, Quatf(), iterations};
+}
+
+/*
+ * Points of the Julia set stay within the radius r at which |z|^2 - |c| = |z|, beyond which orbits only grow.
+ */
+float DistanceField::radius() const {
+    if (kind == FractalKind::mandelbulb) {
+        return MANDELBULB_RADIUS;
+    }
+    return (1 + std::sqrt(1 + 4 * c.length())) / 2;
+}
+
+AABB DistanceField::bounds() const {
+    const float r = radius() * scale;
+    return {centre - Vec3f(r, r, r), centre + Vec3f(r, r, r)};
+}
+
+float DistanceField::distance(const Pos3f &p) const {
+    const Vec3f local = (p - centre) / scale;
+    if (kind == FractalKind::mandelbulb) {
+        return mandelbulb_distance(iterations, local.x, local.y, local.z) * scale;
+    }
+    return julia_distance(c, iterations, local.x, local.y, local.z) * scale;
+}
+
+/*
+ * Estimate the distances from four points, in the fractal's own space, to its surface.
+ */
+void DistanceField::estimate(const float *x, const float *y, const float *z, float *distance) const {
+#ifdef FIELD_X86
+    if (kind == FractalKind::mandelbulb) {
+        mandelbulb_distance4(iterations, _mm_loadu_ps(x), _mm_loadu_ps(y), _mm_loadu_ps(z), distance);
+    } else {
+        julia_distance4(c, iterations, _mm_loadu_ps(x), _mm_loadu_ps(y), _mm_loadu_ps(z), distance);
+    }
+#else
+    for (uint32_t lane = 0; lane < FIELD_LANES; lane++) {
+        distance[lane] = kind == FractalKind::mandelbulb ? mandelbulb_distance(iterations, x[lane], y[lane], z[lane])
+                                                         : julia_distance(c, iterations, x[lane], y[lane], z[lane]);
+    }
+#endif
+}
+
+/*
+ * March up to four rays through the field together, each no further than its parameter in t.
+ * Returns a mask with bit k set if ray k hit, in which case its parameter at the hit replaces t[k].
+ *
+ * Steps are over-relaxed as in Keinert et al., "Enhanced Sphere Tracing": a step which leaves the spheres of
+ * the last two estimates disjoint may have passed through the surface, so it is shortened and the rest of
+ * the ray is sphere traced plainly. Lanes finish on their own; the rest go on stepping together.
+ */
+uint32_t DistanceField::march(const Ray3f *rays, float *t, const uint32_t &count,
+                              const MarchSettings &settings) const {
+    assert(count <= FIELD_LANES);
+    float ox[FIELD_LANES], oy[FIELD_LANES], oz[FIELD_LANES];
+    float dx[FIELD_LANES], dy[FIELD_LANES], dz[FIELD_LANES];
+    float along[FIELD_LANES], end[FIELD_LANES], speed[FIELD_LANES];
+    float step[FIELD_LANES], previous[FIELD_LANES], omega[FIELD_LANES];
+    float px[FIELD_LANES] = {}, py[FIELD_LANES] = {}, pz[FIELD_LANES] = {};
+    float estimates[FIELD_LANES];
+    uint32_t active = 0;
+    uint32_t hits = 0;
+
+    // Bring each ray into the fractal's space and clip it to the bounding sphere: |o + s d|^2 = r^2.
+    const float r = radius();
+    for (uint32_t lane = 0; lane < count; lane++) {
+        const Vec3f o = (rays[lane].position - centre) / scale;
+        const Vec3f d = rays[lane].direction / scale;
+        const float a = d * d;
+        const float b = o * d;
+        const float disc = b * b - a * (o * o - r * r);
+        if (disc <= 0) {
+            continue;
+        }
+        const float root = std::sqrt(disc);
+        const float near = std::max((-b - root) / a, 0.0f);
+        const float far = std::min((-b + root) / a, t[lane]);
+        if (near >= far) {
+            continue;
+        }
+        ox[lane] = o.x;
+        oy[lane] = o.y;
+        oz[lane] = o.z;
+        dx[lane] = d.x;
+        dy[lane] = d.y;
+        dz[lane] = d.z;
+        along[lane] = near;
+        end[lane] = far;
+        speed[lane] = std::sqrt(a);
+        step[lane] = 0;
+        previous[lane] = 0;
+        omega[lane] = settings.relaxation;
+        active |= 1u << lane;
+    }
+
+    for (size_t i = 0; active != 0 && i < settings.max_steps; i++) {
+        for (uint32_t lane = 0; lane < count; lane++) {
+            if (active & (1u << lane)) {
+                px[lane] = ox[lane] + dx[lane] * along[lane];
+                py[lane] = oy[lane] + dy[lane] * along[lane];
+                pz[lane] = oz[lane] + dz[lane] * along[lane];
+            }
+        }
+        estimate(px, py, pz, estimates);
+        STATS_WORK(field_steps, __builtin_popcount(active));
+
+        for (uint32_t lane = 0; lane < count; lane++) {
+            const uint32_t bit = 1u << lane;
+            if (!(active & bit)) {
+                continue;
+            }
+            // The estimate in units of the ray's parameter.
+            const float distance = estimates[lane] / speed[lane];
+            const bool failed = omega[lane] > 1 && std::abs(distance) + previous[lane] < step[lane];
+            if (failed) {
+                step[lane] -= omega[lane] * step[lane];
+                omega[lane] = 1;
+            } else {
+                step[lane] = distance * omega[lane];
+            }
+            previous[lane] = std::abs(distance);
+            if (!failed && distance < settings.epsilon * along[lane]) {
+                t[lane] = along[lane];
+                hits |= bit;
+                active &= ~bit;
+                continue;
+            }
+            along[lane] += step[lane];
+            if (along[lane] >= end[lane]) {
+                active &= ~bit;
+            }
+        }
+    }
+    return hits;
+}
+
+/*
+ * The surface normal near p, from central differences of the distance at the corners of a tetrahedron
+ * of size h around it: four estimates, made together.
+ */
+Vec3f DistanceField::normal(const Pos3f &p, const float &h) const {
+    static const float corners[FIELD_LANES][3] = {{1, -1, -1},
+                                                  {-1, -1, 1},
+                                                  {-1, 1, -1},
+                                                  {1, 1, 1}};
+    const Vec3f local = (p - centre) / scale;
+    const float offset = h / scale;
+    float x[FIELD_LANES], y[FIELD_LANES], z[FIELD_LANES], d[FIELD_LANES];
+    for (uint32_t k = 0; k < FIELD_LANES; k++) {
+        x[k] = local.x + corners[k][0] * offset;
+        y[k] = local.y + corners[k][1] * offset;
+        z[k] = local.z + corners[k][2] * offset;
+    }
+    estimate(x, y, z, d);
+    Vec3f gradient;
+    for (uint32_t k = 0; k < FIELD_LANES; k++) {
+        gradient += Vec3f(corners[k][0], corners[k][1], corners[k][2]) * d[k];
+    }
+    return gradient.unit();
+}
+
+const char *DistanceField::kernel_name() {
+#ifdef FIELD_X86
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
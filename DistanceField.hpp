@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+#include "BVH.hpp"
+#include "Geometry.hpp"
+#include "RenderSettings.hpp"
+
+enum class FractalKind {
+    julia,     // A slice through a quaternion Julia set.
+    mandelbulb // The power 8 Mandelbulb.
+};
+
+/*
+ * A procedural object defined by a distance estimator rather than geometry: a fractal, placed in the scene
+ * by the position of its origin and its size. Rays find it by marching (see MarchSettings), each step
+ * of which evaluates the fractal's formula iterations times.
+ *
+ * Estimates are made for up to four points at once, one per SIMD lane, so march() advances up to four rays
+ * together, and a surface normal takes one evaluation of four points around the hit.
+ * Marching only begins where a ray enters the fractal's bounding sphere, and ends where it leaves.
+ */
+struct DistanceField {
+    FractalKind kind;
+    Pos3f centre;
+    float scale;         // World units per unit of the fractal's own space.
+    Quatf c;             // The Julia set's constant.
+    uint32_t iterations;
+
+    // The quaternion Julia set of z^2 + c, sliced where the last component is zero.
+    static DistanceField julia(const Pos3f &centre, const float &scale, const Quatf &c,
+                               const uint32_t &iterations = 12);
+
+    static DistanceField mandelbulb(const Pos3f &centre, const float &scale, const uint32_t &iterations = 8);
+
+    // The radius of the bounding sphere, in the fractal's own space.
+    float radius() const;
+
+    AABB bounds() const;
+
+    // The estimated distance from p to the surface, in world units; negative inside.
+    float distance(const Pos3f &p) const;
+
+    uint32_t march(const Ray3f *rays, float *t, const uint32_t &count, const MarchSettings &settings) const;
+
+    bool nearest(const Ray3f &ray, float &t, const MarchSettings &settings) const {
+        return march(&ray, &t, 1, settings) != 0;
+    }
+
+    bool any(const Ray3f &ray, const float &t_max, const MarchSettings &settings) const {
+        float t = t_max;
+        return march(&ray, &t, 1, settings) != 0;
+    }
+
+    Vec3f normal(const Pos3f &p, const float &h) const;
+
+    // The distance estimation kernel compiled in.
+    static const char *kernel_name();
+
+private:
+
+    void estimate(const float *x, const float *y, const float *z, float *distance) const;
+};
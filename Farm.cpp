@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Farm.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/*
+ * Workers and the coordinator talk over a socket pair in fixed-size messages, in the byte order of the machine.
+ * A worker announces whether it could open the scene, then renders jobs until it is told to stop,
+ * sending each finished tile as a message followed by its pixels (width * height Vec3fs, row by row)
+ * and then a message that the job is done.
+ */
+enum MessageType : uint32_t {
+    MESSAGE_READY = 1, // Worker to coordinator: the scene is open.
+    MESSAGE_FAILED,    // Worker to coordinator: the scene couldn't be opened.
+    MESSAGE_JOB,       // Coordinator to worker: render height rows starting at row y.
+    MESSAGE_STOP,      // Coordinator to worker: exit.
+    MESSAGE_TILE,      // Worker to coordinator: pixels of the job follow.
+    MESSAGE_DONE       // Worker to coordinator: the job is finished.
+};
+
+struct Message {
+    uint32_t type;
+    uint32_t job;
+    uint32_t x, y;
+    uint32_t width, height;
+};
+
+bool send_all(const int &fd, const void *data, size_t size) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        // Without MSG_NOSIGNAL, writing to a dead peer would kill this process with SIGPIPE.
+        const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+/*
+ * Read exactly size bytes, failing at the end of the stream, on an error, or on a receive timeout.
+ */
+bool receive_all(const int &fd, void *data, size_t size) {
+    auto *bytes = static_cast<uint8_t *>(data);
+    while (size > 0) {
+        const ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= (size_t) received;
+    }
+    return true;
+}
+
+/*
+ * Sends the tiles of a job to the coordinator as they are finished, from whichever threads finish them.
+ */
+struct SocketSink : ImageSink {
+    SocketSink(const int &fd, const uint32_t &job)
+            : fd_(fd), job_(job), mutex_(), ok_(true) {}
+
+    bool ok() const {
+        return ok_;
+    }
+
+    void write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) override {
+        const Message message = {MESSAGE_TILE, job_, (uint32_t) tile.x, (uint32_t) tile.y, (uint32_t) tile.width,
+                                 (uint32_t) tile.height};
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!ok_) {
+            return;
+        }
+        bool ok = send_all(fd_, &message, sizeof(message));
+        if (stride == tile.width) {
+            ok = ok && send_all(fd_, pixels, tile.width * tile.height * sizeof(Vec3f));
+        } else {
+            for (size_t j = 0; ok && j < tile.height; j++) {
+                ok = send_all(fd_, pixels + j * stride, tile.width * sizeof(Vec3f));
+            }
+        }
+        ok_ = ok;
+    }
+
+private:
+
+    int fd_;
+    uint32_t job_;
+    std::mutex mutex_;
+    bool ok_;
+};
+
+/*
+ * The whole life of a worker process, returning its exit status.
+ */
+int worker_main(const int &fd, FarmWorker &worker) {
+    Message message = {};
+    if (!worker.open()) {
+        message.type = MESSAGE_FAILED;
+        send_all(fd, &message, sizeof(message));
+        return 1;
+    }
+    message.type = MESSAGE_READY;
+    if (!send_all(fd, &message, sizeof(message))) {
+        return 1;
+    }
+
+    while (receive_all(fd, &message, sizeof(message))) {
+        if (message.type == MESSAGE_STOP) {
+            return 0;
+        }
+        if (message.type != MESSAGE_JOB) {
+            return 1;
+        }
+        SocketSink sink(fd, message.job);
+        worker.render(message.y, message.height, sink);
+        if (!sink.ok()) {
+            return 1;
+        }
+        message.type = MESSAGE_DONE;
+        if (!send_all(fd, &message, sizeof(message))) {
+            return 1;
+        }
+    }
+    // The coordinator has gone.
+    return 1;
+}
+
+struct Job {
+    size_t first_row;
+    size_t row_count;
+    size_t attempts;
+};
+
+struct Process {
+    pid_t pid;
+    int fd;         // Closed once the worker is lost.
+    bool ready;     // The worker has opened the scene.
+    int job;        // The job it is working on, or -1.
+    Clock::time_point started;
+};
+
+}
+
+/*
+ * Render a width x height frame across settings.workers worker processes on this machine, writing it to the sink.
+ *
+ * The frame is split into jobs of settings.job_rows rows, handed out one at a time to whichever worker is idle.
+ * Workers are forked from this process, so they must be started before it has any other threads;
+ * each opens the scene once and renders jobs with its own thread pool, sending back tiles of pixels as they finish.
+ *
+ * A worker that dies, takes longer than settings.timeout_ms over a job, or sends anything unexpected is killed
+ * and replaced, and its job is handed out again; tiles it had already sent are simply overwritten.
+ * Returns false, having reported why, if a job fails settings.max_attempts times or every worker is lost.
+ */
+bool render_farm(const size_t &width, const size_t &height, FarmWorker &worker, ImageSink &sink,
+                 const FarmSettings &settings, FarmStats &stats) {
+    const auto start = Clock::now();
+    const size_t job_rows = std::max((size_t) 1, settings.job_rows);
+    std::vector<Job> jobs;
+    std::deque<uint32_t> pending;
+    for (size_t y = 0; y < height; y += job_rows) {
+        pending.push_back((uint32_t) jobs.size());
+        jobs.push_back({y, std::min(job_rows, height - y), 0});
+    }
+    stats.jobs = jobs.size();
+
+    std::vector<Process> processes;
+    const auto spawn = [&]() {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            std::cerr << "Could not create a socket for a worker: " << std::strerror(errno) << "\n";
+            return;
+        }
+        const pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Could not start a worker: " << std::strerror(errno) << "\n";
+            close(fds[0]);
+            close(fds[1]);
+            return;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            for (const auto &process : processes) {
+                if (process.fd >= 0) {
+                    close(process.fd);
+                }
+            }
+            _exit(worker_main(fds[1], worker));
+        }
+        close(fds[1]);
+
+        // A worker that stops mid-message is as good as lost.
+        timeval timeout = {settings.timeout_ms / 1000, (settings.timeout_ms % 1000) * 1000};
+        setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        processes.push_back({pid, fds[0], false, -1, Clock::now()});
+    };
+
+    bool ok = true;
+    // Kill a worker and hand its job out again. Workers which had opened the scene are replaced.
+    const auto lose = [&](const size_t &p) {
+        kill(processes[p].pid, SIGKILL);
+        waitpid(processes[p].pid, nullptr, 0);
+        close(processes[p].fd);
+        processes[p].fd = -1;
+        stats.workers_lost++;
+
+        const int job = processes[p].job;
+        if (job >= 0) {
+            if (jobs[job].attempts >= settings.max_attempts) {
+                std::cerr << "Rows " << jobs[job].first_row << " to " << jobs[job].first_row + jobs[job].row_count
+                          << " failed " << jobs[job].attempts << " times\n";
+                ok = false;
+            }
+            pending.push_front((uint32_t) job);
+            stats.retries++;
+        }
+        if (processes[p].ready) {
+            spawn();
+        }
+    };
+
+    for (size_t w = 0; w < std::max((size_t) 1, settings.workers); w++) {
+        spawn();
+    }
+
+    std::vector<Vec3f> pixels;
+    size_t finished = 0;
+    while (ok && finished < jobs.size()) {
+        std::vector<pollfd> polls;
+        std::vector<size_t> polled;
+        int timeout = -1;
+        for (size_t p = 0; p < processes.size(); p++) {
+            Process &process = processes[p];
+            if (process.fd < 0) {
+                continue;
+            }
+            if (process.ready && process.job < 0 && !pending.empty()) {
+                const uint32_t job = pending.front();
+                const Message message = {MESSAGE_JOB, job, 0, (uint32_t) jobs[job].first_row, (uint32_t) width,
+                                         (uint32_t) jobs[job].row_count};
+                pending.pop_front();
+                jobs[job].attempts++;
+                process.job = (int) job;
+                process.started = Clock::now();
+                if (!send_all(process.fd, &message, sizeof(message))) {
+                    std::cerr << "Could not send a job to worker " << process.pid << "\n";
+                    lose(p);
+                    continue;
+                }
+            }
+            if (process.job >= 0) {
+                const int remaining = std::max(0, settings.timeout_ms - (int) elapsed_ms(process.started));
+                timeout = timeout < 0 ? remaining : std::min(timeout, remaining);
+            }
+            polls.push_back({process.fd, POLLIN, 0});
+            polled.push_back(p);
+        }
+        if (!ok) {
+            break;
+        }
+        if (polls.empty()) {
+            std::cerr << "No workers left\n";
+            ok = false;
+            break;
+        }
+
+        const int ready = poll(polls.data(), polls.size(), timeout);
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << "Could not wait for workers: " << std::strerror(errno) << "\n";
+            ok = false;
+            break;
+        }
+        for (size_t k = 0; k < polls.size() && ok; k++) {
+            const size_t p = polled[k];
+            if (polls[k].revents == 0) {
+                if (processes[p].job >= 0 && elapsed_ms(processes[p].started) >= settings.timeout_ms) {
+                    std::cerr << "Worker " << processes[p].pid << " timed out\n";
+                    lose(p);
+                }
+                continue;
+            }
+
+            Message message;
+            bool expected = receive_all(processes[p].fd, &message, sizeof(message));
+            if (expected && message.type == MESSAGE_READY) {
+                expected = !processes[p].ready;
+                processes[p].ready = true;
+            } else if (expected && message.type == MESSAGE_TILE) {
+                const Job &job = jobs[message.job < jobs.size() ? message.job : 0];
+                expected = (int) message.job == processes[p].job && message.width > 0 &&
+                           message.x + message.width <= width && message.y >= job.first_row &&
+                           message.y + message.height <= job.first_row + job.row_count;
+                if (expected) {
+                    pixels.resize((size_t) message.width * message.height);
+                    expected = receive_all(processes[p].fd, pixels.data(), pixels.size() * sizeof(Vec3f));
+                }
+                if (expected) {
+                    sink.write_tile(Tile(message.x, message.y, message.width, message.height), pixels.data(),
+                                    message.width);
+                    stats.tiles++;
+                    stats.bytes += pixels.size() * sizeof(Vec3f);
+                }
+            } else if (expected && message.type == MESSAGE_DONE) {
+                expected = (int) message.job == processes[p].job;
+                if (expected) {
+                    processes[p].job = -1;
+                    finished++;
+                }
+            } else if (expected && message.type == MESSAGE_FAILED) {
+                // The worker has reported why; others will have the same trouble, so it isn't replaced.
+                expected = false;
+            } else {
+                expected = false;
+            }
+            if (!expected) {
+                lose(p);
+            }
+        }
+    }
+
+    for (auto &process : processes) {
+        if (process.fd < 0) {
+            continue;
+        }
+        // After a failure, workers may still be busy with jobs nobody is waiting for.
+        const Message message = {MESSAGE_STOP, 0, 0, 0, 0, 0};
+        if (!ok || !send_all(process.fd, &message, sizeof(message))) {
+            kill(process.pid, SIGKILL);
+        }
+        close(process.fd);
+        waitpid(process.pid, nullptr, 0);
+    }
+    stats.total_ms = elapsed_ms(start);
+    return ok;
+}
+
+void FarmStats::report(std::ostream &out) const {
+    out << "Farm: " << jobs << " jobs in " << total_ms << " ms, " << tiles << " tiles, "
+        << bytes / (1024.0 * 1024.0) << " MiB received, " << retries << " retried, "
+        << workers_lost << " workers lost\n";
+}
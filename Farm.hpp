@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+
+#include "ImageSink.hpp"
+
+/*
+ * The part of a farm render that runs in each worker process.
+ */
+struct FarmWorker {
+    virtual ~FarmWorker() {}
+
+    // Load the scene, once per worker. Returns false if it couldn't be, which is reported.
+    virtual bool open() = 0;
+
+    // Render row_count rows of the frame starting at first_row into the sink, which may be written from any thread.
+    virtual void render(const size_t &first_row, const size_t &row_count, ImageSink &sink) = 0;
+};
+
+struct FarmSettings {
+    size_t workers;      // Worker processes to start.
+    size_t job_rows;     // Rows of the frame handed to a worker at a time; a multiple of the scene's tile size.
+    size_t max_attempts; // Times a job is tried before the render gives up on it.
+    int timeout_ms;      // A worker which spends longer than this on one job is presumed hung and killed.
+
+    FarmSettings()
+            : workers(4), job_rows(64), max_attempts(3), timeout_ms(60000) {}
+};
+
+/*
+ * What happened during a farm render.
+ */
+struct FarmStats {
+    size_t jobs;
+    size_t retries;      // Jobs handed out again after their worker failed.
+    size_t workers_lost; // Workers which died, hung, or sent something unexpected.
+    size_t tiles;
+    size_t bytes;        // Of pixels received from the workers.
+    double total_ms;
+
+    FarmStats()
+            : jobs(0), retries(0), workers_lost(0), tiles(0), bytes(0), total_ms(0) {}
+
+    void report(std::ostream &out) const;
+};
+
+bool render_farm(const size_t &width, const size_t &height, FarmWorker &worker, ImageSink &sink,
+                 const FarmSettings &settings, FarmStats &stats);
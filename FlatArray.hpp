@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/*
+ * A contiguous array of plain values which either owns its elements
+ * or refers to elements held elsewhere, such as in a memory-mapped scene file.
+ *
+ * Reading is the same either way; modifying a referring array first copies its elements
+ * into owned storage.
+ */
+template<typename T>
+struct FlatArray {
+    FlatArray()
+            : owned_(), data_(nullptr), size_(0) {}
+
+    FlatArray(const FlatArray &) = delete;
+
+    FlatArray &operator=(const FlatArray &) = delete;
+
+    const T &operator[](const size_t &i) const {
+        return data_[i];
+    }
+
+    const T *data() const {
+        return data_;
+    }
+
+    const T *begin() const {
+        return data_;
+    }
+
+    const T *end() const {
+        return data_ + size_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    bool owned() const {
+        return data_ == owned_.data();
+    }
+
+    void clear() {
+        owned_.clear();
+        data_ = owned_.data();
+        size_ = 0;
+    }
+
+    // Take ownership of the given values. Only the first size are counted as elements;
+    // any beyond that are padding for vector loads.
+    void assign(std::vector<T> &&values, const size_t &size) {
+        owned_ = std::move(values);
+        data_ = owned_.data();
+        size_ = size;
+    }
+
+    void assign(std::vector<T> &&values) {
+        const size_t size = values.size();
+        assign(std::move(values), size);
+    }
+
+    // Refer to elements owned elsewhere, which must outlive this array or last until it is next modified.
+    void refer(const T *data, const size_t &size) {
+        owned_.clear();
+        owned_.shrink_to_fit();
+        data_ = data;
+        size_ = size;
+    }
+
+    void push_back(const T &value) {
+        own();
+        owned_.push_back(value);
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    // A modifiable reference to element i. It is invalidated by push_back.
+    // Like std::vector::at, throws std::out_of_range if there is no element i.
+    T &at(const size_t &i) {
+        own();
+        return owned_.at(i);
+    }
+
+    // The elements, for modifying in place. Unlike at(), this keeps any padding after owned elements.
+    T *mutable_data() {
+        if (!owned()) {
+            own();
+        }
+        return owned_.data();
+    }
+
+private:
+
+    // Make sure the elements are held in owned_, without padding.
+    void own() {
+        if (!owned()) {
+            owned_.assign(data_, data_ + size_);
+        }
+        owned_.erase(owned_.begin() + size_, owned_.end());
+        data_ = owned_.data();
+    }
+
+    std::vector<T> owned_;
+    const T *data_;
+    size_t size_;
+};
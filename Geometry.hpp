@@ -4,6 +4,15 @@
 #include <cassert>
 #include <iostream>
 
+#if defined(RAYMONDE_FAST_RSQRT) && (defined(__SSE__) || defined(__ARM_NEON))
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#else
+#include <arm_neon.h>
+#endif
+#define GEOMETRY_FAST_RSQRT
+#endif
+
 template<size_t D, typename T>
 struct Pos;
 
@@ -87,6 +96,39 @@ private:
 
 typedef Vec<3, float> Vec3f;
 
+/*
+ * The factor scaling a vector with the given squared length to length l.
+ */
+template<typename T>
+inline T length_scale(const T &l, const T &length_squared) {
+    return l / std::sqrt(length_squared);
+}
+
+#ifdef GEOMETRY_FAST_RSQRT
+/*
+ * With RAYMONDE_FAST_RSQRT, floats use the hardware reciprocal square root estimate,
+ * refined by Newton-Raphson, instead of a square root and a division. Results differ from the exact
+ * path by a few units in the last place, which raymonde_geometry_check bounds.
+ */
+template<>
+inline float length_scale(const float &l, const float &length_squared) {
+#if defined(__SSE__)
+    const float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(length_squared)));
+    return l * estimate * (1.5f - 0.5f * length_squared * estimate * estimate);
+#else
+    const float32x2_t s = vdup_n_f32(length_squared);
+    float32x2_t estimate = vrsqrte_f32(s);
+    estimate = vmul_f32(estimate, vrsqrts_f32(vmul_f32(s, estimate), estimate));
+    estimate = vmul_f32(estimate, vrsqrts_f32(vmul_f32(s, estimate), estimate));
+    return l * vget_lane_f32(estimate, 0);
+#endif
+}
+#endif
+
+/*
+ * Three-vectors have named components rather than an array, and their own copies of
+ * the operations below, so that nothing in the inner loops goes through indexing.
+ */
 template<typename T>
 struct Vec<3, T> {
     Vec<3, T>() : x(T()), y(T()), z(T()) {}
@@ -133,17 +175,22 @@ struct Vec<3, T> {
         return *this;
     }
 
+    T length_squared() const {
+        return x * x + y * y + z * z;
+    }
+
     T length() const {
-        return std::sqrt(x * x + y * y + z * z);
+        return std::sqrt(length_squared());
     }
 
     Vec<3, T> &normalise(T l = 1) {
-        *this = *this * (l / length());
+        *this *= length_scale(l, length_squared());
         return *this;
     }
 
     Vec<3, T> unit(T l = 1) const {
-        return *this * (l / length());
+        const T scale = length_scale(l, length_squared());
+        return Vec<3, T>(x * scale, y * scale, z * scale);
     }
 
     Vec<3, T> position() const {
@@ -153,16 +200,28 @@ struct Vec<3, T> {
     T x, y, z;
 };
 
+static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f is stored packed, e.g. in spheres and scene files");
+
 // Cross product specialises for 3-vectors only.
 template<typename T>
 Vec<3, T> cross(const Vec<3, T> &v1, const Vec<3, T> &v2) {
     return Vec<3, T>(v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
 }
 
+template<typename T>
+T operator*(const Vec<3, T> &lhs, const Vec<3, T> &rhs) {
+    return lhs.x * rhs.x + lhs.y * rhs.y + lhs.z * rhs.z;
+}
+
+template<typename T>
+Vec<3, T> hadamard(const Vec<3, T> &l, const Vec<3, T> &r) {
+    return Vec<3, T>(l.x * r.x, l.y * r.y, l.z * r.z);
+}
+
 // Dot product
 template<size_t D, typename T>
 T operator*(const Vec<D, T> &lhs, const Vec<D, T> &rhs) {
-    T result;
+    T result = T();
     for (size_t i = 0; i < D; i++) {
         result += lhs[i] * rhs[i];
     }
@@ -230,6 +289,11 @@ Vec<D, T> projection(const Vec<D, T> &v, const Vec<D, T> &u) {
     return ((v * u) / (uNorm * uNorm)) * u;
 }
 
+template<typename T>
+Vec<3, T> projection(const Vec<3, T> &v, const Vec<3, T> &u) {
+    return ((v * u) / u.length_squared()) * u;
+}
+
 template<size_t D, typename T>
 std::ostream &operator<<(std::ostream &out, const Vec<D, T> &v) {
     out << "Vec(";
@@ -327,6 +391,8 @@ struct Pos<3, T> {
     T x, y, z;
 };
 
+static_assert(sizeof(Pos3f) == 3 * sizeof(float), "Pos3f is stored packed, e.g. in spheres and scene files");
+
 template<size_t D, typename T>
 T distance(const Pos<D, T> &p1, const Pos<D, T> &p2) {
     return (p1 - p2).length();
@@ -342,6 +408,16 @@ Vec<D, T> operator-(const Pos<D, T> &end, const Pos<D, T> &start) {
     return v;
 }
 
+template<typename T>
+Vec<3, T> operator-(const Pos<3, T> &end, const Pos<3, T> &start) {
+    return Vec<3, T>(end.x - start.x, end.y - start.y, end.z - start.z);
+}
+
+template<typename T>
+T distance_squared(const Pos<3, T> &p1, const Pos<3, T> &p2) {
+    return (p1 - p2).length_squared();
+}
+
 // The sum of a vector and a position yields a new position.
 template<size_t D, typename T>
 Pos<D, T> operator+(Pos<D, T> pos, const Vec<D, T> &vec) {
@@ -393,7 +469,6 @@ std::ostream &operator<<(std::ostream &out, const Ray<D, T> &r) {
     return out;
 }
 
-/*
 template<typename T>
 struct Quaternion {
     T t, x, y, z;
@@ -432,11 +507,12 @@ struct Quaternion {
         return *this;
     }
 
+    // The Hamilton product, this * rhs.
     Quaternion<T> &operator*=(const Quaternion<T> &rhs) {
-        t = t * rhs.t - x*rhs.x - y*rhs.y - z*rhs.z;
-        x = t * rhs.x + x * rhs.t + y * rhs.z - z * rhs.y;
-        y = t * rhs.y + y * rhs.t + z * rhs.x - x * rhs.z;
-        z = t * rhs.z + z * rhs.t + x * rhs.y - y * rhs.x;
+        *this = Quaternion<T>(t * rhs.t - x * rhs.x - y * rhs.y - z * rhs.z,
+                              t * rhs.x + x * rhs.t + y * rhs.z - z * rhs.y,
+                              t * rhs.y + y * rhs.t + z * rhs.x - x * rhs.z,
+                              t * rhs.z + z * rhs.t + x * rhs.y - y * rhs.x);
         return *this;
     }
 
@@ -515,7 +591,13 @@ Quaternion<T> operator-(Quaternion<T> lhs, const U &rhs) {
 
 template<typename T, typename U>
 Quaternion<T> operator-(const U &lhs, const Quaternion<T> &rhs) {
-    return rhs + -lhs;
+    return -rhs + lhs;
+}
+
+template<typename T>
+Quaternion<T> operator*(Quaternion<T> lhs, const Quaternion<T> &rhs) {
+    lhs *= rhs;
+    return lhs;
 }
 
 template<typename T>
@@ -565,5 +647,4 @@ Vec<3, T> rotate(const Vec<3, T> &v, const Quaternion<U> &axis, const V theta) {
     return Vec<3, T>(r.x, r.y, r.z);
 }
 
-typedef Quaternion<float> Quatf;
-*/
\ No newline at end of file
+typedef Quaternion<float> Quatf;
\ No newline at end of file
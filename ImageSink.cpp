@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTISE_X86
+#endif
+
+#include "ImageSink.hpp"
+
+namespace {
+
+// Light values are capped here before tone mapping, which keeps infinities, and the overflow of
+// squaring huge values in the ACES fit, out of its divisions.
+const float POST_MAX_LIGHT = 1e16f;
+
+// Below this, the sRGB curve is a straight line.
+const float SRGB_LINEAR_LIMIT = 0.0031308f;
+
+#ifdef QUANTISE_X86
+
+/*
+ * A post-process's constants, with the numbers in every lane.
+ */
+struct QuantiseConstants {
+    __m128 exposure;
+    __m128 levels; // The largest stored value.
+    ToneMap tone_map;
+    bool srgb;
+    bool wide;     // Two bytes to a channel.
+
+    explicit QuantiseConstants(const PostProcess &post)
+            : exposure(_mm_set1_ps(std::exp2(post.exposure))), levels(_mm_set1_ps((float) post.max_value())),
+              tone_map(post.tone_map), srgb(post.srgb), wide(post.channel_bytes() == 2) {}
+};
+
+/*
+ * The sRGB curve above SRGB_LINEAR_LIMIT, 1.055 c^(1/2.4) - 0.055. Three square roots give v = c^(1/8),
+ * in [0.486, 1] there, and the curve is 1.055 v^(10/3) - 0.055, which is smooth enough for a quintic
+ * fitted at Chebyshev nodes to be good to 5e-7 in single precision. The quintic is evaluated by
+ * Estrin's scheme, whose shallower chain of dependent operations overlaps better than Horner's.
+ */
+inline __m128 sse_srgb_curve(const __m128 &c) {
+    const __m128 v = _mm_sqrt_ps(_mm_sqrt_ps(_mm_sqrt_ps(c)));
+    const __m128 v2 = _mm_mul_ps(v, v);
+    const __m128 p01 = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(0.0332146846f)), _mm_set1_ps(-0.0582588054f));
+    const __m128 p23 = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(0.910281777f)), _mm_set1_ps(-0.163710862f));
+    const __m128 p45 = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(-0.0338782631f)), _mm_set1_ps(0.312351376f));
+    return _mm_add_ps(p01, _mm_mul_ps(v2, _mm_add_ps(p23, _mm_mul_ps(v2, p45))));
+}
+
+/*
+ * The stored values of four channels, which may belong to different pixels, as every step treats
+ * channels alike. NaNs come out black.
+ */
+inline __m128i sse_post(const __m128 &light, const QuantiseConstants &k) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    // max gives its second operand where either is NaN.
+    __m128 c = _mm_min_ps(_mm_max_ps(_mm_mul_ps(light, k.exposure), zero), _mm_set1_ps(POST_MAX_LIGHT));
+    switch (k.tone_map) {
+        case ToneMap::reinhard:
+            c = _mm_div_ps(c, _mm_add_ps(c, one));
+            break;
+        case ToneMap::aces: {
+            const __m128 numerator = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+            const __m128 denominator = _mm_add_ps(
+                    _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))),
+                    _mm_set1_ps(0.14f));
+            c = _mm_div_ps(numerator, denominator);
+            break;
+        }
+        default:
+            break;
+    }
+    c = _mm_min_ps(c, one);
+    if (k.srgb) {
+        const __m128 limit = _mm_set1_ps(SRGB_LINEAR_LIMIT);
+        const __m128 linear = _mm_cmple_ps(c, limit);
+        const __m128 curve = sse_srgb_curve(_mm_max_ps(c, limit));
+        c = _mm_or_ps(_mm_and_ps(linear, _mm_mul_ps(c, _mm_set1_ps(12.92f))), _mm_andnot_ps(linear, curve));
+    }
+    return _mm_cvtps_epi32(_mm_mul_ps(c, k.levels));
+}
+
+/*
+ * Post-process the four pixels (twelve floats) at in to bytes at out: 12 of them, or 24 when wide,
+ * with each channel's two bytes most significant first, as in PPM files.
+ */
+inline void sse_quantise4(const float *in, uint8_t *out, const QuantiseConstants &k) {
+    const __m128i a = sse_post(_mm_loadu_ps(in), k);
+    const __m128i b = sse_post(_mm_loadu_ps(in + 4), k);
+    const __m128i c = sse_post(_mm_loadu_ps(in + 8), k);
+    if (!k.wide) {
+        const __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, c));
+        _mm_storel_epi64((__m128i *) out, bytes);
+        const int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+        std::memcpy(out + 8, &last, 4);
+        return;
+    }
+    // There's no unsigned 32 to 16-bit pack before SSE4.1, so values are offset into signed range and back.
+    const __m128i offset = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short) 0x8000);
+    __m128i low = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(a, offset), _mm_sub_epi32(b, offset)), flip);
+    __m128i high = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(c, offset), _mm_sub_epi32(c, offset)), flip);
+    low = _mm_or_si128(_mm_slli_epi16(low, 8), _mm_srli_epi16(low, 8));
+    high = _mm_or_si128(_mm_slli_epi16(high, 8), _mm_srli_epi16(high, 8));
+    _mm_storeu_si128((__m128i *) out, low);
+    _mm_storel_epi64((__m128i *) (out + 16), high);
+}
+
+#else
+
+float post_channel(const float &light, const float &exposure, const PostProcess &post) {
+    float c = light * exposure;
+    if (!(c >= 0)) {
+        c = 0; // NaN too, as _mm_max_ps gives in the vector kernel.
+    }
+    c = std::min(c, POST_MAX_LIGHT);
+    switch (post.tone_map) {
+        case ToneMap::reinhard:
+            c = c / (c + 1);
+            break;
+        case ToneMap::aces:
+            c = c * (2.51f * c + 0.03f) / (c * (2.43f * c + 0.59f) + 0.14f);
+            break;
+        default:
+            break;
+    }
+    c = std::min(c, 1.0f);
+    if (post.srgb) {
+        c = c <= SRGB_LINEAR_LIMIT ? 12.92f * c : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+    }
+    return c;
+}
+
+#endif
+
+}
+
+/*
+ * Post-process a tile into an image with rows image_width pixels long, as 8 or 16-bit RGB
+ * according to post.bits, with the two bytes of 16-bit channels most significant first.
+ *
+ * Every step works on each channel alone, so the vector kernel takes the tile's packed channels
+ * four at a time, whichever pixel they belong to, and a row of pixels is done in steps of four pixels.
+ */
+void quantise_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride,
+                   uint8_t *image, const size_t &image_width, const PostProcess &post) {
+    const size_t pixel_bytes = 3 * post.channel_bytes();
+#ifdef QUANTISE_X86
+    const QuantiseConstants constants(post);
+    for (size_t j = 0; j < tile.height; j++) {
+        uint8_t *row = image + ((tile.y + j) * image_width + tile.x) * pixel_bytes;
+        const float *source = &pixels[j * stride].x;
+        size_t i = 0;
+        for (; i + 4 <= tile.width; i += 4) {
+            sse_quantise4(source + 3 * i, row + i * pixel_bytes, constants);
+        }
+        if (i < tile.width) {
+            // The last few pixels go through a four-pixel buffer, so as not to read or write past the row.
+            float in[12] = {};
+            uint8_t out[24];
+            std::memcpy(in, source + 3 * i, (tile.width - i) * 3 * sizeof(float));
+            sse_quantise4(in, out, constants);
+            std::memcpy(row + i * pixel_bytes, out, (tile.width - i) * pixel_bytes);
+        }
+    }
+#else
+    const float exposure = std::exp2(post.exposure);
+    const float levels = (float) post.max_value();
+    for (size_t j = 0; j < tile.height; j++) {
+        uint8_t *row = image + ((tile.y + j) * image_width + tile.x) * pixel_bytes;
+        const float *source = &pixels[j * stride].x;
+        for (size_t c = 0; c < 3 * tile.width; c++) {
+            const auto value = (uint32_t) std::lrint(post_channel(source[c], exposure, post) * levels);
+            if (post.channel_bytes() == 2) {
+                row[2 * c] = (uint8_t) (value >> 8);
+                row[2 * c + 1] = (uint8_t) value;
+            } else {
+                row[c] = (uint8_t) value;
+            }
+        }
+    }
+#endif
+}
+
+/*
+ * The name of the post-processing kernel this build uses.
+ */
+const char *quantise_kernel_name() {
+#ifdef QUANTISE_X86
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+/*
+ * Create (or truncate) the file at path, sized for a width x height image, and map it.
+ * On failure the error is reported and ok() returns false.
+ */
+PPMFile::PPMFile(const std::string &path, const size_t &width, const size_t &height, const PostProcess &post)
+        : width_(width), height_(height), post_(post), fd_(-1), size_(0), data_(nullptr), pixels_(nullptr) {
+    const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n" +
+                               std::to_string(post.max_value()) + "\n";
+    size_ = header.size() + width * height * 3 * post.channel_bytes();
+
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || ftruncate(fd_, (off_t) size_) != 0) {
+        std::cerr << "Could not create " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+
+    void *mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Could not map " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    data_ = (uint8_t *) mapping;
+    std::memcpy(data_, header.data(), header.size());
+    pixels_ = data_ + header.size();
+}
+
+PPMFile::~PPMFile() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+/*
+ * Post-process a tile to bytes in the file.
+ */
+void PPMFile::write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) {
+    if (data_ == nullptr) {
+        return;
+    }
+    assert(tile.x + tile.width <= width_ && tile.y + tile.height <= height_);
+    quantise_tile(tile, pixels, stride, pixels_, width_, post_);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "Geometry.hpp"
+#include "Scheduler.hpp"
+
+/*
+ * Somewhere for finished tiles of an image to go.
+ * write_tile may be called concurrently from several threads, for disjoint tiles.
+ */
+struct ImageSink {
+    virtual ~ImageSink() {}
+
+    // Pixels holds the tile's top-left pixel and has rows stride pixels apart.
+    virtual void write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) = 0;
+};
+
+/*
+ * How light values above 1 are brought into range before they are stored.
+ */
+enum class ToneMap {
+    clamp,    // Each channel is cut off at 1.
+    reinhard, // Each channel c becomes c / (1 + c), which never quite reaches 1.
+    aces      // A fit to the ACES filmic curve, with a toe in the shadows and a soft shoulder.
+};
+
+inline const char *tone_map_name(const ToneMap &tone_map) {
+    switch (tone_map) {
+        case ToneMap::reinhard:
+            return "reinhard";
+        case ToneMap::aces:
+            return "aces";
+        default:
+            return "clamp";
+    }
+}
+
+/*
+ * The tone map with the given name, as given by tone_map_name. Returns false if there is none.
+ */
+inline bool parse_tone_map(const std::string &name, ToneMap &tone_map) {
+    for (const ToneMap t : {ToneMap::clamp, ToneMap::reinhard, ToneMap::aces}) {
+        if (name == tone_map_name(t)) {
+            tone_map = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * How rendered light becomes stored pixels: scaled by the exposure, tone mapped, encoded with the sRGB curve
+ * if srgb is set, and rounded to the nearest of 2^bits levels. The defaults store light values as they are,
+ * clamped, in 8 bits.
+ */
+struct PostProcess {
+    float exposure; // In stops: each one doubles the light.
+    ToneMap tone_map;
+    bool srgb;
+    uint32_t bits;  // 8 or 16.
+
+    PostProcess()
+            : exposure(0), tone_map(ToneMap::clamp), srgb(false), bits(8) {}
+
+    size_t channel_bytes() const {
+        return bits > 8 ? 2 : 1;
+    }
+
+    uint32_t max_value() const {
+        return bits > 8 ? 65535 : 255;
+    }
+};
+
+void quantise_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride,
+                   uint8_t *image, const size_t &image_width, const PostProcess &post = PostProcess());
+
+const char *quantise_kernel_name();
+
+/*
+ * A binary PPM file, written through a memory mapping of the whole file.
+ * Tiles are post-processed straight into the mapped bytes as they arrive, and the kernel
+ * writes them back in the background while rendering continues.
+ */
+struct PPMFile : ImageSink {
+    PPMFile(const std::string &path, const size_t &width, const size_t &height,
+            const PostProcess &post = PostProcess());
+
+    ~PPMFile() override;
+
+    PPMFile(const PPMFile &) = delete;
+
+    PPMFile &operator=(const PPMFile &) = delete;
+
+    bool ok() const {
+        return data_ != nullptr;
+    }
+
+    void write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) override;
+
+private:
+
+    size_t width_;
+    size_t height_;
+    PostProcess post_;
+    int fd_;
+    size_t size_;
+    uint8_t *data_;
+    uint8_t *pixels_;
+};
+
+/*
+ * Forwards tiles to another sink, offset to place them within a region of its image.
+ */
+struct SinkRegion : ImageSink {
+    SinkRegion(ImageSink &sink, const size_t &x, const size_t &y)
+            : sink_(sink), x_(x), y_(y) {}
+
+    void write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) override {
+        sink_.write_tile(Tile(tile.x + x_, tile.y + y_, tile.width, tile.height), pixels, stride);
+    }
+
+private:
+
+    ImageSink &sink_;
+    size_t x_;
+    size_t y_;
+};
@@ -0,0 +1,145 @@
+#include <cmath>
+
+#include "Instance.hpp"
+
+Transform::Transform()
+        : m{{1, 0, 0, 0},
+            {0, 1, 0, 0},
+            {0, 0, 1, 0}} {}
+
+Transform Transform::translation(const Vec3f &offset) {
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        t.m[row][3] = offset[row];
+    }
+    return t;
+}
+
+Transform Transform::scaling(const float &factor) {
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        t.m[row][row] = factor;
+    }
+    return t;
+}
+
+/*
+ * Rodrigues' formula: R = cos(a) I + sin(a) [k]x + (1 - cos(a)) k k^T for the unit axis k.
+ */
+Transform Transform::rotation(const Vec3f &axis, const float &angle) {
+    const Vec3f k = axis.unit();
+    const float c = std::cos(angle);
+    const float s = std::sin(angle);
+    const float cross_matrix[3][3] = {{0, -k.z, k.y},
+                                      {k.z, 0, -k.x},
+                                      {-k.y, k.x, 0}};
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            t.m[row][col] = (row == col ? c : 0) + s * cross_matrix[row][col] + (1 - c) * k[row] * k[col];
+        }
+    }
+    return t;
+}
+
+Transform Transform::operator*(const Transform &rhs) const {
+    Transform t;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 4; col++) {
+            t.m[row][col] = m[row][0] * rhs.m[0][col] + m[row][1] * rhs.m[1][col] + m[row][2] * rhs.m[2][col] +
+                            (col == 3 ? m[row][3] : 0);
+        }
+    }
+    return t;
+}
+
+/*
+ * The linear part is inverted by its adjugate over its determinant; the translation is then undone
+ * by the inverted linear part. The transform must not be singular.
+ */
+Transform Transform::inverse() const {
+    const float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                      m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                      m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    const float inv_det = 1.0f / det;
+    Transform t;
+    t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+    t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+    t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+    t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+    for (int row = 0; row < 3; row++) {
+        t.m[row][3] = -(t.m[row][0] * m[0][3] + t.m[row][1] * m[1][3] + t.m[row][2] * m[2][3]);
+    }
+    return t;
+}
+
+/*
+ * The box around the transformed corners of the given box.
+ */
+AABB Transform::apply(const AABB &box) const {
+    AABB result;
+    if (box.empty()) {
+        return result;
+    }
+    for (int corner = 0; corner < 8; corner++) {
+        result.extend(apply(Pos3f(corner & 1 ? box.max.x : box.min.x,
+                                  corner & 2 ? box.max.y : box.min.y,
+                                  corner & 4 ? box.max.z : box.min.z)));
+    }
+    return result;
+}
+
+/*
+ * Build the hierarchy over the spheres, and the sphere arrays in its leaf order.
+ */
+void Prototype::build() {
+    bvh.build(spheres);
+    sphere_arrays.build(spheres, bvh.indices);
+}
+
+AABB Prototype::bounds() const {
+    return bvh.empty() ? AABB() : bvh.nodes[0].bounds;
+}
+
+/*
+ * Find the nearest sphere along the ray, which is in the prototype's space, closer than parameter t.
+ * If there is one, return true with its parameter in t and its index in spheres in sphere.
+ */
+bool Prototype::nearest(const Ray3f &ray, float &t, uint32_t &sphere) const {
+    uint32_t hit = 0;
+    bool collided = false;
+    bvh.traverse(ray, t, [&](uint32_t first, uint32_t count, float &t_max) {
+        if (sphere_arrays.nearest(ray, first, count, t_max, hit)) {
+            collided = true;
+        }
+        return false;
+    });
+    if (collided) {
+        sphere = sphere_arrays.index[hit];
+    }
+    return collided;
+}
+
+/*
+ * Return true iff any sphere lies along the ray, which is in the prototype's space, within parameter t_max.
+ */
+bool Prototype::any(const Ray3f &ray, const float &t_max) const {
+    float cutoff = t_max;
+    bool blocked = false;
+    bvh.traverse(ray, cutoff, [&](uint32_t first, uint32_t count, float &limit) {
+        blocked = sphere_arrays.any(ray, first, count, limit);
+        return blocked;
+    });
+    return blocked;
+}
+
+size_t Prototype::memory_size() const {
+    return spheres.size() * (sizeof(Sphere) + sizeof(uint32_t)) +
+           sphere_arrays.size() * (4 * sizeof(float) + sizeof(uint32_t)) +
+           bvh.nodes.size() * sizeof(BVHNode) + bvh.indices.size() * sizeof(uint32_t);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+
+#include "BVH.hpp"
+#include "FlatArray.hpp"
+#include "Geometry.hpp"
+#include "Sphere.hpp"
+#include "SphereArrays.hpp"
+
+/*
+ * An affine transform: a linear part, such as a rotation or scaling, followed by a translation.
+ */
+struct Transform {
+    float m[3][4]; // Row by row, the linear part then the translation.
+
+    // The identity.
+    Transform();
+
+    static Transform translation(const Vec3f &offset);
+
+    static Transform scaling(const float &factor);
+
+    // Anticlockwise about the given axis, looking back along it.
+    static Transform rotation(const Vec3f &axis, const float &angle);
+
+    // The transform which applies rhs, then this.
+    Transform operator*(const Transform &rhs) const;
+
+    Transform inverse() const;
+
+    Pos3f apply(const Pos3f &p) const {
+        return Pos3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                     m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                     m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vec3f apply(const Vec3f &v) const {
+        return Vec3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                     m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                     m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    /*
+     * The direction isn't renormalised, so that a point at parameter t along the ray
+     * is the transform of the point at t along the original.
+     */
+    Ray3f apply(const Ray3f &ray) const {
+        return Ray3f(apply(ray.position), apply(ray.direction));
+    }
+
+    // The linear part's transpose applied to v: normals map by the transpose of the inverse transform.
+    Vec3f apply_transposed(const Vec3f &v) const {
+        return Vec3f(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                     m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                     m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+
+    AABB apply(const AABB &box) const;
+};
+
+/*
+ * A group of spheres defined once, with an acceleration structure of its own, to be placed in a scene
+ * any number of times by instances. Each sphere's material is an index into the scene's materials.
+ *
+ * build() must be called (as Scene::finalise and Scene::refit do) before the prototype is traced,
+ * and again after spheres are added.
+ */
+struct Prototype {
+    FlatArray<Sphere> spheres;
+    FlatArray<uint32_t> sphere_materials;
+    BVH bvh;
+    SphereArrays sphere_arrays;
+
+    Prototype()
+            : spheres(), sphere_materials(), bvh(), sphere_arrays() {}
+
+    void add_sphere(const Sphere &sphere, const uint32_t &material) {
+        spheres.push_back(sphere);
+        sphere_materials.push_back(material);
+        sphere_arrays.clear();
+    }
+
+    bool built() const {
+        return sphere_arrays.size() == spheres.size();
+    }
+
+    void build();
+
+    AABB bounds() const;
+
+    bool nearest(const Ray3f &ray, float &t, uint32_t &sphere) const;
+
+    bool any(const Ray3f &ray, const float &t_max) const;
+
+    size_t memory_size() const;
+};
+
+/*
+ * A placement of a prototype. Rays are brought into the prototype's space rather than the prototype
+ * into the world, but the placement itself is kept too, for bringing hits and bounds back out,
+ * so that it isn't inverted again for every hit shaded.
+ */
+struct Instance {
+    Transform to_local; // From world space into the prototype's.
+    Transform to_world; // The placement, from the prototype's space into the world's.
+    uint32_t prototype;
+
+    Instance(const Transform &placement, const uint32_t &p)
+            : to_local(placement.inverse()), to_world(placement), prototype(p) {}
+};
@@ -4,7 +4,7 @@
  * Return the light colour/intensity at a given point,
  * if there were no objects in the way.
  */
-Vec3f Light::illumination(const Pos3f &pos) {
+Vec3f Light::illumination(const Pos3f &pos) const {
     float distance = (pos - position).length();
     return colour * brightness / (distance * distance);
 }
@@ -10,5 +10,5 @@ struct Light {
     Light(Pos3f pos, Vec3f col, float bright)
             : position(pos), colour(col), brightness(bright) {}
 
-    Vec3f illumination(const Pos3f &pos);
+    Vec3f illumination(const Pos3f &pos) const;
 };
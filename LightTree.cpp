@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cmath>
+
+#include "LightTree.hpp"
+#include "Sphere.hpp"
+
+/*
+ * Discard the tree.
+ */
+void LightTree::clear() {
+    bvh.clear();
+    max_power.clear();
+    total_power.clear();
+    power.clear();
+    positions_.clear();
+}
+
+/*
+ * Build the tree over the given lights. It must be rebuilt whenever they change.
+ */
+void LightTree::build(const FlatArray<Light> &lights) {
+    clear();
+    if (lights.empty()) {
+        return;
+    }
+
+    std::vector<Sphere> points;
+    std::vector<float> light_power;
+    points.reserve(lights.size());
+    light_power.reserve(lights.size());
+    for (const auto &light : lights) {
+        points.emplace_back(light.position, 0.0f);
+        light_power.push_back(light.brightness * std::max(light.colour.x, std::max(light.colour.y, light.colour.z)));
+        positions_.push_back(light.position);
+    }
+    FlatArray<Sphere> spheres;
+    spheres.assign(std::move(points));
+    bvh.build(spheres);
+
+    // Children are always stored after their parents, so a reverse sweep visits them first.
+    std::vector<float> node_max(bvh.nodes.size(), 0);
+    std::vector<float> node_total(bvh.nodes.size(), 0);
+    for (size_t n = bvh.nodes.size(); n-- > 0;) {
+        const BVHNode &node = bvh.nodes[n];
+        if (node.is_leaf()) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                node_max[n] = std::max(node_max[n], light_power[bvh.indices[i]]);
+                node_total[n] += light_power[bvh.indices[i]];
+            }
+        } else {
+            node_max[n] = std::max(node_max[node.first], node_max[node.first + 1]);
+            node_total[n] = node_total[node.first] + node_total[node.first + 1];
+        }
+    }
+    max_power.assign(std::move(node_max));
+    total_power.assign(std::move(node_total));
+    power.assign(std::move(light_power));
+}
+
+/*
+ * Pick one of the lights which could cast at least cutoff illumination on the point,
+ * roughly in proportion to how much each contributes, given a uniform random number u in [0, 1).
+ * Returns false if it finds no such light; otherwise writes the light and the probability
+ * with which it was picked.
+ *
+ * A node may pass the cutoff on its brightest light's power when none of its lights do, so the descent
+ * can end without a light even if there are some elsewhere. Every light that passes the cutoff can still
+ * be picked, with the probability written, so an estimate that counts a failed sample as no light
+ * (rather than giving up on the rest) is still right on average.
+ *
+ * At each node the child to descend into is chosen in proportion to its lights' total power
+ * over the squared distance to their bounds' centre (but no closer than the bounds' half diagonal),
+ * and u is rescaled so that it can be used again for the next choice.
+ */
+bool LightTree::sample(const Pos3f &point, const float &cutoff, float u, uint32_t &light, float &probability) const {
+    if (bvh.nodes.empty() || importance(point, cutoff, 0) <= 0) {
+        return false;
+    }
+
+    probability = 1;
+    uint32_t n = 0;
+    while (!bvh.nodes[n].is_leaf()) {
+        const uint32_t left = bvh.nodes[n].first;
+        const float left_importance = importance(point, cutoff, left);
+        const float right_importance = importance(point, cutoff, left + 1);
+        if (left_importance + right_importance <= 0) {
+            return false;
+        }
+        const float p_left = left_importance / (left_importance + right_importance);
+        if (u < p_left) {
+            u /= p_left;
+            probability *= p_left;
+            n = left;
+        } else {
+            u = (u - p_left) / (1 - p_left);
+            probability *= 1 - p_left;
+            n = left + 1;
+        }
+        u = std::min(u, std::nextafter(1.0f, 0.0f));
+    }
+
+    // Within the leaf, each light is weighted by the most it could contribute.
+    const BVHNode &leaf = bvh.nodes[n];
+    float total = 0;
+    for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+        total += weight(point, cutoff, bvh.indices[i]);
+    }
+    if (total <= 0) {
+        return false;
+    }
+    // Rounding may leave target just past the last weight, in which case the last light with any is picked.
+    float target = u * total;
+    float chosen = 0;
+    for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+        const float w = weight(point, cutoff, bvh.indices[i]);
+        if (w > 0) {
+            light = bvh.indices[i];
+            chosen = w;
+            if (target < w) {
+                break;
+            }
+            target -= w;
+        }
+    }
+    probability *= chosen / total;
+    return true;
+}
+
+/*
+ * The squared distance from the point to the nearest point of the bounds, or zero if it is inside them.
+ */
+float LightTree::distance_squared(const Pos3f &point, const AABB &bounds) {
+    float d2 = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        const float outside = std::max(bounds.min[axis] - point[axis], std::max(0.0f, point[axis] - bounds.max[axis]));
+        d2 += outside * outside;
+    }
+    return d2;
+}
+
+/*
+ * The most light l could contribute to the point, or zero if that is less than cutoff.
+ */
+float LightTree::weight(const Pos3f &point, const float &cutoff, const uint32_t &l) const {
+    const Vec3f offset = positions_[l] - point;
+    const float d2 = std::max(offset * offset, (float) (MERGE_EPSILON * MERGE_EPSILON));
+    return power[l] >= cutoff * d2 ? power[l] / d2 : 0;
+}
+
+/*
+ * How much the node's lights are estimated to contribute to the point, relative to other nodes';
+ * zero if none of them could cast at least cutoff illumination on it.
+ */
+float LightTree::importance(const Pos3f &point, const float &cutoff, const uint32_t &node) const {
+    const AABB &bounds = bvh.nodes[node].bounds;
+    if (max_power[node] < cutoff * distance_squared(point, bounds)) {
+        return 0;
+    }
+    const Vec3f to_centre = bounds.centroid() - point;
+    const Vec3f diagonal = bounds.max - bounds.min;
+    const float d2 = std::max(to_centre * to_centre, std::max(0.25f * (diagonal * diagonal),
+                                                               (float) (MERGE_EPSILON * MERGE_EPSILON)));
+    return total_power[node] / d2;
+}
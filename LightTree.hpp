@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BVH.hpp"
+#include "constants.hpp"
+#include "FlatArray.hpp"
+#include "Geometry.hpp"
+#include "Light.hpp"
+
+/*
+ * A BVH over the scene's lights, with the power of the lights below each node,
+ * for shading with many lights without considering every one of them at every point.
+ *
+ * A light's power is its brightness times its brightest colour channel, so that the
+ * illumination it casts d away is at most power / d^2 in any channel. Each node records
+ * the greatest power among its lights, bounding what any of them can contribute to a point,
+ * and their total power, estimating what they contribute together.
+ *
+ * Culling visits only the lights that could contribute at least a cutoff at a point,
+ * skipping whole subtrees too far away to matter; sampling picks lights at random,
+ * descending the tree towards the subtrees likely to contribute most.
+ */
+struct LightTree {
+    BVH bvh; // Over the lights' positions.
+    FlatArray<float> max_power;   // Of each node.
+    FlatArray<float> total_power; // Of each node.
+    FlatArray<float> power;       // Of each light.
+
+    LightTree()
+            : bvh(), max_power(), total_power(), power(), positions_() {}
+
+    size_t size() const {
+        return power.size();
+    }
+
+    void clear();
+
+    void build(const FlatArray<Light> &lights);
+
+    bool sample(const Pos3f &point, const float &cutoff, float u, uint32_t &light, float &probability) const;
+
+    /*
+     * Call visitor(l) for each light l which could cast at least cutoff illumination on the point,
+     * ignoring occlusion and the angle of the surface. Lights are visited in no particular order.
+     */
+    template<typename Visitor>
+    void visit(const Pos3f &point, const float &cutoff, Visitor visitor) const {
+        if (bvh.nodes.empty()) {
+            return;
+        }
+
+        uint32_t stack[BVH_STACK_SIZE];
+        size_t stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const uint32_t n = stack[--stack_size];
+            const BVHNode &node = bvh.nodes[n];
+            if (max_power[n] < cutoff * distance_squared(point, node.bounds)) {
+                continue;
+            }
+            if (!node.is_leaf()) {
+                stack[stack_size++] = node.first + 1;
+                stack[stack_size++] = node.first;
+                continue;
+            }
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                const uint32_t l = bvh.indices[i];
+                const Vec3f offset = positions_[l] - point;
+                if (power[l] >= cutoff * (offset * offset)) {
+                    visitor(l);
+                }
+            }
+        }
+    }
+
+private:
+
+    // The lights' positions, for the leaves' per-light tests.
+    std::vector<Pos3f> positions_;
+
+    static float distance_squared(const Pos3f &point, const AABB &bounds);
+
+    float weight(const Pos3f &point, const float &cutoff, const uint32_t &l) const;
+
+    float importance(const Pos3f &point, const float &cutoff, const uint32_t &node) const;
+};
@@ -0,0 +1,45 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MappedFile.hpp"
+
+/*
+ * Open and map the file at path.
+ * On failure the error is reported and ok() returns false.
+ */
+MappedFile::MappedFile(const std::string &path)
+        : fd_(-1), size_(0), data_(nullptr) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd_ < 0 || fstat(fd_, &info) != 0) {
+        std::cerr << "Could not open " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    size_ = (size_t) info.st_size;
+    if (size_ == 0) {
+        std::cerr << "Could not map " << path << ": file is empty\n";
+        return;
+    }
+
+    void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Could not map " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    data_ = (const uint8_t *) mapping;
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap((void *) data_, size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
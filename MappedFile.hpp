@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * A whole file mapped read-only into memory. Pages are read in by the kernel as they are first touched,
+ * so opening even a very large file is cheap.
+ */
+struct MappedFile {
+    explicit MappedFile(const std::string &path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool ok() const {
+        return data_ != nullptr;
+    }
+
+    const uint8_t *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+
+    int fd_;
+    size_t size_;
+    const uint8_t *data_;
+};
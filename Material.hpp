@@ -1,14 +1,69 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+#include <functional>
+
+#include "constants.hpp"
 #include "Geometry.hpp"
 
+/*
+ * How a material's specular highlights are shaded: not at all if its specular colour is black,
+ * by repeated multiplication if its specularity is a small whole number, and otherwise with std::pow.
+ */
+enum class SpecularPath {
+    none,
+    integer,
+    general
+};
+
+// The diffuse_texture of an untextured material.
+#define NO_TEXTURE 0xffffffffu
+
 struct Material {
     Vec3f diffuse_colour;
     Vec3f specular_colour;
     float specularity;
+    uint32_t diffuse_texture; // A texture of the scene's, which scales the diffuse colour, or NO_TEXTURE.
 
-    Material() : diffuse_colour(1.0, 0.0, 1.0), specular_colour(0.0, 1.0, 0.0), specularity(1.0) {}
+    Material()
+            : diffuse_colour(1.0, 0.0, 1.0), specular_colour(0.0, 1.0, 0.0), specularity(1.0),
+              diffuse_texture(NO_TEXTURE) {}
+
+    explicit Material(const Vec3f &diffuse_col, const Vec3f &specular_col, const float &spec,
+                      const uint32_t &texture = NO_TEXTURE)
+            : diffuse_colour(diffuse_col), specular_colour(specular_col), specularity(spec),
+              diffuse_texture(texture) {}
+
+    SpecularPath specular_path() const {
+        if (specular_colour.x == 0 && specular_colour.y == 0 && specular_colour.z == 0) {
+            return SpecularPath::none;
+        }
+        if (specularity >= 0 && specularity <= SPECULAR_INTEGER_LIMIT && specularity == std::floor(specularity)) {
+            return SpecularPath::integer;
+        }
+        return SpecularPath::general;
+    }
+
+    bool operator==(const Material &other) const {
+        return diffuse_colour.x == other.diffuse_colour.x && diffuse_colour.y == other.diffuse_colour.y &&
+               diffuse_colour.z == other.diffuse_colour.z && specular_colour.x == other.specular_colour.x &&
+               specular_colour.y == other.specular_colour.y && specular_colour.z == other.specular_colour.z &&
+               specularity == other.specularity && diffuse_texture == other.diffuse_texture;
+    }
+};
 
-    explicit Material(const Vec3f &diffuse_col, const Vec3f &specular_col, const float &spec)
-            : diffuse_colour(diffuse_col), specular_colour(specular_col), specularity(spec) {}
+/*
+ * Hashes materials by value, so that identical ones can be shared.
+ */
+struct MaterialHash {
+    size_t operator()(const Material &m) const {
+        const std::hash<float> hash;
+        size_t h = hash(m.specularity) * 31 + m.diffuse_texture;
+        for (const float f : {m.diffuse_colour.x, m.diffuse_colour.y, m.diffuse_colour.z,
+                              m.specular_colour.x, m.specular_colour.y, m.specular_colour.z}) {
+            h = h * 31 + hash(f);
+        }
+        return h;
+    }
 };
@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MESH_X86
+#endif
+
+#include "Mesh.hpp"
+#include "Stats.hpp"
+
+namespace {
+
+const uint32_t MESH_MAX_LEAF_SIZE = (1u << MESH_LEAF_COUNT_BITS) - 1;
+const float MESH_GRID_STEPS = 65535;
+
+/*
+ * Per-ray quantities shared by every node and triangle test.
+ *
+ * A node's grid coordinate q along an axis decodes to mesh.bounds.min + q * mesh.cell there, which the ray
+ * reaches at t = q * scale + offset, so that each slab of a node is tested with one multiply-add.
+ * Axes the ray runs parallel to get a huge but finite reciprocal, which keeps 0 * infinity out of the sums.
+ */
+struct MeshRay {
+    float ox, oy, oz;
+    float dx, dy, dz;
+    float scale[3];
+    float offset[3];
+
+    MeshRay(const Ray3f &ray, const Mesh &mesh)
+            : ox(ray.position.x), oy(ray.position.y), oz(ray.position.z),
+              dx(ray.direction.x), dy(ray.direction.y), dz(ray.direction.z) {
+        for (int axis = 0; axis < 3; axis++) {
+            const float d = ray.direction[axis];
+            const float inv = std::abs(d) > 1e-30f ? 1.0f / d : std::copysign(1e30f, d);
+            scale[axis] = mesh.cell[axis] * inv;
+            offset[axis] = (mesh.bounds.min[axis] - ray.position[axis]) * inv;
+        }
+    }
+};
+
+/*
+ * Slab test of a node's bounds, as AABB::intersect.
+ */
+inline bool enter(const MeshNode &node, const MeshRay &r, const float &t_max, float &t_entry) {
+    const float tx1 = node.min[0] * r.scale[0] + r.offset[0];
+    const float tx2 = node.max[0] * r.scale[0] + r.offset[0];
+    float t_near = std::min(tx1, tx2);
+    float t_far = std::max(tx1, tx2);
+
+    const float ty1 = node.min[1] * r.scale[1] + r.offset[1];
+    const float ty2 = node.max[1] * r.scale[1] + r.offset[1];
+    t_near = std::max(t_near, std::min(ty1, ty2));
+    t_far = std::min(t_far, std::max(ty1, ty2));
+
+    const float tz1 = node.min[2] * r.scale[2] + r.offset[2];
+    const float tz2 = node.max[2] * r.scale[2] + r.offset[2];
+    t_near = std::max(t_near, std::min(tz1, tz2));
+    t_far = std::min(t_far, std::max(tz1, tz2));
+
+    t_entry = t_near;
+    return t_far >= std::max(t_near, 0.0f) && t_near <= t_max;
+}
+
+/*
+ * Visit, nearest first, every leaf whose bounds the ray enters before t_max, as BVH::traverse does.
+ */
+template<typename LeafVisitor>
+void traverse(const Mesh &mesh, const MeshRay &r, float &t_max, LeafVisitor leaf) {
+    uint32_t stack[MESH_STACK_SIZE];
+    float stack_entry[MESH_STACK_SIZE];
+    size_t stack_size = 0;
+    uint64_t visited = 0;
+
+    float t_entry;
+    if (enter(mesh.nodes[0], r, t_max, t_entry)) {
+        stack_entry[stack_size] = t_entry;
+        stack[stack_size++] = 0;
+    }
+
+    while (stack_size > 0) {
+        --stack_size;
+        if (stack_entry[stack_size] > t_max) {
+            continue;
+        }
+        const MeshNode &node = mesh.nodes[stack[stack_size]];
+        visited++;
+
+        if (node.is_leaf()) {
+            if (leaf(node.first(), node.count(), t_max)) {
+                break;
+            }
+            continue;
+        }
+
+        const uint32_t left = node.first();
+        float t_left, t_right;
+        const bool hit_left = enter(mesh.nodes[left], r, t_max, t_left);
+        const bool hit_right = enter(mesh.nodes[left + 1], r, t_max, t_right);
+        if (hit_left && hit_right) {
+            const bool left_first = t_left <= t_right;
+            stack_entry[stack_size] = left_first ? t_right : t_left;
+            stack[stack_size++] = left_first ? left + 1 : left;
+            stack_entry[stack_size] = left_first ? t_left : t_right;
+            stack[stack_size++] = left_first ? left : left + 1;
+        } else if (hit_left || hit_right) {
+            stack_entry[stack_size] = hit_left ? t_left : t_right;
+            stack[stack_size++] = hit_left ? left : left + 1;
+        }
+    }
+
+    STATS_WORK(bvh_nodes, visited);
+}
+
+/*
+ * Möller and Trumbore's test. With edges e1 = b - a and e2 = c - a, solving o + td = a + u e1 + v e2
+ * by Cramer's rule gives, with p = d x e2, s = o - a and q = s x e1,
+ *     (t, u, v) = (e2.q, s.p, d.q) / (e1.p),
+ * and the ray hits the triangle if u >= 0, v >= 0 and u + v <= 1. The determinant e1.p is zero
+ * for rays parallel to the triangle, whose quotients are then infinite or NaN and fail the tests.
+ * Returns the hit parameter, or infinity for a miss or a hit behind the origin.
+ */
+inline float scalar_hit(const Mesh &mesh, const MeshRay &r, const uint32_t &triangle) {
+    const Pos3f &a = mesh.vertices[mesh.indices[3 * triangle]];
+    const Pos3f &b = mesh.vertices[mesh.indices[3 * triangle + 1]];
+    const Pos3f &c = mesh.vertices[mesh.indices[3 * triangle + 2]];
+    const float e1x = b.x - a.x, e1y = b.y - a.y, e1z = b.z - a.z;
+    const float e2x = c.x - a.x, e2y = c.y - a.y, e2z = c.z - a.z;
+    const float px = r.dy * e2z - r.dz * e2y;
+    const float py = r.dz * e2x - r.dx * e2z;
+    const float pz = r.dx * e2y - r.dy * e2x;
+    const float inv_det = 1.0f / (e1x * px + e1y * py + e1z * pz);
+    const float sx = r.ox - a.x, sy = r.oy - a.y, sz = r.oz - a.z;
+    const float u = (sx * px + sy * py + sz * pz) * inv_det;
+    const float qx = sy * e1z - sz * e1y;
+    const float qy = sz * e1x - sx * e1z;
+    const float qz = sx * e1y - sy * e1x;
+    const float v = (r.dx * qx + r.dy * qy + r.dz * qz) * inv_det;
+    const float t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+    if (u >= -MESH_EDGE_EPSILON && v >= -MESH_EDGE_EPSILON && u + v <= 1 + MESH_EDGE_EPSILON && t > 0) {
+        return t;
+    }
+    return std::numeric_limits<float>::infinity();
+}
+
+#ifdef MESH_X86
+
+/*
+ * Four triangles at a time, from first; SSE2 is part of the x86-64 baseline.
+ * The triangles' vertices are gathered into lanes, then tested as scalar_hit does.
+ * Returns the hit parameters, with misses and lanes at or beyond `remaining` set to infinity.
+ */
+inline __m128 sse_hits(const Mesh &mesh, const MeshRay &r, const uint32_t &first, const uint32_t &remaining) {
+    alignas(16) float corners[9][4];
+    for (uint32_t k = 0; k < 4; k++) {
+        const uint32_t *triangle = &mesh.indices[3 * (first + std::min(k, remaining - 1))];
+        for (int corner = 0; corner < 3; corner++) {
+            const Pos3f &p = mesh.vertices[triangle[corner]];
+            corners[3 * corner][k] = p.x;
+            corners[3 * corner + 1][k] = p.y;
+            corners[3 * corner + 2][k] = p.z;
+        }
+    }
+    const __m128 ax = _mm_load_ps(corners[0]), ay = _mm_load_ps(corners[1]), az = _mm_load_ps(corners[2]);
+    const __m128 e1x = _mm_sub_ps(_mm_load_ps(corners[3]), ax);
+    const __m128 e1y = _mm_sub_ps(_mm_load_ps(corners[4]), ay);
+    const __m128 e1z = _mm_sub_ps(_mm_load_ps(corners[5]), az);
+    const __m128 e2x = _mm_sub_ps(_mm_load_ps(corners[6]), ax);
+    const __m128 e2y = _mm_sub_ps(_mm_load_ps(corners[7]), ay);
+    const __m128 e2z = _mm_sub_ps(_mm_load_ps(corners[8]), az);
+    const __m128 dx = _mm_set1_ps(r.dx), dy = _mm_set1_ps(r.dy), dz = _mm_set1_ps(r.dz);
+
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    const __m128 sx = _mm_sub_ps(_mm_set1_ps(r.ox), ax);
+    const __m128 sy = _mm_sub_ps(_mm_set1_ps(r.oy), ay);
+    const __m128 sz = _mm_sub_ps(_mm_set1_ps(r.oz), az);
+    const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)),
+                                inv_det);
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)),
+                                inv_det);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)),
+                                inv_det);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 low = _mm_set1_ps(-MESH_EDGE_EPSILON);
+    const __m128 high = _mm_set1_ps(1 + MESH_EDGE_EPSILON);
+    const __m128 lanes = _mm_cvtepi32_ps(_mm_set_epi32(3, 2, 1, 0));
+    const __m128 valid = _mm_and_ps(
+            _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, low), _mm_cmpge_ps(v, low)),
+                       _mm_and_ps(_mm_cmple_ps(_mm_add_ps(u, v), high), _mm_cmpgt_ps(t, zero))),
+            _mm_cmplt_ps(lanes, _mm_set1_ps((float) remaining)));
+    return _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+}
+
+int nearest_leaf(const Mesh &mesh, const MeshRay &r, const uint32_t &first, const uint32_t &count, float &t) {
+    int hit = -1;
+    for (uint32_t i = first; i < first + count; i += 4) {
+        const __m128 hits = sse_hits(mesh, r, i, first + count - i);
+        if (_mm_movemask_ps(_mm_cmplt_ps(hits, _mm_set1_ps(t))) == 0) {
+            continue;
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, hits);
+        for (int k = 0; k < 4; k++) {
+            if (lanes[k] < t) {
+                t = lanes[k];
+                hit = (int) i + k;
+            }
+        }
+    }
+    return hit;
+}
+
+bool any_leaf(const Mesh &mesh, const MeshRay &r, const uint32_t &first, const uint32_t &count, const float &t_max) {
+    for (uint32_t i = first; i < first + count; i += 4) {
+        if (_mm_movemask_ps(_mm_cmple_ps(sse_hits(mesh, r, i, first + count - i), _mm_set1_ps(t_max))) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
+
+int nearest_leaf(const Mesh &mesh, const MeshRay &r, const uint32_t &first, const uint32_t &count, float &t) {
+    int hit = -1;
+    for (uint32_t i = first; i < first + count; i++) {
+        const float current_t = scalar_hit(mesh, r, i);
+        if (current_t < t) {
+            t = current_t;
+            hit = (int) i;
+        }
+    }
+    return hit;
+}
+
+bool any_leaf(const Mesh &mesh, const MeshRay &r, const uint32_t &first, const uint32_t &count, const float &t_max) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (scalar_hit(mesh, r, i) <= t_max) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
+
+/*
+ * A node of the hierarchy while it is laid out, before its bounds are quantised.
+ */
+struct LayoutNode {
+    AABB bounds;
+    uint32_t first;
+    uint32_t count;
+};
+
+}
+
+/*
+ * Build the hierarchy over the triangles with the binned SAH builder spheres use, reorder the triangles
+ * into its leaf order, and pack its nodes. Leaves too large to pack (which the builder only makes when it
+ * reaches its depth limit) are split in half until they fit.
+ */
+void Mesh::build() {
+    const auto start = std::chrono::steady_clock::now();
+    nodes.clear();
+    bounds = AABB();
+    build_stats = BuildStats();
+    const size_t n = triangle_count();
+    if (n == 0) {
+        return;
+    }
+
+    const auto triangle_bounds = [&](const size_t &triangle) {
+        AABB box;
+        for (int corner = 0; corner < 3; corner++) {
+            box.extend(vertices[indices[3 * triangle + corner]]);
+        }
+        return box;
+    };
+
+    std::vector<LayoutNode> layout;
+    {
+        std::vector<AABB> boxes(n);
+        for (size_t i = 0; i < n; i++) {
+            boxes[i] = triangle_bounds(i);
+            bounds.extend(boxes[i]);
+        }
+        BVH hierarchy;
+        hierarchy.build(boxes);
+        build_stats.sah_cost = hierarchy.build_stats.sah_cost;
+
+        std::vector<uint32_t> ordered(indices.size());
+        for (size_t i = 0; i < n; i++) {
+            std::copy(&indices[3 * hierarchy.indices[i]], &indices[3 * hierarchy.indices[i]] + 3, &ordered[3 * i]);
+        }
+        indices.swap(ordered);
+
+        layout.reserve(hierarchy.nodes.size());
+        for (const BVHNode &node : hierarchy.nodes) {
+            layout.push_back({node.bounds, node.first, node.count});
+        }
+    }
+
+    // Split nodes are appended, so the loop reaches their halves too.
+    for (size_t i = 0; i < layout.size(); i++) {
+        if (layout[i].count <= MESH_MAX_LEAF_SIZE) {
+            continue;
+        }
+        const uint32_t first = layout[i].first;
+        const uint32_t mid = first + layout[i].count / 2;
+        const uint32_t end = first + layout[i].count;
+        LayoutNode halves[2] = {{AABB(), first, mid - first}, {AABB(), mid, end - mid}};
+        for (LayoutNode &half : halves) {
+            for (uint32_t triangle = half.first; triangle < half.first + half.count; triangle++) {
+                half.bounds.extend(triangle_bounds(triangle));
+            }
+        }
+        layout[i].first = (uint32_t) layout.size();
+        layout[i].count = 0;
+        layout.push_back(halves[0]);
+        layout.push_back(halves[1]);
+    }
+
+    // Bounds are rounded outwards by a further step, in case decoding them rounds inwards.
+    const Vec3f extent = bounds.max - bounds.min;
+    cell = extent / MESH_GRID_STEPS;
+    const auto quantise = [&](const float &value, const int &axis, const bool &upper) {
+        if (cell[axis] <= 0) {
+            return (uint16_t) 0;
+        }
+        const double q = ((double) value - bounds.min[axis]) / cell[axis];
+        const double rounded = upper ? std::ceil(q) + 1 : std::floor(q) - 1;
+        return (uint16_t) std::min((double) MESH_GRID_STEPS, std::max(0.0, rounded));
+    };
+
+    nodes.resize(layout.size());
+    for (size_t i = 0; i < layout.size(); i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            nodes[i].min[axis] = quantise(layout[i].bounds.min[axis], axis, false);
+            nodes[i].max[axis] = quantise(layout[i].bounds.max[axis], axis, true);
+        }
+        nodes[i].packed = layout[i].first << MESH_LEAF_COUNT_BITS | layout[i].count;
+        if (layout[i].count > 0) {
+            build_stats.leaf_count++;
+        }
+    }
+
+    build_stats.node_count = nodes.size();
+    build_stats.build_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Find the nearest triangle the ray hits closer than t. If there is one, return true,
+ * and write its ray parameter to t and its index to triangle.
+ */
+bool Mesh::nearest(const Ray3f &ray, float &t, uint32_t &triangle) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    const MeshRay r(ray, *this);
+    bool collided = false;
+    traverse(*this, r, t, [&](uint32_t first, uint32_t count, float &t_max) {
+        STATS_WORK(triangle_tests, count);
+        const int hit = nearest_leaf(*this, r, first, count, t_max);
+        if (hit >= 0) {
+            triangle = (uint32_t) hit;
+            collided = true;
+        }
+        return false;
+    });
+    return collided;
+}
+
+/*
+ * Return true iff the ray hits any triangle with ray parameter at most t_max.
+ */
+bool Mesh::any(const Ray3f &ray, const float &t_max) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    const MeshRay r(ray, *this);
+    float cutoff = t_max;
+    bool blocked = false;
+    traverse(*this, r, cutoff, [&](uint32_t first, uint32_t count, float &limit) {
+        STATS_WORK(triangle_tests, count);
+        blocked = any_leaf(*this, r, first, count, limit);
+        return blocked;
+    });
+    return blocked;
+}
+
+/*
+ * The unit normal of a triangle, facing the side its vertices are wound anticlockwise from.
+ */
+Vec3f Mesh::normal(const uint32_t &triangle) const {
+    const Pos3f &a = vertices[indices[3 * triangle]];
+    const Pos3f &b = vertices[indices[3 * triangle + 1]];
+    const Pos3f &c = vertices[indices[3 * triangle + 2]];
+    return cross(b - a, c - a).unit();
+}
+
+/*
+ * Bytes taken by the vertices, indices and hierarchy.
+ */
+size_t Mesh::memory_size() const {
+    return vertices.size() * sizeof(Pos3f) + indices.size() * sizeof(uint32_t) + nodes.size() * sizeof(MeshNode);
+}
+
+void Mesh::report(std::ostream &out) const {
+    const size_t bytes = memory_size();
+    out << "Mesh: " << triangle_count() << " triangles, " << vertices.size() << " vertices, "
+        << build_stats.node_count << " nodes (" << build_stats.leaf_count << " leaves), "
+        << "SAH cost " << build_stats.sah_cost << ", built in " << build_stats.build_ms << " ms, "
+        << bytes / 1048576.0 << " MiB (" << (triangle_count() > 0 ? (double) bytes / triangle_count() : 0.0)
+        << " bytes per triangle)\n";
+}
+
+/*
+ * The name of the triangle intersection kernel this build uses.
+ */
+const char *Mesh::kernel_name() {
+#ifdef MESH_X86
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
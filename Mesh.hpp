@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "BVH.hpp"
+#include "constants.hpp"
+#include "Geometry.hpp"
+
+/*
+ * A node of a mesh's hierarchy, packed into 16 bytes: its bounds, quantised onto a 16-bit grid spanning the
+ * mesh's bounds and rounded outwards, and either the index of the first of its two adjacent children or,
+ * for a leaf, its first triangle and how many triangles it holds.
+ */
+struct MeshNode {
+    uint16_t min[3];
+    uint16_t max[3];
+    uint32_t packed; // first << MESH_LEAF_COUNT_BITS | count, with a count of zero for interior nodes.
+
+    uint32_t first() const {
+        return packed >> MESH_LEAF_COUNT_BITS;
+    }
+
+    uint32_t count() const {
+        return packed & ((1u << MESH_LEAF_COUNT_BITS) - 1);
+    }
+
+    bool is_leaf() const {
+        return count() > 0;
+    }
+};
+
+static_assert(sizeof(MeshNode) == 16, "Mesh nodes are packed into 16 bytes");
+
+/*
+ * An indexed triangle mesh with its own bounding volume hierarchy.
+ *
+ * Triangles are three indices into the vertex buffer, wound anticlockwise seen from the front; rays
+ * hit both sides. Nothing is kept per triangle besides its indices: hits are found by gathering each
+ * leaf's vertices and testing up to four triangles per SIMD instruction, and the surface normal is the
+ * triangle's geometric normal. Together with the quantised nodes, this keeps a built mesh to about
+ * 36 bytes per triangle, half of it the hierarchy, against 18 for the raw geometry of a typical closed mesh.
+ * The packing limits a mesh to 2^26 triangles.
+ *
+ * build() reorders the triangles into the hierarchy's leaf order; it must be called (as Scene::add_mesh does)
+ * before the mesh is traced, and again after its geometry changes.
+ */
+struct Mesh {
+    struct BuildStats {
+        double build_ms;
+        size_t node_count;
+        size_t leaf_count;
+        float sah_cost;
+
+        BuildStats()
+                : build_ms(0), node_count(0), leaf_count(0), sah_cost(0) {}
+    };
+
+    std::vector<Pos3f> vertices;
+    std::vector<uint32_t> indices; // Three per triangle.
+    std::vector<MeshNode> nodes;
+    AABB bounds;
+    Vec3f cell; // The size of a step of the quantisation grid along each axis.
+    BuildStats build_stats;
+
+    Mesh()
+            : vertices(), indices(), nodes(), bounds(), cell(), build_stats() {}
+
+    size_t triangle_count() const {
+        return indices.size() / 3;
+    }
+
+    void add_triangle(const uint32_t &a, const uint32_t &b, const uint32_t &c) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+        nodes.clear();
+    }
+
+    bool built() const {
+        return !nodes.empty() || indices.empty();
+    }
+
+    void build();
+
+    bool nearest(const Ray3f &ray, float &t, uint32_t &triangle) const;
+
+    bool any(const Ray3f &ray, const float &t_max) const;
+
+    Vec3f normal(const uint32_t &triangle) const;
+
+    size_t memory_size() const;
+
+    void report(std::ostream &out) const;
+
+    static const char *kernel_name();
+};
@@ -0,0 +1,140 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "Mesh.hpp"
+#include "ObjFile.hpp"
+
+namespace {
+
+// Bytes read from the file at a time; longer lines grow the buffer.
+const size_t OBJ_BUFFER_SIZE = 1 << 20;
+
+bool is_space(const char &c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+ * Parses the lines of an OBJ file into a mesh, one at a time.
+ */
+struct ObjParser {
+    ObjParser(const std::string &path, Mesh &mesh)
+            : path_(path), mesh_(mesh), line_number_(0), corners_() {}
+
+    /*
+     * Parse one line, which is nul-terminated and has no line break.
+     */
+    bool parse(char *line) {
+        line_number_++;
+        while (is_space(*line)) {
+            line++;
+        }
+        if (line[0] == 'v' && is_space(line[1])) {
+            char *end;
+            const float x = std::strtof(line + 1, &end);
+            const float y = std::strtof(end, &end);
+            const float z = std::strtof(end, &end);
+            mesh_.vertices.emplace_back(x, y, z);
+            return true;
+        }
+        if (line[0] == 'f' && is_space(line[1])) {
+            return parse_face(line + 1);
+        }
+        return true;
+    }
+
+private:
+
+    /*
+     * Each corner of a face is "v", "v/vt", "v//vn" or "v/vt/vn"; only the vertex is used.
+     */
+    bool parse_face(char *corners) {
+        corners_.clear();
+        char *p = corners;
+        while (true) {
+            while (is_space(*p)) {
+                p++;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            char *end;
+            const long index = std::strtol(p, &end, 10);
+            const long count = (long) mesh_.vertices.size();
+            const long vertex = index < 0 ? count + index : index - 1;
+            if (end == p || vertex < 0 || vertex >= count) {
+                std::cerr << path_ << ":" << line_number_ << ": face refers to a missing vertex\n";
+                return false;
+            }
+            corners_.push_back((uint32_t) vertex);
+            p = end;
+            while (*p != '\0' && !is_space(*p)) {
+                p++;
+            }
+        }
+        for (size_t k = 2; k < corners_.size(); k++) {
+            mesh_.add_triangle(corners_[0], corners_[k - 1], corners_[k]);
+        }
+        return true;
+    }
+
+    const std::string &path_;
+    Mesh &mesh_;
+    size_t line_number_;
+    std::vector<uint32_t> corners_;
+};
+
+}
+
+bool load_obj(const std::string &path, Mesh &mesh) {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        std::cerr << "Could not open " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    // The buffer holds the unparsed end of the last read, followed by the next read.
+    ObjParser parser(path, mesh);
+    std::vector<char> buffer(OBJ_BUFFER_SIZE + 1);
+    size_t held = 0;
+    bool ok = true;
+    bool done = false;
+    while (ok && !done) {
+        if (held == buffer.size() - 1) {
+            buffer.resize(buffer.size() * 2);
+        }
+        const size_t read = std::fread(buffer.data() + held, 1, buffer.size() - 1 - held, file);
+        held += read;
+        done = read == 0;
+        if (done && std::ferror(file)) {
+            std::cerr << "Could not read " << path << ": " << std::strerror(errno) << "\n";
+            ok = false;
+            break;
+        }
+
+        // Parse every complete line, and at the end of the file, whatever is left.
+        size_t start = 0;
+        for (size_t i = 0; ok && i < held; i++) {
+            if (buffer[i] == '\n') {
+                buffer[i] = '\0';
+                ok = parser.parse(&buffer[start]);
+                start = i + 1;
+            }
+        }
+        if (ok && done && start < held) {
+            buffer[held] = '\0';
+            ok = parser.parse(&buffer[start]);
+            start = held;
+        }
+        std::memmove(buffer.data(), buffer.data() + start, held - start);
+        held -= start;
+    }
+    std::fclose(file);
+
+    mesh.vertices.shrink_to_fit();
+    mesh.indices.shrink_to_fit();
+    return ok;
+}
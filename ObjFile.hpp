@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+struct Mesh;
+
+/*
+ * Read the geometry of a Wavefront OBJ file into mesh (which should be empty): its vertices ("v" lines)
+ * and faces ("f" lines, whose polygons are split into fans of triangles). Texture coordinates, normals,
+ * groups and materials are skipped. Face corners may refer to vertices by negative, relative indices.
+ *
+ * The file is read through a fixed buffer rather than all at once, so loading takes little memory beyond
+ * the mesh's own. The mesh's hierarchy isn't built. Returns false, having reported why, if the file can't
+ * be read or a face refers to a vertex that hasn't been defined.
+ */
+bool load_obj(const std::string &path, Mesh &mesh);
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKET_X86
+#endif
+
+#include "BVH.hpp"
+#include "Packet.hpp"
+#include "SphereArrays.hpp"
+#include "Stats.hpp"
+
+RayPacket::RayPacket(const Pos3f &o)
+        : origin(o), active(0) {
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        dx[k] = dy[k] = dz[k] = 0;
+        inv_dx[k] = inv_dy[k] = inv_dz[k] = 0;
+        a[k] = inv_a[k] = 1;
+        t[k] = -1;
+        hit[k] = PACKET_NO_HIT;
+    }
+}
+
+/*
+ * Put a ray in the given lane and mark it active.
+ */
+void RayPacket::set_ray(const int &lane, const Vec3f &direction) {
+    dx[lane] = direction.x;
+    dy[lane] = direction.y;
+    dz[lane] = direction.z;
+    active |= 1u << lane;
+}
+
+/*
+ * Compute the per-lane reciprocals and the packet-wide direction bounds,
+ * and reset the active lanes' hits. Call once all rays are set.
+ */
+void RayPacket::prepare() {
+    const float inf = std::numeric_limits<float>::infinity();
+    inv_min = Vec3f(inf, inf, inf);
+    inv_max = Vec3f(-inf, -inf, -inf);
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        if (!(active & (1u << k))) {
+            continue;
+        }
+        inv_dx[k] = 1.0f / dx[k];
+        inv_dy[k] = 1.0f / dy[k];
+        inv_dz[k] = 1.0f / dz[k];
+        a[k] = dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k];
+        inv_a[k] = 1.0f / a[k];
+        t[k] = std::numeric_limits<float>::max();
+        hit[k] = PACKET_NO_HIT;
+
+        inv_min = Vec3f(std::min(inv_min.x, inv_dx[k]), std::min(inv_min.y, inv_dy[k]), std::min(inv_min.z, inv_dz[k]));
+        inv_max = Vec3f(std::max(inv_max.x, inv_dx[k]), std::max(inv_max.y, inv_dy[k]), std::max(inv_max.z, inv_dz[k]));
+    }
+}
+
+namespace {
+
+/*
+ * Conservative test of the whole packet against a box, using interval arithmetic on the
+ * reciprocal directions. Returns false only if no ray in the packet can hit the box.
+ *
+ * Along an axis where every direction has the same sign, each ray's slab entry and exit
+ * parameters lie within the products of the slab offsets with [inv_min, inv_max]; if the latest
+ * possible entry on some axis exceeds the earliest possible exit on another, every ray misses.
+ */
+bool packet_may_hit(const RayPacket &p, const AABB &box) {
+    float entry = 0;
+    float exit = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++) {
+        const float lo = p.inv_min[axis];
+        const float hi = p.inv_max[axis];
+        if (lo < 0 && hi > 0) {
+            return true;
+        }
+        const float near_offset = (lo > 0 ? box.min[axis] : box.max[axis]) - p.origin[axis];
+        const float far_offset = (lo > 0 ? box.max[axis] : box.min[axis]) - p.origin[axis];
+        entry = std::max(entry, std::min(near_offset * lo, near_offset * hi));
+        exit = std::min(exit, std::max(far_offset * lo, far_offset * hi));
+    }
+    return entry <= exit;
+}
+
+#ifdef PACKET_X86
+
+/*
+ * Bitmask of the lanes in `lanes` whose rays enter the box before their current nearest hit.
+ */
+uint32_t packet_box_mask(const RayPacket &p, const AABB &box, const uint32_t &lanes) {
+    uint32_t mask = 0;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 min_x = _mm_set1_ps(box.min.x - p.origin.x);
+    const __m128 min_y = _mm_set1_ps(box.min.y - p.origin.y);
+    const __m128 min_z = _mm_set1_ps(box.min.z - p.origin.z);
+    const __m128 max_x = _mm_set1_ps(box.max.x - p.origin.x);
+    const __m128 max_y = _mm_set1_ps(box.max.y - p.origin.y);
+    const __m128 max_z = _mm_set1_ps(box.max.z - p.origin.z);
+
+    for (int k = 0; k < PACKET_RAYS; k += 4) {
+        if (((lanes >> k) & 0xf) == 0) {
+            continue;
+        }
+        const __m128 ix = _mm_load_ps(&p.inv_dx[k]);
+        const __m128 iy = _mm_load_ps(&p.inv_dy[k]);
+        const __m128 iz = _mm_load_ps(&p.inv_dz[k]);
+        const __m128 tx1 = _mm_mul_ps(min_x, ix);
+        const __m128 tx2 = _mm_mul_ps(max_x, ix);
+        const __m128 ty1 = _mm_mul_ps(min_y, iy);
+        const __m128 ty2 = _mm_mul_ps(max_y, iy);
+        const __m128 tz1 = _mm_mul_ps(min_z, iz);
+        const __m128 tz2 = _mm_mul_ps(max_z, iz);
+        const __m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+        const __m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+        const __m128 hit = _mm_and_ps(_mm_cmpge_ps(t_far, _mm_max_ps(t_near, zero)),
+                                      _mm_cmple_ps(t_near, _mm_load_ps(&p.t[k])));
+        mask |= (uint32_t) _mm_movemask_ps(hit) << k;
+    }
+    return mask & lanes;
+}
+
+/*
+ * Intersect the lanes in `lanes` with one sphere array entry, recording closer hits.
+ * As the rays share an origin, the terms not involving the direction are computed once.
+ */
+void packet_sphere(const RayPacket &p, const SphereArrays &arrays, const uint32_t &entry, const uint32_t &lanes,
+                   float *t, uint32_t *hit) {
+    const float ocx = arrays.x[entry] - p.origin.x;
+    const float ocy = arrays.y[entry] - p.origin.y;
+    const float ocz = arrays.z[entry] - p.origin.z;
+    const __m128 c = _mm_set1_ps(ocx * ocx + ocy * ocy + ocz * ocz - arrays.radius[entry] * arrays.radius[entry]);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i entry_v = _mm_set1_epi32((int) entry);
+
+    for (int k = 0; k < PACKET_RAYS; k += 4) {
+        const uint32_t group = (lanes >> k) & 0xf;
+        if (group == 0) {
+            continue;
+        }
+        const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ocx), _mm_load_ps(&p.dx[k])),
+                                               _mm_mul_ps(_mm_set1_ps(ocy), _mm_load_ps(&p.dy[k]))),
+                                    _mm_mul_ps(_mm_set1_ps(ocz), _mm_load_ps(&p.dz[k])));
+        const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_load_ps(&p.a[k]), c));
+        const __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+        const __m128 inv_a = _mm_load_ps(&p.inv_a[k]);
+        const __m128 t_near = _mm_mul_ps(_mm_sub_ps(b, root), inv_a);
+        const __m128 t_far = _mm_mul_ps(_mm_add_ps(b, root), inv_a);
+        const __m128 near_valid = _mm_cmpge_ps(t_near, zero);
+        const __m128 t_new = _mm_or_ps(_mm_and_ps(near_valid, t_near), _mm_andnot_ps(near_valid, t_far));
+
+        const __m128 t_old = _mm_load_ps(&t[k]);
+        const __m128i group_v = _mm_set_epi32(group & 8 ? -1 : 0, group & 4 ? -1 : 0, group & 2 ? -1 : 0, group & 1 ? -1 : 0);
+        const __m128 closer = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpge_ps(t_new, zero)),
+                                         _mm_and_ps(_mm_cmplt_ps(t_new, t_old), _mm_castsi128_ps(group_v)));
+        _mm_store_ps(&t[k], _mm_or_ps(_mm_and_ps(closer, t_new), _mm_andnot_ps(closer, t_old)));
+
+        const __m128i closer_i = _mm_castps_si128(closer);
+        const __m128i hit_old = _mm_load_si128((const __m128i *) &hit[k]);
+        _mm_store_si128((__m128i *) &hit[k],
+                        _mm_or_si128(_mm_and_si128(closer_i, entry_v), _mm_andnot_si128(closer_i, hit_old)));
+    }
+}
+
+#else
+
+uint32_t packet_box_mask(const RayPacket &p, const AABB &box, const uint32_t &lanes) {
+    uint32_t mask = 0;
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        if (!(lanes & (1u << k))) {
+            continue;
+        }
+        float t_entry;
+        const Vec3f inv_dir(p.inv_dx[k], p.inv_dy[k], p.inv_dz[k]);
+        if (box.intersect(p.origin, inv_dir, p.t[k], t_entry)) {
+            mask |= 1u << k;
+        }
+    }
+    return mask;
+}
+
+void packet_sphere(const RayPacket &p, const SphereArrays &arrays, const uint32_t &entry, const uint32_t &lanes,
+                   float *t, uint32_t *hit) {
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        if (!(lanes & (1u << k))) {
+            continue;
+        }
+        float t_lane = t[k];
+        uint32_t hit_lane;
+        if (arrays.nearest(p.ray(k), entry, 1, t_lane, hit_lane)) {
+            t[k] = t_lane;
+            hit[k] = hit_lane;
+        }
+    }
+}
+
+#endif
+
+int popcount(const uint32_t &mask) {
+    return __builtin_popcount(mask);
+}
+
+/*
+ * Trace the given lanes individually through the subtree rooted at node.
+ */
+void trace_lanes(const BVH &bvh, const SphereArrays &arrays, RayPacket &p, const uint32_t &node, uint32_t lanes) {
+    while (lanes) {
+        const int k = __builtin_ctz(lanes);
+        lanes &= lanes - 1;
+        const Ray3f ray = p.ray(k);
+        bvh.traverse(ray, p.t[k], [&](uint32_t first, uint32_t count, float &t_max) {
+            uint32_t entry;
+            if (arrays.nearest(ray, first, count, t_max, entry)) {
+                p.hit[k] = entry;
+            }
+            return false;
+        }, node);
+    }
+}
+
+}
+
+/*
+ * Find the nearest sphere array entry hit by each active lane of the packet,
+ * leaving it in packet.hit with its ray parameter in packet.t.
+ *
+ * The packet descends the BVH together, culling nodes with a shared interval test before
+ * testing lanes individually. Once fewer than PACKET_DIVERGENCE_THRESHOLD lanes remain in a
+ * subtree, those lanes finish it as single rays.
+ */
+void trace_packet(const BVH &bvh, const SphereArrays &arrays, RayPacket &packet) {
+    if (bvh.empty()) {
+        for (uint32_t entry = 0; entry < arrays.size(); entry++) {
+            packet_sphere(packet, arrays, entry, packet.active, packet.t, packet.hit);
+        }
+        STATS_WORK(sphere_tests, arrays.size() * popcount(packet.active));
+        return;
+    }
+
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stack_lanes[BVH_STACK_SIZE];
+    size_t stack_size = 0;
+
+    const uint32_t root_lanes = packet_box_mask(packet, bvh.nodes[0].bounds, packet.active);
+    if (root_lanes) {
+        stack[stack_size] = 0;
+        stack_lanes[stack_size++] = root_lanes;
+    }
+
+    while (stack_size > 0) {
+        --stack_size;
+        const BVHNode &node = bvh.nodes[stack[stack_size]];
+        const uint32_t lanes = stack_lanes[stack_size];
+        STATS_WORK(bvh_nodes, 1);
+
+        if (node.is_leaf()) {
+            for (uint32_t entry = node.first; entry < node.first + node.count; entry++) {
+                packet_sphere(packet, arrays, entry, lanes, packet.t, packet.hit);
+            }
+            STATS_WORK(sphere_tests, node.count * popcount(lanes));
+            continue;
+        }
+
+        uint32_t child_lanes[2] = {0, 0};
+        float child_distance[2];
+        for (int c = 0; c < 2; c++) {
+            const BVHNode &child = bvh.nodes[node.first + c];
+            child_distance[c] = (child.bounds.centroid() - packet.origin).length();
+            if (!packet_may_hit(packet, child.bounds)) {
+                continue;
+            }
+            const uint32_t mask = packet_box_mask(packet, child.bounds, lanes);
+            if (mask != 0 && popcount(mask) < PACKET_DIVERGENCE_THRESHOLD) {
+                trace_lanes(bvh, arrays, packet, node.first + c, mask);
+            } else {
+                child_lanes[c] = mask;
+            }
+        }
+
+        // Push the farther child first so that the nearer one is visited next.
+        const int nearer = child_distance[0] <= child_distance[1] ? 0 : 1;
+        for (int c : {1 - nearer, nearer}) {
+            if (child_lanes[c]) {
+                stack[stack_size] = node.first + c;
+                stack_lanes[stack_size++] = child_lanes[c];
+            }
+        }
+    }
+}
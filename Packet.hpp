@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+#include "constants.hpp"
+#include "Geometry.hpp"
+
+struct BVH;
+struct SphereArrays;
+
+#define PACKET_NO_HIT 0xffffffffu
+
+/*
+ * A bundle of rays sharing an origin, stored lane-wise for SIMD traversal.
+ * Lanes not set in `active` carry no ray and never record hits.
+ */
+struct RayPacket {
+    Pos3f origin;
+    alignas(16) float dx[PACKET_RAYS];
+    alignas(16) float dy[PACKET_RAYS];
+    alignas(16) float dz[PACKET_RAYS];
+    alignas(16) float inv_dx[PACKET_RAYS];
+    alignas(16) float inv_dy[PACKET_RAYS];
+    alignas(16) float inv_dz[PACKET_RAYS];
+    alignas(16) float a[PACKET_RAYS];     // d . d
+    alignas(16) float inv_a[PACKET_RAYS];
+    alignas(16) float t[PACKET_RAYS];     // Nearest hit so far, in units of the ray parameter.
+    alignas(16) uint32_t hit[PACKET_RAYS]; // Sphere array entry hit, or PACKET_NO_HIT.
+    uint32_t active;
+
+    // Bounds on the reciprocal directions across active lanes, for culling whole packets.
+    Vec3f inv_min;
+    Vec3f inv_max;
+
+    explicit RayPacket(const Pos3f &o);
+
+    void set_ray(const int &lane, const Vec3f &direction);
+
+    void prepare();
+
+    Ray3f ray(const int &lane) const {
+        return Ray3f(origin, Vec3f(dx[lane], dy[lane], dz[lane]));
+    }
+};
+
+void trace_packet(const BVH &bvh, const SphereArrays &arrays, RayPacket &packet);
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "constants.hpp"
+#include "PathTracer.hpp"
+#include "Random.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+float max_component(const Vec3f &v) {
+    return std::max(v.x, std::max(v.y, v.z));
+}
+
+/*
+ * A direction about the given unit axis, from its cosine with the axis and an angle around it.
+ */
+Vec3f around(const Vec3f &axis, const float &cos_theta, const float &phi) {
+    // Any vector not parallel to the axis gives a basis perpendicular to it.
+    const Vec3f helper = std::abs(axis.x) > 0.5f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0);
+    const Vec3f tangent = cross(helper, axis).unit();
+    const Vec3f bitangent = cross(axis, tangent);
+    const float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+    return tangent * (sin_theta * std::cos(phi)) + bitangent * (sin_theta * std::sin(phi)) + axis * cos_theta;
+}
+
+/*
+ * A direction about the normal with probability proportional to its cosine with it,
+ * so that diffuse bounces need no weighting by the cosine.
+ */
+Vec3f cosine_direction(const Vec3f &normal, const float &u, const float &v) {
+    return around(normal, std::sqrt(1 - u), 2 * PI * v);
+}
+
+/*
+ * A direction about the mirror direction with probability proportional to its cosine with it
+ * to the power of the specularity, the shape of the Phong highlight.
+ */
+Vec3f phong_direction(const Vec3f &mirror, const float &specularity, const float &u, const float &v) {
+    return around(mirror, std::pow(u, 1 / (specularity + 1)), 2 * PI * v);
+}
+
+}
+
+void PathQueue::reserve(const size_t &capacity) {
+    for (auto *array : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &t}) {
+        array->resize(capacity);
+    }
+    for (auto *array : {&slot, &random, &object, &hit}) {
+        array->resize(capacity);
+    }
+    kind.resize(capacity);
+}
+
+void ShadowQueue::reserve(const size_t &capacity) {
+    for (auto *array : {&ox, &oy, &oz, &dx, &dy, &dz, &distance, &r, &g, &b}) {
+        array->resize(capacity);
+    }
+    slot.resize(capacity);
+}
+
+void PathStats::report(std::ostream &out) const {
+    out << "Path tracing: " << paths << " paths in " << batches << " batches, " << extension_rays
+        << " extension rays, " << shadow_rays << " shadow rays, " << total_ms << " ms ("
+        << generate_ms << " generate, " << extend_ms << " extend, " << shade_ms << " shade, "
+        << shadow_ms << " shadow)\n";
+}
+
+/*
+ * Run body(begin, end) over runs of PATH_CHUNK_SIZE entries of a queue of count entries, across the scene's
+ * thread pool. The pool hands out tiles, so each run is passed as a tile one row high.
+ */
+template<typename Body>
+void PathTracer::parallel(const size_t &count, Body body) {
+    std::vector<Tile> chunks;
+    for (size_t first = 0; first < count; first += PATH_CHUNK_SIZE) {
+        chunks.emplace_back(first, 0, std::min((size_t) PATH_CHUNK_SIZE, count - first), 1);
+    }
+    scene_.thread_pool().run(chunks, [&](const Tile &chunk, const size_t &) {
+        body(chunk.x, chunk.x + chunk.width);
+    });
+}
+
+/*
+ * Render the image in batches of rows, each batch tracing all of its samples' paths together.
+ * The scene is finalised first if it hasn't been.
+ */
+void PathTracer::render(const size_t &width, const size_t &height, ImageSink &sink, PathStats &stats) {
+    const Stats::Phase phase("path tracing");
+    const auto start = Clock::now();
+    if (scene_.sphere_arrays.empty() && !scene_.spheres.empty()) {
+        scene_.finalise();
+    }
+    settings_.samples = std::max((size_t) 1, settings_.samples);
+    const size_t rows_per_batch = std::max((size_t) 1, settings_.wavefront / (width * settings_.samples));
+    const size_t capacity = rows_per_batch * width * settings_.samples;
+    paths_.reserve(capacity);
+    next_.reserve(capacity);
+    shadows_.reserve(capacity);
+    radiance_.resize(capacity);
+    pixels_.resize(rows_per_batch * width);
+
+    const Viewport viewport(scene_.camera, width, height);
+    scene_.prepare_shading(viewport);
+    for (size_t first_row = 0; first_row < height; first_row += rows_per_batch) {
+        const size_t rows = std::min(rows_per_batch, height - first_row);
+        auto stage_start = Clock::now();
+        generate(viewport, width, first_row, rows);
+        stats.generate_ms += elapsed_ms(stage_start);
+        stats.paths += paths_.size;
+        stats.batches++;
+
+        for (size_t bounce = 0; paths_.size > 0; bounce++) {
+            stats.extension_rays += paths_.size;
+            stage_start = Clock::now();
+            extend();
+            stats.extend_ms += elapsed_ms(stage_start);
+
+            stage_start = Clock::now();
+            shade(bounce);
+            stats.shade_ms += elapsed_ms(stage_start);
+
+            stats.shadow_rays += shadows_.size;
+            stage_start = Clock::now();
+            shadow();
+            stats.shadow_ms += elapsed_ms(stage_start);
+        }
+
+        const float weight = 1.0f / (float) settings_.samples;
+        for (size_t k = 0; k < rows * width; k++) {
+            Vec3f sum(0, 0, 0);
+            for (size_t s = 0; s < settings_.samples; s++) {
+                sum += radiance_[k * settings_.samples + s];
+            }
+            pixels_[k] = sum * weight;
+        }
+        sink.write_tile(Tile(0, first_row, width, rows), pixels_.data(), width);
+    }
+    stats.total_ms = elapsed_ms(start);
+}
+
+/*
+ * Start a path for every sample of every pixel in the batch's rows, jittered within the pixel
+ * if there is more than one sample.
+ */
+void PathTracer::generate(const Viewport &viewport, const size_t &width, const size_t &first_row,
+                          const size_t &rows) {
+    const size_t samples = settings_.samples;
+    const size_t count = rows * width * samples;
+    parallel(count, [&](const size_t &begin, const size_t &end) {
+        for (size_t slot = begin; slot < end; slot++) {
+            const size_t pixel = slot / samples;
+            const size_t i = pixel % width;
+            const size_t j = first_row + pixel / width;
+            uint32_t random = hash_bits((uint32_t) ((i + j * width) * samples + slot % samples));
+            float x = (float) i;
+            float y = (float) j;
+            if (samples > 1) {
+                x += next_uniform(random) - 0.5f;
+                y += next_uniform(random) - 0.5f;
+            }
+            const Vec3f direction = viewport.direction(x, y);
+
+            paths_.ox[slot] = viewport.origin.x;
+            paths_.oy[slot] = viewport.origin.y;
+            paths_.oz[slot] = viewport.origin.z;
+            paths_.dx[slot] = direction.x;
+            paths_.dy[slot] = direction.y;
+            paths_.dz[slot] = direction.z;
+            paths_.tr[slot] = paths_.tg[slot] = paths_.tb[slot] = 1;
+            paths_.slot[slot] = (uint32_t) slot;
+            paths_.random[slot] = random;
+            radiance_[slot] = Vec3f(0, 0, 0);
+        }
+    });
+    paths_.size = count;
+}
+
+/*
+ * Find the nearest hit of every path's ray.
+ */
+void PathTracer::extend() {
+    parallel(paths_.size, [&](const size_t &begin, const size_t &end) {
+        for (size_t i = begin; i < end; i++) {
+            float t = std::numeric_limits<float>::max();
+            Surface surface;
+            scene_.intersect(paths_.ray(i), t, surface);
+            paths_.t[i] = t;
+            paths_.kind[i] = surface.kind;
+            paths_.object[i] = surface.object;
+            paths_.hit[i] = surface.index;
+        }
+    });
+}
+
+/*
+ * Shade every path's hit: paths that escaped gather the background and end. The rest queue a shadow ray
+ * towards a light chosen at random, then bounce, unless they have bounced enough or lose at Russian roulette;
+ * those that go on are compacted into the next queue, which then becomes the current one.
+ */
+void PathTracer::shade(const size_t &bounce) {
+    const Scene &scene = scene_;
+    const bool bounces = bounce < settings_.max_bounces;
+    const bool roulette = bounce + 1 >= settings_.roulette_bounce;
+    const bool sample_tree = scene.light_tree.size() == scene.lights.size();
+    next_size_ = 0;
+    shadow_size_ = 0;
+
+    parallel(paths_.size, [&](const size_t &begin, const size_t &end) {
+        std::vector<uint32_t> survivors;
+        struct ShadowRay {
+            Pos3f origin;
+            Vec3f direction;
+            float distance;
+            Vec3f contribution;
+            uint32_t slot;
+        };
+        std::vector<ShadowRay> shadow_rays;
+
+        for (size_t i = begin; i < end; i++) {
+            Vec3f throughput(paths_.tr[i], paths_.tg[i], paths_.tb[i]);
+            const uint32_t slot = paths_.slot[i];
+            if (paths_.kind[i] == SurfaceKind::none) {
+                radiance_[slot] += hadamard(throughput, scene.background_colour);
+                continue;
+            }
+
+            const Ray3f ray = paths_.ray(i);
+            const Surface surface(paths_.kind[i], paths_.object[i], paths_.hit[i]);
+            const Ray3f collision_normal = scene.surface_normal(ray, surface, paths_.t[i]);
+            const Material material = scene.surface_material(ray, surface, collision_normal);
+            const Pos3f point = collision_normal.position;
+            Vec3f normal = collision_normal.direction;
+            if (normal * ray.direction > 0) {
+                normal = -normal;
+            }
+            const Pos3f origin = point + normal * PATH_RAY_OFFSET;
+            const bool specular = material.specular_path() != SpecularPath::none;
+            uint32_t random = paths_.random[i];
+
+            // Light from one light, weighted by the inverse of the chance of choosing it.
+            if (!scene.lights.empty()) {
+                uint32_t l;
+                float probability;
+                const float u = next_uniform(random);
+                if (!sample_tree) {
+                    l = std::min((uint32_t) (u * (float) scene.lights.size()), (uint32_t) scene.lights.size() - 1);
+                    probability = 1.0f / (float) scene.lights.size();
+                } else if (!scene.light_tree.sample(point, scene.settings.light_cutoff, u, l, probability)) {
+                    probability = 0;
+                }
+                if (probability > 0) {
+                    const Light &light = scene.lights[l];
+                    const Vec3f to_light = light.position - origin;
+                    const float light_distance = to_light.length();
+                    const Vec3f direction = to_light / light_distance;
+                    const float cosine = normal * direction;
+                    if (cosine > 0) {
+                        Vec3f reflectance = material.diffuse_colour * cosine;
+                        if (specular) {
+                            const Vec3f reflected = 2 * cosine * normal - direction;
+                            const float alignment = -(reflected * ray.direction);
+                            if (alignment > 0) {
+                                reflectance += material.specular_colour * std::pow(alignment, material.specularity);
+                            }
+                        }
+                        const Vec3f contribution = hadamard(hadamard(throughput, light.illumination(point)),
+                                                           reflectance) / probability;
+                        if (max_component(contribution) > 0) {
+                            shadow_rays.push_back({origin, direction, light_distance, contribution, slot});
+                        }
+                    }
+                }
+            }
+            if (!bounces) {
+                continue;
+            }
+
+            // Bounce diffusely or specularly, in proportion to how much light each reflects.
+            const float diffuse_weight = max_component(material.diffuse_colour);
+            const float specular_weight = specular ? max_component(material.specular_colour) * 2 /
+                                                     (material.specularity + 1) : 0;
+            const float total_weight = diffuse_weight + specular_weight;
+            if (total_weight <= 0) {
+                continue;
+            }
+            Vec3f direction;
+            const float u = next_uniform(random);
+            const float v = next_uniform(random);
+            if (next_uniform(random) * total_weight < diffuse_weight) {
+                direction = cosine_direction(normal, u, v);
+                throughput = hadamard(throughput, material.diffuse_colour * (total_weight / diffuse_weight));
+            } else {
+                const Vec3f mirror = ray.direction - 2 * (ray.direction * normal) * normal;
+                direction = phong_direction(mirror, material.specularity, u, v);
+                if (direction * normal <= 0) {
+                    continue;
+                }
+                throughput = hadamard(throughput, material.specular_colour *
+                                                  (2 / (material.specularity + 1) * total_weight / specular_weight));
+            }
+
+            // Carry on with a chance in proportion to the throughput, making up for the paths ended.
+            if (roulette) {
+                const float survival = std::min(0.95f, max_component(throughput));
+                if (next_uniform(random) >= survival) {
+                    continue;
+                }
+                throughput = throughput / survival;
+            }
+
+            paths_.ox[i] = origin.x;
+            paths_.oy[i] = origin.y;
+            paths_.oz[i] = origin.z;
+            paths_.dx[i] = direction.x;
+            paths_.dy[i] = direction.y;
+            paths_.dz[i] = direction.z;
+            paths_.tr[i] = throughput.x;
+            paths_.tg[i] = throughput.y;
+            paths_.tb[i] = throughput.z;
+            paths_.random[i] = random;
+            survivors.push_back((uint32_t) i);
+        }
+
+        // Claim room in the output queues for this run's rays, and copy them across.
+        size_t out = next_size_.fetch_add(survivors.size());
+        for (const uint32_t i : survivors) {
+            next_.ox[out] = paths_.ox[i];
+            next_.oy[out] = paths_.oy[i];
+            next_.oz[out] = paths_.oz[i];
+            next_.dx[out] = paths_.dx[i];
+            next_.dy[out] = paths_.dy[i];
+            next_.dz[out] = paths_.dz[i];
+            next_.tr[out] = paths_.tr[i];
+            next_.tg[out] = paths_.tg[i];
+            next_.tb[out] = paths_.tb[i];
+            next_.slot[out] = paths_.slot[i];
+            next_.random[out] = paths_.random[i];
+            out++;
+        }
+        out = shadow_size_.fetch_add(shadow_rays.size());
+        for (const ShadowRay &shadow : shadow_rays) {
+            shadows_.ox[out] = shadow.origin.x;
+            shadows_.oy[out] = shadow.origin.y;
+            shadows_.oz[out] = shadow.origin.z;
+            shadows_.dx[out] = shadow.direction.x;
+            shadows_.dy[out] = shadow.direction.y;
+            shadows_.dz[out] = shadow.direction.z;
+            shadows_.distance[out] = shadow.distance;
+            shadows_.r[out] = shadow.contribution.x;
+            shadows_.g[out] = shadow.contribution.y;
+            shadows_.b[out] = shadow.contribution.z;
+            shadows_.slot[out] = shadow.slot;
+            out++;
+        }
+    });
+
+    std::swap(paths_, next_);
+    paths_.size = next_size_;
+    shadows_.size = shadow_size_;
+}
+
+/*
+ * Add the light carried by every shadow ray that reaches its light.
+ * Each path queues at most one shadow ray per bounce, so no two rays here add to the same sample.
+ */
+void PathTracer::shadow() {
+    parallel(shadows_.size, [&](const size_t &begin, const size_t &end) {
+        for (size_t i = begin; i < end; i++) {
+            const Ray3f ray(Pos3f(shadows_.ox[i], shadows_.oy[i], shadows_.oz[i]),
+                            Vec3f(shadows_.dx[i], shadows_.dy[i], shadows_.dz[i]));
+            if (!scene_.occluded(ray, shadows_.distance[i])) {
+                radiance_[shadows_.slot[i]] += Vec3f(shadows_.r[i], shadows_.g[i], shadows_.b[i]);
+            }
+        }
+    });
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "Camera.hpp"
+#include "Geometry.hpp"
+#include "ImageSink.hpp"
+#include "Scene.hpp"
+
+struct PathSettings {
+    size_t samples;         // Paths per pixel.
+    size_t max_bounces;     // Bounces after the first hit; zero gives direct lighting only.
+    size_t roulette_bounce; // Paths which have bounced this many times may be ended at random, weighted to compensate.
+    size_t wavefront;       // Paths in flight at once. Rows of the image are rendered in batches that fill it.
+
+    PathSettings()
+            : samples(16), max_bounces(4), roulette_bounce(3), wavefront(1 << 20) {}
+};
+
+/*
+ * Where the time went while path tracing, and how much work each stage did.
+ */
+struct PathStats {
+    size_t batches;
+    size_t paths;
+    size_t extension_rays;
+    size_t shadow_rays;
+    double generate_ms;
+    double extend_ms;
+    double shade_ms;
+    double shadow_ms;
+    double total_ms;
+
+    PathStats()
+            : batches(0), paths(0), extension_rays(0), shadow_rays(0), generate_ms(0), extend_ms(0), shade_ms(0),
+              shadow_ms(0), total_ms(0) {}
+
+    void report(std::ostream &out) const;
+};
+
+/*
+ * The rays of paths in flight, array by array, so that each stage streams through them.
+ */
+struct PathQueue {
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<float> tr, tg, tb;  // Throughput: how much of the light arriving along the ray reaches the sample.
+    std::vector<uint32_t> slot;     // The sample the path contributes to.
+    std::vector<uint32_t> random;   // The path's random number generator state.
+    std::vector<float> t;           // Distance to the nearest hit, after extension.
+    std::vector<SurfaceKind> kind;  // The surface hit, after extension (see Surface): what it is,
+    std::vector<uint32_t> object;   // its mesh, instance or distance field,
+    std::vector<uint32_t> hit;      // and its sphere or triangle.
+    size_t size;
+
+    PathQueue()
+            : ox(), oy(), oz(), dx(), dy(), dz(), tr(), tg(), tb(), slot(), random(), t(), kind(), object(), hit(),
+              size(0) {}
+
+    void reserve(const size_t &capacity);
+
+    Ray3f ray(const size_t &i) const {
+        return Ray3f(Pos3f(ox[i], oy[i], oz[i]), Vec3f(dx[i], dy[i], dz[i]));
+    }
+};
+
+/*
+ * Shadow rays towards lights, each carrying what its light contributes to a sample if nothing is in the way.
+ */
+struct ShadowQueue {
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<float> distance;
+    std::vector<float> r, g, b;
+    std::vector<uint32_t> slot;
+    size_t size;
+
+    ShadowQueue()
+            : ox(), oy(), oz(), dx(), dy(), dz(), distance(), r(), g(), b(), slot(), size(0) {}
+
+    void reserve(const size_t &capacity);
+};
+
+/*
+ * A wavefront path tracer: rather than following each path to its end, every path in flight
+ * goes through each stage together, with the stages run in parallel over large queues of rays:
+ *
+ *  - generate: start samples' paths from the camera;
+ *  - extend: find each ray's nearest hit;
+ *  - shade: add light from the background to paths that escaped, choose a light for each hit
+ *    and queue a shadow ray towards it, then bounce the surviving paths into the next queue;
+ *  - shadow: add the light of each shadow ray that isn't blocked.
+ *
+ * Each stage runs one small loop over rays that are all at the same point in their paths, which keeps
+ * traversal and shading coherent, and finished paths are compacted away so later bounces only pay for
+ * the paths still going.
+ *
+ * Surfaces reflect diffusely and with a Phong lobe, as in the scene's direct shading, but the diffuse colour
+ * scales the light once, as a reflectance, where Scene::render scales it twice and adds ambient light.
+ * So a render without bounces only matches the brightness of Scene::render for white materials and no ambient light.
+ * Light comes from the point lights (sampled one per hit, from the light tree when it's built) and from
+ * the background, which surrounds the scene.
+ */
+struct PathTracer {
+    PathTracer(Scene &scene, const PathSettings &settings)
+            : scene_(scene), settings_(settings), paths_(), next_(), shadows_(), radiance_(), next_size_(0),
+              shadow_size_(0), pixels_() {}
+
+    void render(const size_t &width, const size_t &height, ImageSink &sink, PathStats &stats);
+
+private:
+
+    template<typename Body>
+    void parallel(const size_t &count, Body body);
+
+    void generate(const Viewport &viewport, const size_t &width, const size_t &first_row, const size_t &rows);
+
+    void extend();
+
+    void shade(const size_t &bounce);
+
+    void shadow();
+
+    Scene &scene_;
+    PathSettings settings_;
+    PathQueue paths_;
+    PathQueue next_;
+    ShadowQueue shadows_;
+    std::vector<Vec3f> radiance_; // Gathered by each sample of the batch.
+    std::atomic<size_t> next_size_;
+    std::atomic<size_t> shadow_size_;
+    std::vector<Vec3f> pixels_;
+};
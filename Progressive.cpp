@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Progressive.hpp"
+#include "Random.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Pixels start this far into a shared framebuffer, leaving room for the header to grow.
+const size_t SHARED_FRAME_PIXEL_OFFSET = 64;
+
+/*
+ * A uniform random offset in [-0.5, 0.5) from a hash of the key, so that samples are repeatable.
+ */
+float jitter(const uint32_t &key) {
+    return unit_float(hash_bits(key)) - 0.5f;
+}
+
+}
+
+/*
+ * Create (or truncate) the file at path, sized for a width x height image, and map it.
+ * On failure the error is reported and ok() returns false.
+ */
+SharedFramebuffer::SharedFramebuffer(const std::string &path, const size_t &width, const size_t &height,
+                                     const PostProcess &post)
+        : width_(width), post_(post), size_(SHARED_FRAME_PIXEL_OFFSET + width * height * 3), header_(nullptr),
+          pixels_(nullptr) {
+    post_.bits = 8;
+    static_assert(sizeof(SharedFrameHeader) <= SHARED_FRAME_PIXEL_OFFSET, "The shared frame header has outgrown its space");
+
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t) size_) != 0) {
+        std::cerr << "Could not create " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    void *mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Could not map " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+
+    header_ = new(mapping) SharedFrameHeader;
+    std::memcpy(header_->magic, SHARED_FRAME_MAGIC, sizeof(header_->magic));
+    header_->width = (uint32_t) width;
+    header_->height = (uint32_t) height;
+    header_->pixel_offset = (uint32_t) SHARED_FRAME_PIXEL_OFFSET;
+    header_->sequence.store(0);
+    header_->frame = 0;
+    pixels_ = (uint8_t *) mapping + SHARED_FRAME_PIXEL_OFFSET;
+}
+
+SharedFramebuffer::~SharedFramebuffer() {
+    if (header_ != nullptr) {
+        munmap(header_, size_);
+    }
+}
+
+ImageSink *SharedFramebuffer::begin_frame(const size_t &frame) {
+    if (header_ == nullptr) {
+        return nullptr;
+    }
+    header_->sequence.fetch_add(1);
+    header_->frame = (uint32_t) frame;
+    return this;
+}
+
+bool SharedFramebuffer::end_frame() {
+    header_->sequence.fetch_add(1);
+    return true;
+}
+
+void SharedFramebuffer::write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) {
+    quantise_tile(tile, pixels, stride, pixels_, width_, post_);
+}
+
+void ProgressiveStats::report(std::ostream &out) const {
+    out << "Preview: " << passes << " passes, first after " << first_ms << " ms, " << total_ms << " ms in all ("
+        << (cancelled ? "cancelled" : complete ? "complete" : "out of time") << ")\n";
+}
+
+ProgressiveRenderer::ProgressiveRenderer(Scene &scene, const size_t &width, const size_t &height,
+                                         FrameOutput &output, const ProgressiveSettings &settings)
+        : scene_(scene), width_(width), height_(height), output_(output), settings_(settings), frame_(0),
+          cancelled_(false), tiles_(), sum_(width * height), samples_(width * height), scratch_() {
+    // Tiles hold whole blocks of the first pass, so each block is filled by the tile that traced it.
+    size_t step = 1;
+    while (step * 2 <= settings_.initial_step) {
+        step *= 2;
+    }
+    settings_.initial_step = step;
+    const size_t tile = (scene.settings.packet_tile_size() + step - 1) / step * step;
+    tiles_ = TileScheduler::split(width, height, tile);
+}
+
+/*
+ * Render the scene from its camera as it is now, publishing each pass to the output.
+ * Returns false if the render was cancelled or the output failed; a render that ran out of time
+ * has still published its last pass.
+ */
+bool ProgressiveRenderer::render(ProgressiveStats &stats) {
+    const Stats::Phase phase("preview");
+    const auto start = Clock::now();
+    const auto deadline = settings_.budget_ms > 0
+                          ? start + std::chrono::microseconds((int64_t) (settings_.budget_ms * 1000))
+                          : Clock::time_point::max();
+    const Viewport viewport(scene_.camera, width_, height_);
+    scene_.prepare_shading(viewport);
+
+    stats = ProgressiveStats();
+    std::vector<std::pair<size_t, size_t>> passes; // Of (step, sample).
+    for (size_t step = settings_.initial_step; step > 1; step /= 2) {
+        passes.emplace_back(step, 1);
+    }
+    for (size_t sample = 1; sample <= std::max((size_t) 1, settings_.max_samples); sample++) {
+        passes.emplace_back(1, sample);
+    }
+
+    bool ok = true;
+    for (size_t p = 0; p < passes.size(); p++) {
+        // The first pass always finishes, so that there is something to show.
+        const bool finished = run_pass(viewport, passes[p].first, passes[p].second,
+                                       p == 0 ? Clock::time_point::max() : deadline);
+        if (cancelled_) {
+            stats.cancelled = true;
+            ok = false;
+            break;
+        }
+        if (!publish(passes[p].second > 1)) {
+            ok = false;
+            break;
+        }
+        if (p == 0) {
+            stats.first_ms = elapsed_ms(start);
+        }
+        if (!finished) {
+            break;
+        }
+        stats.passes++;
+        stats.complete = p + 1 == passes.size();
+    }
+    stats.total_ms = elapsed_ms(start);
+    return ok;
+}
+
+/*
+ * Trace one pass: with step > 1, one pixel in step x step not traced by an earlier pass, filling its block;
+ * with step 1, every pixel, or for later samples, a jittered sample added to every pixel.
+ * Returns false if the pass was cut short by the deadline or a cancellation.
+ */
+bool ProgressiveRenderer::run_pass(const Viewport &viewport, const size_t &step, const size_t &sample,
+                                   const Clock::time_point &deadline) {
+    std::atomic<bool> finished(true);
+    scene_.thread_pool().run(tiles_, [&](const Tile &tile, const size_t &) {
+        if (cancelled_ || Clock::now() > deadline) {
+            finished = false;
+            return;
+        }
+
+        // The first full-resolution pass renders tiles as a full render would, packets and all.
+        if (step == 1 && sample == 1) {
+            scene_.render_tile(viewport, tile, width_, height_, &sum_[tile.x + tile.y * width_], width_);
+            for (size_t j = tile.y; j < tile.y + tile.height; j++) {
+                std::fill(&samples_[tile.x + j * width_], &samples_[tile.x + j * width_] + tile.width, 1);
+            }
+            return;
+        }
+
+        Surface surface;
+        for (size_t j = tile.y; j < tile.y + tile.height; j += step) {
+            if (cancelled_) {
+                finished = false;
+                return;
+            }
+            for (size_t i = tile.x; i < tile.x + tile.width; i += step) {
+                const size_t k = i + j * width_;
+                if (step == 1) {
+                    const auto key = (uint32_t) (k * 2 * settings_.max_samples + sample * 2);
+                    sum_[k] += scene_.trace(viewport.ray(i + jitter(key), j + jitter(key + 1)), surface);
+                    samples_[k]++;
+                    continue;
+                }
+                if (step < settings_.initial_step && i % (2 * step) == 0 && j % (2 * step) == 0) {
+                    continue;
+                }
+                const Vec3f colour = scene_.trace(viewport.ray(i, j), surface);
+                const size_t block_width = std::min(step, tile.x + tile.width - i);
+                const size_t block_height = std::min(step, tile.y + tile.height - j);
+                for (size_t y = 0; y < block_height; y++) {
+                    std::fill(&sum_[k + y * width_], &sum_[k + y * width_] + block_width, colour);
+                    std::fill(&samples_[k + y * width_], &samples_[k + y * width_] + block_width, 1);
+                }
+            }
+        }
+    });
+    return finished;
+}
+
+/*
+ * Send the image as it stands to the output as a frame, averaging each pixel's samples
+ * unless every pixel has only one.
+ */
+bool ProgressiveRenderer::publish(const bool &average) {
+    ImageSink *sink = output_.begin_frame(frame_);
+    if (sink == nullptr) {
+        return false;
+    }
+    TileScheduler &pool = scene_.thread_pool();
+    scratch_.resize(std::max(scratch_.size(), pool.thread_count()));
+    pool.run(tiles_, [&](const Tile &tile, const size_t &thread) {
+        if (!average) {
+            sink->write_tile(tile, &sum_[tile.x + tile.y * width_], width_);
+            return;
+        }
+        std::vector<Vec3f> &pixels = scratch_[thread];
+        pixels.resize(std::max(pixels.size(), tile.width * tile.height));
+        for (size_t j = 0; j < tile.height; j++) {
+            for (size_t i = 0; i < tile.width; i++) {
+                const size_t k = tile.x + i + (tile.y + j) * width_;
+                pixels[i + j * tile.width] = sum_[k] / (float) samples_[k];
+            }
+        }
+        sink->write_tile(tile, pixels.data(), tile.width);
+    });
+    frame_++;
+    return output_.end_frame();
+}
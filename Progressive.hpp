@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Geometry.hpp"
+#include "ImageSink.hpp"
+#include "Scene.hpp"
+#include "Sequence.hpp"
+
+// The first eight bytes of a shared framebuffer.
+#define SHARED_FRAME_MAGIC "RAYFRAME"
+
+/*
+ * The start of a shared framebuffer, followed by width * height 8-bit RGB pixels, row by row, at pixel_offset.
+ *
+ * sequence is odd while a frame is being written. A viewer should read it, copy the pixels, and read it again,
+ * keeping the copy only if both reads gave the same even number.
+ */
+struct SharedFrameHeader {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixel_offset;
+    std::atomic<uint32_t> sequence;
+    uint32_t frame; // The number of the frame being written, or last written.
+};
+
+/*
+ * Publishes frames through a file mapped into memory, such as one under /dev/shm,
+ * for a viewer in another process to map and display as they arrive.
+ * Pixels are always stored in 8 bits, whatever the post-process asks for.
+ */
+struct SharedFramebuffer : FrameOutput, ImageSink {
+    SharedFramebuffer(const std::string &path, const size_t &width, const size_t &height,
+                      const PostProcess &post = PostProcess());
+
+    ~SharedFramebuffer() override;
+
+    SharedFramebuffer(const SharedFramebuffer &) = delete;
+
+    SharedFramebuffer &operator=(const SharedFramebuffer &) = delete;
+
+    bool ok() const {
+        return header_ != nullptr;
+    }
+
+    ImageSink *begin_frame(const size_t &frame) override;
+
+    bool end_frame() override;
+
+    void write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) override;
+
+private:
+
+    size_t width_;
+    PostProcess post_;
+    size_t size_;
+    SharedFrameHeader *header_;
+    uint8_t *pixels_;
+};
+
+struct ProgressiveSettings {
+    size_t initial_step; // The first pass traces one pixel in initial_step x initial_step; a power of two.
+    size_t max_samples;  // Once every pixel is traced, passes add jittered samples per pixel up to this many.
+    double budget_ms;    // Refinement stops once this long has passed; zero refines to the end.
+
+    ProgressiveSettings()
+            : initial_step(16), max_samples(4), budget_ms(1000) {}
+};
+
+/*
+ * How a progressive render went.
+ */
+struct ProgressiveStats {
+    size_t passes;      // Completed.
+    double first_ms;    // Until the first pass was published.
+    double total_ms;
+    bool complete;      // Every pass finished.
+    bool cancelled;
+
+    ProgressiveStats()
+            : passes(0), first_ms(0), total_ms(0), complete(false), cancelled(false) {}
+
+    void report(std::ostream &out) const;
+};
+
+/*
+ * Renders a scene in passes of increasing quality, publishing the image after each pass, for previews
+ * that respond quickly however large the scene.
+ *
+ * The first pass traces a sparse grid of pixels, each filling the block around it. Each following pass
+ * halves the grid spacing, tracing only the new pixels, until the last traces every pixel as a full
+ * render would. Passes after that add a jittered sample to every pixel, averaging away aliasing.
+ *
+ * A render stops early once its time budget has run out, keeping whatever it has refined, or as soon as
+ * cancel() is called (from any thread), for example because the camera has moved. Cancelled work is
+ * abandoned within a tile, and isn't published.
+ */
+struct ProgressiveRenderer {
+    ProgressiveRenderer(Scene &scene, const size_t &width, const size_t &height, FrameOutput &output,
+                        const ProgressiveSettings &settings);
+
+    bool render(ProgressiveStats &stats);
+
+    void cancel() {
+        cancelled_ = true;
+    }
+
+    // Allow rendering again after a cancellation.
+    void resume() {
+        cancelled_ = false;
+    }
+
+private:
+
+    bool run_pass(const Viewport &viewport, const size_t &step, const size_t &sample,
+                  const std::chrono::steady_clock::time_point &deadline);
+
+    bool publish(const bool &average);
+
+    Scene &scene_;
+    size_t width_;
+    size_t height_;
+    FrameOutput &output_;
+    ProgressiveSettings settings_;
+    size_t frame_;
+    std::atomic<bool> cancelled_;
+    std::vector<Tile> tiles_;
+    std::vector<Vec3f> sum_;        // Of each pixel's samples.
+    std::vector<uint16_t> samples_; // Of each pixel.
+    std::vector<std::vector<Vec3f>> scratch_;
+};
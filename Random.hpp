@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Mix the bits of a key, so that nearby keys give unrelated values.
+ */
+inline uint32_t hash_bits(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x7feb352du;
+    key ^= key >> 15;
+    key *= 0x846ca68bu;
+    key ^= key >> 16;
+    return key;
+}
+
+/*
+ * A uniform number in [0, 1) from the top 24 bits of a word.
+ */
+inline float unit_float(const uint32_t &word) {
+    return (float) (word >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+ * The next uniform random number in [0, 1) from a PCG generator with the given state.
+ */
+inline float next_uniform(uint32_t &state) {
+    state = state * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return unit_float(word);
+}
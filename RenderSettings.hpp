@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+#include "constants.hpp"
+
+/*
+ * What to render: full Phong shading, or cheaper approximations of it for previews, or debugging views.
+ */
+enum class RenderMode {
+    full,       // Diffuse and specular lighting with shadows.
+    diffuse,    // Without specular highlights.
+    no_shadows, // Without shadow rays.
+    normals,    // Surface normals as colours, without lighting.
+    depth       // Distance from the camera in shades of grey, nearest brightest.
+};
+
+inline const char *render_mode_name(const RenderMode &mode) {
+    switch (mode) {
+        case RenderMode::diffuse:
+            return "diffuse";
+        case RenderMode::no_shadows:
+            return "no-shadows";
+        case RenderMode::normals:
+            return "normals";
+        case RenderMode::depth:
+            return "depth";
+        default:
+            return "full";
+    }
+}
+
+/*
+ * The render mode with the given name, as given by render_mode_name. Returns false if there is none.
+ */
+inline bool parse_render_mode(const std::string &name, RenderMode &mode) {
+    for (const RenderMode m : {RenderMode::full, RenderMode::diffuse, RenderMode::no_shadows, RenderMode::normals,
+                               RenderMode::depth}) {
+        if (name == render_mode_name(m)) {
+            mode = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * How rays are marched through distance fields. Each step advances relaxation times the distance the field
+ * estimates to its surface: 1 is plain sphere tracing, and up to nearly 2 takes fewer, longer steps, stepping back
+ * to plain sphere tracing wherever that overshoots. A ray hits once the estimate falls below epsilon times the
+ * ray's parameter there, so that far surfaces are found to the same fraction of a pixel as near ones,
+ * and misses if it hasn't after max_steps steps.
+ */
+struct MarchSettings {
+    size_t max_steps;
+    float epsilon;
+    float relaxation;
+
+    MarchSettings()
+            : max_steps(FIELD_MAX_STEPS), epsilon(FIELD_EPSILON), relaxation(FIELD_RELAXATION) {}
+};
+
+struct RenderSettings {
+    RenderMode render_mode;
+    bool packet_tracing; // Trace primary rays in PACKET_WIDTH x PACKET_WIDTH packets.
+    size_t thread_count; // Zero uses one thread per hardware thread.
+    size_t tile_size;    // Side length of the square tiles the frame is split into; a multiple of PACKET_WIDTH.
+
+    // Adaptive sampling traces a grid of samples adaptive_step pixels apart, refining cells whose corners
+    // hit different spheres or differ by more than adaptive_threshold in any channel, and interpolating the rest.
+    bool adaptive_sampling;
+    size_t adaptive_step;
+    float adaptive_threshold;
+
+    // With many lights: ignore lights which can't cast at least light_cutoff illumination on a point
+    // (zero considers every light), and with light_samples, shade each point from that many lights
+    // picked at random in proportion to their estimated contribution (zero uses every light).
+    // Sampling only applies to full shading.
+    float light_cutoff;
+    size_t light_samples;
+
+    MarchSettings march;
+
+    // Bytes of texture tiles to keep in memory.
+    size_t texture_cache_size;
+
+    // Ambient occlusion: scale the ambient light at each point by the fraction of ao_samples rays about its normal
+    // which travel ao_distance without hitting anything; zero samples leaves the ambient light as it is.
+    // With ao_half_resolution, occlusion is found at one pixel of each 2x2 block and shared with those nearby
+    // that lie on the same surface. Only modes which light surfaces are occluded, and not adaptive sampling.
+    size_t ao_samples;
+    float ao_distance;
+    bool ao_half_resolution;
+
+    RenderSettings()
+            : render_mode(RenderMode::full), packet_tracing(true), thread_count(0), tile_size(32),
+              adaptive_sampling(false), adaptive_step(8), adaptive_threshold(0.02f),
+              light_cutoff(0), light_samples(0), march(), texture_cache_size(TEXTURE_CACHE_SIZE),
+              ao_samples(0), ao_distance(AO_DISTANCE), ao_half_resolution(false) {}
+
+    // The tile size rounded up to a whole number of packets, so that packets never straddle tiles.
+    size_t packet_tile_size() const {
+        const size_t packets = std::max((size_t) 1, (tile_size + PACKET_WIDTH - 1) / PACKET_WIDTH);
+        return packets * PACKET_WIDTH;
+    }
+};
@@ -1,102 +1,936 @@
 #include <algorithm>
 #include <limits>
 
+#include "AdaptiveSampler.hpp"
 #include "Scene.hpp"
+#include "Shading.hpp"
+
+namespace {
+
+// The shading state of the view whose tile this thread is rendering, while Scene::render renders several views.
+thread_local const ViewShading *tile_view = nullptr;
+
+/*
+ * Shades with the given view's state on the calling thread while in scope.
+ */
+struct TileView {
+    explicit TileView(const ViewShading &view)
+            : previous_(tile_view) {
+        tile_view = &view;
+    }
+
+    ~TileView() {
+        tile_view = previous_;
+    }
+
+private:
+    const ViewShading *previous_;
+};
+
+}
+
+/*
+ * Return a handle to the given material, adding it only if the scene has no identical one already.
+ */
+MaterialHandle Scene::add_material(const Material &material) {
+    for (; materials_indexed_ < materials.size(); materials_indexed_++) {
+        material_lookup_.emplace(materials[materials_indexed_], (uint32_t) materials_indexed_);
+    }
+
+    const auto existing = material_lookup_.find(material);
+    if (existing != material_lookup_.end()) {
+        return {existing->second};
+    }
+    const auto index = (uint32_t) materials.size();
+    materials.push_back(material);
+    material_lookup_.emplace(material, index);
+    materials_indexed_ = materials.size();
+    return {index};
+}
 
 /*
  * Insert a new sphere.
  */
-void Scene::add_sphere(const Pos3f &position, const float &radius, const Material &material) {
-    auto *sphere = new Sphere(position, radius, material);
-    spheres.push_back(sphere);
+SphereHandle Scene::add_sphere(const Pos3f &position, const float &radius, const MaterialHandle &material) {
+    spheres.push_back(Sphere(position, radius));
+    sphere_materials.push_back(material.index);
+    bvh.clear();
+    sphere_arrays.clear();
+    return {(uint32_t) (spheres.size() - 1)};
+}
+
+SphereHandle Scene::add_sphere(const Pos3f &position, const float &radius, const Material &material) {
+    return add_sphere(position, radius, add_material(material));
 }
 
 /*
  * Add a new light to the scene
  */
-void Scene::add_light(const Pos3f &position, const Vec3f &colour, const float &brightness) {
-    auto *light = new Light(position, colour, brightness);
-    lights.push_back(light);
+LightHandle Scene::add_light(const Pos3f &position, const Vec3f &colour, const float &brightness) {
+    lights.push_back(Light(position, colour, brightness));
+    return {(uint32_t) (lights.size() - 1)};
 }
 
 /*
- * All spheres and lights are destroyed.
+ * Add a mesh, building its hierarchy if that hasn't been done. Each mesh has a hierarchy of its own,
+ * so unlike adding a sphere, this leaves the spheres' acceleration structures as they are.
  */
-void Scene::clear() {
-    for (auto sphere : spheres) {
-        delete sphere;
+MeshHandle Scene::add_mesh(Mesh &&mesh, const MaterialHandle &material) {
+    if (!mesh.built()) {
+        mesh.build();
     }
+    meshes.push_back(std::move(mesh));
+    mesh_materials.push_back(material.index);
+    return {(uint32_t) (meshes.size() - 1)};
+}
+
+/*
+ * Add an empty prototype, for spheres to be added to and instances to place.
+ */
+PrototypeHandle Scene::add_prototype() {
+    prototypes.emplace_back();
+    return {(uint32_t) (prototypes.size() - 1)};
+}
+
+/*
+ * Insert a new sphere into a prototype, in the prototype's own space.
+ */
+void Scene::add_sphere(const PrototypeHandle &prototype, const Pos3f &position, const float &radius,
+                       const MaterialHandle &material) {
+    prototypes.at(prototype.index).add_sphere(Sphere(position, radius), material.index);
+    instance_bvh.clear();
+}
+
+/*
+ * Place a prototype in the scene, transformed from its own space into the scene's by placement,
+ * which must not be singular. Instances can't be traced until finalise() or refit() is called.
+ */
+InstanceHandle Scene::add_instance(const PrototypeHandle &prototype, const Transform &placement) {
+    instances.emplace_back(placement, prototype.index);
+    instance_bvh.clear();
+    return {(uint32_t) (instances.size() - 1)};
+}
+
+/*
+ * Add a distance field, such as a fractal. Fields are traced as soon as they are added.
+ */
+FieldHandle Scene::add_field(const DistanceField &field, const MaterialHandle &material) {
+    fields.push_back(field);
+    field_materials.push_back(material.index);
+    return {(uint32_t) (fields.size() - 1)};
+}
+
+/*
+ * Load a texture from a binary PPM image into the scene's texture cache (see TextureCache::load).
+ * Returns false, having reported why, if it can't be loaded.
+ */
+bool Scene::load_texture(const std::string &path, TextureHandle &texture) {
+    return textures.load(path, texture.index);
+}
+
+/*
+ * Change a sphere's material. Materials don't affect the acceleration structures, so this is cheap.
+ */
+void Scene::set_material(const SphereHandle &sphere, const MaterialHandle &material) {
+    sphere_materials.at(sphere.index) = material.index;
+}
+
+/*
+ * Scale a material's diffuse colour by a texture, for every object using the material.
+ */
+void Scene::set_diffuse_texture(const MaterialHandle &material, const TextureHandle &texture) {
+    materials.at(material.index).diffuse_texture = texture.index;
+    material_lookup_.clear();
+    materials_indexed_ = 0;
+}
+
+/*
+ * Move or resize a sphere. The acceleration structures are out of date until refit() or finalise() is called.
+ */
+void Scene::move_sphere(const SphereHandle &sphere, const Pos3f &centre, const float &radius) {
+    spheres.at(sphere.index) = Sphere(centre, radius);
+}
+
+/*
+ * Move a light. Shading sees the new position immediately, but light culling and sampling
+ * use the light tree, which is out of date until refit() or finalise() is called.
+ */
+void Scene::move_light(const LightHandle &light, const Pos3f &position) {
+    lights.at(light.index).position = position;
+}
+
+/*
+ * All spheres, meshes, instances, distance fields, materials, textures and lights are removed, and any scene file
+ * they were loaded from is closed.
+ */
+void Scene::clear() {
     spheres.clear();
+    sphere_materials.clear();
+    materials.clear();
+    material_lookup_.clear();
+    materials_indexed_ = 0;
+    kernels_.clear();
+    lights.clear();
+    meshes.clear();
+    mesh_materials.clear();
+    prototypes.clear();
+    instances.clear();
+    instance_bvh.clear();
+    fields.clear();
+    field_materials.clear();
+    textures.clear();
+    light_tree.clear();
+    bvh.clear();
+    sphere_arrays.clear();
+    mapping.reset();
+}
+
+/*
+ * Build the acceleration structures over the scene's spheres and instances, and the light tree over its lights.
+ * This should be called once all spheres, instances and lights have been added; until it is,
+ * raycasts fall back to testing every sphere and instance one at a time, and shading considers every light.
+ *
+ * The sphere arrays are always built, in BVH leaf order if there is a BVH.
+ * Without one, raycasts run the vectorised kernel over every sphere.
+ */
+void Scene::finalise(const bool &build_bvh) {
+    const Stats::Phase phase("finalise");
+    light_tree.build(lights);
+    build_instance_bvh();
+    if (build_bvh) {
+        bvh.build(spheres);
+        sphere_arrays.build(spheres, bvh.indices);
+    } else {
+        bvh.clear();
+        std::vector<uint32_t> identity(spheres.size());
+        for (size_t i = 0; i < identity.size(); i++) {
+            identity[i] = (uint32_t) i;
+        }
+        FlatArray<uint32_t> order;
+        order.assign(std::move(identity));
+        sphere_arrays.build(spheres, order);
+    }
+}
 
-    for (auto light : lights) {
-        delete light;
+/*
+ * Bring the acceleration structures up to date after spheres have been moved or resized,
+ * by refitting the existing BVH where possible rather than building a new one.
+ *
+ * The BVH is rebuilt if spheres have been added since it was built, or if refitting
+ * has made it too much worse than a fresh build (see BVH::refit). Without a BVH, only the
+ * sphere arrays are updated. An unfinalised scene's spheres are left as they are.
+ * The light tree is always rebuilt, which is cheap next to the spheres' BVH,
+ * and the instance hierarchy if instances have been added.
+ */
+void Scene::refit() {
+    const Stats::Phase phase("refit");
+    light_tree.build(lights);
+    if (instance_bvh.indices.size() != instances.size()) {
+        build_instance_bvh();
     }
-    lights.clear();
+    if (sphere_arrays.size() != spheres.size()) {
+        if (!sphere_arrays.empty()) {
+            finalise(!bvh.empty());
+        }
+        return;
+    }
+    if (!bvh.empty() && !bvh.refit(spheres)) {
+        bvh.build(spheres);
+        sphere_arrays.build(spheres, bvh.indices);
+        return;
+    }
+    sphere_arrays.refit(spheres);
+}
+
+/*
+ * Build the hierarchy over the instances, from the bounds of their prototypes placed in the scene,
+ * after building the hierarchies of any prototypes which have changed.
+ */
+void Scene::build_instance_bvh() {
+    for (Prototype &prototype : prototypes) {
+        if (!prototype.built()) {
+            prototype.build();
+        }
+    }
+    std::vector<AABB> bounds(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        bounds[i] = instances[i].to_world.apply(prototypes[instances[i].prototype].bounds());
+    }
+    instance_bvh.build(bounds);
 }
 
 /*
- * Return true iff the given ray intersects with any sphere in the scene,
- * returning. Additionally return:
- *  * A pointer to the sphere which was hit, if any.
- *  * A ray located at the first collision point if it exists,
- *    normal to the surface at that point.
+ * The bytes taken by the scene's geometry and acceleration structures, not counting materials and lights.
+ */
+size_t Scene::memory_size() const {
+    size_t bytes = spheres.size() * (sizeof(Sphere) + sizeof(uint32_t)) +
+                   sphere_arrays.size() * (4 * sizeof(float) + sizeof(uint32_t)) +
+                   bvh.nodes.size() * sizeof(BVHNode) + bvh.indices.size() * sizeof(uint32_t) +
+                   instances.size() * sizeof(Instance) +
+                   instance_bvh.nodes.size() * sizeof(BVHNode) + instance_bvh.indices.size() * sizeof(uint32_t) +
+                   fields.size() * (sizeof(DistanceField) + sizeof(uint32_t));
+    for (const Mesh &mesh : meshes) {
+        bytes += mesh.memory_size();
+    }
+    for (const Prototype &prototype : prototypes) {
+        bytes += prototype.memory_size();
+    }
+    return bytes;
+}
+
+/*
+ * Find the nearest surface along the ray closer than parameter t. If there is one, return true
+ * with its parameter in t and the surface in surface; otherwise leave both as they are.
  *
- * Iterates though all objects in the scene to check for collisions,
- * which is not particularly efficient.
+ * Once the scene is finalised, spheres are tested several at a time from the sphere arrays,
+ * and only those in BVH leaves the ray passes through. The other objects are then searched (see intersect_objects).
  */
-bool Scene::raycast(const Ray3f &ray, Sphere *&sphere_pointer, Ray3f &collision_normal) const {
-    float dist = std::numeric_limits<float>::max();
-    Ray3f current_collision_normal;
+bool Scene::intersect(const Ray3f &ray, float &t, Surface &surface) const {
     bool collided = false;
+    if (sphere_arrays.empty()) {
+        Ray3f collision_normal;
+        for (uint32_t s = 0; s < spheres.size(); s++) {
+            if (spheres[s].raycast(ray, collision_normal)) {
+                const float current_t = distance(ray.position, collision_normal.position) / ray.direction.length();
+                if (current_t < t) {
+                    t = current_t;
+                    surface = Surface::sphere(s);
+                    collided = true;
+                }
+            }
+        }
+    } else {
+        uint32_t hit = 0;
+        if (bvh.empty()) {
+            collided = sphere_arrays.nearest(ray, 0, (uint32_t) sphere_arrays.size(), t, hit);
+        } else {
+            bvh.traverse(ray, t, [&](uint32_t first, uint32_t count, float &t_max) {
+                if (sphere_arrays.nearest(ray, first, count, t_max, hit)) {
+                    collided = true;
+                }
+                return false;
+            });
+        }
+        if (collided) {
+            surface = Surface::sphere(sphere_arrays.index[hit]);
+        }
+    }
+    collided = intersect_objects(ray, t, surface) || collided;
+    return (!fields.empty() && intersect_fields(&ray, &t, &surface, 1)) || collided;
+}
 
-    for (auto sphere : spheres) {
-        const bool current_collided = sphere->raycast(ray, current_collision_normal);
-        if (current_collided) {
+/*
+ * As intersect, but searching only the objects besides the scene's own spheres: each mesh through its own
+ * hierarchy, then the instances. Instances are found through the instance hierarchy (so only once the scene
+ * is finalised), and the ray is brought into each one's prototype to be traced through the prototype's hierarchy.
+ */
+bool Scene::intersect_objects(const Ray3f &ray, float &t, Surface &surface) const {
+    bool collided = false;
+    for (uint32_t m = 0; m < meshes.size(); m++) {
+        uint32_t triangle;
+        if (meshes[m].nearest(ray, t, triangle)) {
+            surface = Surface(SurfaceKind::triangle, m, triangle);
             collided = true;
-            const float current_dist = distance(ray.position, current_collision_normal.position);
-            if (current_dist < dist) {
-                dist = current_dist;
-                collision_normal = current_collision_normal;
-                sphere_pointer = sphere;
-            }
         }
     }
+    instance_bvh.traverse(ray, t, [&](uint32_t first, uint32_t count, float &t_max) {
+        for (uint32_t k = first; k < first + count; k++) {
+            const uint32_t i = instance_bvh.indices[k];
+            const Instance &instance = instances[i];
+            uint32_t sphere;
+            if (prototypes[instance.prototype].nearest(instance.to_local.apply(ray), t_max, sphere)) {
+                surface = Surface(SurfaceKind::instance_sphere, i, sphere);
+                collided = true;
+            }
+        }
+        return false;
+    });
+    return collided;
+}
 
+/*
+ * As intersect, but searching only the distance fields, for count rays at once: rays[k] no further than t[k],
+ * updating t[k] and surfaces[k] where it hits a field. Returns true iff any ray did.
+ * Rays are marched through each field four at a time.
+ */
+bool Scene::intersect_fields(const Ray3f *rays, float *t, Surface *surfaces, const size_t &count) const {
+    bool collided = false;
+    for (uint32_t f = 0; f < fields.size(); f++) {
+        for (size_t first = 0; first < count; first += 4) {
+            const auto group = (uint32_t) std::min(count - first, (size_t) 4);
+            uint32_t hits = fields[f].march(rays + first, t + first, group, settings.march);
+            while (hits) {
+                const int k = __builtin_ctz(hits);
+                surfaces[first + k] = Surface(SurfaceKind::field, f, 0);
+                hits &= hits - 1;
+                collided = true;
+            }
+        }
+    }
     return collided;
 }
 
+/*
+ * Return true iff the given ray hits any surface in the scene. Additionally return
+ * the surface which was hit, and a ray located at the nearest collision point, normal to the surface there.
+ */
+bool Scene::raycast(const Ray3f &ray, Surface &surface, Ray3f &collision_normal) const {
+    float t = std::numeric_limits<float>::max();
+    if (!intersect(ray, t, surface)) {
+        return false;
+    }
+    collision_normal = surface_normal(ray, surface, t);
+    return true;
+}
+
+/*
+ * Return the surface normal ray where the given ray hits the given surface at parameter t.
+ *
+ * A sphere's hit point is snapped back onto its surface, so that rounding in t
+ * doesn't leave it inside the sphere where shadow rays would self-occlude.
+ * Rays hit both sides of a triangle, so its normal is turned to face the ray.
+ * An instance's sphere is hit, and its hit point snapped, in its prototype's space; both the point and
+ * the normal are then brought back out of it.
+ * A distance field is only hit to within a tolerance, the march epsilon times the distance along the ray.
+ * Its normal is estimated over that tolerance, and its hit point is moved off the surface by a few times it.
+ */
+Ray3f Scene::surface_normal(const Ray3f &ray, const Surface &surface, const float &t) const {
+    switch (surface.kind) {
+        case SurfaceKind::instance_sphere: {
+            const Instance &instance = instances[surface.object];
+            const Sphere &sphere = prototypes[instance.prototype].spheres[surface.index];
+            const Ray3f local = instance.to_local.apply(ray);
+            const Vec3f direction = (local.position + local.direction * t - sphere.centre).unit();
+            return {instance.to_world.apply(sphere.centre + direction * sphere.radius),
+                    instance.to_local.apply_transposed(direction).unit()};
+        }
+        case SurfaceKind::triangle: {
+            const Vec3f normal = meshes[surface.object].normal(surface.index);
+            return {ray.position + ray.direction * t, normal * ray.direction > 0 ? -normal : normal};
+        }
+        case SurfaceKind::field: {
+            const float tolerance = settings.march.epsilon * t * ray.direction.length();
+            const Pos3f point = ray.position + ray.direction * t;
+            const Vec3f normal = fields[surface.object].normal(point, tolerance);
+            return {point + normal * (FIELD_SURFACE_OFFSET * tolerance), normal};
+        }
+        default: {
+            const Sphere &sphere = spheres[surface.index];
+            const Vec3f direction = (ray.position + ray.direction * t - sphere.centre).unit();
+            return {sphere.centre + direction * sphere.radius, direction};
+        }
+    }
+}
+
+/*
+ * Return true iff any surface lies along the given ray within max_distance of its origin.
+ * Unlike raycast, this stops at the first blocker found rather than searching for the nearest.
+ */
+bool Scene::occluded(const Ray3f &ray, const float &max_distance) const {
+    // Work in units of the ray parameter rather than distance.
+    float t_max = max_distance / ray.direction.length();
+    if (sphere_arrays.empty()) {
+        for (const Sphere &sphere : spheres) {
+            if (sphere.occludes(ray, max_distance)) {
+                return true;
+            }
+        }
+    } else if (bvh.empty()) {
+        if (sphere_arrays.any(ray, 0, (uint32_t) sphere_arrays.size(), t_max)) {
+            return true;
+        }
+    } else {
+        bool blocked = false;
+        bvh.traverse(ray, t_max, [&](uint32_t first, uint32_t count, float &cutoff) {
+            blocked = sphere_arrays.any(ray, first, count, cutoff);
+            return blocked;
+        });
+        if (blocked) {
+            return true;
+        }
+    }
+
+    for (const Mesh &mesh : meshes) {
+        if (mesh.any(ray, t_max)) {
+            return true;
+        }
+    }
+
+    bool blocked = false;
+    instance_bvh.traverse(ray, t_max, [&](uint32_t first, uint32_t count, float &cutoff) {
+        for (uint32_t k = first; k < first + count && !blocked; k++) {
+            const Instance &instance = instances[instance_bvh.indices[k]];
+            blocked = prototypes[instance.prototype].any(instance.to_local.apply(ray), cutoff);
+        }
+        return blocked;
+    });
+    if (blocked) {
+        return true;
+    }
+
+    for (const DistanceField &field : fields) {
+        if (field.any(ray, t_max, settings.march)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The colour of a texture where the ray hit the surface. Spheres are mapped by longitude and latitude
+ * about their own y axis, with the mip level chosen from the size of the pixel's footprint on the sphere
+ * relative to the texels there. Other surfaces have no texture coordinates, so take the texture's mean colour.
+ */
+Vec3f Scene::texture_colour(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal,
+                            const uint32_t &texture) const {
+    Vec3f direction; // From the sphere's centre to the hit, in the sphere's own space.
+    float radius;    // In world units.
+    switch (surface.kind) {
+        case SurfaceKind::sphere:
+            direction = collision_normal.direction;
+            radius = spheres[surface.index].radius;
+            break;
+        case SurfaceKind::instance_sphere: {
+            const Instance &instance = instances[surface.object];
+            const Sphere &sphere = prototypes[instance.prototype].spheres[surface.index];
+            direction = (instance.to_local.apply(collision_normal.position) - sphere.centre).unit();
+            radius = sphere.radius * ray.direction.length() / instance.to_local.apply(ray.direction).length();
+            break;
+        }
+        default:
+            return textures.average(texture);
+    }
+    const float y = std::min(std::max(direction.y, -1.0f), 1.0f);
+    const float u = 0.5f + std::atan2(direction.z, direction.x) / (2 * PI);
+    const float v = std::acos(y) / PI;
+
+    // The footprint is a pixel's width at the hit's distance, stretched as the surface turns away.
+    const float cosine = std::abs(collision_normal.direction * ray.direction) / ray.direction.length();
+    const float footprint = distance(ray.position, collision_normal.position) * current_view().pixel_angle /
+                            std::max(cosine, TEXTURE_MIN_COSINE);
+    const float ring = std::max(std::sqrt(1 - y * y), 1e-3f);
+    const float across = footprint / (2 * PI * radius * ring) * (float) textures.width(texture);
+    const float down = footprint / (PI * radius) * (float) textures.height(texture);
+    return textures.sample(texture, u, v, std::max(across, down));
+}
+
+/*
+ * The material to shade a surface with: its own, with the diffuse colour scaled by its texture, if it has one,
+ * where the ray hit.
+ */
+Material Scene::surface_material(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal) const {
+    Material material = materials[material_index(surface)];
+    if (material.diffuse_texture != NO_TEXTURE) {
+        material.diffuse_colour = hadamard(material.diffuse_colour,
+                                           texture_colour(ray, surface, collision_normal, material.diffuse_texture));
+    }
+    return material;
+}
+
+/*
+ * Return the colour seen along the ray where it hits the given surface with the given collision normal.
+ * With settings.light_samples, the point is shaded from a random sample of the lights instead.
+ */
+Vec3f Scene::shade(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal) const {
+    const uint32_t m = material_index(surface);
+    Material textured;
+    const Material &material = materials[m].diffuse_texture == NO_TEXTURE
+                               ? materials[m] : (textured = surface_material(ray, surface, collision_normal));
+    if (settings.render_mode == RenderMode::full && settings.light_samples > 0 && light_tree.size() == lights.size()) {
+        return sampled_colour(ray, collision_normal, material, *this);
+    }
+
+    // Outside of a render, the kernels may not have been chosen yet.
+    const ShadingKernel kernel = kernel_mode_ == settings.render_mode && m < kernels_.size()
+                                 ? kernels_[m]
+                                 : shading_kernel(settings.render_mode, material.specular_path());
+    return kernel(ray, collision_normal, material, *this);
+}
+
+/*
+ * Choose each material's shading kernel for the current render mode, work out what shading needs to know
+ * about the viewport (see view_shading), and size the texture cache as the settings ask.
+ * Called at the start of every render, as materials may have changed.
+ */
+void Scene::prepare_shading(const Viewport &viewport) {
+    textures.set_capacity(settings.texture_cache_size);
+    kernel_mode_ = settings.render_mode;
+    kernels_.resize(materials.size());
+    for (size_t m = 0; m < materials.size(); m++) {
+        kernels_[m] = shading_kernel(kernel_mode_, materials[m].specular_path());
+    }
+    view_shading_ = view_shading(viewport);
+}
+
+/*
+ * The shading state of the view being rendered on the calling thread: that of the tile's view
+ * while several are rendered together, otherwise as of prepare_shading.
+ */
+const ViewShading &Scene::current_view() const {
+    return tile_view != nullptr ? *tile_view : view_shading_;
+}
+
+float Scene::depth_range() const {
+    return current_view().depth_range;
+}
+
+/*
+ * The size of the viewport's pixels for texture lookups, and in RenderMode::depth,
+ * the depth range seen from it: the distance to the farthest corner of the scene's bounds.
+ */
+ViewShading Scene::view_shading(const Viewport &viewport) const {
+    ViewShading view;
+    view.pixel_angle = viewport.x_comp / viewport.plane_distance;
+    if (settings.render_mode != RenderMode::depth) {
+        return view;
+    }
+    AABB bounds;
+    if (!bvh.empty()) {
+        bounds = bvh.nodes[0].bounds;
+    } else {
+        for (const auto &s : spheres) {
+            const Vec3f r(s.radius, s.radius, s.radius);
+            bounds.extend(AABB(s.centre - r, s.centre + r));
+        }
+    }
+    for (const Mesh &mesh : meshes) {
+        bounds.extend(mesh.bounds);
+    }
+    if (!instance_bvh.empty()) {
+        bounds.extend(instance_bvh.nodes[0].bounds);
+    }
+    for (const DistanceField &field : fields) {
+        bounds.extend(field.bounds());
+    }
+    const Pos3f &viewpoint = viewport.origin;
+    if (!bounds.empty()) {
+        const Vec3f far(std::max(std::abs(viewpoint.x - bounds.min.x), std::abs(viewpoint.x - bounds.max.x)),
+                        std::max(std::abs(viewpoint.y - bounds.min.y), std::abs(viewpoint.y - bounds.max.y)),
+                        std::max(std::abs(viewpoint.z - bounds.min.z), std::abs(viewpoint.z - bounds.max.z)));
+        view.depth_range = far.length();
+    }
+    return view;
+}
+
 /*
  * Return the colour of the ray if it collides with anything,
  * otherwise return the background colour.
+ * Additionally return the surface which was hit, which is no surface if there was none.
  */
-Vec3f Scene::surface_colour(const Ray3f &ray) {
-    Sphere *sphere_pointer;
+Vec3f Scene::trace(const Ray3f &ray, Surface &surface, SurfaceSample *sample) {
     Ray3f collision_normal;
-    if (raycast(ray, sphere_pointer, collision_normal)) {
-        return sphere_pointer->surface_colour(ray, collision_normal, *this);
-    };
+    STATS_ADD(primary_rays, 1);
+    surface = Surface();
+    if (raycast(ray, surface, collision_normal)) {
+        if (sample != nullptr) {
+            *sample = surface_sample(ray, surface, collision_normal);
+        }
+        return shade(ray, surface, collision_normal);
+    }
     return this->background_colour;
 }
 
+/*
+ * Where the ray hit the surface, for ambient occlusion.
+ */
+SurfaceSample Scene::surface_sample(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal) const {
+    SurfaceSample sample;
+    sample.position = collision_normal.position;
+    sample.normal = collision_normal.direction;
+    sample.ambient = hadamard(ambient_colour, surface_material(ray, surface, collision_normal).diffuse_colour);
+    sample.depth = distance(ray.position, collision_normal.position);
+    return sample;
+}
+
+/*
+ * Return the colour of the ray if it collides with anything,
+ * otherwise return the background colour.
+ */
+Vec3f Scene::surface_colour(const Ray3f &ray) {
+    Surface surface;
+    return trace(ray, surface);
+}
+
+/*
+ * Trace the packet of pixels whose top-left corner is (i0, j0) and shade them into out,
+ * which holds pixel (i0, j0) and has rows stride pixels apart.
+ * Pixels of the packet falling outside the image are left out.
+ * If samples is set, it receives where each pixel's ray hit, PACKET_WIDTH pixels to a row.
+ *
+ * The packet is traced through the spheres together, then marched through any distance fields four rays
+ * at a time; each ray then searches the meshes and instances on its own, no further than what it hit.
+ */
+void Scene::render_packet(const Viewport &viewport, const size_t &i0, const size_t &j0,
+                          const size_t &width, const size_t &height, Vec3f *out, const size_t &stride,
+                          SurfaceSample *samples) {
+    RayPacket packet(viewport.origin);
+    size_t lanes = 0;
+    for (size_t dj = 0; dj < PACKET_WIDTH && j0 + dj < height; dj++) {
+        for (size_t di = 0; di < PACKET_WIDTH && i0 + di < width; di++) {
+            packet.set_ray((int) (di + dj * PACKET_WIDTH), viewport.direction((float) (i0 + di), (float) (j0 + dj)));
+            lanes++;
+        }
+    }
+    packet.prepare();
+    STATS_ADD(primary_rays, lanes);
+
+    // Each pixel's ray, its nearest hit so far and the surface there, row by row.
+    Ray3f rays[PACKET_RAYS];
+    float t[PACKET_RAYS];
+    Surface surfaces[PACKET_RAYS];
+
+    // The packet's traversal and marching are shared out evenly between its pixels' costs.
+    Stats::begin_pixel();
+    trace_packet(bvh, sphere_arrays, packet);
+    size_t k = 0;
+    for (size_t dj = 0; dj < PACKET_WIDTH && j0 + dj < height; dj++) {
+        for (size_t di = 0; di < PACKET_WIDTH && i0 + di < width; di++) {
+            const int lane = (int) (di + dj * PACKET_WIDTH);
+            rays[k] = packet.ray(lane);
+            t[k] = packet.t[lane];
+            surfaces[k] = packet.hit[lane] != PACKET_NO_HIT ? Surface::sphere(sphere_arrays.index[packet.hit[lane]])
+                                                            : Surface();
+            k++;
+        }
+    }
+    if (!fields.empty()) {
+        intersect_fields(rays, t, surfaces, lanes);
+    }
+    const float shared = (float) Stats::work_since_mark() / (float) lanes;
+
+    k = 0;
+    for (size_t dj = 0; dj < PACKET_WIDTH && j0 + dj < height; dj++) {
+        for (size_t di = 0; di < PACKET_WIDTH && i0 + di < width; di++, k++) {
+            Vec3f &pixel = out[di + dj * stride];
+            Stats::begin_pixel();
+            if (!meshes.empty() || !instances.empty()) {
+                intersect_objects(rays[k], t[k], surfaces[k]);
+            }
+            if (!surfaces[k].hit()) {
+                pixel = background_colour;
+            } else {
+                const Ray3f collision_normal = surface_normal(rays[k], surfaces[k], t[k]);
+                pixel = shade(rays[k], surfaces[k], collision_normal);
+                if (samples != nullptr) {
+                    samples[di + dj * PACKET_WIDTH] = surface_sample(rays[k], surfaces[k], collision_normal);
+                }
+            }
+            Stats::end_pixel(i0 + di, j0 + dj, shared);
+        }
+    }
+}
+
+/*
+ * Render one tile of the image into out, which holds the tile's top-left pixel and has rows stride pixels apart.
+ *
+ * With settings.adaptive_sampling, the tile is sampled sparsely and interpolated.
+ * Otherwise, once the scene is finalised (or if it has distance fields but no spheres), primary rays are traced
+ * in packets unless settings.packet_tracing is off, and then with settings.ao_samples, the tile's ambient light
+ * is occluded (see AmbientOcclusion).
+ */
+void Scene::render_tile(const Viewport &viewport, const Tile &tile,
+                        const size_t &width, const size_t &height, Vec3f *out, const size_t &stride) {
+    if (settings.adaptive_sampling) {
+        AdaptiveSampler(*this, viewport, width, height).render_tile(tile, out, stride);
+        return;
+    }
+
+    const bool occlusion = settings.ao_samples > 0 && settings.render_mode != RenderMode::normals &&
+                           settings.render_mode != RenderMode::depth;
+    std::vector<SurfaceSample> samples(occlusion ? tile.width * tile.height : 0);
+    if (settings.packet_tracing && (!sphere_arrays.empty() || (spheres.empty() && !fields.empty()))) {
+        SurfaceSample packet_samples[PACKET_RAYS];
+        for (size_t j = tile.y; j < tile.y + tile.height; j += PACKET_WIDTH) {
+            for (size_t i = tile.x; i < tile.x + tile.width; i += PACKET_WIDTH) {
+                render_packet(viewport, i, j, width, height, out + (i - tile.x) + (j - tile.y) * stride, stride,
+                              occlusion ? packet_samples : nullptr);
+                if (!occlusion) {
+                    continue;
+                }
+                for (size_t dj = 0; dj < PACKET_WIDTH && j + dj < tile.y + tile.height; dj++) {
+                    for (size_t di = 0; di < PACKET_WIDTH && i + di < tile.x + tile.width; di++) {
+                        samples[(i + di - tile.x) + (j + dj - tile.y) * tile.width] =
+                                packet_samples[di + dj * PACKET_WIDTH];
+                        packet_samples[di + dj * PACKET_WIDTH] = SurfaceSample();
+                    }
+                }
+            }
+        }
+    } else {
+        for (size_t j = tile.y; j < tile.y + tile.height; j++) {
+            for (size_t i = tile.x; i < tile.x + tile.width; i++) {
+                Surface surface;
+                Stats::begin_pixel();
+                out[(i - tile.x) + (j - tile.y) * stride] =
+                        trace(viewport.ray(i, j), surface,
+                              occlusion ? &samples[(i - tile.x) + (j - tile.y) * tile.width] : nullptr);
+                Stats::end_pixel(i, j);
+            }
+        }
+    }
+
+    if (occlusion) {
+        AmbientOcclusion(*this).apply(tile, samples.data(), out, stride);
+    }
+}
+
+size_t Scene::tile_size() const {
+    return settings.packet_tile_size();
+}
+
+/*
+ * The scene's render threads, (re)started if settings.thread_count has changed since they were.
+ */
+TileScheduler &Scene::thread_pool() {
+    const size_t wanted = settings.thread_count == 0 ? std::max(1u, std::thread::hardware_concurrency())
+                                                     : settings.thread_count;
+    if (!scheduler || scheduler->thread_count() != wanted) {
+        scheduler.reset(new TileScheduler(wanted));
+    }
+    return *scheduler;
+}
+
+/*
+ * Make sure each of the given number of threads has room for at least the given number of pixels.
+ */
+void Scene::reserve_tile_scratch(const size_t &threads, const size_t &pixels) {
+    tile_scratch_.resize(std::max(tile_scratch_.size(), threads));
+    for (auto &scratch : tile_scratch_) {
+        if (scratch.size() < pixels) {
+            scratch.resize(pixels);
+        }
+    }
+}
+
 /*
  * Given a width, a height, and a buffer to render to,
  * fill the buffer with an image of the scene.
+ *
+ * The image is split into tiles which are spread across the scene's thread pool.
  */
 void Scene::render(const size_t &width, const size_t &height, std::vector<Vec3f> &framebuffer) {
-    const float x_fov_tan = std::tan(camera.fov / 2.0f);
-    const float y_fov_tan = x_fov_tan * (float) height / (float) width;
-    const float x_comp = 2.0f * camera.plane_distance * x_fov_tan / ((float) width - 1);
-    const float y_comp = -2.0f * camera.plane_distance * y_fov_tan / ((float) height - 1);
+    const Stats::Phase phase("render");
+    const Viewport viewport(camera, width, height);
+    prepare_shading(viewport);
+    const std::vector<Tile> tiles = TileScheduler::split(width, height, tile_size());
+    thread_pool().run(tiles, [&](const Tile &tile, const size_t &) {
+        const Stats::TileTimer timer;
+        Stats::begin_tile(nullptr, 0, 0, 0);
+        render_tile(viewport, tile, width, height, &framebuffer[tile.x + tile.y * width], width);
+    });
+}
 
-#pragma omp parallel for
-    for (ssize_t j = 0; j < height; j++) {
-        const float y = (j - height / 2.0f) * y_comp;
-        for (ssize_t i = 0; i < width; i++) {
-            const float x = (i - width / 2.0f) * x_comp;
-            Ray3f ray = Ray3f(camera.position, Vec3f(x, y, camera.plane_distance).unit());
-            framebuffer[i + j * width] = surface_colour(ray);
+/*
+ * Render an image of the scene, handing each tile to the sink as soon as it is finished.
+ *
+ * Only one tile's worth of pixels per thread is held at a time,
+ * so the image can be far larger than would fit in memory as floats.
+ *
+ * In instrumented builds, if cost_sink is set, it receives a heatmap of the work done for each pixel.
+ */
+void Scene::render(const size_t &width, const size_t &height, ImageSink &sink) {
+    const Stats::Phase phase("render");
+    const Viewport viewport(camera, width, height);
+    prepare_shading(viewport);
+    const size_t size = tile_size();
+    const std::vector<Tile> tiles = TileScheduler::split(width, height, size);
+    const bool record_cost = Stats::enabled && cost_sink != nullptr;
+
+    TileScheduler &pool = thread_pool();
+    reserve_tile_scratch(pool.thread_count(), size * size);
+    std::vector<std::vector<float>> cost(pool.thread_count(), std::vector<float>(record_cost ? size * size : 0));
+    pool.run(tiles, [&](const Tile &tile, const size_t &thread) {
+        const Stats::TileTimer timer;
+        Vec3f *pixels = tile_scratch_[thread].data();
+        if (record_cost) {
+            // Interpolated pixels of adaptively sampled tiles cost nothing.
+            std::fill(cost[thread].begin(), cost[thread].end(), 0.0f);
+            Stats::begin_tile(cost[thread].data(), tile.x, tile.y, tile.width);
+        } else {
+            Stats::begin_tile(nullptr, 0, 0, 0);
         }
-    }
+
+        render_tile(viewport, tile, width, height, pixels, tile.width);
+        sink.write_tile(tile, pixels, tile.width);
+
+        if (record_cost) {
+            for (size_t k = 0; k < tile.width * tile.height; k++) {
+                pixels[k] = Stats::heat_colour(cost[thread][k]);
+            }
+            cost_sink->write_tile(tile, pixels, tile.width);
+        }
+    });
 }
 
+/*
+ * Render several views of the scene into one image in a single parallel pass, with each view's pixels
+ * going to its region of the sink.
+ *
+ * The views are split into the same grid of tiles, and each task renders one tile of the grid in every view
+ * in turn, so that views of nearby points are shaded close together in time. Each view is shaded with its own
+ * depth range and pixel size.
+ *
+ * Only the row_count rows of the views starting at first_row are rendered; the first row should be
+ * a multiple of the tile size, so that packets and tiles line up with those of a whole render.
+ */
+void Scene::render(const std::vector<View> &views, ImageSink &sink, const size_t &first_row, const size_t &row_count) {
+    const Stats::Phase phase("render");
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<Viewport> viewports;
+    viewports.reserve(views.size());
+    for (const auto &view : views) {
+        viewports.emplace_back(view.camera, view.width, view.height);
+        width = std::max(width, view.width);
+        height = std::max(height, view.height);
+    }
+    if (!views.empty()) {
+        prepare_shading(viewports[0]);
+    }
+    std::vector<ViewShading> view_shadings;
+    view_shadings.reserve(viewports.size());
+    for (const auto &viewport : viewports) {
+        view_shadings.push_back(view_shading(viewport));
+    }
+    const size_t size = tile_size();
+    const size_t last_row = height - std::min(height, first_row) > row_count ? first_row + row_count : height;
+    // The views share one grid of tiles, and each task renders a tile of the grid in every view.
+    std::vector<Tile> tiles = TileScheduler::split(width, last_row - std::min(last_row, first_row), size);
+    for (Tile &tile : tiles) {
+        tile.y += first_row;
+    }
+    const bool record_cost = Stats::enabled && cost_sink != nullptr;
+
+    TileScheduler &pool = thread_pool();
+    reserve_tile_scratch(pool.thread_count(), size * size);
+    std::vector<std::vector<float>> cost(pool.thread_count(), std::vector<float>(record_cost ? size * size : 0));
+    pool.run(tiles, [&](const Tile &cell, const size_t &thread) {
+        const Stats::TileTimer timer;
+        Vec3f *pixels = tile_scratch_[thread].data();
+        for (size_t v = 0; v < views.size(); v++) {
+            const View &view = views[v];
+            if (cell.x >= view.width || cell.y >= view.height) {
+                continue;
+            }
+            const Tile tile(cell.x, cell.y, std::min(cell.width, view.width - cell.x),
+                            std::min(cell.height, view.height - cell.y));
+            if (record_cost) {
+                std::fill(cost[thread].begin(), cost[thread].end(), 0.0f);
+                Stats::begin_tile(cost[thread].data(), tile.x, tile.y, tile.width);
+            } else {
+                Stats::begin_tile(nullptr, 0, 0, 0);
+            }
+            const TileView shading(view_shadings[v]);
+            render_tile(viewports[v], tile, view.width, view.height, pixels, tile.width);
+            const Tile region(view.x + tile.x, view.y + tile.y, tile.width, tile.height);
+            sink.write_tile(region, pixels, tile.width);
 
+            if (record_cost) {
+                for (size_t k = 0; k < tile.width * tile.height; k++) {
+                    pixels[k] = Stats::heat_colour(cost[thread][k]);
+                }
+                cost_sink->write_tile(region, pixels, tile.width);
+            }
+        }
+    });
+}
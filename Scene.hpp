@@ -1,40 +1,327 @@
 #pragma once
 
+#include <deque>
 #include <forward_list>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "AmbientOcclusion.hpp"
+#include "BVH.hpp"
 #include "Camera.hpp"
+#include "DistanceField.hpp"
+#include "FlatArray.hpp"
 #include "Material.hpp"
 #include "Geometry.hpp"
 #include "Sphere.hpp"
+#include "SphereArrays.hpp"
+#include "ImageSink.hpp"
+#include "Instance.hpp"
 #include "Light.hpp"
+#include "LightTree.hpp"
+#include "MappedFile.hpp"
+#include "Mesh.hpp"
+#include "Packet.hpp"
+#include "RenderSettings.hpp"
+#include "Scheduler.hpp"
+#include "Shading.hpp"
+#include "Stats.hpp"
+#include "Texture.hpp"
 
 struct Sphere;
 
+/*
+ * Stable references to a scene's objects. Objects are never removed or reordered,
+ * so unlike pointers into the scene's arrays, handles stay valid as more objects are added,
+ * until the scene is cleared.
+ */
+struct SphereHandle {
+    uint32_t index;
+};
+
+struct LightHandle {
+    uint32_t index;
+};
+
+struct MaterialHandle {
+    uint32_t index;
+};
+
+struct MeshHandle {
+    uint32_t index;
+};
+
+struct PrototypeHandle {
+    uint32_t index;
+};
+
+struct InstanceHandle {
+    uint32_t index;
+};
+
+struct FieldHandle {
+    uint32_t index;
+};
+
+struct TextureHandle {
+    uint32_t index;
+};
+
+enum class SurfaceKind : uint32_t {
+    none,
+    sphere,          // One of the scene's own spheres.
+    triangle,        // A triangle of a mesh.
+    instance_sphere, // A sphere of an instance's prototype.
+    field            // A distance field.
+};
+
+/*
+ * The surface a ray hit. A default Surface is no surface, as for a ray which hit nothing.
+ */
+struct Surface {
+    SurfaceKind kind;
+    uint32_t object; // The mesh, instance or distance field; unused for the scene's own spheres.
+    uint32_t index;  // The sphere or triangle; unused for distance fields.
+
+    Surface()
+            : kind(SurfaceKind::none), object(0), index(0) {}
+
+    Surface(const SurfaceKind &k, const uint32_t &o, const uint32_t &i)
+            : kind(k), object(o), index(i) {}
+
+    static Surface sphere(const uint32_t &index) {
+        return {SurfaceKind::sphere, 0, index};
+    }
+
+    bool hit() const {
+        return kind != SurfaceKind::none;
+    }
+
+    // Whether both are on the same object: the same sphere, the same mesh or field, or nothing.
+    bool same_object(const Surface &other) const {
+        const bool spheres = kind == SurfaceKind::sphere || kind == SurfaceKind::instance_sphere;
+        return kind == other.kind && object == other.object && (!spheres || index == other.index);
+    }
+};
+
+/*
+ * One of several views of a scene rendered together, such as a stereo pair or the cells of a light field.
+ * The view's pixels go to a width x height region of the sink's image with its top-left corner at (x, y).
+ */
+struct View {
+    Camera camera;
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+
+    View(const Camera &c, const size_t &x_, const size_t &y_, const size_t &w, const size_t &h)
+            : camera(c), x(x_), y(y_), width(w), height(h) {}
+};
+
+/*
+ * What shading needs to know about the viewport being rendered, worked out by Scene::prepare_shading.
+ */
+struct ViewShading {
+    float depth_range; // The distance beyond which everything is black in RenderMode::depth.
+    float pixel_angle; // The angle a pixel spans, for choosing texture mip levels.
+
+    ViewShading()
+            : depth_range(0), pixel_angle(0) {}
+};
+
 struct Scene {
     Camera camera;
     Vec3f background_colour;
     Vec3f ambient_colour;
-    std::vector<Sphere *> spheres;
-    std::vector<Light *> lights;
+    FlatArray<Sphere> spheres;
+    FlatArray<uint32_t> sphere_materials; // Index into materials of each sphere's material.
+    FlatArray<Material> materials;        // Distinct materials only.
+    FlatArray<Light> lights;
+    std::vector<Mesh> meshes;
+    std::vector<uint32_t> mesh_materials; // Index into materials of each mesh's material.
+    std::deque<Prototype> prototypes; // A deque, as their arrays can't be moved.
+    std::vector<Instance> instances;
+    BVH instance_bvh; // Over the instances' bounds in world space, once the scene is finalised.
+    std::vector<DistanceField> fields;
+    std::vector<uint32_t> field_materials; // Index into materials of each distance field's material.
+    TextureCache textures;
+    LightTree light_tree;
+    BVH bvh;
+    SphereArrays sphere_arrays;
+    RenderSettings settings;
+    std::unique_ptr<TileScheduler> scheduler;
+    ImageSink *cost_sink; // Receives per-pixel cost heatmaps in instrumented builds; may be null.
+    std::unique_ptr<MappedFile> mapping; // The scene file the arrays refer into, if the scene was loaded from one.
 
     Scene(const Camera &c, const Vec3f &b, const Vec3f &a)
-            : camera(c), background_colour(b), ambient_colour(a), spheres(), lights() {}
+            : camera(c), background_colour(b), ambient_colour(a), spheres(), sphere_materials(), materials(),
+              lights(), meshes(), mesh_materials(), prototypes(), instances(), instance_bvh(), fields(),
+              field_materials(), textures(), light_tree(), bvh(),
+              sphere_arrays(), settings(), scheduler(), cost_sink(nullptr), mapping(),
+              material_lookup_(), materials_indexed_(0), tile_scratch_(), kernels_(), kernel_mode_(RenderMode::full),
+              view_shading_() {}
 
     ~Scene() {
         clear();
     }
 
-    void add_sphere(const Pos3f &position, const float &radius, const Material &material);
+    MaterialHandle add_material(const Material &material);
+
+    SphereHandle add_sphere(const Pos3f &position, const float &radius, const MaterialHandle &material);
+
+    SphereHandle add_sphere(const Pos3f &position, const float &radius, const Material &material);
+
+    LightHandle add_light(const Pos3f &position, const Vec3f &colour, const float &brightness);
+
+    MeshHandle add_mesh(Mesh &&mesh, const MaterialHandle &material);
+
+    PrototypeHandle add_prototype();
+
+    void add_sphere(const PrototypeHandle &prototype, const Pos3f &position, const float &radius,
+                    const MaterialHandle &material);
+
+    InstanceHandle add_instance(const PrototypeHandle &prototype, const Transform &placement);
+
+    FieldHandle add_field(const DistanceField &field, const MaterialHandle &material);
+
+    bool load_texture(const std::string &path, TextureHandle &texture);
+
+    const Sphere &sphere(const SphereHandle &handle) const {
+        return spheres[handle.index];
+    }
+
+    const Material &material(const MaterialHandle &handle) const {
+        return materials[handle.index];
+    }
+
+    const Light &light(const LightHandle &handle) const {
+        return lights[handle.index];
+    }
+
+    const Material &material_of(const SphereHandle &handle) const {
+        return materials[sphere_materials[handle.index]];
+    }
+
+    uint32_t material_index(const Surface &surface) const {
+        switch (surface.kind) {
+            case SurfaceKind::triangle:
+                return mesh_materials[surface.object];
+            case SurfaceKind::instance_sphere:
+                return prototypes[instances[surface.object].prototype].sphere_materials[surface.index];
+            case SurfaceKind::field:
+                return field_materials[surface.object];
+            default:
+                return sphere_materials[surface.index];
+        }
+    }
+
+    const Material &material_of(const Surface &surface) const {
+        return materials[material_index(surface)];
+    }
+
+    void set_material(const SphereHandle &sphere, const MaterialHandle &material);
 
-    void add_light(const Pos3f &position, const Vec3f &colour, const float &brightness);
+    void set_diffuse_texture(const MaterialHandle &material, const TextureHandle &texture);
+
+    void move_sphere(const SphereHandle &sphere, const Pos3f &centre, const float &radius);
+
+    void move_light(const LightHandle &light, const Pos3f &position);
 
     void clear();
 
-    bool raycast(const Ray3f &ray, Sphere *&sphere_pointer, Ray3f &collision_normal) const;
+    void finalise(const bool &build_bvh = true);
+
+    void refit();
+
+    size_t memory_size() const;
+
+    bool intersect(const Ray3f &ray, float &t, Surface &surface) const;
+
+    bool intersect_objects(const Ray3f &ray, float &t, Surface &surface) const;
+
+    bool intersect_fields(const Ray3f *rays, float *t, Surface *surfaces, const size_t &count) const;
+
+    bool raycast(const Ray3f &ray, Surface &surface, Ray3f &collision_normal) const;
+
+    /*
+     * Call visitor(l) for each light l that may light the point: every light, or with a light cutoff,
+     * only those which could cast at least that much illumination on it (once the light tree is built).
+     */
+    template<typename Visitor>
+    void for_each_light(const Pos3f &point, Visitor visitor) const {
+        if (settings.light_cutoff > 0 && light_tree.size() == lights.size()) {
+            light_tree.visit(point, settings.light_cutoff, visitor);
+            return;
+        }
+        for (uint32_t l = 0; l < lights.size(); l++) {
+            visitor(l);
+        }
+    }
+
+    bool occluded(const Ray3f &ray, const float &max_distance) const;
+
+    Ray3f surface_normal(const Ray3f &ray, const Surface &surface, const float &t) const;
+
+    void prepare_shading(const Viewport &viewport);
+
+    // The distance beyond which everything is black in RenderMode::depth, for the view being rendered.
+    float depth_range() const;
+
+    Material surface_material(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal) const;
+
+    Vec3f shade(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal) const;
+
+    Vec3f trace(const Ray3f &ray, Surface &surface, SurfaceSample *sample = nullptr);
 
     Vec3f surface_colour(const Ray3f &ray);
 
+    void render_packet(const Viewport &viewport, const size_t &i0, const size_t &j0,
+                       const size_t &width, const size_t &height, Vec3f *out, const size_t &stride,
+                       SurfaceSample *samples = nullptr);
+
+    void render_tile(const Viewport &viewport, const Tile &tile,
+                     const size_t &width, const size_t &height, Vec3f *out, const size_t &stride);
+
+    size_t tile_size() const;
+
+    TileScheduler &thread_pool();
+
     void render(const size_t &width, const size_t &height, std::vector<Vec3f> &framebuffer);
+
+    void render(const size_t &width, const size_t &height, ImageSink &sink);
+
+    void render(const std::vector<View> &views, ImageSink &sink, const size_t &first_row = 0,
+                const size_t &row_count = std::numeric_limits<size_t>::max());
+
+private:
+
+    // Finds existing materials by value. Only the first materials_indexed_ materials are in it; the rest,
+    // such as those of a scene loaded from a file, are added by the next add_material.
+    std::unordered_map<Material, uint32_t, MaterialHash> material_lookup_;
+    size_t materials_indexed_;
+
+    // Each render thread's tile of pixels, kept between frames.
+    std::vector<std::vector<Vec3f>> tile_scratch_;
+
+    // The shading kernel for each material in kernel_mode_, chosen by prepare_shading.
+    std::vector<ShadingKernel> kernels_;
+    RenderMode kernel_mode_;
+    ViewShading view_shading_; // As of prepare_shading, for renders of a single view.
+
+    ViewShading view_shading(const Viewport &viewport) const;
+
+    const ViewShading &current_view() const;
+
+    void reserve_tile_scratch(const size_t &threads, const size_t &pixels);
+
+    void build_instance_bvh();
+
+    SurfaceSample surface_sample(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal) const;
+
+    Vec3f texture_colour(const Ray3f &ray, const Surface &surface, const Ray3f &collision_normal,
+                         const uint32_t &texture) const;
 };
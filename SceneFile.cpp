@@ -0,0 +1,223 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "MappedFile.hpp"
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+
+static_assert(std::is_trivially_copyable<Material>::value, "Materials are stored in scene files as raw bytes");
+static_assert(std::is_trivially_copyable<Sphere>::value, "Spheres are stored in scene files as raw bytes");
+static_assert(sizeof(Sphere) == 16, "Sphere records should pack into 16 bytes");
+static_assert(std::is_trivially_copyable<Light>::value, "Lights are stored in scene files as raw bytes");
+static_assert(std::is_trivially_copyable<BVHNode>::value, "BVH nodes are stored in scene files as raw bytes");
+
+namespace {
+
+uint64_t align(const uint64_t &offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+/*
+ * Point data at the given section of the file, which must hold its elements
+ * and padding more zeroed elements after them. Returns false if the section doesn't fit.
+ */
+template<typename T>
+bool map_section(const MappedFile &file, const SceneFileSection &section, const size_t &padding, const T *&data) {
+    if (section.count == 0 && padding == 0) {
+        data = nullptr;
+        return true;
+    }
+    if (section.offset > file.size() || section.offset % alignof(T) != 0 ||
+        section.count + padding > (file.size() - section.offset) / sizeof(T)) {
+        return false;
+    }
+    data = (const T *) (file.data() + section.offset);
+    return true;
+}
+
+/*
+ * The sections of a scene file being written, laid out one after another.
+ */
+struct SectionWriter {
+    struct Block {
+        const void *data;
+        size_t bytes;
+    };
+
+    uint64_t end;
+    std::vector<Block> blocks;
+
+    SectionWriter()
+            : end(align(sizeof(SceneFileHeader))), blocks() {}
+
+    // Add count elements (plus any padding elements, which must follow them in memory) as the next section.
+    template<typename T>
+    void add(SceneFileSection &section, const T *data, const size_t &count, const size_t &padding = 0) {
+        section.offset = count > 0 ? end : 0;
+        section.count = count;
+        if (count == 0) {
+            return;
+        }
+        blocks.push_back({data, (count + padding) * sizeof(T)});
+        end = align(end + blocks.back().bytes);
+    }
+
+    bool write(std::ofstream &out, const SceneFileHeader &header) const {
+        static const char zeros[SCENE_FILE_ALIGNMENT] = {};
+        out.write((const char *) &header, sizeof(header));
+        uint64_t position = sizeof(header);
+        for (const auto &block : blocks) {
+            out.write(zeros, (std::streamsize) (align(position) - position));
+            out.write((const char *) block.data, (std::streamsize) block.bytes);
+            position = align(position) + block.bytes;
+        }
+        return (bool) out;
+    }
+};
+
+}
+
+/*
+ * Load a scene from a binary scene file. Its arrays are used in place from a mapping of the file,
+ * which the scene keeps open. A BVH is built only if the file doesn't contain one; the light tree is always built.
+ * On failure the error is reported and null is returned.
+ */
+Scene *load_scene(const std::string &path) {
+    std::unique_ptr<MappedFile> file(new MappedFile(path));
+    if (!file->ok()) {
+        return nullptr;
+    }
+
+    SceneFileHeader header;
+    if (file->size() < sizeof(header)) {
+        std::cerr << path << " is not a scene file\n";
+        return nullptr;
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << path << " is not a scene file\n";
+        return nullptr;
+    }
+    if (header.version != SCENE_FILE_VERSION || header.header_size != sizeof(header)) {
+        std::cerr << path << " is scene file version " << header.version
+                  << ", but only version " << SCENE_FILE_VERSION << " is supported\n";
+        return nullptr;
+    }
+
+    const uint64_t sphere_count = header.spheres.count;
+    const bool has_bvh = header.bvh_nodes.count > 0;
+    const Material *materials = nullptr;
+    const Sphere *spheres = nullptr;
+    const uint32_t *sphere_materials = nullptr;
+    const Light *lights = nullptr;
+    const BVHNode *nodes = nullptr;
+    const uint32_t *indices = nullptr;
+    const float *x = nullptr, *y = nullptr, *z = nullptr, *radius = nullptr;
+    bool valid = map_section(*file, header.materials, 0, materials) &&
+                 map_section(*file, header.spheres, 0, spheres) &&
+                 header.sphere_materials.count == sphere_count &&
+                 map_section(*file, header.sphere_materials, 0, sphere_materials) &&
+                 map_section(*file, header.lights, 0, lights);
+    if (valid && has_bvh) {
+        valid = header.bvh_indices.count == sphere_count && header.arrays_x.count == sphere_count &&
+                header.arrays_y.count == sphere_count && header.arrays_z.count == sphere_count &&
+                header.arrays_radius.count == sphere_count &&
+                map_section(*file, header.bvh_nodes, 0, nodes) &&
+                map_section(*file, header.bvh_indices, 0, indices) &&
+                map_section(*file, header.arrays_x, SPHERE_ARRAYS_PADDING, x) &&
+                map_section(*file, header.arrays_y, SPHERE_ARRAYS_PADDING, y) &&
+                map_section(*file, header.arrays_z, SPHERE_ARRAYS_PADDING, z) &&
+                map_section(*file, header.arrays_radius, SPHERE_ARRAYS_PADDING, radius);
+    }
+    if (!valid) {
+        std::cerr << path << " is truncated or corrupt\n";
+        return nullptr;
+    }
+
+    const Camera camera(Pos3f(header.camera_position[0], header.camera_position[1], header.camera_position[2]),
+                        Vec3f(header.camera_orientation[0], header.camera_orientation[1], header.camera_orientation[2]),
+                        header.camera_fov, header.camera_plane_distance);
+    auto scene = new Scene(camera,
+                           Vec3f(header.background_colour[0], header.background_colour[1], header.background_colour[2]),
+                           Vec3f(header.ambient_colour[0], header.ambient_colour[1], header.ambient_colour[2]));
+    scene->materials.refer(materials, header.materials.count);
+    scene->spheres.refer(spheres, sphere_count);
+    scene->sphere_materials.refer(sphere_materials, sphere_count);
+    scene->lights.refer(lights, header.lights.count);
+
+    if (has_bvh) {
+        scene->bvh.nodes.refer(nodes, header.bvh_nodes.count);
+        scene->bvh.indices.refer(indices, sphere_count);
+        scene->bvh.build_stats.primitive_count = sphere_count;
+        scene->bvh.build_stats.node_count = header.bvh_nodes.count;
+        scene->bvh.build_stats.prebuilt = true;
+        scene->sphere_arrays.x.refer(x, sphere_count);
+        scene->sphere_arrays.y.refer(y, sphere_count);
+        scene->sphere_arrays.z.refer(z, sphere_count);
+        scene->sphere_arrays.radius.refer(radius, sphere_count);
+        scene->sphere_arrays.index.refer(indices, sphere_count);
+    }
+    scene->mapping = std::move(file);
+
+    if (has_bvh) {
+        scene->light_tree.build(scene->lights);
+    } else {
+        scene->finalise();
+    }
+    return scene;
+}
+
+/*
+ * Write a scene to a binary scene file, including its BVH and sphere arrays if it has been finalised with one.
+ * Scene files hold only spheres and untextured materials, so scenes with meshes, instances, distance fields
+ * or textures can't be saved.
+ * On failure the error is reported and false is returned.
+ */
+bool save_scene(const Scene &scene, const std::string &path) {
+    if (!scene.meshes.empty() || !scene.instances.empty() || !scene.fields.empty() || scene.textures.size() > 0) {
+        std::cerr << "Scenes with meshes, instances, distance fields or textures can't be saved to scene files\n";
+        return false;
+    }
+
+    SceneFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_FILE_VERSION;
+    header.header_size = sizeof(header);
+
+    for (int axis = 0; axis < 3; axis++) {
+        header.camera_position[axis] = scene.camera.position[axis];
+        header.camera_orientation[axis] = scene.camera.orientation[axis];
+        header.background_colour[axis] = scene.background_colour[axis];
+        header.ambient_colour[axis] = scene.ambient_colour[axis];
+    }
+    header.camera_fov = scene.camera.fov;
+    header.camera_plane_distance = scene.camera.plane_distance;
+
+    SectionWriter sections;
+    sections.add(header.materials, scene.materials.data(), scene.materials.size());
+    sections.add(header.spheres, scene.spheres.data(), scene.spheres.size());
+    sections.add(header.sphere_materials, scene.sphere_materials.data(), scene.sphere_materials.size());
+    sections.add(header.lights, scene.lights.data(), scene.lights.size());
+
+    const SphereArrays &arrays = scene.sphere_arrays;
+    if (!scene.bvh.empty() && arrays.size() == scene.spheres.size()) {
+        sections.add(header.bvh_nodes, scene.bvh.nodes.data(), scene.bvh.nodes.size());
+        sections.add(header.bvh_indices, scene.bvh.indices.data(), scene.bvh.indices.size());
+        sections.add(header.arrays_x, arrays.x.data(), arrays.size(), SPHERE_ARRAYS_PADDING);
+        sections.add(header.arrays_y, arrays.y.data(), arrays.size(), SPHERE_ARRAYS_PADDING);
+        sections.add(header.arrays_z, arrays.z.data(), arrays.size(), SPHERE_ARRAYS_PADDING);
+        sections.add(header.arrays_radius, arrays.radius.data(), arrays.size(), SPHERE_ARRAYS_PADDING);
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out || !sections.write(out, header)) {
+        std::cerr << "Could not write " << path << "\n";
+        return false;
+    }
+    return true;
+}
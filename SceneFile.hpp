@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+struct Scene;
+
+// The first eight bytes of every scene file.
+#define SCENE_FILE_MAGIC "RAYSCENE"
+
+// Bumped whenever the layout of the file or of any type stored in it changes.
+#define SCENE_FILE_VERSION 3
+
+// Every section starts at a multiple of this many bytes from the start of the file.
+#define SCENE_FILE_ALIGNMENT 64
+
+/*
+ * A run of count elements starting offset bytes into the file.
+ */
+struct SceneFileSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+/*
+ * Binary scene files hold a header followed by sections which are raw arrays of the types
+ * the renderer uses in memory (Material, Sphere, the spheres' material indices, Light, BVHNode
+ * and the sphere arrays), so that a loaded scene can refer to the mapped file directly,
+ * without parsing or allocating anything per object.
+ *
+ * The acceleration sections (BVH nodes and indices, and the sphere arrays in leaf order,
+ * each followed by SPHERE_ARRAYS_PADDING zeros) are empty if the scene was saved without a BVH;
+ * one is then built on loading.
+ *
+ * Files are in the byte order of the machine that wrote them, and are trusted:
+ * the loader checks that sections lie within the file, but not the values in them.
+ */
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+
+    float camera_position[3];
+    float camera_orientation[3];
+    float camera_fov;
+    float camera_plane_distance;
+    float background_colour[3];
+    float ambient_colour[3];
+
+    SceneFileSection materials;
+    SceneFileSection spheres;
+    SceneFileSection sphere_materials;
+    SceneFileSection lights;
+
+    SceneFileSection bvh_nodes;
+    SceneFileSection bvh_indices;
+    SceneFileSection arrays_x;
+    SceneFileSection arrays_y;
+    SceneFileSection arrays_z;
+    SceneFileSection arrays_radius;
+};
+
+Scene *load_scene(const std::string &path);
+
+bool save_scene(const Scene &scene, const std::string &path);
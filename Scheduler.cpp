@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <chrono>
+
+#include "Scheduler.hpp"
+
+/*
+ * Start the pool. A thread count of zero uses one thread per hardware thread.
+ */
+TileScheduler::TileScheduler(const size_t &thread_count)
+        : workers_(), threads_(), mutex_(), start_(), done_(), generation_(0), running_(0), stopping_(false),
+          tiles_(nullptr), task_(nullptr), wall_ms_(0) {
+    size_t count = thread_count;
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        workers_.emplace_back(new Worker());
+    }
+    for (size_t i = 1; i < count; i++) {
+        threads_.emplace_back(&TileScheduler::thread_main, this, i);
+    }
+}
+
+TileScheduler::~TileScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    start_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+/*
+ * Worker threads sleep until a run starts, help with it, then report back.
+ */
+void TileScheduler::thread_main(const size_t &index) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+            if (stopping_) {
+                return;
+            }
+            seen = generation_;
+        }
+
+        work(index);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_--;
+        }
+        done_.notify_all();
+    }
+}
+
+/*
+ * Pop the next tile from this thread's own deque, or failing that steal one from the back
+ * of another thread's. Returns false once there is nothing left anywhere.
+ */
+bool TileScheduler::take(const size_t &index, uint32_t &tile) {
+    Worker &self = *workers_[index];
+    {
+        std::lock_guard<std::mutex> lock(self.mutex);
+        if (!self.tiles.empty()) {
+            tile = self.tiles.front();
+            self.tiles.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t offset = 1; offset < workers_.size(); offset++) {
+        Worker &victim = *workers_[(index + offset) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            self.steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Process tiles until none remain, recording how long this thread spent on them.
+ */
+void TileScheduler::work(const size_t &index) {
+    Worker &self = *workers_[index];
+    uint32_t tile;
+    while (take(index, tile)) {
+        const auto start = std::chrono::steady_clock::now();
+        (*task_)((*tiles_)[tile], index);
+        self.busy_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        self.tiles_done++;
+    }
+}
+
+/*
+ * Call task once for each tile, spread over the pool, and return when all calls have finished.
+ * The task is told which thread is running it, for per-thread scratch space.
+ */
+void TileScheduler::run(const std::vector<Tile> &tiles, const Task &task) {
+    const auto start = std::chrono::steady_clock::now();
+
+    // Deal the tiles out in contiguous runs, so each thread starts on a compact region.
+    const size_t count = workers_.size();
+    for (size_t i = 0; i < count; i++) {
+        Worker &worker = *workers_[i];
+        worker.tiles.clear();
+        worker.busy_ms = 0;
+        worker.tiles_done = 0;
+        worker.steals = 0;
+        for (size_t t = tiles.size() * i / count; t < tiles.size() * (i + 1) / count; t++) {
+            worker.tiles.push_back((uint32_t) t);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tiles_ = &tiles;
+        task_ = &task;
+        running_ = threads_.size();
+        generation_++;
+    }
+    start_.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&] { return running_ == 0; });
+    tiles_ = nullptr;
+    task_ = nullptr;
+    wall_ms_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Print, for the last run, how much of the wall time each thread spent rendering.
+ */
+void TileScheduler::report(std::ostream &out) const {
+    out << "Scheduler: " << workers_.size() << " threads, " << wall_ms_ << " ms\n";
+    for (size_t i = 0; i < workers_.size(); i++) {
+        const Worker &worker = *workers_[i];
+        const double utilisation = wall_ms_ > 0 ? 100.0 * worker.busy_ms / wall_ms_ : 0;
+        out << "  thread " << i << ": " << worker.tiles_done << " tiles ("
+            << worker.steals << " stolen), " << utilisation << "% busy\n";
+    }
+}
+
+namespace {
+
+/*
+ * Spread the lower 16 bits of v out to the even bits of the result.
+ */
+uint32_t spread_bits(uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+uint32_t morton_code(const size_t &x, const size_t &y) {
+    return spread_bits((uint32_t) x) | (spread_bits((uint32_t) y) << 1);
+}
+
+}
+
+/*
+ * Cut a width x height image into tiles of at most tile_size pixels per side,
+ * listed in Morton (Z-curve) order so that consecutive tiles are near each other.
+ */
+std::vector<Tile> TileScheduler::split(const size_t &width, const size_t &height, const size_t &tile_size) {
+    const size_t columns = (width + tile_size - 1) / tile_size;
+    const size_t rows = (height + tile_size - 1) / tile_size;
+
+    std::vector<std::pair<uint32_t, Tile>> coded;
+    coded.reserve(columns * rows);
+    for (size_t ty = 0; ty < rows; ty++) {
+        for (size_t tx = 0; tx < columns; tx++) {
+            const size_t x = tx * tile_size;
+            const size_t y = ty * tile_size;
+            coded.emplace_back(morton_code(tx, ty),
+                               Tile(x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)));
+        }
+    }
+    std::stable_sort(coded.begin(), coded.end(), [](const std::pair<uint32_t, Tile> &a,
+                                                    const std::pair<uint32_t, Tile> &b) {
+        return a.first < b.first;
+    });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(coded.size());
+    for (const auto &entry : coded) {
+        tiles.push_back(entry.second);
+    }
+    return tiles;
+}
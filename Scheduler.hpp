@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Tile {
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+
+    Tile()
+            : x(0), y(0), width(0), height(0) {}
+
+    Tile(const size_t &x0, const size_t &y0, const size_t &w, const size_t &h)
+            : x(x0), y(y0), width(w), height(h) {}
+};
+
+/*
+ * A fixed pool of threads which render lists of tiles.
+ *
+ * Each run deals the tiles out to per-thread deques in contiguous runs of a Morton-ordered list,
+ * so that each thread works through a compact region of the image. A thread that empties its
+ * own deque steals from the far end of another's.
+ *
+ * The calling thread takes part as thread 0, so a pool of one thread spawns nothing.
+ */
+struct TileScheduler {
+    typedef std::function<void(const Tile &tile, const size_t &thread)> Task;
+
+    explicit TileScheduler(const size_t &thread_count = 0);
+
+    ~TileScheduler();
+
+    TileScheduler(const TileScheduler &) = delete;
+
+    TileScheduler &operator=(const TileScheduler &) = delete;
+
+    size_t thread_count() const {
+        return workers_.size();
+    }
+
+    void run(const std::vector<Tile> &tiles, const Task &task);
+
+    void report(std::ostream &out) const;
+
+    static std::vector<Tile> split(const size_t &width, const size_t &height, const size_t &tile_size);
+
+private:
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<uint32_t> tiles;
+        double busy_ms;
+        size_t tiles_done;
+        size_t steals;
+
+        Worker()
+                : mutex(), tiles(), busy_ms(0), tiles_done(0), steals(0) {}
+    };
+
+    void thread_main(const size_t &index);
+
+    void work(const size_t &index);
+
+    bool take(const size_t &index, uint32_t &tile);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    uint64_t generation_;
+    size_t running_;
+    bool stopping_;
+
+    const std::vector<Tile> *tiles_;
+    const Task *task_;
+    double wall_ms_;
+};
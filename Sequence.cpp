@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "BVH.hpp"
+#include "constants.hpp"
+#include "Sequence.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+bool read_pos(std::istringstream &in, Pos3f &p) {
+    return (bool) (in >> p.x >> p.y >> p.z);
+}
+
+}
+
+/*
+ * Make the update's changes to the scene, and bring its acceleration structures up to date.
+ */
+void FrameUpdate::apply(Scene &scene) const {
+    if (move_camera) {
+        scene.camera = camera;
+    }
+    for (const auto &sphere : spheres) {
+        scene.move_sphere(sphere.first, sphere.second.centre, sphere.second.radius);
+    }
+    for (const auto &light : lights) {
+        scene.move_light(light.first, light.second);
+    }
+    if (!spheres.empty() || !lights.empty()) {
+        scene.refit();
+    }
+}
+
+Turntable::Turntable(const Scene &scene, const size_t &frames)
+        : frames_(frames), frame_(0), centre_(0, 0, 0), spheres_(scene.spheres.begin(), scene.spheres.end()),
+          lights_() {
+    AABB bounds;
+    for (const auto &sphere : spheres_) {
+        bounds.extend(sphere.centre);
+    }
+    if (!bounds.empty()) {
+        centre_ = bounds.centroid();
+    }
+    for (const auto &light : scene.lights) {
+        lights_.push_back(light.position);
+    }
+}
+
+bool Turntable::next(const Scene &, FrameUpdate &update) {
+    if (frame_ >= frames_) {
+        return false;
+    }
+    const float angle = 2 * PI * (float) frame_ / (float) frames_;
+    const float c = std::cos(angle);
+    const float s = std::sin(angle);
+    const auto spin = [&](const Pos3f &p) {
+        const Vec3f r = p - centre_;
+        return centre_ + Vec3f(c * r.x + s * r.z, r.y, c * r.z - s * r.x);
+    };
+
+    update.spheres.reserve(spheres_.size());
+    for (size_t i = 0; i < spheres_.size(); i++) {
+        update.spheres.emplace_back(SphereHandle{(uint32_t) i}, Sphere(spin(spheres_[i].centre), spheres_[i].radius));
+    }
+    update.lights.reserve(lights_.size());
+    for (size_t i = 0; i < lights_.size(); i++) {
+        update.lights.emplace_back(LightHandle{(uint32_t) i}, spin(lights_[i]));
+    }
+    frame_++;
+    return true;
+}
+
+SequenceFile::SequenceFile(const std::string &path)
+        : path_(path), file_(path), line_number_(0), ok_(true) {
+    if (!file_) {
+        std::cerr << "Could not open " << path << "\n";
+        ok_ = false;
+    }
+}
+
+bool SequenceFile::next(const Scene &scene, FrameUpdate &update) {
+    std::string line;
+    while (ok_ && std::getline(file_, line)) {
+        line_number_++;
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        std::istringstream in(line);
+        std::string directive;
+        if (!(in >> directive)) {
+            continue;
+        }
+
+        bool ok;
+        size_t index = 0;
+        if (directive == "frame") {
+            ok = true;
+        } else if (directive == "camera") {
+            // The orientation is optional, so keep whatever the camera had if it's missing.
+            Camera camera = update.move_camera ? update.camera : scene.camera;
+            ok = read_pos(in, camera.position);
+            Vec3f orientation;
+            if (ok && in >> orientation.x) {
+                ok = (bool) (in >> orientation.y >> orientation.z);
+                camera.orientation = orientation;
+            } else {
+                in.clear();
+            }
+            update.move_camera = ok;
+            update.camera = camera;
+        } else if (directive == "sphere") {
+            Pos3f centre;
+            ok = (in >> index) && index < scene.spheres.size() && read_pos(in, centre);
+            if (ok) {
+                float radius;
+                if (!(in >> radius)) {
+                    radius = scene.spheres[index].radius;
+                    in.clear();
+                }
+                update.spheres.emplace_back(SphereHandle{(uint32_t) index}, Sphere(centre, radius));
+            }
+        } else if (directive == "light") {
+            Pos3f position;
+            ok = (in >> index) && index < scene.lights.size() && read_pos(in, position);
+            if (ok) {
+                update.lights.emplace_back(LightHandle{(uint32_t) index}, position);
+            }
+        } else {
+            std::cerr << path_ << ":" << line_number_ << ": unknown directive " << directive << "\n";
+            ok_ = false;
+            return false;
+        }
+
+        std::string extra;
+        if (!ok || in >> extra) {
+            std::cerr << path_ << ":" << line_number_ << ": malformed " << directive << "\n";
+            ok_ = false;
+            return false;
+        }
+        if (directive == "frame") {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string PPMSequence::path(const size_t &frame) const {
+    const size_t first = pattern_.find('#');
+    if (first == std::string::npos) {
+        const size_t dot = pattern_.rfind('.');
+        const size_t slash = pattern_.rfind('/');
+        const size_t at = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? pattern_.size() : dot;
+        return pattern_.substr(0, at) + "_" + std::to_string(frame) + pattern_.substr(at);
+    }
+    const size_t last = pattern_.find_first_not_of('#', first);
+    const size_t width = (last == std::string::npos ? pattern_.size() : last) - first;
+    std::string number = std::to_string(frame);
+    if (number.size() < width) {
+        number.insert(0, width - number.size(), '0');
+    }
+    return pattern_.substr(0, first) + number + pattern_.substr(first + width);
+}
+
+ImageSink *PPMSequence::begin_frame(const size_t &frame) {
+    file_.reset(new PPMFile(path(frame), width_, height_, post_));
+    if (!file_->ok()) {
+        file_.reset();
+    }
+    return file_.get();
+}
+
+/*
+ * Unmap the frame's file, leaving the kernel to write it back.
+ */
+bool PPMSequence::end_frame() {
+    file_.reset();
+    return true;
+}
+
+PPMStream::PPMStream(const int &fd, const size_t &width, const size_t &height, const PostProcess &post)
+        : fd_(fd), width_(width), post_(post), header_size_(0), back_(), front_(), mutex_(), ready_(), written_(),
+          pending_(false), stopping_(false), failed_(false), writer_() {
+    const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n" +
+                               std::to_string(post.max_value()) + "\n";
+    header_size_ = header.size();
+    back_.resize(header_size_ + width * height * 3 * post.channel_bytes());
+    std::copy(header.begin(), header.end(), back_.begin());
+    front_ = back_;
+    writer_ = std::thread(&PPMStream::write_frames, this);
+}
+
+/*
+ * Wait for the last frame to be written.
+ */
+PPMStream::~PPMStream() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_one();
+    writer_.join();
+}
+
+ImageSink *PPMStream::begin_frame(const size_t &) {
+    return this;
+}
+
+/*
+ * Hand the finished frame to the writer, once it has finished with the previous one.
+ */
+bool PPMStream::end_frame() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    written_.wait(lock, [&] { return !pending_; });
+    if (failed_) {
+        return false;
+    }
+    std::swap(back_, front_);
+    pending_ = true;
+    lock.unlock();
+    ready_.notify_one();
+    return true;
+}
+
+void PPMStream::write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) {
+    quantise_tile(tile, pixels, stride, back_.data() + header_size_, width_, post_);
+}
+
+void PPMStream::write_frames() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        ready_.wait(lock, [&] { return pending_ || stopping_; });
+        if (!pending_) {
+            return;
+        }
+
+        // front_ is only swapped while no frame is pending, so it can be written without the lock.
+        lock.unlock();
+        const uint8_t *data = front_.data();
+        size_t remaining = front_.size();
+        bool failed = false;
+        while (remaining > 0) {
+            const ssize_t written = write(fd_, data, remaining);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                std::cerr << "Could not write frame: " << std::strerror(errno) << "\n";
+                failed = true;
+                break;
+            }
+            data += written;
+            remaining -= (size_t) written;
+        }
+        lock.lock();
+
+        pending_ = false;
+        failed_ = failed_ || failed;
+        written_.notify_one();
+    }
+}
+
+void SequenceStats::report(std::ostream &out) const {
+    if (frames == 0) {
+        out << "Sequence: no frames\n";
+        return;
+    }
+    out << "Sequence: " << frames << " frames in " << total_ms << " ms, " << total_ms / frames << " ms per frame ("
+        << update_ms / frames << " update, " << render_ms / frames << " render, "
+        << output_ms / frames << " output)\n";
+}
+
+/*
+ * Render frames from source until it runs out, applying each frame's updates to the scene
+ * and streaming the finished frames to output.
+ *
+ * The scene, its acceleration structures, thread pool and tile buffers are all reused from frame to frame,
+ * so a long sequence costs little more than rendering its frames. Returns false if the source
+ * or output failed; the frames before the failure will have been written.
+ */
+bool render_sequence(Scene &scene, const size_t &width, const size_t &height,
+                     FrameSource &source, FrameOutput &output, SequenceStats &stats) {
+    const auto start = Clock::now();
+    FrameUpdate update;
+    bool ok = true;
+    while (ok) {
+        auto phase_start = Clock::now();
+        update.clear();
+        if (!source.next(scene, update)) {
+            ok = source.ok();
+            break;
+        }
+        update.apply(scene);
+        stats.update_ms += elapsed_ms(phase_start);
+
+        phase_start = Clock::now();
+        ImageSink *sink = output.begin_frame(stats.frames);
+        if (sink == nullptr) {
+            ok = false;
+            break;
+        }
+        scene.render(width, height, *sink);
+        stats.render_ms += elapsed_ms(phase_start);
+
+        phase_start = Clock::now();
+        ok = output.end_frame();
+        stats.output_ms += elapsed_ms(phase_start);
+        stats.frames++;
+    }
+    stats.total_ms = elapsed_ms(start);
+    return ok;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Camera.hpp"
+#include "Geometry.hpp"
+#include "ImageSink.hpp"
+#include "Scene.hpp"
+#include "Sphere.hpp"
+
+/*
+ * Changes to a scene for one frame of a sequence. Anything not mentioned keeps its value from the previous frame.
+ */
+struct FrameUpdate {
+    bool move_camera;
+    Camera camera;
+    std::vector<std::pair<SphereHandle, Sphere>> spheres;
+    std::vector<std::pair<LightHandle, Pos3f>> lights;
+
+    FrameUpdate()
+            : move_camera(false), camera(Pos3f(0, 0, 0)), spheres(), lights() {}
+
+    // Empty the update, keeping its storage for the next frame.
+    void clear() {
+        move_camera = false;
+        spheres.clear();
+        lights.clear();
+    }
+
+    void apply(Scene &scene) const;
+};
+
+/*
+ * Where the frames of a sequence come from.
+ */
+struct FrameSource {
+    virtual ~FrameSource() {}
+
+    // Fill update with the changes for the next frame, returning false once there are no more frames.
+    virtual bool next(const Scene &scene, FrameUpdate &update) = 0;
+
+    // False if the source stopped early because of an error, which it has reported.
+    virtual bool ok() const {
+        return true;
+    }
+};
+
+/*
+ * Spins the spheres and lights a full turn about a vertical axis through the centre of the spheres' bounds,
+ * over the given number of frames.
+ */
+struct Turntable : FrameSource {
+    Turntable(const Scene &scene, const size_t &frames);
+
+    bool next(const Scene &scene, FrameUpdate &update) override;
+
+private:
+
+    size_t frames_;
+    size_t frame_;
+    Pos3f centre_;
+    std::vector<Sphere> spheres_; // Where everything was at the start.
+    std::vector<Pos3f> lights_;
+};
+
+/*
+ * Reads frames from a text file, one directive per line; blank lines and anything after a # are ignored.
+ *
+ *     camera PX PY PZ [OX OY OZ]
+ *     sphere INDEX X Y Z [RADIUS]
+ *     light INDEX X Y Z
+ *     frame
+ *
+ * Spheres and lights are numbered in the order they were added to the scene.
+ * Each frame line renders a frame with every change since the previous one.
+ * Lines are read as they are needed, so sequences can be arbitrarily long, or piped in as they're generated.
+ */
+struct SequenceFile : FrameSource {
+    explicit SequenceFile(const std::string &path);
+
+    bool next(const Scene &scene, FrameUpdate &update) override;
+
+    bool ok() const override {
+        return ok_;
+    }
+
+private:
+
+    std::string path_;
+    std::ifstream file_;
+    size_t line_number_;
+    bool ok_;
+};
+
+/*
+ * Where the frames of a sequence go.
+ */
+struct FrameOutput {
+    virtual ~FrameOutput() {}
+
+    // The sink for the given frame's pixels, or null if it couldn't be opened, which is reported.
+    virtual ImageSink *begin_frame(const size_t &frame) = 0;
+
+    // Finish the frame begun last. Returns false if it couldn't be written, which is reported.
+    virtual bool end_frame() = 0;
+};
+
+/*
+ * Writes each frame to its own PPM file. The first run of #s in the pattern is replaced by
+ * the zero-padded frame number, which is otherwise added before the extension.
+ */
+struct PPMSequence : FrameOutput {
+    PPMSequence(const std::string &pattern, const size_t &width, const size_t &height,
+                const PostProcess &post = PostProcess())
+            : pattern_(pattern), width_(width), height_(height), post_(post), file_() {}
+
+    ImageSink *begin_frame(const size_t &frame) override;
+
+    bool end_frame() override;
+
+    std::string path(const size_t &frame) const;
+
+private:
+
+    std::string pattern_;
+    size_t width_;
+    size_t height_;
+    PostProcess post_;
+    std::unique_ptr<PPMFile> file_;
+};
+
+/*
+ * Writes frames one after another as binary PPMs to a file descriptor, such as standard output,
+ * for piping into an encoder (e.g. ffmpeg -f image2pipe -c:v ppm -i -).
+ *
+ * Frames are double-buffered: a finished frame is written out by a background thread
+ * while the next one renders, so rendering only waits if output is slower than it.
+ */
+struct PPMStream : FrameOutput, ImageSink {
+    PPMStream(const int &fd, const size_t &width, const size_t &height, const PostProcess &post = PostProcess());
+
+    ~PPMStream() override;
+
+    PPMStream(const PPMStream &) = delete;
+
+    PPMStream &operator=(const PPMStream &) = delete;
+
+    ImageSink *begin_frame(const size_t &frame) override;
+
+    bool end_frame() override;
+
+    void write_tile(const Tile &tile, const Vec3f *pixels, const size_t &stride) override;
+
+private:
+
+    void write_frames();
+
+    int fd_;
+    size_t width_;
+    PostProcess post_;
+    size_t header_size_;
+    std::vector<uint8_t> back_;  // The frame being rendered.
+    std::vector<uint8_t> front_; // The frame being written.
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable written_;
+    bool pending_; // front_ holds a frame which hasn't been written yet.
+    bool stopping_;
+    bool failed_;
+    std::thread writer_;
+};
+
+/*
+ * Where the time went while rendering a sequence.
+ */
+struct SequenceStats {
+    size_t frames;
+    double update_ms; // Applying updates and refitting.
+    double render_ms;
+    double output_ms; // Waiting for frames to be written.
+    double total_ms;
+
+    SequenceStats()
+            : frames(0), update_ms(0), render_ms(0), output_ms(0), total_ms(0) {}
+
+    void report(std::ostream &out) const;
+};
+
+bool render_sequence(Scene &scene, const size_t &width, const size_t &height,
+                     FrameSource &source, FrameOutput &output, SequenceStats &stats);
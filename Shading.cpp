@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstring>
+
+#include "constants.hpp"
+#include "Random.hpp"
+#include "Scene.hpp"
+#include "Shading.hpp"
+#include "Stats.hpp"
+
+namespace {
+
+/*
+ * Cast a shadow ray from a (displaced) surface point towards a light.
+ * The light is visible unless some geometry lies between the surface and the light.
+ */
+bool light_visible(const Scene &scene, const Ray3f &illumination_ray, const Light &light) {
+    STATS_ADD(shadow_rays, 1);
+    if (scene.occluded(illumination_ray, distance(illumination_ray.position, light.position))) {
+        STATS_ADD(shadow_rays_occluded, 1);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Whether a light along the illumination ray lies in front of the surface. Lights behind it would give negative
+ * diffuse light and false highlights, so they are skipped (before any shadow ray, which they don't need).
+ */
+bool faces_light(const Ray3f &illumination_ray, const Ray3f &collision_normal) {
+    return illumination_ray.direction * collision_normal.direction > 0;
+}
+
+Vec3f diffuse_term(const Vec3f &surface_illumination, const Ray3f &illumination_ray, const Ray3f &collision_normal,
+                   const Material &material) {
+    const float diffuse_intensity = illumination_ray.direction * collision_normal.direction; // These are both unit vectors.
+    return hadamard(surface_illumination * diffuse_intensity, material.diffuse_colour);
+}
+
+/*
+ * x to the power of a material's specularity. Whole exponents are computed by squaring in double precision,
+ * which rounds to the same float as std::pow almost always, for a fraction of the cost.
+ */
+template<SpecularPath specular>
+float specular_power(const float &x, const float &exponent) {
+    if (specular == SpecularPath::general) {
+        return std::pow(x, exponent);
+    }
+    double result = 1;
+    double base = x;
+    for (auto n = (unsigned) exponent; n > 0; n >>= 1) {
+        if (n & 1) {
+            result *= base;
+        }
+        base *= base;
+    }
+    return (float) result;
+}
+
+/*
+ * Specular component: varies with the cosine of the angle between the incident ray (camera) and the
+ * direction of light reflected across the surface normal. (Brighter if reflecting directly into the camera)
+ */
+template<SpecularPath specular>
+Vec3f specular_term(const Vec3f &surface_illumination, const Ray3f &illumination_ray, const Ray3f &collision_normal,
+                    const Ray3f &incident_ray, const Material &material) {
+    const Vec3f reflected_ray = 2 * (-illumination_ray.direction * collision_normal.direction) * collision_normal.direction + illumination_ray.direction;
+    const float specular_intensity = specular_power<specular>(reflected_ray * incident_ray.direction,
+                                                              material.specularity);
+    return hadamard(surface_illumination * specular_intensity, material.specular_colour);
+}
+
+/*
+ * A seed for the random numbers used to shade a point, from the bits of its coordinates,
+ * so that renders are repeatable whichever thread shades which point.
+ */
+uint32_t point_seed(const Pos3f &point) {
+    uint32_t seed = 2166136261u;
+    for (int axis = 0; axis < 3; axis++) {
+        uint32_t bits;
+        std::memcpy(&bits, &point[axis], sizeof(bits));
+        seed = (seed ^ bits) * 16777619u;
+    }
+    return seed;
+}
+
+/*
+ * Move a collision normal slightly off the surface along the normal,
+ * so that rays leaving the surface from it don't hit the surface itself.
+ */
+Ray3f displace_normal_outward(const Ray3f &normal) {
+    return {normal.position + normal.direction * INCIDENT_NORMAL_DISPLACEMENT, normal.direction};
+}
+
+/*
+ * Assuming a collision has occurred, pass in the ray and the collision normal
+ * it induces on the surface, and return the observed colour at that point in the given render mode.
+ * The specular path must be the material's, or SpecularPath::general.
+ *
+ * Input vectors are assumed to be of unit length.
+ */
+template<RenderMode mode, SpecularPath specular>
+Vec3f shade(const Ray3f &incident_ray, const Ray3f &collision_normal, const Material &material, const Scene &scene) {
+    if (mode == RenderMode::normals) {
+        return 0.5f * (collision_normal.direction + Vec3f(1, 1, 1));
+    }
+    if (mode == RenderMode::depth) {
+        const float range = scene.depth_range();
+        const float depth = distance(incident_ray.position, collision_normal.position);
+        const float brightness = range > 0 ? std::max(0.0f, 1 - depth / range) : 1.0f;
+        return Vec3f(brightness, brightness, brightness);
+    }
+    const bool specular_lit = mode != RenderMode::diffuse && specular != SpecularPath::none;
+
+    Ray3f coll_normal = displace_normal_outward(collision_normal);
+
+    //Vec3f surface_lighting = material.compute_ambient(scene.ambient_colour);
+    Vec3f surface_lighting = scene.ambient_colour;
+    Vec3f surface_lighting_spec(0,0,0);
+
+    // For each light: cast a ray towards the light, checking if it hit something first.
+    scene.for_each_light(collision_normal.position, [&](const uint32_t &l) {
+        const Light &light = scene.lights[l];
+        auto illumination_ray = Ray3f(coll_normal.position, (light.position - coll_normal.position).unit());
+        if (!faces_light(illumination_ray, collision_normal)) {
+            return;
+        }
+        if (mode == RenderMode::no_shadows || light_visible(scene, illumination_ray, light)) {
+            const Vec3f surface_illumination = light.illumination(collision_normal.position);
+            surface_lighting += diffuse_term(surface_illumination, illumination_ray, collision_normal, material);
+            if (specular_lit) {
+                surface_lighting_spec += specular_term<specular>(surface_illumination, illumination_ray,
+                                                                 collision_normal, incident_ray, material);
+            }
+        }
+    });
+
+    if (!specular_lit) {
+        return hadamard(surface_lighting, material.diffuse_colour);
+    }
+    return hadamard(surface_lighting, material.diffuse_colour) + hadamard(surface_lighting_spec, material.specular_colour);
+}
+
+/*
+ * The kernel for a mode which lights surfaces, specialised for the material's specular highlights.
+ */
+template<RenderMode mode>
+ShadingKernel lit_kernel(const SpecularPath &specular) {
+    switch (specular) {
+        case SpecularPath::none:
+            return &shade<mode, SpecularPath::none>;
+        case SpecularPath::integer:
+            return &shade<mode, SpecularPath::integer>;
+        default:
+            return &shade<mode, SpecularPath::general>;
+    }
+}
+
+}
+
+/*
+ * The shading function for a render mode and a material's specular path,
+ * so that the choice is made once per material rather than at every point shaded.
+ */
+ShadingKernel shading_kernel(const RenderMode &mode, const SpecularPath &specular) {
+    switch (mode) {
+        case RenderMode::normals:
+            return &shade<RenderMode::normals, SpecularPath::none>;
+        case RenderMode::depth:
+            return &shade<RenderMode::depth, SpecularPath::none>;
+        case RenderMode::diffuse:
+            return &shade<RenderMode::diffuse, SpecularPath::none>;
+        case RenderMode::no_shadows:
+            return lit_kernel<RenderMode::no_shadows>(specular);
+        default:
+            return lit_kernel<RenderMode::full>(specular);
+    }
+}
+
+/*
+ * Fully shade a collision with a surface (see shade).
+ */
+Vec3f surface_colour(const Ray3f &incident_ray, const Ray3f &collision_normal, const Material &material,
+                     const Scene &scene) {
+    return shading_kernel(RenderMode::full, material.specular_path())(incident_ray, collision_normal, material, scene);
+}
+
+/*
+ * Like surface_colour, but lit by scene.settings.light_samples lights picked from the light tree
+ * in proportion to their estimated contribution, each weighted by the inverse of the probability
+ * it was picked with. The result is noisy, but on average the same as lighting from every light
+ * (within the light cutoff), for a cost that barely grows with the number of lights.
+ */
+Vec3f sampled_colour(const Ray3f &incident_ray, const Ray3f &collision_normal, const Material &material,
+                     const Scene &scene) {
+    Ray3f coll_normal = displace_normal_outward(collision_normal);
+    Vec3f surface_lighting = scene.ambient_colour;
+    Vec3f surface_lighting_spec(0,0,0);
+
+    const size_t samples = scene.settings.light_samples;
+    uint32_t random = point_seed(collision_normal.position);
+    for (size_t s = 0; s < samples; s++) {
+        uint32_t l;
+        float probability;
+        // A sample that finds no light counts as no light, which keeps the average right (see LightTree::sample).
+        if (!scene.light_tree.sample(collision_normal.position, scene.settings.light_cutoff, next_uniform(random),
+                                     l, probability)) {
+            continue;
+        }
+        const Light &light = scene.lights[l];
+        auto illumination_ray = Ray3f(coll_normal.position, (light.position - coll_normal.position).unit());
+        if (faces_light(illumination_ray, collision_normal) && light_visible(scene, illumination_ray, light)) {
+            const Vec3f surface_illumination = light.illumination(collision_normal.position) /
+                                               (probability * (float) samples);
+            surface_lighting += diffuse_term(surface_illumination, illumination_ray, collision_normal, material);
+            surface_lighting_spec += specular_term<SpecularPath::general>(surface_illumination, illumination_ray,
+                                                                          collision_normal, incident_ray, material);
+        }
+    }
+
+    return hadamard(surface_lighting, material.diffuse_colour) + hadamard(surface_lighting_spec, material.specular_colour);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Geometry.hpp"
+#include "Material.hpp"
+#include "RenderSettings.hpp"
+
+struct Scene;
+
+/*
+ * Shading of a point where a ray hit some surface of the scene, whatever kind of surface it is.
+ * Each function takes the incident ray and the collision normal: a ray from the hit point
+ * along the unit surface normal there, on the side the incident ray came from.
+ */
+
+// Shades a collision with a surface; one of the specialisations of shade in Shading.cpp.
+typedef Vec3f (*ShadingKernel)(const Ray3f &incident_ray, const Ray3f &collision_normal, const Material &material,
+                               const Scene &scene);
+
+ShadingKernel shading_kernel(const RenderMode &mode, const SpecularPath &specular);
+
+Vec3f surface_colour(const Ray3f &incident_ray, const Ray3f &collision_normal, const Material &material,
+                     const Scene &scene);
+
+Vec3f sampled_colour(const Ray3f &incident_ray, const Ray3f &collision_normal, const Material &material,
+                     const Scene &scene);
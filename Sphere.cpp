@@ -2,12 +2,14 @@
 
 #include "constants.hpp"
 #include "Sphere.hpp"
+#include "Stats.hpp"
 
 /*
  * Return true iff the given ray intersects with this sphere,
  * additionally returning the surface normal ray located at the first collision point if it exists.
  */
 bool Sphere::raycast(const Ray3f &ray, Ray3f &normal) const {
+    STATS_WORK(sphere_tests, 1);
     const Vec3f to_sphere = centre - ray.position;
 
     // If the whole sphere is behind the ray, there is no intersection point.
@@ -40,56 +42,31 @@ bool Sphere::raycast(const Ray3f &ray, Ray3f &normal) const {
 }
 
 /*
- * Move a ray slightly outwards from the origin.
- * This is used to displace collision normals so tht spheres do not self-occlude.
- */
-Ray3f Sphere::displace_normal_outward(const Ray3f &normal) const {
-    Vec3f centre_to_normal = normal.position - centre;
-    return {centre_to_normal + centre_to_normal.unit(INCIDENT_NORMAL_DISPLACEMENT) + centre, normal.direction};
-}
-
-/*
- * Assuming a collision has occurred, pass in the ray and the collision normal
- * it induces on this sphere, and return the observed colour at that point.
+ * Return true iff the given ray hits this sphere no further than max_distance from its origin.
  *
- * Input vectors are assumed to be of unit length.
+ * Solves |o + td - c|^2 = r^2 for t without constructing the collision point or normal;
+ * a ray starting inside the sphere is blocked by the far intersection.
  */
-Vec3f Sphere::surface_colour(const Ray3f &incident_ray, const Ray3f &collision_normal, const Scene &scene) const {
-    Ray3f coll_normal = displace_normal_outward(collision_normal);
-
-    //Vec3f surface_lighting = material.compute_ambient(scene.ambient_colour);
-    Vec3f surface_lighting = scene.ambient_colour;
-    Vec3f surface_lighting_spec(0,0,0);
-
-    // For each light: cast a ray towards the light, checking if it hit something first.
-    for (auto light : scene.lights) {
-        auto illumination_ray = Ray3f(coll_normal.position, (light->position - coll_normal.position).unit());
-        Ray3f shadow_collision_normal;
-        Sphere *sphere_pointer;
-        bool collided = scene.raycast(illumination_ray, sphere_pointer, shadow_collision_normal);
-
-        // If the ray never collided with geometry, the light wasn't occluded.
-        // If the collision point is behind the light, no occlusion.
-        if (!collided ||
-            distance(coll_normal.position, shadow_collision_normal.position) >
-            distance(coll_normal.position, light->position)) {
-
-            const Vec3f surface_illumination = light->illumination(collision_normal.position);
-            const float diffuse_intensity = illumination_ray.direction * collision_normal.direction; // These are both unit vectors.
-
-            // Specular component: varies with the cosine of the angle between the incident ray (camera) and the
-            // direction of light reflected across the surface normal. (Brighter if reflecting directly into the camera)
-            const Vec3f reflected_ray = 2 * (-illumination_ray.direction * collision_normal.direction) * collision_normal.direction + illumination_ray.direction;
-            const float specular_intensity = std::pow(reflected_ray * incident_ray.direction, material.specularity);
+bool Sphere::occludes(const Ray3f &ray, const float &max_distance) const {
+    STATS_WORK(sphere_tests, 1);
+    const Vec3f to_sphere = centre - ray.position;
+    const float a = ray.direction * ray.direction;
+    const float b = to_sphere * ray.direction;
+    const float c = to_sphere * to_sphere - radius * radius;
+    const float discriminant = b * b - a * c;
+    if (discriminant < 0) {
+        return false;
+    }
 
-            const Vec3f diffuse = hadamard(surface_illumination * diffuse_intensity, material.diffuse_colour);
-            const Vec3f specular = hadamard(surface_illumination * specular_intensity, material.specular_colour);
-            surface_lighting += diffuse;
-            surface_lighting_spec += specular;
+    const float root = std::sqrt(discriminant);
+    float t = (b - root) / a;
+    if (t < 0) {
+        t = (b + root) / a;
+        if (t < 0) {
+            return false;
         }
     }
-
-    return hadamard(surface_lighting, material.diffuse_colour) + hadamard(surface_lighting_spec, material.specular_colour);
+    return t * t * a <= max_distance * max_distance;
 }
 
 /*
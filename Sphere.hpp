@@ -1,28 +1,24 @@
 #pragma once
 
-#include "Geometry.hpp"
-#include "Material.hpp"
-#include "Scene.hpp"
+#include <cstdint>
 
-struct Scene;
+#include "Geometry.hpp"
 
+/*
+ * Just the geometry, so that spheres pack into 16 bytes;
+ * each sphere's material is kept alongside it, in Scene::sphere_materials.
+ */
 struct Sphere {
     Pos3f centre;
     float radius;
-    Material material;
 
-    Sphere(const Pos3f &c, const float &r, const Material &m)
-            : centre(c), radius(r), material(m) {}
+    Sphere(const Pos3f &c, const float &r)
+            : centre(c), radius(r) {}
 
     bool raycast(const Ray3f &ray, Ray3f &normal) const;
 
-    Vec3f surface_colour(const Ray3f &incident_ray, const Ray3f &collision_normal, const Scene &scene) const;
+    bool occludes(const Ray3f &ray, const float &max_distance) const;
 
     float nearest_distance(const Pos3f &position) const;
-
-private:
-
-    Ray3f displace_normal_outward(const Ray3f &normal) const;
-
 };
 
@@ -0,0 +1,320 @@
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPHERE_ARRAYS_X86
+#endif
+
+#include "SphereArrays.hpp"
+#include "Sphere.hpp"
+#include "Stats.hpp"
+
+namespace {
+
+/*
+ * Per-ray quantities shared by every sphere test.
+ */
+struct RayConstants {
+    float ox, oy, oz;
+    float dx, dy, dz;
+    float a;     // d . d
+    float inv_a;
+
+    explicit RayConstants(const Ray3f &ray)
+            : ox(ray.position.x), oy(ray.position.y), oz(ray.position.z),
+              dx(ray.direction.x), dy(ray.direction.y), dz(ray.direction.z),
+              a(ray.direction * ray.direction), inv_a(1.0f / a) {}
+};
+
+typedef int (*NearestKernel)(const SphereArrays &, const RayConstants &, uint32_t, uint32_t, float &);
+
+typedef bool (*AnyKernel)(const SphereArrays &, const RayConstants &, uint32_t, uint32_t, float);
+
+/*
+ * With oc = c - o, the ray o + td meets the sphere where
+ *     (d.d) t^2 - 2 (oc.d) t + (oc.oc - r^2) = 0,
+ * so with b = oc.d and c = oc.oc - r^2 the roots are t = (b -+ sqrt(b^2 - (d.d) c)) / (d.d).
+ * The nearer root is used unless it lies behind the origin (the ray starts inside the sphere),
+ * in which case the farther one is.
+ */
+inline float scalar_hit(const SphereArrays &s, const RayConstants &r, uint32_t i) {
+    const float ocx = s.x[i] - r.ox;
+    const float ocy = s.y[i] - r.oy;
+    const float ocz = s.z[i] - r.oz;
+    const float b = ocx * r.dx + ocy * r.dy + ocz * r.dz;
+    const float c = ocx * ocx + ocy * ocy + ocz * ocz - s.radius[i] * s.radius[i];
+    const float discriminant = b * b - r.a * c;
+    if (discriminant < 0) {
+        return std::numeric_limits<float>::infinity();
+    }
+    const float root = std::sqrt(discriminant);
+    const float t_near = (b - root) * r.inv_a;
+    const float t = t_near >= 0 ? t_near : (b + root) * r.inv_a;
+    return t >= 0 ? t : std::numeric_limits<float>::infinity();
+}
+
+int nearest_scalar(const SphereArrays &s, const RayConstants &r, uint32_t first, uint32_t count, float &t) {
+    int hit = -1;
+    for (uint32_t i = first; i < first + count; i++) {
+        const float current_t = scalar_hit(s, r, i);
+        if (current_t < t) {
+            t = current_t;
+            hit = (int) i;
+        }
+    }
+    return hit;
+}
+
+bool any_scalar(const SphereArrays &s, const RayConstants &r, uint32_t first, uint32_t count, float t_max) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (scalar_hit(s, r, i) <= t_max) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef SPHERE_ARRAYS_X86
+
+/*
+ * Four spheres at a time; SSE2 is part of the x86-64 baseline.
+ * Returns the hit parameters, with misses and lanes at or beyond `remaining` set to infinity.
+ */
+inline __m128 sse_hits(const SphereArrays &s, const RayConstants &r, uint32_t i, uint32_t remaining) {
+    const __m128 ocx = _mm_sub_ps(_mm_loadu_ps(&s.x[i]), _mm_set1_ps(r.ox));
+    const __m128 ocy = _mm_sub_ps(_mm_loadu_ps(&s.y[i]), _mm_set1_ps(r.oy));
+    const __m128 ocz = _mm_sub_ps(_mm_loadu_ps(&s.z[i]), _mm_set1_ps(r.oz));
+    const __m128 rad = _mm_loadu_ps(&s.radius[i]);
+
+    const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(r.dx)), _mm_mul_ps(ocy, _mm_set1_ps(r.dy))),
+                                _mm_mul_ps(ocz, _mm_set1_ps(r.dz)));
+    const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                                _mm_mul_ps(rad, rad));
+    const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(r.a), c));
+    const __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+    const __m128 inv_a = _mm_set1_ps(r.inv_a);
+    const __m128 t_near = _mm_mul_ps(_mm_sub_ps(b, root), inv_a);
+    const __m128 t_far = _mm_mul_ps(_mm_add_ps(b, root), inv_a);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 near_valid = _mm_cmpge_ps(t_near, zero);
+    const __m128 t = _mm_or_ps(_mm_and_ps(near_valid, t_near), _mm_andnot_ps(near_valid, t_far));
+
+    const __m128 lanes = _mm_cvtepi32_ps(_mm_set_epi32(3, 2, 1, 0));
+    const __m128 valid = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpge_ps(t, zero)),
+                                    _mm_cmplt_ps(lanes, _mm_set1_ps((float) remaining)));
+    return _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+}
+
+int nearest_sse(const SphereArrays &s, const RayConstants &r, uint32_t first, uint32_t count, float &t) {
+    int hit = -1;
+    for (uint32_t i = first; i < first + count; i += 4) {
+        const __m128 hits = sse_hits(s, r, i, first + count - i);
+        if (_mm_movemask_ps(_mm_cmplt_ps(hits, _mm_set1_ps(t))) == 0) {
+            continue;
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, hits);
+        for (int k = 0; k < 4; k++) {
+            if (lanes[k] < t) {
+                t = lanes[k];
+                hit = (int) i + k;
+            }
+        }
+    }
+    return hit;
+}
+
+bool any_sse(const SphereArrays &s, const RayConstants &r, uint32_t first, uint32_t count, float t_max) {
+    for (uint32_t i = first; i < first + count; i += 4) {
+        if (_mm_movemask_ps(_mm_cmple_ps(sse_hits(s, r, i, first + count - i), _mm_set1_ps(t_max))) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Eight spheres at a time. Compiled for AVX2/FMA regardless of the global target flags,
+ * and only called if the CPU reports support for them.
+ */
+__attribute__((target("avx2,fma")))
+inline __m256 avx2_hits(const SphereArrays &s, const RayConstants &r, uint32_t i, uint32_t remaining) {
+    const __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(&s.x[i]), _mm256_set1_ps(r.ox));
+    const __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(&s.y[i]), _mm256_set1_ps(r.oy));
+    const __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(&s.z[i]), _mm256_set1_ps(r.oz));
+    const __m256 rad = _mm256_loadu_ps(&s.radius[i]);
+
+    const __m256 b = _mm256_fmadd_ps(ocz, _mm256_set1_ps(r.dz),
+                                     _mm256_fmadd_ps(ocy, _mm256_set1_ps(r.dy),
+                                                     _mm256_mul_ps(ocx, _mm256_set1_ps(r.dx))));
+    const __m256 c = _mm256_fnmadd_ps(rad, rad, _mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))));
+    const __m256 discriminant = _mm256_fnmadd_ps(_mm256_set1_ps(r.a), c, _mm256_mul_ps(b, b));
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+    const __m256 inv_a = _mm256_set1_ps(r.inv_a);
+    const __m256 t_near = _mm256_mul_ps(_mm256_sub_ps(b, root), inv_a);
+    const __m256 t_far = _mm256_mul_ps(_mm256_add_ps(b, root), inv_a);
+    const __m256 t = _mm256_blendv_ps(t_far, t_near, _mm256_cmp_ps(t_near, zero, _CMP_GE_OQ));
+
+    const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int) remaining), lanes));
+    const __m256 valid = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ),
+                                                     _mm256_cmp_ps(t, zero, _CMP_GE_OQ)), in_range);
+    return _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), t, valid);
+}
+
+__attribute__((target("avx2,fma")))
+int nearest_avx2(const SphereArrays &s, const RayConstants &r, uint32_t first, uint32_t count, float &t) {
+    int hit = -1;
+    for (uint32_t i = first; i < first + count; i += 8) {
+        const __m256 hits = avx2_hits(s, r, i, first + count - i);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(hits, _mm256_set1_ps(t), _CMP_LT_OQ)) == 0) {
+            continue;
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, hits);
+        for (int k = 0; k < 8; k++) {
+            if (lanes[k] < t) {
+                t = lanes[k];
+                hit = (int) i + k;
+            }
+        }
+    }
+    return hit;
+}
+
+__attribute__((target("avx2,fma")))
+bool any_avx2(const SphereArrays &s, const RayConstants &r, uint32_t first, uint32_t count, float t_max) {
+    for (uint32_t i = first; i < first + count; i += 8) {
+        const __m256 hits = avx2_hits(s, r, i, first + count - i);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(hits, _mm256_set1_ps(t_max), _CMP_LE_OQ)) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
+
+struct Kernels {
+    NearestKernel nearest;
+    AnyKernel any;
+    const char *name;
+
+    Kernels()
+            : nearest(nearest_scalar), any(any_scalar), name("scalar") {
+#ifdef SPHERE_ARRAYS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            nearest = nearest_avx2;
+            any = any_avx2;
+            name = "avx2";
+        } else {
+            nearest = nearest_sse;
+            any = any_sse;
+            name = "sse2";
+        }
+#endif
+    }
+};
+
+/*
+ * The widest kernel the CPU supports, chosen once on first use.
+ */
+const Kernels &kernels() {
+    static const Kernels selected;
+    return selected;
+}
+
+}
+
+/*
+ * Discard all entries.
+ */
+void SphereArrays::clear() {
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+    index.clear();
+}
+
+/*
+ * Copy the given spheres in, in the given order (typically the BVH leaf order,
+ * so that each leaf refers to a contiguous run of entries).
+ */
+void SphereArrays::build(const FlatArray<Sphere> &spheres, const FlatArray<uint32_t> &order) {
+    const size_t n = order.size();
+    std::vector<float> new_x(n + SPHERE_ARRAYS_PADDING, 0);
+    std::vector<float> new_y(n + SPHERE_ARRAYS_PADDING, 0);
+    std::vector<float> new_z(n + SPHERE_ARRAYS_PADDING, 0);
+    std::vector<float> new_radius(n + SPHERE_ARRAYS_PADDING, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        const Sphere &sphere = spheres[order[i]];
+        new_x[i] = sphere.centre.x;
+        new_y[i] = sphere.centre.y;
+        new_z[i] = sphere.centre.z;
+        new_radius[i] = sphere.radius;
+    }
+
+    x.assign(std::move(new_x), n);
+    y.assign(std::move(new_y), n);
+    z.assign(std::move(new_z), n);
+    radius.assign(std::move(new_radius), n);
+    index.assign(std::vector<uint32_t>(order.begin(), order.end()));
+}
+
+/*
+ * Copy the spheres' current positions and radii in, keeping the existing order.
+ * Arrays referring to a scene file are copied (with their padding) the first time.
+ */
+void SphereArrays::refit(const FlatArray<Sphere> &spheres) {
+    if (!x.owned()) {
+        FlatArray<uint32_t> order;
+        order.assign(std::vector<uint32_t>(index.begin(), index.end()));
+        build(spheres, order);
+        return;
+    }
+    float *new_x = x.mutable_data();
+    float *new_y = y.mutable_data();
+    float *new_z = z.mutable_data();
+    float *new_radius = radius.mutable_data();
+    for (size_t i = 0; i < index.size(); i++) {
+        const Sphere &sphere = spheres[index[i]];
+        new_x[i] = sphere.centre.x;
+        new_y[i] = sphere.centre.y;
+        new_z[i] = sphere.centre.z;
+        new_radius[i] = sphere.radius;
+    }
+}
+
+/*
+ * Find the nearest intersection among entries [first, first + count) closer than t.
+ * If there is one, return true, write its ray parameter to t and its entry number to hit.
+ */
+bool SphereArrays::nearest(const Ray3f &ray, uint32_t first, uint32_t count, float &t, uint32_t &hit) const {
+    STATS_WORK(sphere_tests, count);
+    const int result = kernels().nearest(*this, RayConstants(ray), first, count, t);
+    if (result < 0) {
+        return false;
+    }
+    hit = (uint32_t) result;
+    return true;
+}
+
+/*
+ * Return true iff any of entries [first, first + count) is hit with ray parameter at most t_max.
+ */
+bool SphereArrays::any(const Ray3f &ray, uint32_t first, uint32_t count, float t_max) const {
+    STATS_WORK(sphere_tests, count);
+    return kernels().any(*this, RayConstants(ray), first, count, t_max);
+}
+
+/*
+ * The name of the intersection kernel selected for this CPU.
+ */
+const char *SphereArrays::kernel_name() {
+    return kernels().name;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "constants.hpp"
+#include "FlatArray.hpp"
+#include "Geometry.hpp"
+
+struct Sphere;
+
+/*
+ * Structure-of-arrays copy of the scene's spheres, laid out so that one ray
+ * can be intersected against several consecutive spheres per SIMD instruction.
+ *
+ * The coordinate and radius arrays are followed by SPHERE_ARRAYS_PADDING zeros,
+ * so that a full vector load starting at any valid entry stays in bounds.
+ */
+struct SphereArrays {
+    FlatArray<float> x;
+    FlatArray<float> y;
+    FlatArray<float> z;
+    FlatArray<float> radius;
+    FlatArray<uint32_t> index; // Index of each entry in Scene::spheres.
+
+    SphereArrays()
+            : x(), y(), z(), radius(), index() {}
+
+    size_t size() const {
+        return index.size();
+    }
+
+    bool empty() const {
+        return index.empty();
+    }
+
+    void clear();
+
+    void build(const FlatArray<Sphere> &spheres, const FlatArray<uint32_t> &order);
+
+    void refit(const FlatArray<Sphere> &spheres);
+
+    bool nearest(const Ray3f &ray, uint32_t first, uint32_t count, float &t, uint32_t &hit) const;
+
+    bool any(const Ray3f &ray, uint32_t first, uint32_t count, float t_max) const;
+
+    static const char *kernel_name();
+};
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Stats.hpp"
+
+/*
+ * Add another set of counters into this one.
+ */
+void Stats::Counters::merge(const Counters &other) {
+    if (other.tiles > 0) {
+        tile_ms_min = tiles > 0 ? std::min(tile_ms_min, other.tile_ms_min) : other.tile_ms_min;
+        tile_ms_max = std::max(tile_ms_max, other.tile_ms_max);
+    }
+    primary_rays += other.primary_rays;
+    shadow_rays += other.shadow_rays;
+    shadow_rays_occluded += other.shadow_rays_occluded;
+    occlusion_rays += other.occlusion_rays;
+    bvh_nodes += other.bvh_nodes;
+    sphere_tests += other.sphere_tests;
+    triangle_tests += other.triangle_tests;
+    field_steps += other.field_steps;
+    work += other.work;
+    tiles += other.tiles;
+    tile_ms += other.tile_ms;
+}
+
+#ifdef RAYMONDE_INSTRUMENT
+
+namespace {
+
+// Every thread's counters, so they can be summed; they live as long as the program.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<Stats::Counters>> registry;
+std::vector<std::pair<std::string, double>> phases;
+
+}
+
+/*
+ * The calling thread's counters, registered on first use.
+ */
+Stats::Counters &Stats::local() {
+    thread_local Counters *counters = nullptr;
+    if (counters == nullptr) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.emplace_back(new Counters());
+        counters = registry.back().get();
+    }
+    return *counters;
+}
+
+/*
+ * Zero every thread's counters and forget all phase timings.
+ * Must not be called while rendering.
+ */
+void Stats::reset() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &counters : registry) {
+        *counters = Counters();
+    }
+    phases.clear();
+}
+
+/*
+ * The sum of every thread's counters. Must not be called while rendering.
+ */
+Stats::Counters Stats::total() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    Counters sum;
+    for (const auto &counters : registry) {
+        sum.merge(*counters);
+    }
+    return sum;
+}
+
+/*
+ * Add time to a named phase; phases are reported in the order they were first seen.
+ */
+void Stats::add_phase(const std::string &name, const double &ms) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &phase : phases) {
+        if (phase.first == name) {
+            phase.second += ms;
+            return;
+        }
+    }
+    phases.emplace_back(name, ms);
+}
+
+Stats::TileTimer::~TileTimer() {
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+    Counters &counters = local();
+    counters.tile_ms_min = counters.tiles > 0 ? std::min(counters.tile_ms_min, ms) : ms;
+    counters.tile_ms_max = std::max(counters.tile_ms_max, ms);
+    counters.tile_ms += ms;
+    counters.tiles++;
+}
+
+/*
+ * Print ray counts and rates, the work per ray, tile timings, and the time spent in each phase.
+ * Rates are relative to the "render" phase.
+ */
+void Stats::report(std::ostream &out) {
+    const Counters sum = total();
+    double render_ms = 0;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (const auto &phase : phases) {
+            if (phase.first == "render") {
+                render_ms = phase.second;
+            }
+        }
+    }
+
+    const uint64_t rays = sum.primary_rays + sum.shadow_rays + sum.occlusion_rays;
+    out << "Rays: " << sum.primary_rays << " primary, " << sum.shadow_rays << " shadow ("
+        << (sum.shadow_rays > 0 ? 100.0 * sum.shadow_rays_occluded / sum.shadow_rays : 0.0) << "% occluded)";
+    if (sum.occlusion_rays > 0) {
+        out << ", " << sum.occlusion_rays << " ambient occlusion";
+    }
+    if (render_ms > 0) {
+        out << ", " << rays / (render_ms / 1000.0) / 1e6 << " Mrays/s";
+    }
+    out << "\n";
+
+    if (rays > 0) {
+        out << "Work: " << (double) sum.bvh_nodes / rays << " BVH nodes, "
+            << (double) sum.sphere_tests / rays << " sphere tests, "
+            << (double) sum.triangle_tests / rays << " triangle tests and "
+            << (double) sum.field_steps / rays << " field steps per ray\n";
+    }
+    if (sum.tiles > 0) {
+        out << "Tiles: " << sum.tiles << ", " << sum.tile_ms_min << " / " << sum.tile_ms / sum.tiles << " / "
+            << sum.tile_ms_max << " ms min / mean / max\n";
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    out << "Phases:";
+    for (const auto &phase : phases) {
+        out << " " << phase.first << " " << phase.second << " ms;";
+    }
+    out << "\n";
+}
+
+/*
+ * Map a pixel's cost onto a black-blue-red-yellow-white scale.
+ * The scale is logarithmic and fixed, so tiles can be coloured independently as they finish;
+ * white is reached at 2^12 units of work.
+ */
+Vec3f Stats::heat_colour(const float &cost) {
+    const float v = std::min(1.0f, std::log2(1.0f + cost) / 12.0f);
+    const float r = std::min(1.0f, std::max(0.0f, 3.0f * v - 1.0f));
+    const float g = std::min(1.0f, std::max(0.0f, 3.0f * v - 2.0f));
+    const float b = v < 1.0f / 3.0f ? 3.0f * v : std::max(0.0f, 2.0f - 3.0f * v) + g;
+    return Vec3f(r, g, std::min(1.0f, b));
+}
+
+#endif
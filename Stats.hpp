@@ -0,0 +1,163 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "Geometry.hpp"
+
+/*
+ * Render instrumentation, compiled in only when RAYMONDE_INSTRUMENT is defined.
+ *
+ * Each thread counts into its own Counters, so counting costs no synchronisation;
+ * Stats::total() sums them once rendering is over. Without RAYMONDE_INSTRUMENT the macros
+ * expand to nothing and the functions are empty inlines, so instrumented code costs nothing.
+ *
+ * "Work" is the number of BVH nodes visited, spheres and triangles tested and distance field steps taken,
+ * and is what the per-pixel cost image shows.
+ */
+struct Stats {
+    struct Counters {
+        uint64_t primary_rays;
+        uint64_t shadow_rays;
+        uint64_t shadow_rays_occluded;
+        uint64_t occlusion_rays; // Ambient occlusion rays.
+        uint64_t bvh_nodes;
+        uint64_t sphere_tests;
+        uint64_t triangle_tests;
+        uint64_t field_steps;    // Distance estimates made while marching rays through distance fields.
+        uint64_t work;
+        uint64_t tiles;
+        double tile_ms;
+        double tile_ms_min;
+        double tile_ms_max;
+
+        // Per-pixel cost recording for the tile in progress on this thread.
+        float *cost;
+        size_t cost_x, cost_y, cost_stride;
+        uint64_t work_mark;
+
+        Counters()
+                : primary_rays(0), shadow_rays(0), shadow_rays_occluded(0), occlusion_rays(0), bvh_nodes(0),
+                  sphere_tests(0), triangle_tests(0), field_steps(0), work(0), tiles(0), tile_ms(0), tile_ms_min(0),
+                  tile_ms_max(0), cost(nullptr), cost_x(0), cost_y(0), cost_stride(0), work_mark(0) {}
+
+        void merge(const Counters &other);
+    };
+
+#ifdef RAYMONDE_INSTRUMENT
+    static const bool enabled = true;
+
+    static Counters &local();
+
+    static void reset();
+
+    static Counters total();
+
+    static void add_phase(const std::string &name, const double &ms);
+
+    static void report(std::ostream &out);
+
+    static Vec3f heat_colour(const float &cost);
+
+    // Record pixel costs into cost, which holds image pixel (x, y) and has rows stride pixels apart.
+    // A null buffer turns recording off.
+    static void begin_tile(float *cost, const size_t &x, const size_t &y, const size_t &stride) {
+        Counters &counters = local();
+        counters.cost = cost;
+        counters.cost_x = x;
+        counters.cost_y = y;
+        counters.cost_stride = stride;
+    }
+
+    static void begin_pixel() {
+        local().work_mark = local().work;
+    }
+
+    static uint64_t work_since_mark() {
+        return local().work - local().work_mark;
+    }
+
+    // Record the work since begin_pixel, plus a share of any work done for several pixels at once,
+    // as the cost of image pixel (i, j).
+    static void end_pixel(const size_t &i, const size_t &j, const float &shared = 0) {
+        Counters &counters = local();
+        if (counters.cost != nullptr) {
+            counters.cost[(i - counters.cost_x) + (j - counters.cost_y) * counters.cost_stride] =
+                    (float) (counters.work - counters.work_mark) + shared;
+        }
+    }
+
+    /*
+     * Times a named phase of the program, from construction to destruction.
+     */
+    struct Phase {
+        explicit Phase(const char *name)
+                : name_(name), start_(std::chrono::steady_clock::now()) {}
+
+        ~Phase() {
+            add_phase(name_, std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start_).count());
+        }
+
+    private:
+        const char *name_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    /*
+     * Times one tile, recording it in the calling thread's counters.
+     */
+    struct TileTimer {
+        TileTimer()
+                : start_(std::chrono::steady_clock::now()) {}
+
+        ~TileTimer();
+
+    private:
+        std::chrono::steady_clock::time_point start_;
+    };
+
+#define STATS_ADD(field, n) (Stats::local().field += (n))
+#define STATS_WORK(field, n) do { Stats::Counters &stats_counters = Stats::local(); \
+        stats_counters.field += (n); stats_counters.work += (n); } while (0)
+
+#else
+    static const bool enabled = false;
+
+    static void reset() {}
+
+    static Counters total() {
+        return Counters();
+    }
+
+    static void report(std::ostream &) {}
+
+    static Vec3f heat_colour(const float &) {
+        return Vec3f();
+    }
+
+    static void begin_tile(float *, const size_t &, const size_t &, const size_t &) {}
+
+    static void begin_pixel() {}
+
+    static uint64_t work_since_mark() {
+        return 0;
+    }
+
+    static void end_pixel(const size_t &, const size_t &, const float & = 0) {}
+
+    struct Phase {
+        explicit Phase(const char *) {}
+    };
+
+    struct TileTimer {
+        TileTimer() {}
+    };
+
+#define STATS_ADD(field, n) ((void) 0)
+#define STATS_WORK(field, n) ((void) 0)
+
+#endif
+};
@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Texture.hpp"
+
+namespace {
+
+const char TEXTURE_FILE_MAGIC[8] = {'R', 'A', 'Y', 'T', 'I', 'L', 'E', 'S'};
+const uint32_t TEXTURE_FILE_VERSION = 1;
+
+// Images may be at most this many texels a side.
+const uint32_t TEXTURE_MAX_SIZE = 1 << 16;
+
+const uint32_t NO_SLOT = 0xffffffff;
+
+/*
+ * The start of a tiled texture file. The tiles follow from offset TEXTURE_TILE_BYTES, so that each lies on
+ * a page boundary, level by level from the full size image down.
+ */
+struct TextureFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tile_size;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Spread the low bits of x out to every other bit.
+uint32_t spread_bits(uint32_t x) {
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// The offset in bytes of texel (x, y) within its tile.
+uint32_t texel_offset(const uint32_t &x, const uint32_t &y) {
+    return 4 * (spread_bits(x % TEXTURE_TILE_SIZE) | (spread_bits(y % TEXTURE_TILE_SIZE) << 1));
+}
+
+uint64_t tile_key(const uint32_t &texture, const uint64_t &tile) {
+    return ((uint64_t) texture << 40) | tile;
+}
+
+size_t shard_index(const uint64_t &key) {
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) % TEXTURE_CACHE_SHARDS;
+}
+
+/*
+ * Skip whitespace and comments in a PPM header, then read a number.
+ */
+bool read_ppm_number(std::istream &in, uint32_t &value) {
+    while (true) {
+        const int c = in.peek();
+        if (c == '#') {
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        } else if (std::isspace(c)) {
+            in.get();
+        } else {
+            break;
+        }
+    }
+    return (bool) (in >> value);
+}
+
+/*
+ * Read a binary PPM image with at most 8 bits a channel into texels, four bytes each (the fourth unused).
+ */
+bool read_ppm(const std::string &path, uint32_t &width, uint32_t &height, std::vector<uint8_t> &texels) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Could not open " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    char magic[2];
+    uint32_t max_value = 0;
+    if (!in.read(magic, 2) || magic[0] != 'P' || magic[1] != '6' ||
+        !read_ppm_number(in, width) || !read_ppm_number(in, height) || !read_ppm_number(in, max_value) ||
+        !std::isspace(in.get())) {
+        std::cerr << path << " is not a binary PPM image\n";
+        return false;
+    }
+    if (width == 0 || height == 0 || width > TEXTURE_MAX_SIZE || height > TEXTURE_MAX_SIZE || max_value > 255) {
+        std::cerr << path << " is " << width << "x" << height << " with a maximum value of " << max_value
+                  << "; textures must be at most " << TEXTURE_MAX_SIZE << " texels a side, with 8 bits a channel\n";
+        return false;
+    }
+
+    texels.resize((size_t) width * height * 4);
+    std::vector<char> row((size_t) width * 3);
+    const float scale = 255.0f / (float) std::max(max_value, (uint32_t) 1);
+    for (size_t y = 0; y < height; y++) {
+        if (!in.read(row.data(), (std::streamsize) row.size())) {
+            std::cerr << path << " is truncated\n";
+            return false;
+        }
+        uint8_t *out = &texels[y * width * 4];
+        for (size_t x = 0; x < width; x++) {
+            for (size_t c = 0; c < 3; c++) {
+                const float value = (float) (uint8_t) row[x * 3 + c];
+                out[x * 4 + c] = max_value == 255 ? (uint8_t) value : (uint8_t) std::min(255.0f, value * scale + 0.5f);
+            }
+            out[x * 4 + 3] = 255;
+        }
+    }
+    return true;
+}
+
+/*
+ * Halve a level, rounding odd sizes up, by averaging 2x2 blocks of its texels.
+ * Along an odd edge, the last block repeats the edge texels.
+ */
+void downsample(const std::vector<uint8_t> &texels, const uint32_t &width, const uint32_t &height,
+                std::vector<uint8_t> &half, const uint32_t &half_width, const uint32_t &half_height) {
+    half.resize((size_t) half_width * half_height * 4);
+    for (uint32_t y = 0; y < half_height; y++) {
+        const size_t y0 = std::min(2 * y, height - 1);
+        const size_t y1 = std::min(2 * y + 1, height - 1);
+        for (uint32_t x = 0; x < half_width; x++) {
+            const size_t x0 = std::min(2 * x, width - 1);
+            const size_t x1 = std::min(2 * x + 1, width - 1);
+            for (size_t c = 0; c < 4; c++) {
+                const uint32_t sum = texels[(y0 * width + x0) * 4 + c] + texels[(y0 * width + x1) * 4 + c] +
+                                     texels[(y1 * width + x0) * 4 + c] + texels[(y1 * width + x1) * 4 + c];
+                half[((size_t) y * half_width + x) * 4 + c] = (uint8_t) ((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+/*
+ * Convert the image at image_path to a tiled file at tiles_path, written under a temporary name and renamed
+ * into place once complete, so that a conversion cut short is never mistaken for a finished one.
+ */
+bool convert(const std::string &image_path, const std::string &tiles_path) {
+    uint32_t width;
+    uint32_t height;
+    std::vector<uint8_t> texels;
+    if (!read_ppm(image_path, width, height, texels)) {
+        return false;
+    }
+
+    const std::string temporary_path = tiles_path + ".tmp";
+    std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+    TextureFileHeader header;
+    std::memcpy(header.magic, TEXTURE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TEXTURE_FILE_VERSION;
+    header.tile_size = TEXTURE_TILE_SIZE;
+    header.width = width;
+    header.height = height;
+    std::vector<uint8_t> tile(TEXTURE_TILE_BYTES, 0);
+    std::memcpy(tile.data(), &header, sizeof(header));
+    out.write((const char *) tile.data(), (std::streamsize) tile.size());
+
+    std::vector<uint8_t> half;
+    while (out) {
+        for (uint32_t tile_y = 0; tile_y < height; tile_y += TEXTURE_TILE_SIZE) {
+            for (uint32_t tile_x = 0; tile_x < width; tile_x += TEXTURE_TILE_SIZE) {
+                // Texels past the edge of the level repeat the edge; lookups never reach them.
+                for (uint32_t y = 0; y < TEXTURE_TILE_SIZE; y++) {
+                    const size_t row = std::min(tile_y + y, height - 1) * (size_t) width;
+                    for (uint32_t x = 0; x < TEXTURE_TILE_SIZE; x++) {
+                        const size_t column = std::min(tile_x + x, width - 1);
+                        std::memcpy(&tile[texel_offset(x, y)], &texels[(row + column) * 4], 4);
+                    }
+                }
+                out.write((const char *) tile.data(), (std::streamsize) tile.size());
+            }
+        }
+        if (width == 1 && height == 1) {
+            break;
+        }
+        const uint32_t half_width = (width + 1) / 2;
+        const uint32_t half_height = (height + 1) / 2;
+        downsample(texels, width, height, half, half_width, half_height);
+        std::swap(texels, half);
+        width = half_width;
+        height = half_height;
+    }
+    out.close();
+    if (!out || std::rename(temporary_path.c_str(), tiles_path.c_str()) != 0) {
+        std::cerr << "Could not write " << tiles_path << ": " << std::strerror(errno) << "\n";
+        std::remove(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
+
+void TextureCacheStats::report(std::ostream &out) const {
+    const uint64_t lookups = hits + misses;
+    out << "Texture cache: " << lookups << " tile lookups, "
+        << (lookups > 0 ? 100.0 * (double) hits / (double) lookups : 0.0) << "% hits, "
+        << misses << " tiles read, " << evictions << " evicted\n";
+}
+
+TextureCache::TextureCache(const size_t &capacity)
+        : capacity_(capacity), textures_(), shards_() {}
+
+TextureCache::~TextureCache() {
+    clear();
+}
+
+/*
+ * Load the texture from the binary PPM image at path, converting it to a tiled file first unless an up to date
+ * one exists, and return its index in texture. Returns false, having reported why, if it can't be loaded.
+ */
+bool TextureCache::load(const std::string &path, uint32_t &texture) {
+    const std::string tiles_path = path + ".tiles";
+    struct stat image_info;
+    struct stat tiles_info;
+    const bool image_exists = stat(path.c_str(), &image_info) == 0;
+    const bool tiles_exist = stat(tiles_path.c_str(), &tiles_info) == 0;
+    if (!image_exists && !tiles_exist) {
+        std::cerr << "Could not open " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    const bool current = tiles_exist && (!image_exists || tiles_info.st_mtime >= image_info.st_mtime);
+    if (!current && !convert(path, tiles_path)) {
+        return false;
+    }
+
+    Texture t;
+    t.path = tiles_path;
+    t.fd = open(tiles_path.c_str(), O_RDONLY);
+    if (t.fd < 0 || fstat(t.fd, &tiles_info) != 0) {
+        std::cerr << "Could not open " << tiles_path << ": " << std::strerror(errno) << "\n";
+        if (t.fd >= 0) {
+            close(t.fd);
+        }
+        return false;
+    }
+    TextureFileHeader header;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    bool valid = pread(t.fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                 std::memcmp(header.magic, TEXTURE_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == TEXTURE_FILE_VERSION && header.tile_size == TEXTURE_TILE_SIZE &&
+                 header.width > 0 && header.height > 0 &&
+                 header.width <= TEXTURE_MAX_SIZE && header.height <= TEXTURE_MAX_SIZE;
+    if (valid) {
+        width = header.width;
+        height = header.height;
+    }
+    uint32_t tiles = 0;
+    while (valid) {
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_across = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        level.first_tile = tiles;
+        t.levels.push_back(level);
+        tiles += level.tiles_across * ((height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE);
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    uint8_t last[4];
+    valid = valid && (uint64_t) tiles_info.st_size == (uint64_t) (tiles + 1) * TEXTURE_TILE_BYTES &&
+            pread(t.fd, last, 4, (off_t) tiles * TEXTURE_TILE_BYTES) == 4;
+    if (!valid) {
+        std::cerr << tiles_path << " is not a tiled texture of this version, or is truncated;"
+                  << " remove it to convert " << path << " again\n";
+        close(t.fd);
+        return false;
+    }
+    t.average = Vec3f(last[0], last[1], last[2]) * (1.0f / 255.0f);
+
+    if (!shards_) {
+        allocate();
+    }
+    texture = (uint32_t) textures_.size();
+    textures_.push_back(std::move(t));
+    return true;
+}
+
+/*
+ * Change the size of the tile pool, dropping every cached tile. Must not be called during lookups.
+ */
+void TextureCache::set_capacity(const size_t &capacity) {
+    if (capacity == capacity_) {
+        return;
+    }
+    capacity_ = capacity;
+    if (shards_) {
+        allocate();
+    }
+}
+
+/*
+ * Forget every texture and free the pool, which is only allocated again when a texture is next loaded.
+ */
+void TextureCache::clear() {
+    for (const Texture &t : textures_) {
+        close(t.fd);
+    }
+    textures_.clear();
+    shards_.reset();
+}
+
+void TextureCache::allocate() {
+    const size_t slots = std::max((size_t) 1, capacity_ / ((size_t) TEXTURE_TILE_BYTES * TEXTURE_CACHE_SHARDS));
+    shards_.reset(new Shard[TEXTURE_CACHE_SHARDS]);
+    for (size_t s = 0; s < TEXTURE_CACHE_SHARDS; s++) {
+        Shard &shard = shards_[s];
+        shard.slots.reserve(slots);
+        shard.keys.resize(slots);
+        shard.newer.resize(slots);
+        shard.older.resize(slots);
+        shard.newest = NO_SLOT;
+        shard.oldest = NO_SLOT;
+        shard.used = 0;
+        shard.tiles.reset(new uint8_t[slots * TEXTURE_TILE_BYTES]);
+    }
+}
+
+void TextureCache::Shard::unlink(const uint32_t &slot) {
+    if (newer[slot] != NO_SLOT) {
+        older[newer[slot]] = older[slot];
+    } else {
+        newest = older[slot];
+    }
+    if (older[slot] != NO_SLOT) {
+        newer[older[slot]] = newer[slot];
+    } else {
+        oldest = newer[slot];
+    }
+}
+
+void TextureCache::Shard::make_newest(const uint32_t &slot) {
+    newer[slot] = NO_SLOT;
+    older[slot] = newest;
+    if (newest != NO_SLOT) {
+        newer[newest] = slot;
+    } else {
+        oldest = slot;
+    }
+    newest = slot;
+}
+
+/*
+ * The texels of the tile with the given key, which belongs in the given shard, whose lock must be held.
+ * The tile becomes the shard's most recently used, and is read from disk if it isn't already cached.
+ */
+const uint8_t *TextureCache::tile(Shard &shard, const uint32_t &texture, const uint64_t &key) const {
+    const auto found = shard.slots.find(key);
+    if (found != shard.slots.end()) {
+        shard.stats.hits++;
+        if (shard.newest != found->second) {
+            shard.unlink(found->second);
+            shard.make_newest(found->second);
+        }
+        return &shard.tiles[(size_t) found->second * TEXTURE_TILE_BYTES];
+    }
+
+    shard.stats.misses++;
+    uint32_t slot;
+    if (shard.used < shard.keys.size()) {
+        slot = shard.used++;
+    } else {
+        slot = shard.oldest;
+        shard.unlink(slot);
+        shard.slots.erase(shard.keys[slot]);
+        shard.stats.evictions++;
+    }
+    uint8_t *data = &shard.tiles[(size_t) slot * TEXTURE_TILE_BYTES];
+    const Texture &t = textures_[texture];
+    const off_t offset = (off_t) ((key & (((uint64_t) 1 << 40) - 1)) + 1) * TEXTURE_TILE_BYTES;
+    if (pread(t.fd, data, TEXTURE_TILE_BYTES, offset) != TEXTURE_TILE_BYTES) {
+        // The file has changed underneath us; show the tile as the default material's magenta.
+        std::cerr << "Could not read a tile of " << t.path << ": " << std::strerror(errno) << "\n";
+        for (size_t i = 0; i < TEXTURE_TILE_BYTES; i += 4) {
+            data[i] = 255;
+            data[i + 1] = 0;
+            data[i + 2] = 255;
+        }
+    }
+    shard.keys[slot] = key;
+    shard.slots.emplace(key, slot);
+    shard.make_newest(slot);
+    return data;
+}
+
+/*
+ * Bilinearly interpolate the given level's texels around (u, v). The four texels are copied out under their
+ * shard's lock, which is taken once for all of them when they share a tile.
+ */
+Vec3f TextureCache::bilinear(const uint32_t &texture, const uint32_t &level, const float &u, const float &v) const {
+    const Level &l = textures_[texture].levels[level];
+    const float x = (u - std::floor(u)) * (float) l.width - 0.5f;
+    const float y = std::min(std::max(v, 0.0f), 1.0f) * (float) l.height - 0.5f;
+    const float x_floor = std::floor(x);
+    const float y_floor = std::floor(y);
+    const float fx = x - x_floor;
+    const float fy = y - y_floor;
+    const int32_t x0 = (int32_t) x_floor;
+    const int32_t y0 = (int32_t) y_floor;
+    const uint32_t xs[2] = {x0 < 0 ? l.width - 1 : (uint32_t) x0,
+                            x0 + 1 >= (int32_t) l.width ? 0 : (uint32_t) (x0 + 1)};
+    const uint32_t ys[2] = {(uint32_t) std::max(y0, 0), (uint32_t) std::min(y0 + 1, (int32_t) l.height - 1)};
+
+    uint64_t keys[4];
+    uint32_t offsets[4];
+    for (size_t i = 0; i < 4; i++) {
+        const uint32_t tx = xs[i & 1];
+        const uint32_t ty = ys[i >> 1];
+        keys[i] = tile_key(texture, l.first_tile + (ty / TEXTURE_TILE_SIZE) * l.tiles_across + tx / TEXTURE_TILE_SIZE);
+        offsets[i] = texel_offset(tx, ty);
+    }
+    uint8_t texels[4][4];
+    bool copied[4] = {false, false, false, false};
+    for (size_t i = 0; i < 4; i++) {
+        if (copied[i]) {
+            continue;
+        }
+        Shard &shard = shards_[shard_index(keys[i])];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const uint8_t *data = tile(shard, texture, keys[i]);
+        for (size_t j = i; j < 4; j++) {
+            if (keys[j] == keys[i]) {
+                std::memcpy(texels[j], data + offsets[j], 4);
+                copied[j] = true;
+            }
+        }
+    }
+
+    const float weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+    Vec3f colour(0, 0, 0);
+    for (size_t i = 0; i < 4; i++) {
+        colour += Vec3f(texels[i][0], texels[i][1], texels[i][2]) * weights[i];
+    }
+    return colour * (1.0f / 255.0f);
+}
+
+/*
+ * The texture's colour at (u, v), both from 0 to 1 across the full size image, for a lookup spanning footprint
+ * texels of it. The mip level is chosen so the footprint is about a texel, and blended with the next level down
+ * (trilinear filtering), so at most eight texels are read however large the footprint.
+ */
+Vec3f TextureCache::sample(const uint32_t &texture, const float &u, const float &v, const float &footprint) const {
+    const Texture &t = textures_[texture];
+    const uint32_t last = (uint32_t) t.levels.size() - 1;
+    const float level = footprint > 1 ? std::log2(footprint) : 0;
+    if (!std::isfinite(u) || !std::isfinite(v) || level >= (float) last) {
+        return t.average;
+    }
+    const uint32_t fine = (uint32_t) level;
+    const float blend = level - (float) fine;
+    Vec3f colour = bilinear(texture, fine, u, v);
+    if (blend > 0) {
+        const Vec3f coarse = fine + 1 == last ? t.average : bilinear(texture, fine + 1, u, v);
+        colour = colour * (1 - blend) + coarse * blend;
+    }
+    return colour;
+}
+
+TextureCacheStats TextureCache::stats() const {
+    TextureCacheStats total;
+    if (!shards_) {
+        return total;
+    }
+    for (size_t s = 0; s < TEXTURE_CACHE_SHARDS; s++) {
+        std::lock_guard<std::mutex> lock(shards_[s].mutex);
+        total.hits += shards_[s].stats.hits;
+        total.misses += shards_[s].stats.misses;
+        total.evictions += shards_[s].stats.evictions;
+    }
+    return total;
+}
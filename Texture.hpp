@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "constants.hpp"
+#include "Geometry.hpp"
+
+/*
+ * Counts of tile lookups made through a texture cache since it was last cleared.
+ */
+struct TextureCacheStats {
+    uint64_t hits;
+    uint64_t misses;    // Tiles read from disk.
+    uint64_t evictions; // Tiles dropped to make room.
+
+    TextureCacheStats()
+            : hits(0), misses(0), evictions(0) {}
+
+    void report(std::ostream &out) const;
+};
+
+/*
+ * The textures of a scene, sampled through a cache of fixed size, so that a scene may use far more texture data
+ * than fits in memory.
+ *
+ * A texture is loaded from a binary PPM image. On first load, its chain of mip levels (each half the size of the
+ * last, down to one texel) is built and written to a tiled file beside the image, <image>.tiles, which later loads
+ * reuse for as long as it is newer than the image. Only that conversion needs the whole image in memory;
+ * afterwards each texture costs a file descriptor and a few numbers.
+ *
+ * The tiled file holds squares of TEXTURE_TILE_SIZE texels a side, level by level and row by row, with the texels
+ * of each tile in Morton order, so that the 2x2 block of a bilinear lookup is nearly always within one tile and
+ * usually within one cache line. A tile is read from the file the first time a lookup touches it, into a pool of
+ * capacity bytes shared by all the textures; once the pool is full, the least recently used tile makes way.
+ * The pool is split into TEXTURE_CACHE_SHARDS shards, each with a lock, a map and a recency list of its own,
+ * so render threads rarely wait on each other. A lookup which misses reads its tile holding the shard's lock.
+ *
+ * Textures wrap horizontally and are clamped vertically, as for longitude and latitude around a sphere.
+ */
+struct TextureCache {
+    explicit TextureCache(const size_t &capacity = TEXTURE_CACHE_SIZE);
+
+    ~TextureCache();
+
+    TextureCache(const TextureCache &) = delete;
+
+    TextureCache &operator=(const TextureCache &) = delete;
+
+    bool load(const std::string &path, uint32_t &texture);
+
+    size_t size() const {
+        return textures_.size();
+    }
+
+    uint32_t width(const uint32_t &texture) const {
+        return textures_[texture].levels[0].width;
+    }
+
+    uint32_t height(const uint32_t &texture) const {
+        return textures_[texture].levels[0].height;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    void set_capacity(const size_t &capacity);
+
+    void clear();
+
+    Vec3f sample(const uint32_t &texture, const float &u, const float &v, const float &footprint) const;
+
+    // The texture's mean colour: its one-texel mip level, which is kept in memory.
+    Vec3f average(const uint32_t &texture) const {
+        return textures_[texture].average;
+    }
+
+    TextureCacheStats stats() const;
+
+private:
+
+    struct Level {
+        uint32_t width;
+        uint32_t height;
+        uint32_t tiles_across;
+        uint32_t first_tile; // The number of tiles in the levels before this one.
+    };
+
+    struct Texture {
+        std::string path; // Of the tiled file.
+        int fd;
+        std::vector<Level> levels;
+        Vec3f average;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, uint32_t> slots; // The slot holding each tile.
+        std::vector<uint64_t> keys;                   // The tile in each slot.
+        std::vector<uint32_t> newer;                  // The recency list, through the slots.
+        std::vector<uint32_t> older;
+        uint32_t newest;
+        uint32_t oldest;
+        uint32_t used;
+        std::unique_ptr<uint8_t[]> tiles; // Left uninitialised, so untouched slots cost no memory.
+        TextureCacheStats stats;
+
+        void unlink(const uint32_t &slot);
+
+        void make_newest(const uint32_t &slot);
+    };
+
+    size_t capacity_;
+    std::vector<Texture> textures_;
+    std::unique_ptr<Shard[]> shards_;
+
+    void allocate();
+
+    const uint8_t *tile(Shard &shard, const uint32_t &texture, const uint64_t &key) const;
+
+    Vec3f bilinear(const uint32_t &texture, const uint32_t &level, const float &u, const float &v) const;
+};
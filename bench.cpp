@@ -0,0 +1,1233 @@
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "constants.hpp"
+#include "DistanceField.hpp"
+#include "Farm.hpp"
+#include "Geometry.hpp"
+#include "ImageSink.hpp"
+#include "Instance.hpp"
+#include "Light.hpp"
+#include "Mesh.hpp"
+#include "ObjFile.hpp"
+#include "PathTracer.hpp"
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+#include "Sequence.hpp"
+#include "Shading.hpp"
+#include "Sphere.hpp"
+#include "SphereArrays.hpp"
+#include "Texture.hpp"
+
+/*
+ * Benchmarks for the renderer's hot paths and for whole renders of generated scenes.
+ * Results are written as a JSON array, one object per measurement.
+ *
+ * Usage: raymonde_bench [--full] [--out results.json]
+ *
+ * The default (quick) suite takes well under a minute; --full sweeps up to a million spheres,
+ * 8K resolution and every power-of-two thread count up to the hardware's.
+ */
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Accumulates benchmark results so the compiler can't discard the work that produced them.
+volatile float sink_value = 0;
+
+struct Result {
+    std::string group;
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> params;
+    size_t iterations;
+    double seconds;
+    double throughput;
+    std::string unit;
+};
+
+std::string json_escape(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+void write_json(std::ostream &out, const std::vector<Result> &results) {
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        out << "  {\"group\": \"" << json_escape(r.group) << "\", \"name\": \"" << json_escape(r.name) << "\", "
+            << "\"params\": {";
+        for (size_t p = 0; p < r.params.size(); p++) {
+            out << (p ? ", " : "") << "\"" << json_escape(r.params[p].first) << "\": " << r.params[p].second;
+        }
+        out << "}, \"iterations\": " << r.iterations << ", \"seconds\": " << r.seconds
+            << ", \"throughput\": " << r.throughput << ", \"unit\": \"" << r.unit << "\"}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+template<typename T>
+std::string number(const T &v) {
+    std::ostringstream out;
+    out << v;
+    return out.str();
+}
+
+/*
+ * Run body repeatedly, in batches of batch_size calls, until min_seconds have passed.
+ * Returns the number of calls and the time they took.
+ */
+std::pair<size_t, double> time_loop(const std::function<void()> &body, const size_t &batch_size,
+                                    const double &min_seconds) {
+    size_t iterations = 0;
+    const auto start = Clock::now();
+    double elapsed = 0;
+    while (elapsed < min_seconds) {
+        for (size_t i = 0; i < batch_size; i++) {
+            body();
+        }
+        iterations += batch_size;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return {iterations, elapsed};
+}
+
+/*
+ * Random spheres filling a slab in front of the default camera, sized so that
+ * the slab is roughly as crowded whatever the count, and lights scattered around it,
+ * with their brightness scaled by light_scale.
+ */
+Scene *generate_scene(const size_t &sphere_count, const size_t &light_count, const unsigned &seed,
+                      const float &light_scale = 1.0f) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    Camera camera(Pos3f(0, 0, 0), Vec3f(0, 0, 1.0f), PI / 2.0f);
+    auto scene = new Scene(camera, Vec3f(0.05, 0.03, 0.04), Vec3f(0.05, 0.03, 0.04));
+
+    const float extent = 40.0f;
+    const float depth = 40.0f;
+    const float volume = 4 * extent * extent * depth;
+    const float radius = 0.4f * std::cbrt(volume / (float) sphere_count);
+    for (size_t i = 0; i < sphere_count; i++) {
+        const Pos3f centre((unit(rng) * 2 - 1) * extent, (unit(rng) * 2 - 1) * extent, 10 + unit(rng) * depth);
+        const Material material(Vec3f(unit(rng), unit(rng), unit(rng)), Vec3f(1, 1, 1) * unit(rng),
+                                1 + 20 * unit(rng));
+        scene->add_sphere(centre, radius * (0.5f + unit(rng)), material);
+    }
+
+    for (size_t i = 0; i < light_count; i++) {
+        const Pos3f position((unit(rng) * 2 - 1) * 2 * extent, (unit(rng) * 2 - 1) * 2 * extent,
+                             unit(rng) * (10 + depth));
+        scene->add_light(position, Vec3f(unit(rng), unit(rng), unit(rng)),
+                         light_scale * (500.0f + 1000.0f * unit(rng)));
+    }
+    return scene;
+}
+
+/*
+ * A torus facing the default camera, with rings x sides quads each split into two triangles.
+ */
+Mesh generate_torus(const size_t &rings, const size_t &sides) {
+    const float major = 10.0f;
+    const float minor = 4.0f;
+    Mesh mesh;
+    mesh.vertices.reserve(rings * sides);
+    mesh.indices.reserve(6 * rings * sides);
+    for (size_t i = 0; i < rings; i++) {
+        const float u = 2 * PI * (float) i / (float) rings;
+        for (size_t j = 0; j < sides; j++) {
+            const float v = 2 * PI * (float) j / (float) sides;
+            const float r = major + minor * std::cos(v);
+            mesh.vertices.emplace_back(r * std::cos(u), r * std::sin(u), 30 + minor * std::sin(v));
+        }
+    }
+    for (size_t i = 0; i < rings; i++) {
+        for (size_t j = 0; j < sides; j++) {
+            const auto a = (uint32_t) (i * sides + j);
+            const auto b = (uint32_t) ((i + 1) % rings * sides + j);
+            const auto c = (uint32_t) ((i + 1) % rings * sides + (j + 1) % sides);
+            const auto d = (uint32_t) (i * sides + (j + 1) % sides);
+            mesh.add_triangle(a, b, c);
+            mesh.add_triangle(a, c, d);
+        }
+    }
+    return mesh;
+}
+
+std::vector<Ray3f> random_camera_rays(const size_t &count, const unsigned &seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> spread(-1.0f, 1.0f);
+    std::vector<Ray3f> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        rays.emplace_back(Pos3f(0, 0, 0), Vec3f(spread(rng), spread(rng), 1.0f).unit());
+    }
+    return rays;
+}
+
+/*
+ * Discards every tile, so that whole-frame benchmarks measure rendering alone.
+ */
+struct NullSink : ImageSink {
+    void write_tile(const Tile &, const Vec3f *pixels, const size_t &) override {
+        sink_value = sink_value + pixels[0].x;
+    }
+};
+
+/*
+ * The vector operations everything else is built on, timed over arrays of random vectors
+ * (so that the call overhead of time_loop is spread over many of them), and the accuracy of
+ * normalisation against double precision, which RAYMONDE_FAST_RSQRT trades for speed.
+ */
+void geometry_benchmarks(std::vector<Result> &results, const double &min_seconds) {
+    const size_t count = 1024;
+    std::mt19937 rng(8);
+    std::uniform_real_distribution<float> spread(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> exponent(-3.0f, 3.0f);
+    std::vector<Vec3f> vectors;
+    for (size_t i = 0; i < count; i++) {
+        vectors.push_back(Vec3f(spread(rng), spread(rng), spread(rng)) * std::pow(10.0f, exponent(rng)));
+    }
+#ifdef RAYMONDE_FAST_RSQRT
+    const std::string fast_rsqrt = "true";
+#else
+    const std::string fast_rsqrt = "false";
+#endif
+
+    const std::vector<std::pair<std::string, std::function<float(const Vec3f &, const Vec3f &)>>> operations = {
+            {"Vec3f::unit", [](const Vec3f &a, const Vec3f &) { return a.unit().x; }},
+            {"Vec3f::length", [](const Vec3f &a, const Vec3f &) { return a.length(); }},
+            {"Vec3f dot", [](const Vec3f &a, const Vec3f &b) { return a * b; }},
+            {"Vec3f cross", [](const Vec3f &a, const Vec3f &b) { return cross(a, b).y; }},
+            {"projection", [](const Vec3f &a, const Vec3f &b) { return projection(a, b).z; }}};
+    for (const auto &operation : operations) {
+        const auto timing = time_loop([&] {
+            float sum = 0;
+            for (size_t i = 0; i + 1 < count; i++) {
+                sum += operation.second(vectors[i], vectors[i + 1]);
+            }
+            sink_value = sink_value + sum;
+        }, 16, min_seconds);
+        const size_t calls = timing.first * (count - 1);
+        results.push_back({"micro", operation.first, {{"fast_rsqrt", fast_rsqrt}}, calls, timing.second,
+                           calls / timing.second, "calls/s"});
+    }
+
+    double max_error = 0;
+    for (const Vec3f &v : vectors) {
+        const Vec3f u = v.unit();
+        const double length = std::sqrt((double) v.x * v.x + (double) v.y * v.y + (double) v.z * v.z);
+        max_error = std::max(max_error, std::abs(u.x - v.x / length));
+        max_error = std::max(max_error, std::abs(u.y - v.y / length));
+        max_error = std::max(max_error, std::abs(u.z - v.z / length));
+    }
+    results.push_back({"accuracy", "Vec3f::unit", {{"fast_rsqrt", fast_rsqrt}, {"max_error", number(max_error)}},
+                       count, 0, 0, ""});
+    std::cerr << "Vec3f::unit: largest component error " << max_error << " against double precision\n";
+}
+
+void micro_benchmarks(std::vector<Result> &results, const double &min_seconds) {
+    const size_t ray_count = 4096;
+    const std::vector<Ray3f> rays = random_camera_rays(ray_count, 1);
+
+    geometry_benchmarks(results, min_seconds);
+
+    // A single sphere, hit by roughly half of the rays.
+    {
+        const Sphere sphere(Pos3f(0, 0, 20), 12.0f);
+        size_t r = 0;
+        const auto timing = time_loop([&] {
+            Ray3f normal;
+            if (sphere.raycast(rays[r++ % ray_count], normal)) {
+                sink_value = sink_value + normal.position.z;
+            }
+        }, 1024, min_seconds);
+        results.push_back({"micro", "Sphere::raycast", {}, timing.first, timing.second,
+                           timing.first / timing.second, "calls/s"});
+    }
+
+    {
+        Light light(Pos3f(0, 50, 15), Vec3f(1, 0, 0), 1500.0f);
+        size_t r = 0;
+        const auto timing = time_loop([&] {
+            const Ray3f &ray = rays[r++ % ray_count];
+            sink_value = sink_value + light.illumination(ray.position + ray.direction * 20.0f).x;
+        }, 1024, min_seconds);
+        results.push_back({"micro", "Light::illumination", {}, timing.first, timing.second,
+                           timing.first / timing.second, "calls/s"});
+    }
+
+    for (const size_t sphere_count : {10, 1000, 100000}) {
+        for (const bool use_bvh : {true, false}) {
+            if (!use_bvh && sphere_count > 1000) {
+                continue;
+            }
+            Scene *scene = generate_scene(sphere_count, 4, 2);
+            scene->finalise(use_bvh);
+
+            size_t r = 0;
+            const auto raycast = time_loop([&] {
+                Surface surface;
+                Ray3f normal;
+                if (scene->raycast(rays[r++ % ray_count], surface, normal)) {
+                    sink_value = sink_value + normal.position.z;
+                }
+            }, 256, min_seconds);
+            results.push_back({"micro", "Scene::raycast",
+                               {{"spheres", number(sphere_count)}, {"bvh", use_bvh ? "true" : "false"}},
+                               raycast.first, raycast.second, raycast.first / raycast.second, "rays/s"});
+
+            // Shading of precomputed hits, which is dominated by the shadow rays to each light.
+            if (use_bvh) {
+                std::vector<std::pair<Surface, std::pair<Ray3f, Ray3f>>> hits;
+                for (const Ray3f &ray : rays) {
+                    Surface surface;
+                    Ray3f normal;
+                    if (scene->raycast(ray, surface, normal)) {
+                        hits.push_back({surface, {ray, normal}});
+                    }
+                }
+                if (!hits.empty()) {
+                    size_t h = 0;
+                    const auto shading = time_loop([&] {
+                        const auto &hit = hits[h++ % hits.size()];
+                        const Material &material = scene->material_of(hit.first);
+                        sink_value = sink_value + surface_colour(hit.second.first, hit.second.second, material,
+                                                                *scene).x;
+                    }, 256, min_seconds);
+                    results.push_back({"micro", "surface_colour",
+                                       {{"spheres", number(sphere_count)}, {"lights", "4"}},
+                                       shading.first, shading.second, shading.first / shading.second, "calls/s"});
+                }
+            }
+            delete scene;
+        }
+    }
+}
+
+/*
+ * Render one generated scene once, after a warm-up frame, and record pixels per second.
+ */
+void render_benchmark(std::vector<Result> &results, const std::string &name,
+                      const size_t &sphere_count, const size_t &light_count,
+                      const size_t &width, const size_t &height, const size_t &threads,
+                      const bool &use_bvh, const bool &packets) {
+    Scene *scene = generate_scene(sphere_count, light_count, 3);
+    const auto build_start = Clock::now();
+    scene->finalise(use_bvh);
+    const double build_seconds = std::chrono::duration<double>(Clock::now() - build_start).count();
+    scene->settings.thread_count = threads;
+    scene->settings.packet_tracing = packets;
+
+    NullSink sink;
+    scene->render(std::min(width, (size_t) 64), std::min(height, (size_t) 64), sink);
+
+    const auto start = Clock::now();
+    scene->render(width, height, sink);
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    results.push_back({"render", name,
+                       {{"spheres", number(sphere_count)}, {"lights", number(light_count)},
+                        {"width", number(width)}, {"height", number(height)}, {"threads", number(threads)},
+                        {"bvh", use_bvh ? "true" : "false"}, {"packets", packets ? "true" : "false"},
+                        {"build_seconds", number(build_seconds)}},
+                       1, seconds, (double) (width * height) / seconds, "pixels/s"});
+    std::cerr << name << ": " << sphere_count << " spheres, " << light_count << " lights, "
+              << width << "x" << height << ", " << threads << " threads: " << seconds << " s\n";
+    delete scene;
+}
+
+void render_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const std::vector<size_t> sphere_counts = full ? std::vector<size_t>{10, 1000, 10000, 100000, 1000000}
+                                                   : std::vector<size_t>{10, 1000, 100000};
+    const std::vector<std::pair<size_t, size_t>> resolutions =
+            full ? std::vector<std::pair<size_t, size_t>>{{256, 144}, {1920, 1080}, {3840, 2160}, {7680, 4320}}
+                 : std::vector<std::pair<size_t, size_t>>{{256, 144}, {960, 540}};
+    const size_t base_width = full ? 1920 : 960;
+    const size_t base_height = full ? 1080 : 540;
+
+    // Scaling with scene size and resolution, on every hardware thread.
+    for (const size_t sphere_count : sphere_counts) {
+        for (const auto &resolution : resolutions) {
+            render_benchmark(results, "scene_scaling", sphere_count, 4, resolution.first, resolution.second,
+                             hardware, true, true);
+        }
+    }
+
+    // Scaling with light count.
+    for (const size_t light_count : full ? std::vector<size_t>{1, 4, 16, 64, 256} : std::vector<size_t>{1, 4, 16}) {
+        render_benchmark(results, "light_scaling", 1000, light_count, base_width, base_height, hardware, true, true);
+    }
+
+    // Scaling with thread count: powers of two, then every hardware thread.
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < hardware; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(hardware);
+    for (const size_t threads : thread_counts) {
+        render_benchmark(results, "thread_scaling", full ? 100000 : 10000, 4, base_width, base_height,
+                         threads, true, true);
+    }
+
+    // Acceleration strategies against each other.
+    for (const size_t sphere_count : {10, 100, 1000}) {
+        render_benchmark(results, "strategy", sphere_count, 4, base_width, base_height, hardware, false, false);
+        render_benchmark(results, "strategy", sphere_count, 4, base_width, base_height, hardware, true, false);
+        render_benchmark(results, "strategy", sphere_count, 4, base_width, base_height, hardware, true, true);
+    }
+}
+
+/*
+ * Loading generated scenes from binary scene files, against building them object by object.
+ * Also times the first small frame after loading, which is when the mapped pages are first touched.
+ */
+void scene_file_benchmarks(std::vector<Result> &results, const bool &full) {
+    const char path[] = "./raymonde_bench.scene";
+    for (const size_t sphere_count : full ? std::vector<size_t>{10000, 1000000, 4000000}
+                                          : std::vector<size_t>{10000, 1000000}) {
+        const auto build_start = Clock::now();
+        Scene *built = generate_scene(sphere_count, 4, 4);
+        built->finalise();
+        const double build_seconds = std::chrono::duration<double>(Clock::now() - build_start).count();
+        const bool saved = save_scene(*built, path);
+        delete built;
+        if (!saved) {
+            continue;
+        }
+
+        const auto load_start = Clock::now();
+        Scene *scene = load_scene(path);
+        const double load_seconds = std::chrono::duration<double>(Clock::now() - load_start).count();
+        if (scene == nullptr) {
+            continue;
+        }
+
+        NullSink sink;
+        const auto frame_start = Clock::now();
+        scene->render(64, 64, sink);
+        const double frame_seconds = std::chrono::duration<double>(Clock::now() - frame_start).count();
+        delete scene;
+        std::remove(path);
+
+        results.push_back({"scene_file", "load_scene",
+                           {{"spheres", number(sphere_count)}, {"build_seconds", number(build_seconds)},
+                            {"first_frame_seconds", number(frame_seconds)}},
+                           1, load_seconds, (double) sphere_count / load_seconds, "spheres/s"});
+        std::cerr << "scene_file: " << sphere_count << " spheres: built in " << build_seconds << " s, loaded in "
+                  << load_seconds << " s, first 64x64 frame " << frame_seconds << " s\n";
+    }
+}
+
+
+/*
+ * A stereo pair rendered as two separate frames, against one pass over both views.
+ */
+void multi_view_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t width = full ? 1920 : 480;
+    const size_t height = full ? 1080 : 270;
+    const Vec3f eye_offset(0.5f, 0, 0);
+    for (const size_t light_count : full ? std::vector<size_t>{1, 4, 16, 64} : std::vector<size_t>{4, 16}) {
+        Scene *scene = generate_scene(1000, light_count, 5);
+        scene->finalise();
+        Camera left_eye = scene->camera;
+        Camera right_eye = scene->camera;
+        left_eye.position = scene->camera.position + eye_offset;
+        right_eye.position = scene->camera.position - eye_offset;
+        const std::vector<View> views = {View(left_eye, 0, 0, width, height),
+                                         View(right_eye, width, 0, width, height)};
+
+        NullSink sink;
+        scene->render(64, 64, sink);
+        for (const std::string mode : {"separate", "views"}) {
+            const auto start = Clock::now();
+            if (mode == "separate") {
+                const Camera camera = scene->camera;
+                scene->camera = left_eye;
+                scene->render(width, height, sink);
+                scene->camera = right_eye;
+                scene->render(width, height, sink);
+                scene->camera = camera;
+            } else {
+                scene->render(views, sink);
+            }
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            results.push_back({"multi_view", mode,
+                               {{"spheres", "1000"}, {"lights", number(light_count)}, {"views", "2"},
+                                {"width", number(width)}, {"height", number(height)}},
+                               1, seconds, (double) (2 * width * height) / seconds, "pixels/s"});
+            std::cerr << "multi_view " << mode << ": " << light_count << " lights, 2 x " << width << "x" << height
+                      << ": " << seconds << " s\n";
+        }
+        delete scene;
+    }
+}
+
+
+/*
+ * Scenes with many dim lights (of the same total brightness whatever their number), shaded from every light,
+ * from only those above a cutoff, and from a few sampled ones.
+ */
+void many_light_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = 256;
+    const size_t height = 144;
+    const float cutoff = 1.0f / 64;
+    const size_t samples = 4;
+    for (const size_t light_count : full ? std::vector<size_t>{16, 64, 256, 1024, 4096}
+                                         : std::vector<size_t>{16, 64, 256}) {
+        Scene *scene = generate_scene(1000, light_count, 7, 16.0f / (float) light_count);
+        scene->finalise();
+        scene->settings.thread_count = hardware;
+
+        NullSink sink;
+        scene->render(64, 64, sink);
+        for (const std::string mode : {"all", "cutoff", "sampled"}) {
+            scene->settings.light_cutoff = mode == "all" ? 0.0f : cutoff;
+            scene->settings.light_samples = mode == "sampled" ? samples : 0;
+            const auto start = Clock::now();
+            scene->render(width, height, sink);
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            results.push_back({"many_lights", mode,
+                               {{"spheres", "1000"}, {"lights", number(light_count)},
+                                {"cutoff", number(scene->settings.light_cutoff)},
+                                {"samples", number(scene->settings.light_samples)},
+                                {"width", number(width)}, {"height", number(height)},
+                                {"threads", number(hardware)}},
+                               1, seconds, (double) (width * height) / seconds, "pixels/s"});
+            std::cerr << "many_lights " << mode << ": " << light_count << " lights: " << seconds << " s\n";
+        }
+        delete scene;
+    }
+}
+
+/*
+ * Frames handed straight to a NullSink.
+ */
+struct NullOutput : FrameOutput {
+    NullSink sink;
+
+    ImageSink *begin_frame(const size_t &) override {
+        return &sink;
+    }
+
+    bool end_frame() override {
+        return true;
+    }
+};
+
+/*
+ * Each render mode, on a scene whose materials are split between the specular paths:
+ * a third have no highlights, a third whole-number exponents and the rest fractional ones.
+ */
+void render_mode_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = full ? 1280 : 480;
+    const size_t height = full ? 720 : 270;
+    const size_t light_count = 16;
+    Scene *scene = generate_scene(full ? 100000 : 10000, light_count, 9);
+    for (size_t m = 0; m < scene->materials.size(); m++) {
+        Material &material = scene->materials.mutable_data()[m];
+        if (m % 3 == 0) {
+            material.specular_colour = Vec3f(0, 0, 0);
+        } else if (m % 3 == 1) {
+            material.specularity = std::floor(material.specularity);
+        }
+    }
+    scene->finalise();
+    scene->settings.thread_count = hardware;
+
+    NullSink sink;
+    scene->render(64, 64, sink);
+    for (const RenderMode mode : {RenderMode::full, RenderMode::diffuse, RenderMode::no_shadows, RenderMode::normals,
+                                  RenderMode::depth}) {
+        scene->settings.render_mode = mode;
+        const auto start = Clock::now();
+        scene->render(width, height, sink);
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        results.push_back({"render_modes", render_mode_name(mode),
+                           {{"spheres", number(scene->spheres.size())}, {"lights", number(light_count)},
+                            {"width", number(width)}, {"height", number(height)}, {"threads", number(hardware)}},
+                           1, seconds, (double) (width * height) / seconds, "pixels/s"});
+        std::cerr << "render_modes " << render_mode_name(mode) << ": " << seconds << " s\n";
+    }
+    delete scene;
+}
+
+/*
+ * A farm worker which generates its scene rather than loading one.
+ */
+struct GeneratedWorker : FarmWorker {
+    GeneratedWorker(const size_t &sphere_count, const size_t &threads, const size_t &width, const size_t &height)
+            : sphere_count_(sphere_count), threads_(threads), width_(width), height_(height), scene_() {}
+
+    bool open() override {
+        scene_.reset(generate_scene(sphere_count_, 16, 11));
+        scene_->finalise();
+        scene_->settings.thread_count = threads_;
+        return true;
+    }
+
+    void render(const size_t &first_row, const size_t &row_count, ImageSink &sink) override {
+        scene_->render({View(scene_->camera, 0, 0, width_, height_)}, sink, first_row, row_count);
+    }
+
+private:
+
+    size_t sphere_count_;
+    size_t threads_;
+    size_t width_;
+    size_t height_;
+    std::unique_ptr<Scene> scene_;
+};
+
+/*
+ * One frame rendered across different numbers of worker processes, sharing the hardware threads between them.
+ * The time includes starting the workers and generating their scenes.
+ * This must run while the bench has no threads of its own, as the workers are forked.
+ */
+void farm_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = full ? 1920 : 480;
+    const size_t height = full ? 1080 : 270;
+    const size_t sphere_count = full ? 100000 : 10000;
+    for (const size_t workers : full ? std::vector<size_t>{1, 2, 4, 8} : std::vector<size_t>{1, 2, 4}) {
+        const size_t threads = std::max((size_t) 1, hardware / workers);
+        GeneratedWorker worker(sphere_count, threads, width, height);
+        FarmSettings settings;
+        settings.workers = workers;
+        settings.job_rows = 64;
+        FarmStats stats;
+        NullSink sink;
+        if (!render_farm(width, height, worker, sink, settings, stats)) {
+            continue;
+        }
+        const double seconds = stats.total_ms / 1000;
+        results.push_back({"farm", "render_farm",
+                           {{"spheres", number(sphere_count)}, {"workers", number(workers)},
+                            {"threads_per_worker", number(threads)}, {"jobs", number(stats.jobs)},
+                            {"width", number(width)}, {"height", number(height)}},
+                           1, seconds, (double) (width * height) / seconds, "pixels/s"});
+        std::cerr << "farm: " << workers << " workers: " << seconds << " s\n";
+    }
+}
+
+/*
+ * Path tracing a generated scene with a few samples per pixel, for different numbers of bounces,
+ * reporting the rays traced per second and the share of time in each stage.
+ */
+void path_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = full ? 1280 : 480;
+    const size_t height = full ? 720 : 270;
+    const size_t samples = full ? 16 : 4;
+    Scene *scene = generate_scene(full ? 100000 : 10000, 16, 12);
+    scene->finalise();
+    scene->settings.thread_count = hardware;
+
+    NullSink sink;
+    for (const size_t bounces : {0, 1, 4}) {
+        PathSettings settings;
+        settings.samples = samples;
+        settings.max_bounces = bounces;
+        PathTracer tracer(*scene, settings);
+        PathStats stats;
+        tracer.render(width, height, sink, stats);
+        const double seconds = stats.total_ms / 1000;
+        const size_t rays = stats.extension_rays + stats.shadow_rays;
+
+        results.push_back({"path", "wavefront",
+                           {{"spheres", number(scene->spheres.size())}, {"samples", number(samples)},
+                            {"bounces", number(bounces)}, {"width", number(width)}, {"height", number(height)},
+                            {"threads", number(hardware)}, {"extend_ms", number(stats.extend_ms)},
+                            {"shade_ms", number(stats.shade_ms)}, {"shadow_ms", number(stats.shadow_ms)}},
+                           1, seconds, (double) rays / seconds, "rays/s"});
+        std::cerr << "path: " << bounces << " bounces: " << seconds << " s, " << rays / seconds << " rays/s\n";
+    }
+    delete scene;
+}
+
+/*
+ * A generated torus mesh: how long its hierarchy takes to build and how much memory it takes per triangle,
+ * raycasts and whole renders of it, and loading it back from an OBJ file.
+ */
+void mesh_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t rings = full ? 1000 : 100;
+    const size_t width = full ? 1280 : 480;
+    const size_t height = full ? 720 : 270;
+
+    Mesh mesh = generate_torus(rings, rings / 2);
+    const size_t triangles = mesh.triangle_count();
+    mesh.build();
+    results.push_back({"mesh", "build",
+                       {{"triangles", number(triangles)}, {"nodes", number(mesh.build_stats.node_count)},
+                        {"bytes_per_triangle", number((double) mesh.memory_size() / (double) triangles)}},
+                       1, mesh.build_stats.build_ms / 1000, triangles / (mesh.build_stats.build_ms / 1000),
+                       "triangles/s"});
+    std::cerr << "mesh: ";
+    mesh.report(std::cerr);
+
+    // Written out before the mesh goes to the scene, as building reordered its triangles.
+    const char path[] = "./raymonde_bench.obj";
+    {
+        std::ofstream obj(path);
+        for (const Pos3f &v : mesh.vertices) {
+            obj << "v " << v.x << " " << v.y << " " << v.z << "\n";
+        }
+        for (size_t t = 0; t < triangles; t++) {
+            obj << "f " << mesh.indices[3 * t] + 1 << " " << mesh.indices[3 * t + 1] + 1 << " "
+                << mesh.indices[3 * t + 2] + 1 << "\n";
+        }
+    }
+
+    Scene *scene = generate_scene(0, 4, 13);
+    scene->add_mesh(std::move(mesh), scene->add_material(Material(Vec3f(0.7, 0.7, 0.7), Vec3f(0.2, 0.2, 0.2), 10)));
+    scene->finalise();
+    scene->settings.thread_count = hardware;
+
+    const size_t ray_count = 4096;
+    const std::vector<Ray3f> rays = random_camera_rays(ray_count, 14);
+    size_t r = 0;
+    const auto raycast = time_loop([&] {
+        Surface surface;
+        Ray3f normal;
+        if (scene->raycast(rays[r++ % ray_count], surface, normal)) {
+            sink_value = sink_value + normal.position.z;
+        }
+    }, 256, full ? 1.0 : 0.2);
+    results.push_back({"mesh", "Scene::raycast", {{"triangles", number(triangles)}},
+                       raycast.first, raycast.second, raycast.first / raycast.second, "rays/s"});
+
+    NullSink sink;
+    scene->render(width, height, sink);
+    const auto start = Clock::now();
+    scene->render(width, height, sink);
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results.push_back({"mesh", "render",
+                       {{"triangles", number(triangles)}, {"width", number(width)}, {"height", number(height)},
+                        {"threads", number(hardware)}},
+                       1, seconds, (double) (width * height) / seconds, "pixels/s"});
+    std::cerr << "mesh: " << triangles << " triangles: " << raycast.first / raycast.second << " rays/s, "
+              << width << "x" << height << " frame " << seconds << " s\n";
+    delete scene;
+
+    std::ifstream written(path, std::ios::binary | std::ios::ate);
+    const auto bytes = (double) written.tellg();
+    Mesh loaded;
+    const auto load_start = Clock::now();
+    const bool ok = load_obj(path, loaded);
+    const double load_seconds = std::chrono::duration<double>(Clock::now() - load_start).count();
+    std::remove(path);
+    if (ok) {
+        results.push_back({"mesh", "load_obj",
+                           {{"triangles", number(loaded.triangle_count())}, {"bytes", number(bytes)}},
+                           1, load_seconds, bytes / 1e6 / load_seconds, "MB/s"});
+        std::cerr << "mesh: loaded " << bytes / 1e6 << " MB of OBJ in " << load_seconds << " s\n";
+    }
+}
+
+/*
+ * A cluster of spheres placed many times at random through the same slab as generate_scene's spheres,
+ * each placement turned and scaled at random, as instances of one prototype and, where it fits in memory,
+ * as the same spheres added one by one. Reports how big each scene is, how long it takes to finalise,
+ * and how fast it renders.
+ */
+void instancing_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = full ? 1280 : 480;
+    const size_t height = full ? 720 : 270;
+    const std::vector<std::pair<size_t, size_t>> configs =
+            full ? std::vector<std::pair<size_t, size_t>>{{100, 10000}, {1000, 10000}, {1000, 100000}}
+                 : std::vector<std::pair<size_t, size_t>>{{100, 1000}, {100, 10000}};
+    for (const auto &config : configs) {
+        const size_t cluster = config.first;
+        const size_t placements = config.second;
+        std::mt19937 rng(15);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        std::vector<Sphere> spheres;
+        std::vector<Material> materials;
+        const float radius = 0.4f * std::cbrt(8.0f / (float) cluster);
+        for (size_t i = 0; i < cluster; i++) {
+            spheres.emplace_back(Pos3f(unit(rng) * 2 - 1, unit(rng) * 2 - 1, unit(rng) * 2 - 1),
+                                 radius * (0.5f + unit(rng)));
+            materials.emplace_back(Vec3f(unit(rng), unit(rng), unit(rng)), Vec3f(1, 1, 1) * unit(rng),
+                                   1 + 20 * unit(rng));
+        }
+        std::vector<std::pair<Transform, float>> transforms;
+        const float extent = 40.0f;
+        const float depth = 40.0f;
+        const float scale = 0.4f * std::cbrt(4 * extent * extent * depth / (float) placements);
+        for (size_t i = 0; i < placements; i++) {
+            const float factor = scale * (0.5f + unit(rng));
+            const Vec3f offset((unit(rng) * 2 - 1) * extent, (unit(rng) * 2 - 1) * extent, 10 + unit(rng) * depth);
+            const Vec3f axis(unit(rng) * 2 - 1, unit(rng) * 2 - 1, unit(rng) * 2 - 1);
+            transforms.emplace_back(Transform::translation(offset) * Transform::rotation(axis, 2 * PI * unit(rng)) *
+                                    Transform::scaling(factor), factor);
+        }
+
+        for (const bool instanced : {true, false}) {
+            if (!instanced && cluster * placements > 1000000) {
+                continue;
+            }
+            Scene *scene = generate_scene(0, 4, 16);
+            std::vector<MaterialHandle> handles;
+            for (const Material &material : materials) {
+                handles.push_back(scene->add_material(material));
+            }
+            if (instanced) {
+                const PrototypeHandle prototype = scene->add_prototype();
+                for (size_t i = 0; i < cluster; i++) {
+                    scene->add_sphere(prototype, spheres[i].centre, spheres[i].radius, handles[i]);
+                }
+                for (const auto &transform : transforms) {
+                    scene->add_instance(prototype, transform.first);
+                }
+            } else {
+                for (const auto &transform : transforms) {
+                    for (size_t i = 0; i < cluster; i++) {
+                        scene->add_sphere(transform.first.apply(spheres[i].centre),
+                                          spheres[i].radius * transform.second, handles[i]);
+                    }
+                }
+            }
+            const auto build_start = Clock::now();
+            scene->finalise();
+            const double build_seconds = std::chrono::duration<double>(Clock::now() - build_start).count();
+            scene->settings.thread_count = hardware;
+
+            NullSink sink;
+            scene->render(width, height, sink);
+            const auto start = Clock::now();
+            scene->render(width, height, sink);
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            const size_t bytes = scene->memory_size();
+            delete scene;
+
+            results.push_back({"instancing", instanced ? "instanced" : "flat",
+                               {{"cluster", number(cluster)}, {"placements", number(placements)},
+                                {"spheres", number(cluster * placements)}, {"bytes", number(bytes)},
+                                {"build_seconds", number(build_seconds)}, {"width", number(width)},
+                                {"height", number(height)}, {"threads", number(hardware)}},
+                               1, seconds, (double) (width * height) / seconds, "pixels/s"});
+            std::cerr << "instancing: " << cluster * placements << " spheres " << (instanced ? "instanced" : "flat")
+                      << ": " << bytes / 1048576.0 << " MiB, built in " << build_seconds << " s, frame "
+                      << seconds << " s\n";
+        }
+    }
+}
+
+/*
+ * Each fractal in front of the default camera: marching rays through it one at a time against four at a time
+ * (the rays of a row of a packet, which mostly step alike), and preview-sized renders of it with plain and
+ * over-relaxed sphere tracing. Instrumented builds report the steps per ray.
+ */
+void field_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = full ? 1280 : 320;
+    const size_t height = full ? 720 : 180;
+    for (const FractalKind kind : {FractalKind::julia, FractalKind::mandelbulb}) {
+        const char *fractal = kind == FractalKind::julia ? "julia" : "mandelbulb";
+        Scene *scene = generate_scene(0, 4, 17);
+        const DistanceField field = kind == FractalKind::julia
+                                    ? DistanceField::julia(Pos3f(0, 0, 4), 1.5f, Quatf(-0.2f, 0.6f, 0.2f, 0.2f))
+                                    : DistanceField::mandelbulb(Pos3f(0, 0, 4), 1.8f);
+        scene->add_field(field, scene->add_material(Material(Vec3f(0.8, 0.6, 0.4), Vec3f(0.3, 0.3, 0.3), 20)));
+        scene->finalise();
+        scene->settings.thread_count = hardware;
+
+        const size_t side = 64;
+        const Viewport viewport(scene->camera, side, side);
+        std::vector<Ray3f> rays;
+        for (size_t j = 0; j < side; j++) {
+            for (size_t i = 0; i < side; i++) {
+                rays.push_back(viewport.ray((float) i, (float) j));
+            }
+        }
+        for (const size_t lanes : {1, 4}) {
+            size_t r = 0;
+            const auto march = time_loop([&] {
+                float t[4] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                              std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+                Surface surfaces[4];
+                if (scene->intersect_fields(&rays[r], t, surfaces, lanes)) {
+                    sink_value = sink_value + t[0];
+                }
+                r = (r + lanes) % rays.size();
+            }, 64, full ? 1.0 : 0.2);
+            const double rays_per_second = (double) (march.first * lanes) / march.second;
+            results.push_back({"field", "march", {{"fractal", fractal}, {"lanes", number(lanes)}},
+                               march.first * lanes, march.second, rays_per_second, "rays/s"});
+            std::cerr << "field: " << fractal << ", " << lanes << " rays at a time: " << rays_per_second
+                      << " rays/s\n";
+        }
+
+        NullSink sink;
+        for (const float relaxation : {1.0f, FIELD_RELAXATION}) {
+            scene->settings.march.relaxation = relaxation;
+            Stats::reset();
+            scene->render(width, height, sink);
+            const auto start = Clock::now();
+            scene->render(width, height, sink);
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            const Stats::Counters counters = Stats::total();
+            const uint64_t traced = counters.primary_rays + counters.shadow_rays;
+            const double steps = traced > 0 ? (double) counters.field_steps / (double) traced : 0;
+            results.push_back({"field", "render",
+                               {{"fractal", fractal}, {"relaxation", number(relaxation)},
+                                {"width", number(width)}, {"height", number(height)}, {"threads", number(hardware)},
+                                {"steps_per_ray", number(steps)}},
+                               1, seconds, (double) (width * height) / seconds, "pixels/s"});
+            std::cerr << "field: " << fractal << ", relaxation " << relaxation << ": " << width << "x" << height
+                      << " frame " << seconds * 1000 << " ms";
+            if (Stats::enabled) {
+                std::cerr << ", " << steps << " steps per ray";
+            }
+            std::cerr << "\n";
+        }
+        delete scene;
+    }
+}
+
+/*
+ * Ambient occlusion on a generated scene lit mostly by its ambient light: the cost of a frame with occlusion
+ * found at every pixel and at half resolution, for a few sample counts, and each one's RMS error against
+ * a frame with 256 samples at every pixel.
+ */
+void ambient_occlusion_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t width = full ? 640 : 320;
+    const size_t height = full ? 360 : 180;
+    Scene *scene = generate_scene(10000, 4, 24, 0.2f);
+    scene->ambient_colour = Vec3f(0.8f, 0.8f, 0.8f);
+    scene->finalise();
+    scene->settings.thread_count = hardware;
+
+    std::vector<Vec3f> reference(width * height);
+    scene->settings.ao_samples = 256;
+    scene->render(width, height, reference);
+
+    struct Config {
+        size_t samples;
+        bool half_resolution;
+    };
+    for (const Config config : {Config{0, false}, Config{4, false}, Config{16, false}, Config{64, false},
+                                Config{4, true}, Config{8, true}, Config{16, true}}) {
+        scene->settings.ao_samples = config.samples;
+        scene->settings.ao_half_resolution = config.half_resolution;
+        std::vector<Vec3f> framebuffer(width * height);
+        Stats::reset();
+        const auto start = Clock::now();
+        scene->render(width, height, framebuffer);
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        // Highlights with fractional exponents can be NaN where the reflection points away from the viewer;
+        // those pixels are left out.
+        double squared_error = 0;
+        size_t compared = 0;
+        for (size_t p = 0; p < framebuffer.size(); p++) {
+            const Vec3f difference = framebuffer[p] - reference[p];
+            const float squared = difference * difference;
+            if (std::isfinite(squared)) {
+                squared_error += squared / 3;
+                compared++;
+            }
+        }
+        const double error = std::sqrt(squared_error / (double) std::max((size_t) 1, compared));
+        const char *resolution = config.half_resolution ? "half" : "full";
+        results.push_back({"ambient_occlusion", "render",
+                           {{"samples", number(config.samples)}, {"resolution", resolution},
+                            {"width", number(width)}, {"height", number(height)}, {"threads", number(hardware)},
+                            {"rms_error", number(error)},
+                            {"occlusion_rays", number(Stats::total().occlusion_rays)}},
+                           1, seconds, (double) (width * height) / seconds, "pixels/s"});
+        std::cerr << "ambient_occlusion: " << config.samples << " samples at " << resolution << " resolution: "
+                  << width << "x" << height << " frame " << seconds * 1000 << " ms, RMS error " << error << "\n";
+    }
+    delete scene;
+}
+
+/*
+ * Textures: converting an image to a tiled file against reusing the file, random and coherent lookups with a
+ * cache big enough for the whole texture against one an eighth of its size, and renders of a generated scene
+ * with and without every material textured.
+ */
+void texture_benchmarks(std::vector<Result> &results, const bool &full) {
+    const std::string path = "./raymonde_bench_texture.ppm";
+    const uint32_t side = full ? 8192 : 2048;
+    {
+        std::mt19937 rng(21);
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "P6\n" << side << " " << side << "\n255\n";
+        std::vector<char> row(side * 3);
+        for (uint32_t y = 0; y < side; y++) {
+            for (uint32_t x = 0; x < side; x++) {
+                const uint32_t noise = rng();
+                row[x * 3] = (char) (((x / 64 + y / 64) % 2) * 192 + (noise & 63));
+                row[x * 3 + 1] = (char) (x * 255 / side);
+                row[x * 3 + 2] = (char) ((noise >> 8) & 255);
+            }
+            out.write(row.data(), (std::streamsize) row.size());
+        }
+    }
+    std::remove((path + ".tiles").c_str());
+
+    const size_t texture_bytes = (size_t) side * side * 4 * 4 / 3;
+    for (const bool convert : {true, false}) {
+        TextureCache cache;
+        uint32_t texture;
+        const auto start = Clock::now();
+        if (!cache.load(path, texture)) {
+            return;
+        }
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        const char *name = convert ? "convert" : "reuse";
+        results.push_back({"texture", "load", {{"side", number(side)}, {"mode", name}},
+                           1, seconds, (double) side * side / seconds, "texels/s"});
+        std::cerr << "texture: " << side << "x" << side << " " << name << ": " << seconds * 1000 << " ms\n";
+    }
+
+    for (const size_t capacity : {texture_bytes * 2, texture_bytes / 8}) {
+        for (const bool coherent : {false, true}) {
+            TextureCache cache(capacity);
+            uint32_t texture;
+            if (!cache.load(path, texture)) {
+                return;
+            }
+            std::mt19937 rng(22);
+            std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+            float u = 0;
+            float v = 0;
+            const auto lookups = time_loop([&] {
+                if (coherent) {
+                    // A scanline across the texture, a texel per lookup.
+                    u += 1.0f / (float) side;
+                    if (u >= 1) {
+                        u = 0;
+                        v = v + 1.0f / (float) side >= 1 ? 0 : v + 1.0f / (float) side;
+                    }
+                } else {
+                    u = unit(rng);
+                    v = unit(rng);
+                }
+                sink_value = sink_value + cache.sample(texture, u, v, 1.5f).x;
+            }, 4096, full ? 1.0 : 0.2);
+            const TextureCacheStats stats = cache.stats();
+            const double hit_rate = (double) stats.hits / (double) std::max((uint64_t) 1, stats.hits + stats.misses);
+            const double per_second = (double) lookups.first / lookups.second;
+            const char *pattern = coherent ? "coherent" : "random";
+            results.push_back({"texture", "sample",
+                               {{"side", number(side)}, {"cache_mib", number(capacity / 1048576.0)},
+                                {"pattern", pattern}, {"hit_rate", number(hit_rate)}},
+                               lookups.first, lookups.second, per_second, "lookups/s"});
+            std::cerr << "texture: " << pattern << " lookups, " << capacity / 1048576.0 << " MiB cache: "
+                      << per_second << " lookups/s, " << hit_rate * 100 << "% tile hits\n";
+        }
+    }
+
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (const bool textured : {false, true}) {
+        Scene *scene = generate_scene(10000, 4, 23);
+        scene->finalise();
+        scene->settings.thread_count = hardware;
+        scene->settings.texture_cache_size = texture_bytes / 8;
+        TextureHandle texture;
+        if (textured && scene->load_texture(path, texture)) {
+            for (uint32_t m = 0; m < scene->materials.size(); m++) {
+                scene->set_diffuse_texture({m}, texture);
+            }
+        }
+        NullSink sink;
+        const size_t width = full ? 1920 : 480;
+        const size_t height = full ? 1080 : 270;
+        scene->render(width, height, sink);
+        const auto start = Clock::now();
+        scene->render(width, height, sink);
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        results.push_back({"texture", "render",
+                           {{"textured", textured ? "true" : "false"}, {"spheres", "10000"},
+                            {"width", number(width)}, {"height", number(height)}, {"threads", number(hardware)}},
+                           1, seconds, (double) (width * height) / seconds, "pixels/s"});
+        std::cerr << "texture: " << (textured ? "textured" : "untextured") << " " << width << "x" << height
+                  << " frame " << seconds * 1000 << " ms\n";
+        delete scene;
+    }
+    std::remove((path + ".tiles").c_str());
+    std::remove(path.c_str());
+}
+
+/*
+ * Turntable sequences of generated scenes: the time per frame spent updating (refitting) and rendering,
+ * against rebuilding the acceleration structures from scratch each frame.
+ */
+void sequence_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const size_t frames = full ? 120 : 24;
+    for (const size_t sphere_count : full ? std::vector<size_t>{10000, 100000, 1000000}
+                                          : std::vector<size_t>{10000, 100000}) {
+        Scene *scene = generate_scene(sphere_count, 4, 6);
+        scene->finalise();
+        scene->settings.thread_count = hardware;
+        const auto rebuild_start = Clock::now();
+        scene->finalise();
+        const double rebuild_ms = std::chrono::duration<double, std::milli>(Clock::now() - rebuild_start).count();
+
+        Turntable turntable(*scene, frames);
+        NullOutput output;
+        SequenceStats stats;
+        render_sequence(*scene, 256, 144, turntable, output, stats);
+
+        results.push_back({"sequence", "turntable",
+                           {{"spheres", number(sphere_count)}, {"frames", number(frames)},
+                            {"width", "256"}, {"height", "144"}, {"threads", number(hardware)},
+                            {"update_ms", number(stats.update_ms / frames)},
+                            {"render_ms", number(stats.render_ms / frames)},
+                            {"rebuild_ms", number(rebuild_ms)},
+                            {"refits", number(scene->bvh.build_stats.refit_count)}},
+                           frames, stats.total_ms / 1000.0, frames / (stats.total_ms / 1000.0), "frames/s"});
+        std::cerr << "sequence: " << sphere_count << " spheres, " << frames << " frames: "
+                  << stats.total_ms / frames << " ms per frame (" << stats.update_ms / frames << " update, "
+                  << stats.render_ms / frames << " render), rebuilding takes " << rebuild_ms << " ms\n";
+        delete scene;
+    }
+}
+
+/*
+ * Turning a rendered frame of linear light into stored pixels, tile by tile on one thread: the scalar clamp
+ * the renderer used before post-processing, against the vector kernel with each tone map, with and without
+ * the sRGB curve, and at 16 bits. The frame's light spans several stops, as lit scenes' does.
+ */
+void post_process_benchmarks(std::vector<Result> &results, const bool &full) {
+    const size_t width = full ? 3840 : 1920;
+    const size_t height = full ? 2160 : 1080;
+    const size_t tile_size = 64;
+    std::vector<Vec3f> frame(width * height);
+    std::mt19937 rng(25);
+    std::uniform_real_distribution<float> stops(-8.0f, 3.0f);
+    for (Vec3f &pixel : frame) {
+        pixel = Vec3f(std::exp2(stops(rng)), std::exp2(stops(rng)), std::exp2(stops(rng)));
+    }
+    std::vector<uint8_t> image(width * height * 3 * 2);
+    std::vector<Tile> tiles;
+    for (size_t y = 0; y < height; y += tile_size) {
+        for (size_t x = 0; x < width; x += tile_size) {
+            tiles.emplace_back(x, y, std::min(tile_size, width - x), std::min(tile_size, height - y));
+        }
+    }
+
+    struct Config {
+        std::string name;
+        PostProcess post;
+        bool scalar_clamp;
+    };
+    std::vector<Config> configs(1, {"scalar-clamp", PostProcess(), true});
+    for (const ToneMap tone_map : {ToneMap::clamp, ToneMap::reinhard, ToneMap::aces}) {
+        for (const bool srgb : {false, true}) {
+            PostProcess post;
+            post.tone_map = tone_map;
+            post.srgb = srgb;
+            configs.push_back({std::string(tone_map_name(tone_map)) + (srgb ? "-srgb" : ""), post, false});
+        }
+    }
+    PostProcess wide;
+    wide.tone_map = ToneMap::aces;
+    wide.srgb = true;
+    wide.bits = 16;
+    configs.push_back({"aces-srgb-16", wide, false});
+
+    std::cerr << "Post-processing kernel: " << quantise_kernel_name() << "\n";
+    for (const Config &config : configs) {
+        const auto timing = time_loop([&] {
+            for (const Tile &tile : tiles) {
+                const Vec3f *pixels = &frame[tile.x + tile.y * width];
+                if (!config.scalar_clamp) {
+                    quantise_tile(tile, pixels, width, image.data(), width, config.post);
+                    continue;
+                }
+                for (size_t j = 0; j < tile.height; j++) {
+                    uint8_t *row = image.data() + ((tile.y + j) * width + tile.x) * 3;
+                    for (size_t i = 0; i < tile.width; i++) {
+                        const Vec3f &c = pixels[i + j * width];
+                        row[3 * i] = (uint8_t) (255 * std::max(0.f, std::min(1.f, c.x)));
+                        row[3 * i + 1] = (uint8_t) (255 * std::max(0.f, std::min(1.f, c.y)));
+                        row[3 * i + 2] = (uint8_t) (255 * std::max(0.f, std::min(1.f, c.z)));
+                    }
+                }
+            }
+            sink_value = sink_value + image[image.size() / 3];
+        }, 1, full ? 1.0 : 0.2);
+        const double seconds = timing.second / (double) timing.first;
+        results.push_back({"post_process", "frame",
+                           {{"mode", config.name}, {"width", number(width)}, {"height", number(height)}},
+                           timing.first, timing.second, (double) (width * height) / seconds, "pixels/s"});
+        std::cerr << "post_process: " << config.name << ": " << width << "x" << height << " frame "
+                  << seconds * 1000 << " ms, " << seconds * 1e9 / (double) (width * height) << " ns per pixel\n";
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    bool full = false;
+    const char *out_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--full") == 0) {
+            full = true;
+        } else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--full] [--out results.json]\n";
+            return 1;
+        }
+    }
+
+    std::cerr << "Sphere intersection kernel: " << SphereArrays::kernel_name() << "\n";
+    std::vector<Result> results;
+    micro_benchmarks(results, full ? 1.0 : 0.2);
+    render_benchmarks(results, full);
+    multi_view_benchmarks(results, full);
+    many_light_benchmarks(results, full);
+    render_mode_benchmarks(results, full);
+    farm_benchmarks(results, full);
+    path_benchmarks(results, full);
+    mesh_benchmarks(results, full);
+    instancing_benchmarks(results, full);
+    field_benchmarks(results, full);
+    texture_benchmarks(results, full);
+    ambient_occlusion_benchmarks(results, full);
+    post_process_benchmarks(results, full);
+    sequence_benchmarks(results, full);
+    scene_file_benchmarks(results, full);
+
+    if (out_path != nullptr) {
+        std::ofstream out(out_path);
+        write_json(out, results);
+    } else {
+        write_json(std::cout, results);
+    }
+    return 0;
+}
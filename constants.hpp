@@ -6,3 +6,68 @@
 #define MERGE_EPSILON 0.00001
 
 #define INCIDENT_NORMAL_DISPLACEMENT 0.00001
+
+// Specular exponents which are whole numbers up to this are computed by repeated multiplication.
+#define SPECULAR_INTEGER_LIMIT 128
+
+// Bounding volume hierarchy construction parameters.
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 1.0f
+#define BVH_STACK_SIZE 64
+
+// A refitted BVH is rebuilt once its expected cost grows past this multiple of its cost when built.
+#define BVH_REFIT_LIMIT 1.5f
+
+// Primary rays are traced in square packets of this many pixels per side.
+#define PACKET_WIDTH 4
+#define PACKET_RAYS (PACKET_WIDTH * PACKET_WIDTH)
+
+// Lanes of a packet that still hit a node once fewer than this many do are traced individually.
+#define PACKET_DIVERGENCE_THRESHOLD 4
+
+// The sphere arrays are padded so that a full vector load starting at any valid entry stays in bounds.
+#define SPHERE_ARRAYS_PADDING 8
+
+// Path tracing: rays leaving a surface start this far off it, and queues are processed in chunks of this many rays.
+#define PATH_RAY_OFFSET 0.0001f
+#define PATH_CHUNK_SIZE 4096
+
+// Mesh hierarchy leaves hold at most 2^MESH_LEAF_COUNT_BITS - 1 triangles. The traversal stack has room
+// for the deepest hierarchy the BVH builder makes, plus the splitting of any leaves larger than that.
+#define MESH_LEAF_COUNT_BITS 5
+#define MESH_STACK_SIZE 96
+// How far outside a triangle, in barycentric coordinates, a hit still counts, so rays can't slip between
+// triangles through rounding along their shared edges.
+#define MESH_EDGE_EPSILON 1e-6f
+
+// Distance fields: the default march settings (see MarchSettings), and the squared magnitude past which
+// a fractal's orbit has escaped.
+#define FIELD_MAX_STEPS 256
+#define FIELD_EPSILON 0.001f
+#define FIELD_RELAXATION 1.5f
+#define FIELD_ESCAPE 256.0f
+// A hit on a distance field is moved off the surface by this many times the tolerance it was found to,
+// so that shadow rays leaving it aren't stopped by the surface they start on.
+#define FIELD_SURFACE_OFFSET 2.0f
+
+// Textures are cached in square tiles of this many texels a side (a power of two), four bytes a texel,
+// in a pool of TEXTURE_CACHE_SIZE bytes by default, split into this many independently locked shards.
+#define TEXTURE_TILE_SIZE 32
+#define TEXTURE_TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 4)
+#define TEXTURE_CACHE_SIZE ((size_t) 64 << 20)
+#define TEXTURE_CACHE_SHARDS 16
+// A texture lookup's footprint grows as the surface turns away from the viewer, but no further than it would
+// for a surface at an angle with this cosine, so that grazing views don't blur textures away entirely.
+#define TEXTURE_MIN_COSINE 0.2f
+
+// Ambient occlusion rays look this far for something blocking them, by default, and start off the surface
+// by this fraction of that: they leave it at every angle, and at grazing ones, rounding in the hit
+// can put the start just behind the surface.
+#define AO_DISTANCE 4.0f
+#define AO_RAY_OFFSET 0.001f
+// At half resolution, a pixel takes the occlusion found at a nearby one only if that lies off the pixel's
+// tangent plane by less than this fraction of the pixel's depth, and the cosine between their normals is at least this.
+#define AO_PLANE_TOLERANCE 0.02f
+#define AO_NORMAL_TOLERANCE 0.9f
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "Geometry.hpp"
+
+/*
+ * Checks the 3-D fast paths of Geometry.hpp against the generic Vec<D, T> and Pos<D, T> templates they stand in for,
+ * which are run as 4-D vectors whose last component is zero, as no specialisation covers those.
+ *
+ * Each result must be within a stated number of units in the last place of the generic one, measured against
+ * the magnitude of the terms that make it up, so that cancellation doesn't count against the fast path.
+ * CMake builds this once as it is and once with RAYMONDE_FAST_RSQRT, whose normalisation gets a looser bound.
+ *
+ * Usage: raymonde_geometry_check; the exit status is nonzero if any check fails.
+ */
+
+namespace {
+
+typedef Vec<4, float> Vec4f;
+typedef Pos<4, float> Pos4f;
+
+#ifdef GEOMETRY_FAST_RSQRT
+const float UNIT_ULPS = 4;
+const char *const RSQRT_NAME = "fast reciprocal square root";
+#else
+const float UNIT_ULPS = 1;
+const char *const RSQRT_NAME = "exact square root";
+#endif
+
+Vec4f widen(const Vec3f &v) {
+    Vec4f w;
+    for (size_t i = 0; i < 3; i++) {
+        w[i] = v[i];
+    }
+    return w;
+}
+
+Pos4f widen(const Pos3f &p) {
+    Pos4f w;
+    for (size_t i = 0; i < 3; i++) {
+        w[i] = p[i];
+    }
+    return w;
+}
+
+/*
+ * The worst error of one operation, in units in the last place, against the bound it must stay within.
+ */
+struct Check {
+    std::string name;
+    float allowed_ulps;
+    float worst_ulps;
+
+    Check(const std::string &n, const float &allowed)
+            : name(n), allowed_ulps(allowed), worst_ulps(0) {}
+
+    void compare(const float &fast, const float &generic, const float &scale) {
+        const float ulp = std::max(scale, FLT_MIN) * FLT_EPSILON;
+        worst_ulps = std::max(worst_ulps, std::isfinite(fast) ? std::abs(fast - generic) / ulp : INFINITY);
+    }
+
+    bool report(std::ostream &out) const {
+        const bool ok = worst_ulps <= allowed_ulps;
+        out << (ok ? "ok   " : "FAIL ") << name << ": worst " << worst_ulps << " ulp (allowed " << allowed_ulps
+            << ")\n";
+        return ok;
+    }
+};
+
+}
+
+int main() {
+    std::mt19937 rng(15);
+    std::uniform_real_distribution<float> spread(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> exponent(-6.0f, 6.0f);
+    auto random_vector = [&] {
+        Vec3f v(spread(rng), spread(rng), spread(rng));
+        if (rng() % 8 == 0) {
+            v[rng() % 3] = 0;
+        }
+        return v * std::pow(10.0f, exponent(rng));
+    };
+
+    Check dot("dot", 2);
+    Check hadamard_product("hadamard", 1);
+    Check projected("projection", 6);
+    Check difference("position difference", 1);
+    Check squared_distance("distance_squared", 2);
+    Check length("length", 1);
+    Check unit("unit", UNIT_ULPS);
+    Check normalised("normalise(2.5)", UNIT_ULPS);
+
+    for (size_t n = 0; n < 100000; n++) {
+        const Vec3f a = random_vector();
+        const Vec3f b = random_vector();
+        const Vec4f wa = widen(a);
+        const Vec4f wb = widen(b);
+
+        float magnitude = 0;
+        for (size_t i = 0; i < 3; i++) {
+            magnitude += std::abs(a[i] * b[i]);
+        }
+        dot.compare(a * b, wa * wb, magnitude);
+
+        const Vec3f h = hadamard(a, b);
+        const Vec4f wh = hadamard(wa, wb);
+        for (size_t i = 0; i < 3; i++) {
+            hadamard_product.compare(h[i], wh[i], std::abs(a[i] * b[i]));
+        }
+
+        if (b * b > 0) {
+            const Vec3f p = projection(a, b);
+            const Vec4f wp = projection(wa, wb);
+            for (size_t i = 0; i < 3; i++) {
+                projected.compare(p[i], wp[i], magnitude / (b * b) * std::abs(b[i]));
+            }
+        }
+
+        const Pos3f start(a.x, a.y, a.z);
+        const Pos3f end(b.x, b.y, b.z);
+        const Vec3f d = end - start;
+        const Vec4f wd = widen(end) - widen(start);
+        float spread_squared = 0;
+        for (size_t i = 0; i < 3; i++) {
+            difference.compare(d[i], wd[i], std::abs(a[i]) + std::abs(b[i]));
+            spread_squared += wd[i] * wd[i];
+        }
+        squared_distance.compare(distance_squared(end, start), wd * wd, spread_squared);
+
+        length.compare(a.length(), wa.length(), wa.length());
+        if (a * a > 0) {
+            const Vec3f u = a.unit();
+            const Vec4f wu = wa.unit();
+            Vec3f v = a;
+            v.normalise(2.5f);
+            Vec4f wv = wa;
+            wv.normalise(2.5f);
+            for (size_t i = 0; i < 3; i++) {
+                unit.compare(u[i], wu[i], 1);
+                normalised.compare(v[i], wv[i], 2.5f);
+            }
+        }
+    }
+
+    std::cout << "Geometry fast paths against the generic templates, with " << RSQRT_NAME << ":\n";
+    bool ok = true;
+    for (const Check *check : {&dot, &hadamard_product, &projected, &difference, &squared_distance, &length, &unit,
+                               &normalised}) {
+        ok = check->report(std::cout) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "Camera.hpp"
+#include "Geometry.hpp"
+#include "LightTree.hpp"
+#include "Scene.hpp"
+#include "Shading.hpp"
+
+/*
+ * Checks that shading from lights sampled from the light tree is right on average with a light cutoff,
+ * including at points where the tree's descent can end among lights that are all below the cutoff.
+ *
+ * A patch of floor is lit by a few lights that pass the cutoff, and beside it is a row of lights that are each
+ * just too dim to pass it. The farthest of those are bright enough that every node over the row passes the cutoff,
+ * and between them they take most of the tree's estimate, so most descents end without a light. Both the tree's
+ * own estimate of the light at the patch and sampled_colour over it are compared with lighting from every light
+ * that passes the cutoff.
+ *
+ * Usage: raymonde_light_check; the exit status is nonzero if any check fails.
+ */
+
+namespace {
+
+const float CUTOFF = 0.1f;
+const size_t ROW_LENGTH = 24;
+
+/*
+ * How far an estimate is from the exact value, against what it may be off by.
+ */
+bool report(std::ostream &out, const std::string &name, const float &estimate, const float &exact,
+            const float &tolerance) {
+    const float error = std::abs(estimate - exact) / exact;
+    const bool ok = error <= tolerance;
+    out << (ok ? "ok   " : "FAIL ") << name << ": " << estimate << " against " << exact << ", off by "
+        << 100 * error << "% (allowed " << 100 * tolerance << "%)\n";
+    return ok;
+}
+
+}
+
+int main() {
+    Scene scene(Camera(Pos3f(0, 1, -1), Vec3f(0, 0, 1), PI / 2), Vec3f(0, 0, 0), Vec3f(0, 0, 0));
+    const Pos3f centre(0, 0, 0);
+    for (size_t l = 1; l <= ROW_LENGTH; l++) {
+        const Pos3f position(2.0f * (float) l, 1, 0);
+        scene.add_light(position, Vec3f(1, 1, 1), 0.9f * CUTOFF * distance_squared(position, centre));
+    }
+    scene.add_light(Pos3f(0, 3, 0), Vec3f(1, 0.9f, 0.8f), 5);
+    scene.add_light(Pos3f(-3, 2, 2), Vec3f(0.8f, 0.9f, 1), 3);
+    scene.add_light(Pos3f(1, 4, -3), Vec3f(1, 1, 1), 8);
+    scene.settings.light_cutoff = CUTOFF;
+    scene.finalise();
+    const LightTree &tree = scene.light_tree;
+
+    // The tree's estimate at the middle of the patch, over evenly spread random numbers, against every light.
+    float exact = 0;
+    tree.visit(centre, CUTOFF, [&](const uint32_t &l) {
+        exact += tree.power[l] / distance_squared(scene.lights[l].position, centre);
+    });
+    const size_t steps = 100000;
+    size_t failed = 0;
+    float estimate = 0;
+    for (size_t k = 0; k < steps; k++) {
+        uint32_t l;
+        float probability;
+        if (!tree.sample(centre, CUTOFF, ((float) k + 0.5f) / (float) steps, l, probability)) {
+            failed++;
+            continue;
+        }
+        estimate += tree.power[l] / distance_squared(scene.lights[l].position, centre) / probability;
+    }
+    estimate /= (float) steps;
+
+    std::cout << "Light tree sampling with cutoff " << CUTOFF << ", " << scene.lights.size() << " lights:\n";
+    bool ok = failed > 0;
+    std::cout << (ok ? "ok   " : "FAIL ") << "descents ending below the cutoff: " << failed << " of " << steps << "\n";
+    ok = report(std::cout, "tree estimate", estimate, exact, 0.01f) && ok;
+
+    // Shading over the patch from a few sampled lights at each point, against shading from every light.
+    const Material material(Vec3f(1, 1, 1), Vec3f(0, 0, 0), 10);
+    scene.settings.light_samples = 4;
+    Vec3f sampled(0, 0, 0);
+    Vec3f full(0, 0, 0);
+    const size_t side = 200;
+    for (size_t j = 0; j < side; j++) {
+        for (size_t i = 0; i < side; i++) {
+            const Pos3f point(((float) i / side - 0.5f) * 0.1f, 0, ((float) j / side - 0.5f) * 0.1f);
+            const Ray3f incident(Pos3f(0, 1, -1), (point - Pos3f(0, 1, -1)).unit());
+            const Ray3f normal(point, Vec3f(0, 1, 0));
+            sampled += sampled_colour(incident, normal, material, scene);
+            full += surface_colour(incident, normal, material, scene);
+        }
+    }
+    ok = report(std::cout, "sampled shading", sampled.x, full.x, 0.02f) && ok;
+    return ok ? 0 : 1;
+}
@@ -1,14 +1,34 @@
+#include <algorithm>
 #include <limits>
 #include <cmath>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
-#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 #include "constants.hpp"
+#include "Farm.hpp"
 #include "Geometry.hpp"
 #include "Sphere.hpp"
 #include "Camera.hpp"
+#include "DistanceField.hpp"
+#include "ImageSink.hpp"
+#include "Mesh.hpp"
+#include "ObjFile.hpp"
+#include "PathTracer.hpp"
+#include "Progressive.hpp"
 #include "Scene.hpp"
+#include "SceneFile.hpp"
+#include "Sequence.hpp"
+#include "RenderSettings.hpp"
+#include "Stats.hpp"
 
 /*
  * The intensity at a given pixel of a sine wave that extends across the field.
@@ -79,85 +99,536 @@ Scene *setup_scene() {
     scene->add_light(Pos3f(0, -50, 5), green, 1500.0);
     scene->add_light(Pos3f(50, 0, 15), blue, 1500.0);
 
+    scene->finalise();
+    return scene;
+}
+
+/*
+ * Set up a scene of the mesh in the given OBJ file, lit from three sides and seen from in front,
+ * far enough back to take it all in. Returns null if the file couldn't be loaded.
+ */
+Scene *setup_mesh_scene(const std::string &obj_path) {
+    Mesh mesh;
+    if (!load_obj(obj_path, mesh)) {
+        return nullptr;
+    }
+    mesh.build();
+
+    const Pos3f centre = mesh.bounds.min + (mesh.bounds.max - mesh.bounds.min) / 2;
+    const float radius = std::max(distance(mesh.bounds.min, mesh.bounds.max) / 2, 1e-3f);
+    const float cam_fov = PI / 3.0f;
+    const Camera camera(centre - Vec3f(0, 0, 1.2f * radius / std::tan(cam_fov / 2)), Vec3f(0, 0, 1.0f), cam_fov);
+    auto scene = new Scene(camera, Vec3f(0.05, 0.03, 0.04), Vec3f(0.05, 0.03, 0.04));
+
+    const Vec3f white(1.0, 1.0, 1.0);
+    scene->add_mesh(std::move(mesh), scene->add_material(Material(Vec3f(0.7, 0.7, 0.7), 0.2 * white, 10.0)));
+
+    const float brightness = 4 * radius * radius;
+    scene->add_light(centre + Vec3f(-2, 2, -2) * radius, white, 2 * brightness);
+    scene->add_light(centre + Vec3f(2, 1, -1) * radius, Vec3f(1.0, 0.8, 0.6), brightness);
+    scene->add_light(centre + Vec3f(0, -2, 2) * radius, Vec3f(0.6, 0.7, 1.0), brightness);
+
+    scene->finalise();
+    return scene;
+}
+
+/*
+ * Set up a scene of a fractal, the given "julia" or "mandelbulb", resting above a floor and lit from three sides.
+ * Returns null if there is no such fractal.
+ */
+Scene *setup_fractal_scene(const std::string &name) {
+    DistanceField field;
+    if (name == "julia") {
+        field = DistanceField::julia(Pos3f(0, 0, 0), 1, Quatf(-0.2f, 0.6f, 0.2f, 0.2f));
+    } else if (name == "mandelbulb") {
+        field = DistanceField::mandelbulb(Pos3f(0, 0, 0), 1.2f);
+    } else {
+        std::cerr << "Unknown fractal " << name << "; expected julia or mandelbulb\n";
+        return nullptr;
+    }
+
+    const float radius = field.radius() * field.scale;
+    const float cam_fov = PI / 3.0f;
+    const Camera camera(Pos3f(0, 0.2f * radius, -1.6f * radius / std::tan(cam_fov / 2)), Vec3f(0, -0.1f, 1.0f),
+                        cam_fov);
+    auto scene = new Scene(camera, Vec3f(0.05, 0.03, 0.04), Vec3f(0.05, 0.03, 0.04));
+
+    const Vec3f white(1.0, 1.0, 1.0);
+    scene->add_field(field, scene->add_material(Material(Vec3f(0.8, 0.6, 0.4), 0.3 * white, 20.0)));
+    scene->add_sphere(Pos3f(0, -10 - radius, 0), 10, Material(Vec3f(0.5, 0.5, 0.5), 0.0 * white, 10.0));
+
+    const float brightness = 4 * radius * radius;
+    const Pos3f centre = field.centre;
+    scene->add_light(centre + Vec3f(-2, 2, -2) * radius, white, 2 * brightness);
+    scene->add_light(centre + Vec3f(2, 1, -1) * radius, Vec3f(1.0, 0.8, 0.6), brightness);
+    scene->add_light(centre + Vec3f(0, 3, 2) * radius, Vec3f(0.6, 0.7, 1.0), brightness);
+
+    scene->finalise();
     return scene;
 }
 
 /*
- * Render an image of the given dimensions into the provided framebuffer.
+ * Where a render's scene comes from, as given on the command line: see open_scene.
  */
-void render(const size_t &width, const size_t &height, std::vector<Vec3f> &buffer, const float interocular = 0) {
-    Scene *scene = setup_scene();
+struct SceneSource {
+    std::string path;         // Given by --scene or --fractal; empty for the built-in scene.
+    std::string texture_path; // Given by --texture, to texture every material of the scene with; none if empty.
+};
+
+/*
+ * Load the texture at path and scale the diffuse colour of each of the scene's materials by it.
+ */
+bool apply_texture(Scene &scene, const std::string &path) {
+    TextureHandle texture;
+    if (!scene.load_texture(path, texture)) {
+        return false;
+    }
+    for (uint32_t m = 0; m < scene.materials.size(); m++) {
+        scene.set_diffuse_texture({m}, texture);
+    }
+    return true;
+}
+
+/*
+ * Load the scene from source.path, which is a scene file, an OBJ file, or "fractal:" followed by the name of
+ * a fractal, or set up the built-in one if it is empty, and texture it if source.texture_path is set.
+ * Returns null if the scene or texture couldn't be loaded.
+ */
+Scene *open_scene(const SceneSource &source, const RenderSettings &settings) {
+    const std::string &scene_path = source.path;
+    const Stats::Phase phase("setup");
+    const std::string fractal_prefix = "fractal:";
+    const bool obj = scene_path.size() > 4 && scene_path.compare(scene_path.size() - 4, 4, ".obj") == 0;
+    const bool fractal = scene_path.compare(0, fractal_prefix.size(), fractal_prefix) == 0;
+    Scene *scene = scene_path.empty() ? setup_scene()
+                   : fractal ? setup_fractal_scene(scene_path.substr(fractal_prefix.size()))
+                   : obj ? setup_mesh_scene(scene_path) : load_scene(scene_path);
+    if (scene != nullptr && !source.texture_path.empty() && !apply_texture(*scene, source.texture_path)) {
+        delete scene;
+        return nullptr;
+    }
+    if (scene != nullptr) {
+        scene->settings = settings;
+    }
+    return scene;
+}
+
+void report(const Scene &scene) {
+    scene.bvh.report(std::cerr);
+    scene.scheduler->report(std::cerr);
+    for (const Mesh &mesh : scene.meshes) {
+        mesh.report(std::cerr);
+    }
+    if (!scene.instances.empty()) {
+        size_t placed = 0;
+        for (const Instance &instance : scene.instances) {
+            placed += scene.prototypes[instance.prototype].spheres.size();
+        }
+        std::cerr << "Instances: " << scene.instances.size() << " of " << scene.prototypes.size() << " prototypes, "
+                  << placed << " spheres placed, scene " << scene.memory_size() / 1048576.0 << " MiB\n";
+    }
+    std::cerr << "Sphere intersection kernel: " << SphereArrays::kernel_name() << "\n";
+    if (!scene.meshes.empty()) {
+        std::cerr << "Triangle intersection kernel: " << Mesh::kernel_name() << "\n";
+    }
+    if (!scene.fields.empty()) {
+        std::cerr << "Distance estimation kernel: " << DistanceField::kernel_name() << "\n";
+    }
+    if (scene.textures.size() > 0) {
+        std::cerr << "Textures: " << scene.textures.size() << ", cache " << scene.textures.capacity() / 1048576.0
+                  << " MiB\n";
+        scene.textures.stats().report(std::cerr);
+    }
+    Stats::report(std::cerr);
+}
+
+/*
+ * The views making up a width x height image of the scene: the camera's own, or if the interocular distance
+ * is nonzero, a side-by-side stereo pair.
+ */
+std::vector<View> eye_views(const Camera &camera, const size_t &width, const size_t &height, const float &interocular) {
+    if (interocular == 0) {
+        return {View(camera, 0, 0, width, height)};
+    }
+    // Both eyes render together into their halves of the output; the right half is wider for odd widths.
+    const size_t left_width = width / 2;
+    const size_t right_width = width - left_width;
+    const Vec3f eye_transformation(interocular / 2, 0, 0);
+    Camera left_eye = camera;
+    Camera right_eye = camera;
+    left_eye.position = camera.position + eye_transformation;
+    right_eye.position = camera.position - eye_transformation;
+    return {View(left_eye, 0, 0, left_width, height), View(right_eye, left_width, 0, right_width, height)};
+}
+
+/*
+ * Render an image of the given dimensions into the provided sink,
+ * and a heatmap of the per-pixel cost into cost_sink if it is not null.
+ * The scene is loaded from source (see open_scene).
+ */
+bool render(const size_t &width, const size_t &height, ImageSink &sink, ImageSink *cost_sink,
+            const SceneSource &source, const RenderSettings &settings, const float interocular = 0) {
+    Scene *scene = open_scene(source, settings);
+    if (scene == nullptr) {
+        return false;
+    }
 
     // Render a side-by-side 3d rendering if the interocular distance is nonzero.
+    scene->cost_sink = cost_sink;
     if (interocular == 0) {
-        scene->render(width, height, buffer);
+        scene->render(width, height, sink);
     } else {
-        // Use two buffers in case of odd resolutions.
-        const size_t left_width = width / 2;
-        const size_t right_width = width - left_width;
-        std::vector<Vec3f> left_buffer(left_width * height);
-        std::vector<Vec3f> right_buffer(left_width * height);
-
-        Vec3f eye_transformation(interocular / 2, 0, 0);
-        Pos3f orig_cam_pos = scene->camera.position;
-
-        // Render the left eye.
-        scene->camera.position = orig_cam_pos + eye_transformation;
-        scene->render(left_width, height, left_buffer);
-
-        // Now the right.
-        scene->camera.position = orig_cam_pos - eye_transformation;
-        scene->render(right_width, height, right_buffer);
-
-        // Don't forget to reset the camera position.
-        scene->camera.position = orig_cam_pos;
-
-        // Stitch the views together into the output buffer.
-        for (size_t j = 0; j < height; j++) {
-            for (size_t i = 0; i < left_width; i++) {
-                buffer[i + j * width] = left_buffer[i + j * left_width];
-            }
-        }
-        for (size_t j = 0; j < height; j++) {
-            for (size_t i = 0; i < left_width; i++) {
-                buffer[i + left_width + j * width] = right_buffer[i + j * right_width];
-            }
-        }
+        scene->render(eye_views(scene->camera, width, height, interocular), sink);
     }
 
+    report(*scene);
     delete scene;
+    return true;
 }
 
-float clamp_unit(float f) {
-    return std::max(0.f, std::min(1.f, f));
+/*
+ * Render a mono image of the scene from its camera into the sink by path tracing.
+ */
+bool render_paths(const size_t &width, const size_t &height, ImageSink &sink, const SceneSource &source,
+                  const RenderSettings &settings, const PathSettings &path_settings) {
+    Scene *scene = open_scene(source, settings);
+    if (scene == nullptr) {
+        return false;
+    }
+
+    PathTracer tracer(*scene, path_settings);
+    PathStats stats;
+    tracer.render(width, height, sink, stats);
+    stats.report(std::cerr);
+    report(*scene);
+    delete scene;
+    return true;
+}
+
+/*
+ * A worker process of a farm render, rendering rows of the same image as render() would.
+ */
+struct SceneWorker : FarmWorker {
+    SceneWorker(const size_t &width, const size_t &height, const SceneSource &source,
+                const RenderSettings &settings, const float &interocular)
+            : width_(width), height_(height), source_(source), settings_(settings),
+              interocular_(interocular), scene_(), views_() {}
+
+    bool open() override {
+        scene_.reset(open_scene(source_, settings_));
+        if (scene_) {
+            views_ = eye_views(scene_->camera, width_, height_, interocular_);
+        }
+        return (bool) scene_;
+    }
+
+    void render(const size_t &first_row, const size_t &row_count, ImageSink &sink) override {
+        scene_->render(views_, sink, first_row, row_count);
+    }
+
+private:
+
+    size_t width_;
+    size_t height_;
+    SceneSource source_;
+    RenderSettings settings_;
+    float interocular_;
+    std::unique_ptr<Scene> scene_;
+    std::vector<View> views_;
+};
+
+/*
+ * Render the image across worker processes, each loading the scene for itself.
+ * Unless a thread count was given, the hardware threads are shared out between the workers.
+ */
+bool render_farm(const size_t &width, const size_t &height, ImageSink &sink, const SceneSource &source,
+                 RenderSettings settings, FarmSettings farm_settings, const float interocular = 0) {
+    if (settings.thread_count == 0) {
+        const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        settings.thread_count = std::max((size_t) 1, hardware / std::max((size_t) 1, farm_settings.workers));
+    }
+    // Jobs start on tile boundaries, so that the image is the same as a render in one process.
+    const size_t tile = settings.packet_tile_size();
+    farm_settings.job_rows = std::max((size_t) 1, (farm_settings.job_rows + tile - 1) / tile) * tile;
+
+    SceneWorker worker(width, height, source, settings, interocular);
+    FarmStats stats;
+    const bool ok = render_farm(width, height, worker, sink, farm_settings, stats);
+    stats.report(std::cerr);
+    return ok;
+}
+
+/*
+ * Render a sequence of frames of the given dimensions: a turntable of frame_count frames,
+ * or the frames in sequence_path if that isn't empty. Frames are written to numbered files
+ * following frames_path, or streamed to standard output if it is "-".
+ */
+bool render_frames(const size_t &width, const size_t &height, const SceneSource &scene_source,
+                   const RenderSettings &settings, const size_t &frame_count, const std::string &sequence_path,
+                   const std::string &frames_path, const PostProcess &post) {
+    std::unique_ptr<Scene> scene(open_scene(scene_source, settings));
+    if (!scene) {
+        return false;
+    }
+
+    std::unique_ptr<FrameSource> source;
+    if (sequence_path.empty()) {
+        source.reset(new Turntable(*scene, frame_count));
+    } else {
+        source.reset(new SequenceFile(sequence_path));
+    }
+    std::unique_ptr<FrameOutput> output;
+    if (frames_path == "-") {
+        output.reset(new PPMStream(STDOUT_FILENO, width, height, post));
+    } else {
+        output.reset(new PPMSequence(frames_path, width, height, post));
+    }
+
+    SequenceStats stats;
+    const bool ok = render_sequence(*scene, width, height, *source, *output, stats);
+    output.reset();
+    stats.report(std::cerr);
+    if (scene->scheduler) {
+        report(*scene);
+    }
+    return ok;
 }
 
 /*
- * Output the contents of the provided buffer into a ppm file at the specified path.
- * Each colour channel is clamped independently to the range [0.0, 1.0].
+ * Preview the scene progressively, publishing each pass to a shared framebuffer at preview_path,
+ * or as PPMs on standard output if it is "-". If sequence_path isn't empty, updates are read from it
+ * (which may be /dev/stdin) as they arrive: each frame directive cancels the render in progress,
+ * applies the changes and starts again. Returns once the last update's preview is finished.
  */
-void output_ppm(const int &width, const int &height, const std::vector<Vec3f> &buffer, const char *out_path) {
-    std::ofstream ofs;
-    ofs.open(out_path);
-    ofs << "P6\n" << width << " " << height << "\n255\n";
+bool render_preview(const size_t &width, const size_t &height, const SceneSource &scene_source,
+                    const RenderSettings &settings, const ProgressiveSettings &preview_settings,
+                    const std::string &sequence_path, const std::string &preview_path, const PostProcess &post) {
+    std::unique_ptr<Scene> scene(open_scene(scene_source, settings));
+    if (!scene) {
+        return false;
+    }
+    std::unique_ptr<FrameOutput> output;
+    if (preview_path == "-") {
+        output.reset(new PPMStream(STDOUT_FILENO, width, height, post));
+    } else {
+        auto *framebuffer = new SharedFramebuffer(preview_path, width, height, post);
+        output.reset(framebuffer);
+        if (!framebuffer->ok()) {
+            return false;
+        }
+    }
+    ProgressiveRenderer renderer(*scene, width, height, *output, preview_settings);
 
-    for (size_t p = 0; p < width * height; p++) {
-        ofs << (char) (255 * clamp_unit(buffer[p][0]));
-        ofs << (char) (255 * clamp_unit(buffer[p][1]));
-        ofs << (char) (255 * clamp_unit(buffer[p][2]));
+    // The reader hands each update over and waits for it to be applied, so it never reads the scene mid-change.
+    std::mutex mutex;
+    std::condition_variable changed;
+    FrameUpdate update;
+    bool pending = false;
+    bool finished = sequence_path.empty();
+    bool stopping = false;
+    std::unique_ptr<SequenceFile> source;
+    std::thread reader;
+    if (!finished) {
+        source.reset(new SequenceFile(sequence_path));
+        reader = std::thread([&] {
+            FrameUpdate next;
+            while (source->next(*scene, next)) {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stopping) {
+                    break;
+                }
+                std::swap(update, next);
+                pending = true;
+                renderer.cancel();
+                changed.notify_all();
+                changed.wait(lock, [&] { return !pending || stopping; });
+                next.clear();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+            changed.notify_all();
+        });
     }
 
-    ofs.close();
+    bool ok = true;
+    while (true) {
+        ProgressiveStats stats;
+        if (!renderer.render(stats) && !stats.cancelled) {
+            ok = false;
+        }
+        stats.report(std::cerr);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return pending || finished || !ok; });
+        if (!pending || !ok) {
+            break;
+        }
+        update.apply(*scene);
+        update.clear();
+        pending = false;
+        renderer.resume();
+        changed.notify_all();
+    }
+    if (reader.joinable()) {
+        // After a failure, the reader stops once its current read returns.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        reader.join();
+    }
+    return ok && (!source || source->ok());
 }
 
-int main() {
+int main(int argc, char **argv) {
     char out_path[] = "./out.ppm";
+    char cost_path[] = "./out_cost.ppm";
     const size_t width = 2000;
     const size_t height = 1000;
 
-    std::vector<Vec3f> buffer(width * height);
-    render(width, height, buffer, 1);
-    output_ppm(width, height, buffer, out_path);
+    SceneSource scene_source;
+    RenderSettings settings;
+    size_t frame_count = 0;
+    std::string sequence_path;
+    std::string frames_path = "./out_####.ppm";
+    FarmSettings farm_settings;
+    farm_settings.workers = 0;
+    std::string preview_path;
+    ProgressiveSettings preview_settings;
+    bool path_trace = false;
+    PathSettings path_settings;
+    PostProcess post;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene_source.path = argv[++i];
+        } else if (std::strcmp(argv[i], "--fractal") == 0 && i + 1 < argc) {
+            scene_source.path = std::string("fractal:") + argv[++i];
+        } else if (std::strcmp(argv[i], "--march-steps") == 0 && i + 1 < argc) {
+            settings.march.max_steps = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--march-epsilon") == 0 && i + 1 < argc) {
+            settings.march.epsilon = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--relaxation") == 0 && i + 1 < argc) {
+            settings.march.relaxation = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--texture") == 0 && i + 1 < argc) {
+            scene_source.texture_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--texture-cache") == 0 && i + 1 < argc) {
+            settings.texture_cache_size = (size_t) (std::strtod(argv[++i], nullptr) * 1048576);
+        } else if (std::strcmp(argv[i], "--ao") == 0 && i + 1 < argc) {
+            settings.ao_samples = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--ao-distance") == 0 && i + 1 < argc) {
+            settings.ao_distance = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--ao-half") == 0) {
+            settings.ao_half_resolution = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            settings.thread_count = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            settings.tile_size = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--no-packets") == 0) {
+            settings.packet_tracing = false;
+        } else if (std::strcmp(argv[i], "--adaptive") == 0) {
+            settings.adaptive_sampling = true;
+        } else if (std::strcmp(argv[i], "--adaptive-step") == 0 && i + 1 < argc) {
+            settings.adaptive_step = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--adaptive-threshold") == 0 && i + 1 < argc) {
+            settings.adaptive_threshold = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            if (!parse_render_mode(argv[++i], settings.render_mode)) {
+                std::cerr << "Unknown render mode " << argv[i] << "; expected full, diffuse, no-shadows, normals or depth\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+            post.exposure = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--tone-map") == 0 && i + 1 < argc) {
+            if (!parse_tone_map(argv[++i], post.tone_map)) {
+                std::cerr << "Unknown tone map " << argv[i] << "; expected clamp, reinhard or aces\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--srgb") == 0) {
+            post.srgb = true;
+        } else if (std::strcmp(argv[i], "--bits") == 0 && i + 1 < argc) {
+            post.bits = (uint32_t) std::strtoul(argv[++i], nullptr, 10);
+            if (post.bits != 8 && post.bits != 16) {
+                std::cerr << "Images are stored with 8 or 16 bits to a channel, not " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--light-cutoff") == 0 && i + 1 < argc) {
+            settings.light_cutoff = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--light-samples") == 0 && i + 1 < argc) {
+            settings.light_samples = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            farm_settings.workers = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--job-rows") == 0 && i + 1 < argc) {
+            farm_settings.job_rows = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--job-timeout") == 0 && i + 1 < argc) {
+            farm_settings.timeout_ms = (int) std::strtol(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--preview") == 0 && i + 1 < argc) {
+            preview_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            preview_settings.budget_ms = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--preview-step") == 0 && i + 1 < argc) {
+            preview_settings.initial_step = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--preview-samples") == 0 && i + 1 < argc) {
+            preview_settings.max_samples = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--path-samples") == 0 && i + 1 < argc) {
+            path_trace = true;
+            path_settings.samples = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--bounces") == 0 && i + 1 < argc) {
+            path_trace = true;
+            path_settings.max_bounces = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frame_count = (size_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--sequence") == 0 && i + 1 < argc) {
+            sequence_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--frames-out") == 0 && i + 1 < argc) {
+            frames_path = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--scene FILE | --fractal julia|mandelbulb]"
+                      << " [--march-steps N] [--march-epsilon E] [--relaxation W] [--texture FILE.ppm] [--texture-cache MB]"
+                      << " [--ao N [--ao-distance D] [--ao-half]] [--threads N] [--tile-size N] [--no-packets]"
+                      << " [--mode MODE] [--adaptive] [--adaptive-step N] [--adaptive-threshold T]"
+                      << " [--exposure STOPS] [--tone-map clamp|reinhard|aces] [--srgb] [--bits 8|16]"
+                      << " [--light-cutoff C] [--light-samples N] [--workers N] [--job-rows N] [--job-timeout MS]"
+                      << " [--frames N | --sequence FILE] [--frames-out PATTERN|-]"
+                      << " [--preview PATH|- [--budget MS] [--preview-step N] [--preview-samples N]]"
+                      << " [--path-samples N] [--bounces N]\n";
+            return 1;
+        }
+    }
+
+    // Previews and sequences are rendered as mono frames, without cost images.
+    if (!preview_path.empty()) {
+        return render_preview(width, height, scene_source, settings, preview_settings, sequence_path, preview_path,
+                              post) ? 0 : 1;
+    }
+    if (frame_count > 0 || !sequence_path.empty()) {
+        return render_frames(width, height, scene_source, settings, frame_count, sequence_path, frames_path, post)
+               ? 0 : 1;
+    }
+
+    PPMFile output(out_path, width, height, post);
+    if (!output.ok()) {
+        return 1;
+    }
+
+    // Instrumented builds also write out how much work each pixel took,
+    // except in farm renders, where the costs stay in the workers.
+    std::unique_ptr<PPMFile> cost_output;
+    if (Stats::enabled && farm_settings.workers == 0) {
+        cost_output.reset(new PPMFile(cost_path, width, height));
+        if (!cost_output->ok()) {
+            return 1;
+        }
+    }
+    if (path_trace) {
+        return render_paths(width, height, output, scene_source, settings, path_settings) ? 0 : 1;
+    }
+    if (farm_settings.workers > 0) {
+        return render_farm(width, height, output, scene_source, settings, farm_settings, 1) ? 0 : 1;
+    }
+    if (!render(width, height, output, cost_output.get(), scene_source, settings, 1)) {
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,181 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+
+/*
+ * Converts a text scene description into a binary scene file for raymonde --scene.
+ *
+ * The description has one directive per line; blank lines and anything after a # are ignored.
+ * Angles are in radians, and the camera is looking along its orientation vector.
+ *
+ *     camera PX PY PZ OX OY OZ [FOV [PLANE_DISTANCE]]
+ *     background R G B
+ *     ambient R G B
+ *     material NAME DR DG DB SR SG SB SPECULARITY
+ *     sphere X Y Z RADIUS MATERIAL
+ *     light X Y Z R G B BRIGHTNESS
+ *
+ * Materials must be defined before the spheres that use them.
+ * The camera, background and ambient directives may appear anywhere; the last of each wins.
+ */
+
+namespace {
+
+struct Description {
+    Camera camera;
+    Vec3f background_colour;
+    Vec3f ambient_colour;
+    std::map<std::string, Material> materials;
+
+    Description()
+            : camera(Pos3f(0, 0, 0)), background_colour(), ambient_colour(), materials() {}
+};
+
+bool read_vec(std::istringstream &in, Vec3f &v) {
+    return (bool) (in >> v.x >> v.y >> v.z);
+}
+
+bool read_pos(std::istringstream &in, Pos3f &p) {
+    return (bool) (in >> p.x >> p.y >> p.z);
+}
+
+/*
+ * Parse the description into scene, reporting the first error with its line number.
+ * The camera, background and ambient colours are parsed into description, and applied by the caller.
+ */
+bool parse(std::istream &input, const std::string &name, Description &description, Scene &scene) {
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(input, line)) {
+        line_number++;
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        std::istringstream in(line);
+        std::string directive;
+        if (!(in >> directive)) {
+            continue;
+        }
+
+        bool ok;
+        if (directive == "camera") {
+            // The field of view and plane distance are optional, so read whatever numbers are left.
+            Camera &camera = description.camera;
+            ok = read_pos(in, camera.position) && read_vec(in, camera.orientation);
+            float optional[2];
+            int count = 0;
+            while (ok && count < 2 && in >> optional[count]) {
+                count++;
+            }
+            ok = ok && in.eof();
+            if (count > 0) {
+                camera.fov = optional[0];
+            }
+            if (count > 1) {
+                camera.plane_distance = optional[1];
+            }
+            in.clear();
+        } else if (directive == "background") {
+            ok = read_vec(in, description.background_colour);
+        } else if (directive == "ambient") {
+            ok = read_vec(in, description.ambient_colour);
+        } else if (directive == "material") {
+            std::string material_name;
+            Material material;
+            ok = in >> material_name && read_vec(in, material.diffuse_colour) &&
+                 read_vec(in, material.specular_colour) && in >> material.specularity;
+            if (ok) {
+                description.materials[material_name] = material;
+            }
+        } else if (directive == "sphere") {
+            Pos3f centre;
+            float radius;
+            std::string material_name;
+            ok = read_pos(in, centre) && in >> radius >> material_name;
+            if (ok) {
+                const auto material = description.materials.find(material_name);
+                if (material == description.materials.end()) {
+                    std::cerr << name << ":" << line_number << ": unknown material " << material_name << "\n";
+                    return false;
+                }
+                scene.add_sphere(centre, radius, material->second);
+            }
+        } else if (directive == "light") {
+            Pos3f position;
+            Vec3f colour;
+            float brightness;
+            ok = read_pos(in, position) && read_vec(in, colour) && in >> brightness;
+            if (ok) {
+                scene.add_light(position, colour, brightness);
+            }
+        } else {
+            std::cerr << name << ":" << line_number << ": unknown directive " << directive << "\n";
+            return false;
+        }
+
+        std::string extra;
+        if (!ok || in >> extra) {
+            std::cerr << name << ":" << line_number << ": malformed " << directive << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    bool build_bvh = true;
+    const char *input_path = nullptr;
+    const char *output_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--no-bvh") == 0) {
+            build_bvh = false;
+        } else if (input_path == nullptr) {
+            input_path = argv[i];
+        } else if (output_path == nullptr) {
+            output_path = argv[i];
+        } else {
+            input_path = nullptr;
+            break;
+        }
+    }
+    if (input_path == nullptr || output_path == nullptr) {
+        std::cerr << "Usage: " << argv[0] << " [--no-bvh] INPUT.txt OUTPUT.scene\n";
+        return 1;
+    }
+
+    std::ifstream input(input_path);
+    if (!input) {
+        std::cerr << "Could not open " << input_path << "\n";
+        return 1;
+    }
+
+    Description description;
+    Scene scene(description.camera, description.background_colour, description.ambient_colour);
+    if (!parse(input, input_path, description, scene)) {
+        return 1;
+    }
+    scene.camera = description.camera;
+    scene.background_colour = description.background_colour;
+    scene.ambient_colour = description.ambient_colour;
+
+    // Saving the BVH means loading the scene needs no preprocessing at all.
+    if (build_bvh) {
+        scene.finalise();
+    }
+    if (!save_scene(scene, output_path)) {
+        return 1;
+    }
+    std::cerr << input_path << ": " << scene.spheres.size() << " spheres, " << scene.materials.size()
+              << " materials, " << scene.lights.size() << " lights\n";
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Geometry.hpp"
+#include "RenderSettings.hpp"
+#include "Scene.hpp"
+#include "SceneFile.hpp"
+
+/*
+ * Checks shading of the scene in the given file (CMake converts scenes/default.txt for it):
+ * without shadow rays, no pixel may come out darker than with them, as skipping a shadow ray
+ * can only let more light through.
+ *
+ * Usage: raymonde_shading_check SCENE; the exit status is nonzero if any check fails.
+ */
+
+namespace {
+
+const size_t WIDTH = 400;
+const size_t HEIGHT = 200;
+
+std::vector<Vec3f> render_mode(Scene &scene, const RenderMode &mode) {
+    scene.settings.render_mode = mode;
+    std::vector<Vec3f> framebuffer(WIDTH * HEIGHT);
+    scene.render(WIDTH, HEIGHT, framebuffer);
+    return framebuffer;
+}
+
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " SCENE\n";
+        return 1;
+    }
+    Scene *scene = load_scene(argv[1]);
+    if (scene == nullptr) {
+        return 1;
+    }
+
+    const std::vector<Vec3f> full = render_mode(*scene, RenderMode::full);
+    const std::vector<Vec3f> unshadowed = render_mode(*scene, RenderMode::no_shadows);
+    size_t darker = 0;
+    for (size_t p = 0; p < full.size(); p++) {
+        for (size_t c = 0; c < 3; c++) {
+            if (unshadowed[p][c] < full[p][c]) {
+                darker++;
+                break;
+            }
+        }
+    }
+    delete scene;
+
+    std::cout << (darker == 0 ? "ok   " : "FAIL ") << "no-shadows against full shading: " << darker << " of "
+              << full.size() << " pixels darker\n";
+    return darker == 0 ? 0 : 1;
+}